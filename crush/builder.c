@@ -15,6 +15,154 @@
 
 #define BUG_ON(x) assert(!(x))
 
+/* let the caches know their results are stale */
+static void crush_map_changed(struct crush_map *map)
+{
+	if (map)
+		map->epoch++;
+}
+
+/*
+ * The arrays of a bucket of __size__ items have room for
+ * bucket_capacity(size) items: it grows by 1/16th to 1/8th of the
+ * size at a time so that adding items one by one copies them O(1)
+ * times on average and wastes at most 1/8th of the memory.
+ */
+static __u32 bucket_capacity(__u32 size)
+{
+	__u32 step = 1;
+
+	while (step * 16 <= size)
+		step *= 2;
+	return (size + step - 1) / step * step;
+}
+
+static void *bucket_alloc(size_t elem, __u32 size)
+{
+	__u32 capacity = bucket_capacity(size);
+
+	return malloc(elem * (capacity ? capacity : 1));
+}
+
+/*
+ * Resize the __*array__ of a bucket going from __size__ to __newsize__
+ * items. The array may have been allocated by the caller with exactly
+ * __size__ items rather than by bucket_alloc(): it is always given
+ * bucket_capacity(__newsize__) items, which realloc(3) does in place
+ * when the capacity did not change.
+ */
+static int bucket_resize(void *array, size_t elem, __u32 size, __u32 newsize)
+{
+	void **p = array;
+	__u32 capacity = bucket_capacity(newsize);
+	void *_realloc;
+
+	_realloc = realloc(*p, elem * (capacity ? capacity : 1));
+	if (_realloc == NULL)
+		/* when shrinking, the array is still large enough */
+		return newsize > size ? -ENOMEM : 0;
+	*p = _realloc;
+	return 0;
+}
+
+/*
+ * The map->changes are updated by each function that modifies a map
+ * so that crush_finalize_incremental() is O(changes) instead of
+ * O(map). If an allocation fails or they are found to be
+ * inconsistent, they are forgotten and the next
+ * crush_finalize_incremental() looks at the whole map.
+ */
+static void changes_forget(struct crush_map *map)
+{
+	crush_destroy_map_changes(map->changes);
+	map->changes = NULL;
+}
+
+/* add __delta__ to the number of references to the device __item__ */
+static void changes_ref(struct crush_map *map, int item, int delta)
+{
+	struct crush_map_changes *c = map->changes;
+
+	if (c == NULL || item < 0)
+		return;
+	if (item >= c->device_refs_size) {
+		__s32 size = item + 1 + item / 8;
+		void *_realloc;
+
+		if (delta < 0 ||
+		    (_realloc = realloc(c->device_refs, sizeof(__u32) * size)) == NULL) {
+			changes_forget(map);
+			return;
+		}
+		c->device_refs = _realloc;
+		memset(c->device_refs + c->device_refs_size, 0,
+		       sizeof(__u32) * (size - c->device_refs_size));
+		c->device_refs_size = size;
+	}
+	if (delta < 0 && c->device_refs[item] == 0) {
+		changes_forget(map);
+		return;
+	}
+	c->device_refs[item] += delta;
+	if (c->device_refs[item] && item >= c->max_devices)
+		c->max_devices = item + 1;
+	while (c->max_devices > 0 && c->device_refs[c->max_devices - 1] == 0)
+		c->max_devices--;
+}
+
+/* add __delta__ references to the items of __b__ from __start__ to __end__ */
+static void changes_ref_items(struct crush_map *map, struct crush_bucket *b,
+			      __u32 start, __u32 end, int delta)
+{
+	__u32 i;
+
+	for (i = start; i < end && map->changes; i++)
+		changes_ref(map, b->items[i], delta);
+}
+
+/* the next crush_finalize() recomputes the straws or reciprocals of __b__ */
+static void changes_dirty(struct crush_map *map, struct crush_bucket *b)
+{
+	struct crush_map_changes *c = map->changes;
+	int pos = -1 - b->id;
+
+	if (c == NULL ||
+	    (b->alg != CRUSH_BUCKET_STRAW && b->alg != CRUSH_BUCKET_STRAW2))
+		return;
+	if (pos >= c->dirty_size) {
+		__s32 size = map->max_buckets > pos ? map->max_buckets : pos + 1;
+		void *_realloc;
+
+		if ((_realloc = realloc(c->dirty, size)) == NULL) {
+			changes_forget(map);
+			return;
+		}
+		c->dirty = _realloc;
+		memset(c->dirty + c->dirty_size, 0, size - c->dirty_size);
+		if ((_realloc = realloc(c->dirty_buckets, sizeof(__s32) * size)) == NULL) {
+			changes_forget(map);
+			return;
+		}
+		c->dirty_buckets = _realloc;
+		c->dirty_size = size;
+	}
+	if (c->dirty[pos])
+		return;
+	c->dirty[pos] = 1;
+	c->dirty_buckets[c->num_dirty++] = pos;
+}
+
+/* __b__ had __size__ items before some were appended */
+static void changes_append(struct crush_map *map, struct crush_bucket *b,
+			   __u32 size)
+{
+	if (map == NULL || map->changes == NULL)
+		return;
+	map->changes->num_items += b->size - size;
+	changes_ref_items(map, b, size, b->size, 1);
+	changes_dirty(map, b);
+}
+
 struct crush_map *crush_create()
 {
 	struct crush_map *m;
@@ -30,11 +178,109 @@ struct crush_map *crush_create()
 /*
  * finalize should be called _after_ all buckets are added to the map.
  */
+void crush_set_reciprocal(struct crush_reciprocal *reciprocal, __u32 weight)
+{
+	__u64 high, rem;
+	int l = 0;
+
+	reciprocal->weight = weight;
+	if (weight == 0) {
+		reciprocal->magic = 0;
+		reciprocal->shift = 0;
+		return;
+	}
+	/* l = ceil(log2(weight)) */
+	while (((__u64)1 << l) < weight)
+		l++;
+	/*
+	 * Granlund & Montgomery: with m = floor(2^(N+l) / d) + 1,
+	 * m * d - 2^(N+l) <= d <= 2^l and floor(n * m / 2^(N+l)) is
+	 * floor(n / d) for all 0 <= n < 2^N. Here N = 49 and m < 2^50.
+	 */
+	reciprocal->shift = CRUSH_RECIPROCAL_BITS + l;
+	/*
+	 * floor(2^shift / d) with 64 bit divisions: shift >= 49 and
+	 * d <= 2^32, so that 2^(shift-32) and the remainder shifted
+	 * by 32 bits both fit
+	 */
+	high = ((__u64)1 << (reciprocal->shift - 32)) / weight;
+	rem = ((__u64)1 << (reciprocal->shift - 32)) % weight;
+	reciprocal->magic = (high << 32) + (rem << 32) / weight + 1;
+}
+
+static void crush_finalize_straw2(struct crush_bucket_straw2 *bucket)
+{
+	__u32 i;
+
+	if (bucket->item_reciprocals == NULL) {
+		bucket->item_reciprocals = malloc(sizeof(struct crush_reciprocal) *
+						  bucket->h.size);
+		/* without reciprocals the mapper divides */
+		if (bucket->item_reciprocals == NULL)
+			return;
+	}
+	for (i = 0; i < bucket->h.size; i++)
+		crush_set_reciprocal(&bucket->item_reciprocals[i],
+				     bucket->item_weights[i]);
+}
+
+int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket);
+
+/* the straws are computed once, after all the changes to the bucket */
+static void crush_finalize_straw(struct crush_map *map,
+				 struct crush_bucket_straw *bucket)
+{
+	if (bucket->straws_stale && crush_calc_straw(map, bucket) == 0)
+		bucket->straws_stale = 0;
+}
+
+/* compute what the mapper needs that the builder leaves for later */
+static void crush_finalize_bucket(struct crush_map *map, struct crush_bucket *b)
+{
+	switch (b->alg) {
+	case CRUSH_BUCKET_STRAW:
+		crush_finalize_straw(map, (struct crush_bucket_straw *)b);
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		crush_finalize_straw2((struct crush_bucket_straw2 *)b);
+		break;
+	}
+}
+
+void crush_finalize_incremental(struct crush_map *map)
+{
+	struct crush_map_changes *c = map->changes;
+	__s32 i;
+
+	if (c == NULL) {
+		crush_finalize(map);
+		return;
+	}
+	crush_map_changed(map);
+	for (i = 0; i < c->num_dirty; i++) {
+		int pos = c->dirty_buckets[i];
+
+		c->dirty[pos] = 0;
+		if (pos < map->max_buckets && map->buckets[pos])
+			crush_finalize_bucket(map, map->buckets[pos]);
+	}
+	c->num_dirty = 0;
+
+	/* the same as the sums of crush_finalize() */
+	map->max_devices = c->max_devices;
+	map->working_size = sizeof(struct crush_work) +
+		map->max_buckets * sizeof(struct crush_work_bucket *) +
+		c->num_buckets * sizeof(struct crush_work_bucket) +
+		c->num_items * sizeof(__u32);
+}
+
 void crush_finalize(struct crush_map *map)
 {
+	struct crush_map_changes *c;
 	int b;
 	__u32 i;
 
+	crush_map_changed(map);
 	/* Calculate the needed working space while we do other
 	   finalization tasks. */
 	map->working_size = sizeof(struct crush_work);
@@ -51,16 +297,36 @@ void crush_finalize(struct crush_map *map)
 			if (map->buckets[b]->items[i] >= map->max_devices)
 				map->max_devices = map->buckets[b]->items[i] + 1;
 
-		switch (map->buckets[b]->alg) {
-		default:
-			/* The base case, permutation variables and
-			   the pointer to the permutation array. */
-			map->working_size += sizeof(struct crush_work_bucket);
-			break;
-		}
+		crush_finalize_bucket(map, map->buckets[b]);
+		/* The base case, permutation variables and the
+		   pointer to the permutation array. */
+		map->working_size += sizeof(struct crush_work_bucket);
 		/* Every bucket has a permutation array. */
 		map->working_size += map->buckets[b]->size * sizeof(__u32);
 	}
+
+	/* start over tracking the changes */
+	changes_forget(map);
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	if (map->max_devices > 0) {
+		c->device_refs = calloc(map->max_devices, sizeof(__u32));
+		if (c->device_refs == NULL) {
+			free(c);
+			return;
+		}
+		c->device_refs_size = map->max_devices;
+	}
+	map->changes = c;
+	for (b=0; b<map->max_buckets && map->changes; b++) {
+		if (map->buckets[b] == 0)
+			continue;
+		c->num_buckets++;
+		c->num_items += map->buckets[b]->size;
+		changes_ref_items(map, map->buckets[b], 0,
+				  map->buckets[b]->size, 1);
+	}
 }
 
 
@@ -71,6 +337,7 @@ int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 {
 	__u32 r;
 
+	crush_map_changed(map);
 	if (ruleno < 0) {
 		for (r=0; r < map->max_rules; r++)
 			if (map->rules[r] == 0)
@@ -145,6 +412,7 @@ int crush_add_bucket(struct crush_map *map,
 {
 	int pos;
 
+	crush_map_changed(map);
 	/* find a bucket id */
 	if (id == 0)
 		id = crush_get_next_bucket_id(map);
@@ -173,6 +441,9 @@ int crush_add_bucket(struct crush_map *map,
         /* add it */
 	bucket->id = id;
 	map->buckets[pos] = bucket;
+	if (map->changes)
+		map->changes->num_buckets++;
+	changes_append(map, bucket, 0);
 
 	if (idout) *idout = id;
 	return 0;
@@ -182,6 +453,12 @@ int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucket)
 {
 	int pos = -1 - bucket->id;
        assert(pos < map->max_buckets);
+	crush_map_changed(map);
+	if (map->changes) {
+		map->changes->num_buckets--;
+		map->changes->num_items -= bucket->size;
+		changes_ref_items(map, bucket, 0, bucket->size, -1);
+	}
 	map->buckets[pos] = NULL;
 	crush_destroy_bucket(bucket);
 	return 0;
@@ -212,7 +489,7 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	bucket->h.weight = size * item_weight;
 	bucket->item_weight = item_weight;
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = bucket_alloc(sizeof(__s32), size);
 
         if (!bucket->h.items)
                 goto err;
@@ -248,15 +525,15 @@ crush_make_list_bucket(int hash, int type, int size,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = bucket_alloc(sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
 
 
-        bucket->item_weights = malloc(sizeof(__u32)*size);
+        bucket->item_weights = bucket_alloc(sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
-	bucket->sum_weights = malloc(sizeof(__u32)*size);
+	bucket->sum_weights = bucket_alloc(sizeof(__u32), size);
         if (!bucket->sum_weights)
                 goto err;
 	w = 0;
@@ -322,6 +599,18 @@ static int calc_depth(int size)
 	return depth;
 }
 
+__u64 crush_calc_tree_num_nodes(__u32 size)
+{
+	int depth = 1;
+	__u32 t;
+
+	if (size == 0)
+		return 0;
+	for (t = size - 1; t; t >>= 1)
+		depth++;
+	return (__u64)1 << depth;
+}
+
 struct crush_bucket_tree*
 crush_make_tree_bucket(int hash, int type, int size,
 		       int *items,    /* in leaf order */
@@ -350,7 +639,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 		return bucket;
 	}
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = bucket_alloc(sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
 
@@ -427,34 +716,43 @@ err:
  * moral of the story: if you do something clever, write down why it
  * works.
  */
+struct straw_sort_entry {
+	__u32 weight;
+	int index;
+};
+
+/* by weight and then by index, as the insertion sort used to */
+static int straw_sort_compare(const void *a, const void *b)
+{
+	const struct straw_sort_entry *x = a, *y = b;
+
+	if (x->weight != y->weight)
+		return x->weight < y->weight ? -1 : 1;
+	return x->index - y->index;
+}
+
 int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
 {
+	struct straw_sort_entry *sorted;
 	int *reverse;
-	int i, j, k;
+	int i, j;
 	double straw, wbelow, lastw, wnext, pbelow;
 	int numleft;
 	int size = bucket->h.size;
 	__u32 *weights = bucket->item_weights;
 
-	/* reverse sort by weight (simple insertion sort) */
-	reverse = malloc(sizeof(int) * size);
-        if (!reverse)
+	/* reverse sort by weight */
+	sorted = malloc(sizeof(*sorted) * size + sizeof(int) * size);
+        if (!sorted && size)
                 return -ENOMEM;
-	if (size)
-		reverse[0] = 0;
-	for (i=1; i<size; i++) {
-		for (j=0; j<i; j++) {
-			if (weights[i] < weights[reverse[j]]) {
-				/* insert here */
-				for (k=i; k>j; k--)
-					reverse[k] = reverse[k-1];
-				reverse[j] = i;
-				break;
-			}
-		}
-		if (j == i)
-			reverse[i] = i;
+	reverse = (int *)(sorted + size);
+	for (i=0; i<size; i++) {
+		sorted[i].weight = weights[i];
+		sorted[i].index = i;
 	}
+	qsort(sorted, size, sizeof(*sorted), straw_sort_compare);
+	for (i=0; i<size; i++)
+		reverse[i] = sorted[i].index;
 
 	numleft = size;
 	straw = 1.0;
@@ -541,7 +839,7 @@ int crush_calc_straw(struct crush_map *map, struct crush_bucket_straw *bucket)
 		}
 	}
 
-	free(reverse);
+	free(sorted);
 	return 0;
 }
 
@@ -565,13 +863,13 @@ crush_make_straw_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = bucket_alloc(sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = bucket_alloc(sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
-        bucket->straws = malloc(sizeof(__u32)*size);
+        bucket->straws = bucket_alloc(sizeof(__u32), size);
         if (!bucket->straws)
                 goto err;
 
@@ -614,10 +912,10 @@ crush_make_straw2_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = bucket_alloc(sizeof(__s32), size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = bucket_alloc(sizeof(__u32), size);
         if (!bucket->item_weights)
                 goto err;
 
@@ -674,7 +972,6 @@ crush_make_bucket(struct crush_map *map,
 int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item, int weight)
 {
         int newsize = bucket->h.size + 1;
-	void *_realloc = NULL;
 
 	/* In such situation 'CRUSH_BUCKET_UNIFORM', the weight
 	   provided for the item should be the same as
@@ -685,11 +982,8 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
 	  return -EINVAL;
 	}
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
 
 	bucket->h.items[newsize-1] = item;
 
@@ -705,23 +999,13 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
 int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int weight)
 {
         int newsize = bucket->h.size + 1;
-	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->item_weights, sizeof(__u32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->sum_weights, sizeof(__u32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->sum_weights = _realloc;
-	}
 	
 	bucket->h.items[newsize-1] = item;
 	bucket->item_weights[newsize-1] = weight;
@@ -750,17 +1034,17 @@ int crush_add_tree_bucket_item(struct crush_bucket_tree *bucket, int item, int w
 	int j;
 	void *_realloc = NULL;
 
-	bucket->num_nodes = 1 << depth;
-
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->node_weights, sizeof(__u32)*bucket->num_nodes)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->node_weights = _realloc;
+	if (bucket->num_nodes != 1U << depth) {
+		if ((_realloc = realloc(bucket->node_weights, sizeof(__u32) << depth)) == NULL) {
+			return -ENOMEM;
+		} else {
+			bucket->node_weights = _realloc;
+		}
+		memset(bucket->node_weights + bucket->num_nodes, 0,
+		       sizeof(__u32) * ((1 << depth) - bucket->num_nodes));
+		bucket->num_nodes = 1 << depth;
 	}
 
 	node = crush_calc_tree_node(newsize-1);
@@ -802,23 +1086,12 @@ int crush_add_straw_bucket_item(struct crush_map *map,
 {
 	int newsize = bucket->h.size + 1;
 
-	void *_realloc = NULL;
-
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->item_weights, sizeof(__u32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->straws, sizeof(__u32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->straws = _realloc;
-	}
 
 	bucket->h.items[newsize-1] = item;
 	bucket->item_weights[newsize-1] = weight;
@@ -828,8 +1101,11 @@ int crush_add_straw_bucket_item(struct crush_map *map,
 
 	bucket->h.weight += weight;
 	bucket->h.size++;
-	
-	return crush_calc_straw(map, bucket);
+	/* until the next crush_finalize() */
+	bucket->straws[newsize-1] = 0;
+	bucket->straws_stale = 1;
+
+	return 0;
 }
 
 int crush_add_straw2_bucket_item(struct crush_map *map,
@@ -838,18 +1114,10 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 {
 	int newsize = bucket->h.size + 1;
 
-	void *_realloc = NULL;
-
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if (bucket_resize(&bucket->item_weights, sizeof(__u32), bucket->h.size, newsize))
 		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
 
 	bucket->h.items[newsize-1] = item;
 	bucket->item_weights[newsize-1] = weight;
@@ -859,6 +1127,9 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 
 	bucket->h.weight += weight;
 	bucket->h.size++;
+	/* until the next crush_finalize() */
+	free(bucket->item_reciprocals);
+	bucket->item_reciprocals = NULL;
 
 	return 0;
 }
@@ -866,20 +1137,113 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 int crush_bucket_add_item(struct crush_map *map,
 			  struct crush_bucket *b, int item, int weight)
 {
+	__u32 size = b->size;
+	int r;
+
+	crush_map_changed(map);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		r = crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		r = crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		r = crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
+		r = crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+		r = crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+		break;
 	default:
 		return -1;
 	}
+	changes_append(map, b, size);
+	return r;
+}
+
+int crush_bucket_add_items(struct crush_map *map, struct crush_bucket *b,
+			   int count, const int *items, const int *weights)
+{
+	__u32 size = b->size;
+	__u32 newsize = size + count;
+	__u32 weight = b->weight;
+	__u32 *item_weights = NULL;
+	int i;
+
+	if (count < 0)
+		return -EINVAL;
+	if (b->alg < CRUSH_BUCKET_UNIFORM || b->alg > CRUSH_BUCKET_STRAW2)
+		return -1;
+	for (i = 0; i < count; i++) {
+		if (b->alg == CRUSH_BUCKET_UNIFORM &&
+		    ((struct crush_bucket_uniform *)b)->item_weight != (__u32)weights[i])
+			return -EINVAL;
+		if (crush_addition_is_unsafe(weight, weights[i]))
+			return -ERANGE;
+		weight += weights[i];
+	}
+
+	crush_map_changed(map);
+	if (b->alg == CRUSH_BUCKET_TREE) {
+		int r = 0;
+
+		/* each item is O(log(size)), the items array grows geometrically */
+		for (i = 0; i < count && r == 0; i++)
+			r = crush_add_tree_bucket_item((struct crush_bucket_tree *)b,
+						       items[i], weights[i]);
+		changes_append(map, b, size);
+		return r;
+	}
+
+	if (bucket_resize(&b->items, sizeof(__s32), size, newsize))
+		return -ENOMEM;
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *bucket = (struct crush_bucket_list *)b;
+		if (bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize) ||
+		    bucket_resize(&bucket->sum_weights, sizeof(__u32), size, newsize))
+			return -ENOMEM;
+		for (i = 0; i < count; i++)
+			bucket->sum_weights[size + i] = weights[i] +
+				(size + i > 0 ? bucket->sum_weights[size + i - 1] : 0);
+		item_weights = bucket->item_weights;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *bucket = (struct crush_bucket_straw *)b;
+		if (bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize) ||
+		    bucket_resize(&bucket->straws, sizeof(__u32), size, newsize))
+			return -ENOMEM;
+		memset(bucket->straws + size, 0, sizeof(__u32) * count);
+		/* until the next crush_finalize() */
+		bucket->straws_stale = 1;
+		item_weights = bucket->item_weights;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *bucket = (struct crush_bucket_straw2 *)b;
+		if (bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize))
+			return -ENOMEM;
+		/* until the next crush_finalize() */
+		free(bucket->item_reciprocals);
+		bucket->item_reciprocals = NULL;
+		item_weights = bucket->item_weights;
+		break;
+	}
+	}
+
+	for (i = 0; i < count; i++) {
+		b->items[size + i] = items[i];
+		if (item_weights)
+			item_weights[size + i] = weights[i];
+	}
+	b->weight = weight;
+	b->size = newsize;
+	changes_append(map, b, size);
+	return 0;
 }
 
 /************************************************/
@@ -888,7 +1252,6 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 {
 	unsigned i, j;
 	int newsize;
-	void *_realloc = NULL;
 	
 	for (i = 0; i < bucket->h.size; i++)
 		if (bucket->h.items[i] == item)
@@ -896,19 +1259,16 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	if (i == bucket->h.size)
 		return -ENOENT;
 
-	for (j = i; j < bucket->h.size; j++)
+	for (j = i; j + 1 < bucket->h.size; j++)
 		bucket->h.items[j] = bucket->h.items[j+1];
-	newsize = --bucket->h.size;
+	newsize = bucket->h.size - 1;
 	if (bucket->item_weight < bucket->h.weight)
 		bucket->h.weight -= bucket->item_weight;
 	else
 		bucket->h.weight = 0;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
+	bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize);
+	bucket->h.size = newsize;
 	return 0;
 }
 
@@ -925,7 +1285,7 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 		return -ENOENT;
 
 	weight = bucket->item_weights[i];
-	for (j = i; j < bucket->h.size; j++) {
+	for (j = i; j + 1 < bucket->h.size; j++) {
 		bucket->h.items[j] = bucket->h.items[j+1];
 		bucket->item_weights[j] = bucket->item_weights[j+1];
 		bucket->sum_weights[j] = bucket->sum_weights[j+1] - weight;
@@ -934,28 +1294,23 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 		bucket->h.weight -= weight;
 	else
 		bucket->h.weight = 0;
-	newsize = --bucket->h.size;
-	
-	void *_realloc = NULL;
+	newsize = bucket->h.size - 1;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->sum_weights = _realloc;
-	}
+	bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize);
+	bucket_resize(&bucket->item_weights, sizeof(__u32), bucket->h.size, newsize);
+	bucket_resize(&bucket->sum_weights, sizeof(__u32), bucket->h.size, newsize);
+	bucket->h.size = newsize;
 	return 0;
 }
 
+/* a removed item leaves a 0 with no weight at its position */
+static int tree_item_is_removed(const struct crush_bucket_tree *bucket,
+				unsigned i)
+{
+	return bucket->h.items[i] == 0 &&
+		bucket->node_weights[crush_calc_tree_node(i)] == 0;
+}
+
 int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 {
 	unsigned i;
@@ -967,7 +1322,8 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 		int j;
 		int depth = calc_depth(bucket->h.size);
 
-		if (bucket->h.items[i] != item)
+		if (bucket->h.items[i] != item ||
+		    tree_item_is_removed(bucket, i))
 			continue;
 
 		bucket->h.items[i] = 0;
@@ -1002,11 +1358,7 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 
 		void *_realloc = NULL;
 
-		if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
-			return -ENOMEM;
-		} else {
-			bucket->h.items = _realloc;
-		}
+		bucket_resize(&bucket->h.items, sizeof(__s32), bucket->h.size, newsize);
 
 		olddepth = calc_depth(bucket->h.size);
 		newdepth = calc_depth(newsize);
@@ -1041,32 +1393,21 @@ int crush_remove_straw_bucket_item(struct crush_map *map,
 			for (j = i; j < bucket->h.size; j++) {
 				bucket->h.items[j] = bucket->h.items[j+1];
 				bucket->item_weights[j] = bucket->item_weights[j+1];
+				bucket->straws[j] = bucket->straws[j+1];
 			}
 			break;
 		}
 	}
-	if (i == bucket->h.size)
+	if (bucket->h.size != newsize)
 		return -ENOENT;
-	
-	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->straws = _realloc;
-	}
+	bucket_resize(&bucket->h.items, sizeof(__s32), newsize + 1, newsize);
+	bucket_resize(&bucket->item_weights, sizeof(__u32), newsize + 1, newsize);
+	bucket_resize(&bucket->straws, sizeof(__u32), newsize + 1, newsize);
+	/* until the next crush_finalize() */
+	bucket->straws_stale = 1;
 
-	return crush_calc_straw(map, bucket);
+	return 0;
 }
 
 int crush_remove_straw2_bucket_item(struct crush_map *map,
@@ -1078,6 +1419,9 @@ int crush_remove_straw2_bucket_item(struct crush_map *map,
 	for (i = 0; i < bucket->h.size; i++) {
 		if (bucket->h.items[i] == item) {
 			bucket->h.size--;
+			/* until the next crush_finalize() */
+			free(bucket->item_reciprocals);
+			bucket->item_reciprocals = NULL;
 			if (bucket->item_weights[i] < bucket->h.weight)
 				bucket->h.weight -= bucket->item_weights[i];
 			else
@@ -1089,44 +1433,199 @@ int crush_remove_straw2_bucket_item(struct crush_map *map,
 			break;
 		}
 	}
-	if (i == bucket->h.size)
+	if (bucket->h.size != newsize)
 		return -ENOENT;
 
-	void *_realloc = NULL;
-
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->h.items = _realloc;
-	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->item_weights = _realloc;
-	}
+	bucket_resize(&bucket->h.items, sizeof(__s32), newsize + 1, newsize);
+	bucket_resize(&bucket->item_weights, sizeof(__u32), newsize + 1, newsize);
 
 	return 0;
 }
 
 int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *b, int item)
 {
+	__u32 size = b->size;
+	int r;
+
+	crush_map_changed(map);
+	/* the item is replaced by 0 and the trailing empty leaves go */
+	if (map && b->alg == CRUSH_BUCKET_TREE)
+		changes_ref_items(map, b, 0, size, -1);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_remove_uniform_bucket_item((struct crush_bucket_uniform *)b, item);
+		r = crush_remove_uniform_bucket_item((struct crush_bucket_uniform *)b, item);
+		break;
 	case CRUSH_BUCKET_LIST:
-		return crush_remove_list_bucket_item((struct crush_bucket_list *)b, item);
+		r = crush_remove_list_bucket_item((struct crush_bucket_list *)b, item);
+		break;
 	case CRUSH_BUCKET_TREE:
-		return crush_remove_tree_bucket_item((struct crush_bucket_tree *)b, item);
+		r = crush_remove_tree_bucket_item((struct crush_bucket_tree *)b, item);
+		break;
 	case CRUSH_BUCKET_STRAW:
-		return crush_remove_straw_bucket_item(map, (struct crush_bucket_straw *)b, item);
+		r = crush_remove_straw_bucket_item(map, (struct crush_bucket_straw *)b, item);
+		break;
 	case CRUSH_BUCKET_STRAW2:
-		return crush_remove_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item);
+		r = crush_remove_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item);
+		break;
 	default:
 		return -1;
 	}
+	if (map && map->changes) {
+		map->changes->num_items -= size - b->size;
+		if (b->alg == CRUSH_BUCKET_TREE)
+			changes_ref_items(map, b, 0, b->size, 1);
+		else if (b->size < size)
+			changes_ref(map, item, -1);
+		changes_dirty(map, b);
+	}
+	return r;
 }
 
 
+static int crush_compare_items(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int crush_bucket_remove_items(struct crush_map *map, struct crush_bucket *b,
+			      int count, const int *items)
+{
+	int *sorted;
+	__u8 *seen;
+	__u32 *item_weights = NULL;
+	__u32 *straws = NULL;
+	__u32 size = b->size;
+	__u32 newsize, found;
+	int n, i;
+	__u32 j;
+
+	if (count < 0)
+		return -EINVAL;
+	if (b->alg < CRUSH_BUCKET_UNIFORM || b->alg > CRUSH_BUCKET_STRAW2)
+		return -1;
+	if (count == 0)
+		return 0;
+
+	sorted = malloc(sizeof(int) * count);
+	if (!sorted)
+		return -ENOMEM;
+	memcpy(sorted, items, sizeof(int) * count);
+	qsort(sorted, count, sizeof(int), crush_compare_items);
+	for (i = 1, n = 1; i < count; i++)
+		if (sorted[i] != sorted[n-1])
+			sorted[n++] = sorted[i];
+
+	/* all or nothing: count the distinct __items__ in the bucket */
+	seen = calloc(n, 1);
+	if (!seen) {
+		free(sorted);
+		return -ENOMEM;
+	}
+	for (j = 0, found = 0; j < size; j++) {
+		int *k = bsearch(&b->items[j], sorted, n, sizeof(int),
+				 crush_compare_items);
+
+		if (b->alg == CRUSH_BUCKET_TREE &&
+		    tree_item_is_removed((struct crush_bucket_tree *)b, j))
+			continue;
+		if (k && !seen[k - sorted]) {
+			seen[k - sorted] = 1;
+			found++;
+		}
+	}
+	free(seen);
+	if (found < (__u32)n) {
+		free(sorted);
+		return -ENOENT;
+	}
+
+	crush_map_changed(map);
+	if (b->alg == CRUSH_BUCKET_TREE) {
+		if (map)
+			changes_ref_items(map, b, 0, size, -1);
+		/* the items keep their position in the tree */
+		for (i = 0; i < n; i++)
+			crush_remove_tree_bucket_item((struct crush_bucket_tree *)b,
+						      sorted[i]);
+		free(sorted);
+		if (map && map->changes) {
+			map->changes->num_items -= size - b->size;
+			changes_ref_items(map, b, 0, b->size, 1);
+		}
+		return 0;
+	}
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST:
+		item_weights = ((struct crush_bucket_list *)b)->item_weights;
+		break;
+	case CRUSH_BUCKET_STRAW:
+		item_weights = ((struct crush_bucket_straw *)b)->item_weights;
+		straws = ((struct crush_bucket_straw *)b)->straws;
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		item_weights = ((struct crush_bucket_straw2 *)b)->item_weights;
+		break;
+	}
+	for (j = 0, newsize = 0; j < size; j++) {
+		if (bsearch(&b->items[j], sorted, n, sizeof(int), crush_compare_items)) {
+			__u32 weight = item_weights ? item_weights[j] :
+				((struct crush_bucket_uniform *)b)->item_weight;
+			if (weight < b->weight)
+				b->weight -= weight;
+			else
+				b->weight = 0;
+			if (map)
+				changes_ref(map, b->items[j], -1);
+			continue;
+		}
+		b->items[newsize] = b->items[j];
+		if (item_weights)
+			item_weights[newsize] = item_weights[j];
+		if (straws)
+			straws[newsize] = straws[j];
+		newsize++;
+	}
+	free(sorted);
+
+	bucket_resize(&b->items, sizeof(__s32), size, newsize);
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *bucket = (struct crush_bucket_list *)b;
+		for (j = 0; j < newsize; j++)
+			bucket->sum_weights[j] = bucket->item_weights[j] +
+				(j > 0 ? bucket->sum_weights[j-1] : 0);
+		bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize);
+		bucket_resize(&bucket->sum_weights, sizeof(__u32), size, newsize);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *bucket = (struct crush_bucket_straw *)b;
+		bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize);
+		bucket_resize(&bucket->straws, sizeof(__u32), size, newsize);
+		/* until the next crush_finalize() */
+		bucket->straws_stale = 1;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *bucket = (struct crush_bucket_straw2 *)b;
+		bucket_resize(&bucket->item_weights, sizeof(__u32), size, newsize);
+		/* until the next crush_finalize() */
+		free(bucket->item_reciprocals);
+		bucket->item_reciprocals = NULL;
+		break;
+	}
+	}
+	b->size = newsize;
+	if (map && map->changes) {
+		map->changes->num_items -= size - newsize;
+		changes_dirty(map, b);
+	}
+	return 0;
+}
+
 /************************************************/
 
 int crush_adjust_uniform_bucket_item_weight(struct crush_bucket_uniform *bucket, int item, int weight)
@@ -1194,7 +1693,6 @@ int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
 {
 	unsigned idx;
 	int diff;
-        int r;
 
 	for (idx = 0; idx < bucket->h.size; idx++)
 		if (bucket->h.items[idx] == item)
@@ -1205,10 +1703,8 @@ int crush_adjust_straw_bucket_item_weight(struct crush_map *map,
 	diff = weight - bucket->item_weights[idx];
 	bucket->item_weights[idx] = weight;
 	bucket->h.weight += diff;
-
-	r = crush_calc_straw(map, bucket);
-        if (r < 0)
-                return r;
+	/* until the next crush_finalize() */
+	bucket->straws_stale = 1;
 
 	return diff;
 }
@@ -1237,6 +1733,9 @@ int crush_bucket_adjust_item_weight(struct crush_map *map,
 				    struct crush_bucket *b,
 				    int item, int weight)
 {
+	crush_map_changed(map);
+	if (map)
+		changes_dirty(map, b);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
 		return crush_adjust_uniform_bucket_item_weight((struct crush_bucket_uniform *)b,
@@ -1355,7 +1854,8 @@ static int crush_reweight_straw_bucket(struct crush_map *map, struct crush_bucke
 
                 bucket->h.weight += bucket->item_weights[i];
 	}
-	crush_calc_straw(map, bucket);
+	/* until the next crush_finalize() */
+	bucket->straws_stale = 1;
 
 	return 0;
 }
@@ -1384,6 +1884,9 @@ static int crush_reweight_straw2_bucket(struct crush_map *map, struct crush_buck
 
 int crush_reweight_bucket(struct crush_map *map, struct crush_bucket *b)
 {
+	crush_map_changed(map);
+	if (map)
+		changes_dirty(map, b);
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
 		return crush_reweight_uniform_bucket(map, (struct crush_bucket_uniform *)b);
@@ -1491,6 +1994,7 @@ int crush_multiplication_is_unsafe(__u32  a, __u32 b)
 /* methods to configure crush_map */
 
 void set_legacy_crush_map(struct crush_map *map) {
+  crush_map_changed(map);
   /* initialize legacy tunable values */
   map->choose_local_tries = 2;
   map->choose_local_fallback_tries = 5;
@@ -1506,6 +2010,7 @@ void set_legacy_crush_map(struct crush_map *map) {
 }
 
 void set_optimal_crush_map(struct crush_map *map) {
+  crush_map_changed(map);
   map->choose_local_tries = 0;
   map->choose_local_fallback_tries = 0;
   map->choose_total_tries = 50;
@@ -27,6 +27,37 @@ extern struct crush_map *crush_create();
  * @param map the crush_map
  */
 extern void crush_finalize(struct crush_map *map);
+/** @ingroup API
+ *
+ * Same as crush_finalize() but only look at what changed since the
+ * previous crush_finalize() or crush_finalize_incremental(), which is
+ * much faster on a large map. The functions of builder.h keep track
+ * of the buckets they modify and of the sums crush_finalize() needs.
+ * A change they do not know about is ignored: crush_finalize() must
+ * be called instead if the buckets of the __map__ were modified
+ * directly or with functions that are not documented in builder.h
+ * (crush_add_straw_bucket_item(), etc.). The first call is a
+ * crush_finalize().
+ *
+ * @param map the crush_map
+ */
+extern void crush_finalize_incremental(struct crush_map *map);
+/** @ingroup API
+ *
+ * Set __reciprocal__ so that the mapper can replace the division of
+ * a straw2 draw by __weight__ with a multiplication and a shift. The
+ * quotient is exactly the same.
+ *
+ * crush_finalize() sets the reciprocals of the straw2 buckets and
+ * crush_choose_reciprocals_prepare() the reciprocals of the weight
+ * sets. If a weight is modified afterwards, the mapper divides by it
+ * until its reciprocal is set again.
+ *
+ * @param reciprocal the reciprocal to set
+ * @param weight a 16.16 fixed point weight
+ */
+extern void crush_set_reciprocal(struct crush_reciprocal *reciprocal,
+				 __u32 weight);
 
 /* rules */
 /** @ingroup API
@@ -75,6 +106,12 @@ extern struct crush_rule *crush_make_rule(int len, int ruleset, int type, int mi
  *     __arg1__ leaves within all the buckets of type __arg2__ and
  *     select them.
  *
+ * - __CRUSH_RULE_CHOOSE_TOPK__ and __CRUSH_RULE_CHOOSELEAF_TOPK__
+ *     are the same as __CRUSH_RULE_CHOOSE_FIRSTN__ and
+ *     __CRUSH_RULE_CHOOSELEAF_FIRSTN__ but choose the __arg1__ items
+ *     in a single pass over each straw2 bucket currently selected,
+ *     instead of one pass per item plus one per collision. See below.
+ *
  * In all __CHOOSE__ steps, if __arg1__ is zero, the number of items
  * to select is determined by the __max_result__ argument of
  * crush_do_rule(), i.e. __arg1__ is __max_result__ minus the number of
@@ -119,9 +156,34 @@ extern struct crush_rule *crush_make_rule(int len, int ruleset, int type, int mi
  *     P times (P being the value of the argument of the SET_CHOOSELEAF_TRIES
  *     rule step)
  *
+ * - __CRUSH_RULE_CHOOSE_TOPK__ and __CRUSH_RULE_CHOOSELEAF_TOPK__
+ *
+ *   A placement mode of its own, not a faster way to compute one of
+ *   the legacy modes: the items it chooses are not those the FIRSTN
+ *   and INDEP steps choose, and it is only implemented in userspace.
+ *   Each item of a selected straw2 bucket gets a single straw2 draw
+ *   (r = 0, the first weight set of the choose_args) and the items
+ *   with the __arg1__ highest draws are chosen, which are distinct
+ *   without retries. Like straw2, it moves the minimum amount of data:
+ *   changing the weight of an item only changes its own draw, so only
+ *   the inputs it enters or leaves the top __arg1__ of are remapped.
+ *
+ *   An item above __arg2__ is replaced by the item of type __arg2__
+ *   found by following the highest draws below it. If that fails (an
+ *   empty bucket, a device above __arg2__ or an out device) the item
+ *   with the next highest draw is used instead. CHOOSELEAF_TOPK then
+ *   finds a device below each item the same way: the highest draws are
+ *   followed down to the last bucket, in which the in device with the
+ *   highest draw is chosen. If fewer than __arg1__ items are found,
+ *   for instance because the bucket has fewer items than that, all
+ *   the draws are made again with r = 1, 2, ... (at most as many
+ *   times as the choose tries) and the items already chosen are
+ *   skipped. A bucket that is not straw2 is explored as with
+ *   __CRUSH_RULE_CHOOSE_FIRSTN__ and __CRUSH_RULE_CHOOSELEAF_FIRSTN__.
+ *
  * @param rule the rule in which the step is inserted
  * @param pos the zero based step index
- * @param op one of __CRUSH_RULE_NOOP__, __CRUSH_RULE_TAKE__, __CRUSH_RULE_CHOOSE_FIRSTN__, __CRUSH_RULE_CHOOSE_INDEP__, __CRUSH_RULE_CHOOSELEAF_FIRSTN__, __CRUSH_RULE_CHOOSELEAF_INDEP__, __CRUSH_RULE_SET_CHOOSE_TRIES__, __CRUSH_RULE_SET_CHOOSELEAF_TRIES__ or __CRUSH_RULE_EMIT__
+ * @param op one of __CRUSH_RULE_NOOP__, __CRUSH_RULE_TAKE__, __CRUSH_RULE_CHOOSE_FIRSTN__, __CRUSH_RULE_CHOOSE_INDEP__, __CRUSH_RULE_CHOOSELEAF_FIRSTN__, __CRUSH_RULE_CHOOSELEAF_INDEP__, __CRUSH_RULE_CHOOSE_TOPK__, __CRUSH_RULE_CHOOSELEAF_TOPK__, __CRUSH_RULE_SET_CHOOSE_TRIES__, __CRUSH_RULE_SET_CHOOSELEAF_TRIES__ or __CRUSH_RULE_EMIT__
  * @param arg1 first argument for __op__
  * @param arg2 second argument for __op__
  */
@@ -207,6 +269,10 @@ extern void crush_destroy_choose_args(struct crush_choose_arg *args);
  * If __bucket->alg__ is ::CRUSH_BUCKET_UNIFORM, the value of __weight__ must be equal to
  * __(struct crush_bucket_uniform *)bucket->item_weight__.
  *
+ * If __bucket->alg__ is ::CRUSH_BUCKET_STRAW, the new item has no
+ * straw and the __bucket__ must not be used for mapping until
+ * crush_finalize() computes its straws.
+ *
  * - return -ENOMEM if the __bucket__ cannot be resized with __realloc(3)__.
  * - return -ERANGE if adding __weight__ to the weight of the bucket overflows.
  * - return -EINVAL if __bucket->alg__ is ::CRUSH_BUCKET_UNIFORM and
@@ -216,6 +282,36 @@ extern void crush_destroy_choose_args(struct crush_choose_arg *args);
  * @returns 0 on success, < 0 on error
  */
 extern int crush_bucket_add_item(struct crush_map *map, struct crush_bucket *bucket, int item, int weight);
+/** @ingroup API
+ *
+ * Add the __count__ __items__ to __bucket__, in order, with their
+ * __weights__. It is equivalent to calling crush_bucket_add_item()
+ * for each item but the arrays of the bucket are resized once and the
+ * straws of a ::CRUSH_BUCKET_STRAW bucket are computed once, by the next
+ * crush_finalize(). Building a bucket of N items takes O(N) time
+ * instead of O(N^2). Until then, a ::CRUSH_BUCKET_STRAW __bucket__
+ * must not be used for mapping.
+ *
+ * The __bucket__ is not modified if an error other than -ENOMEM is
+ * returned.
+ *
+ * - return -ENOMEM if the __bucket__ cannot be resized with __realloc(3)__.
+ * - return -ERANGE if adding the __weights__ to the weight of the bucket overflows.
+ * - return -EINVAL if __count__ is negative or if __bucket->alg__ is
+ *   ::CRUSH_BUCKET_UNIFORM and one of the __weights__ is not equal to
+ *   __(struct crush_bucket_uniform *)bucket->item_weight__.
+ * - return -1 if the value of __bucket->alg__ is unknown.
+ *
+ * @param map a crush_map containing __bucket__
+ * @param bucket the bucket to which the __items__ are added
+ * @param count the number of __items__
+ * @param items the items to add
+ * @param weights the weight of each item in __items__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_bucket_add_items(struct crush_map *map, struct crush_bucket *bucket,
+				  int count, const int *items, const int *weights);
 /** @ingroup API
  *
  * If __bucket->alg__ is ::CRUSH_BUCKET_UNIFORM,
@@ -230,6 +326,10 @@ extern int crush_bucket_add_item(struct crush_map *map, struct crush_bucket *buc
  * The return value is the difference between the new item weight and the former
  * item weight.
  *
+ * If __bucket->alg__ is ::CRUSH_BUCKET_STRAW, the straws still match
+ * the former weights and the __bucket__ must not be used for mapping
+ * until crush_finalize() computes them again.
+ *
  * @returns the difference between the new weight and the former weight
  */
 extern int crush_bucket_adjust_item_weight(struct crush_map *map, struct crush_bucket *bucket, int item, int weight);
@@ -237,7 +337,9 @@ extern int crush_bucket_adjust_item_weight(struct crush_map *map, struct crush_b
  *
  * Recursively update the weight of __bucket__ and its children, deep
  * first. The __bucket__ weight is set to the sum of the weight of the
- * items it contains.
+ * items it contains. The ::CRUSH_BUCKET_STRAW buckets that are
+ * reweighted must not be used for mapping until crush_finalize()
+ * computes their straws again.
  *
  * - return -ERANGE if the sum of the weight of the items in __bucket__ overflows.
  * - return -1 if the value of __bucket->alg__ is unknown.
@@ -264,6 +366,12 @@ extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucke
  * the bucket weight. If the weight of the item is greater than the
  * weight of the bucket, silentely set the bucket weight to zero.
  *
+ * If __bucket->alg__ is ::CRUSH_BUCKET_STRAW, the straws of the
+ * remaining items no longer match their weights and the __bucket__
+ * must not be used for mapping until crush_finalize() computes them
+ * again. If __bucket->alg__ is ::CRUSH_BUCKET_TREE, the item is
+ * replaced by a 0 with no weight that is not taken for the device 0.
+ *
  * - return -ENOMEM if the __bucket__ cannot be sized down with __realloc(3)__.
  * - return -1 if the value of __bucket->alg__ is unknown.
  *
@@ -273,6 +381,34 @@ extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucke
  * @returns 0 on success, < 0 on error
  */
 extern int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *bucket, int item);
+/** @ingroup API
+ *
+ * Remove the __count__ __items__ from __bucket__ and subtract their
+ * weights from the bucket weight, as crush_bucket_remove_item() does
+ * for each of them. Unless __bucket->alg__ is ::CRUSH_BUCKET_TREE, the
+ * remaining items are compacted in a single pass, keeping their
+ * order, and the straws of a
+ * ::CRUSH_BUCKET_STRAW bucket are computed once, by the next
+ * crush_finalize(). Until then, a ::CRUSH_BUCKET_STRAW __bucket__ must
+ * not be used for mapping. An item that is listed more than once is
+ * removed once.
+ *
+ * Either all the __items__ are removed or none of them.
+ *
+ * - return -ENOENT if one of the __items__ is not in __bucket__.
+ * - return -ENOMEM if __malloc(3)__ fails.
+ * - return -EINVAL if __count__ is negative.
+ * - return -1 if the value of __bucket->alg__ is unknown.
+ *
+ * @param map a crush_map containing __bucket__
+ * @param bucket the bucket from which the __items__ are removed
+ * @param count the number of __items__
+ * @param items the items to remove
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_bucket_remove_items(struct crush_map *map, struct crush_bucket *bucket,
+				     int count, const int *items);
 
 struct crush_bucket_uniform *
 crush_make_uniform_bucket(int hash, int type, int size,
@@ -286,6 +422,17 @@ struct crush_bucket_tree*
 crush_make_tree_bucket(int hash, int type, int size,
 		       int *items,    /* in leaf order */
 		       int *weights);
+/** @ingroup API
+ *
+ * The number of nodes of a ::CRUSH_BUCKET_TREE bucket with __size__
+ * items, as set by crush_make_tree_bucket() and the functions that add
+ * or remove items. It does not fit __num_nodes__ if __size__ > 64.
+ *
+ * @param size the number of items of the bucket
+ *
+ * @returns 0 if __size__ is 0, the number of nodes otherwise
+ */
+extern __u64 crush_calc_tree_num_nodes(__u32 size);
 struct crush_bucket_straw *
 crush_make_straw_bucket(struct crush_map *map,
 			int hash, int type, int size,
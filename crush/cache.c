@@ -0,0 +1,232 @@
+#include <sched.h>
+
+#include "cache.h"
+#include "mapper.h"
+#include "parallel.h"
+
+#define dprintk(args...) /* printf(args) */
+
+/* the number of entries of a set, among which CLOCK picks a victim */
+#define CRUSH_CACHE_WAYS 8
+
+struct crush_cache_entry {
+	__u64 tag;        /* 0 if the entry is empty */
+	int x;
+	int ruleno;
+	int result_max;
+	int len;
+	int referenced;   /* used since the hand last went over it */
+};
+
+struct crush_cache_shard {
+	int lock;
+	__u32 sets;       /* a power of two */
+	struct crush_cache_entry *entries; /* sets * CRUSH_CACHE_WAYS */
+	int *results;     /* result_max items for each entry */
+	__u8 *hands;      /* the CLOCK hand of each set */
+	__u64 hits;
+	__u64 misses;
+} __attribute__((aligned(64)));
+
+struct crush_cache {
+	int num_shards;
+	int result_max;
+	struct crush_cache_shard *shards;
+	const struct crush_map *map;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	__u32 generation;  /* incremented by each crush_cache_bind() */
+};
+
+static void shard_lock(struct crush_cache_shard *shard)
+{
+	while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&shard->lock, __ATOMIC_RELAXED))
+			sched_yield();
+}
+
+static void shard_unlock(struct crush_cache_shard *shard)
+{
+	__atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+}
+
+/* the 64 bits finalizer of MurmurHash3 */
+static __u64 mix64(__u64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+struct crush_cache *crush_cache_create(int num_shards, int size,
+				       int result_max)
+{
+	struct crush_cache *cache;
+	__u32 sets;
+	int i;
+
+	if (size <= 0 || result_max <= 0)
+		return NULL;
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->num_shards = crush_parallel_threads(num_shards);
+	/* each shard has at least one set */
+	if (cache->num_shards > size / CRUSH_CACHE_WAYS)
+		cache->num_shards = size < CRUSH_CACHE_WAYS ?
+			1 : size / CRUSH_CACHE_WAYS;
+	cache->result_max = result_max;
+	if (posix_memalign((void **)&cache->shards, 64,
+			   sizeof(*cache->shards) * cache->num_shards)) {
+		free(cache);
+		return NULL;
+	}
+	memset(cache->shards, 0, sizeof(*cache->shards) * cache->num_shards);
+
+	/* the largest power of two that does not exceed size */
+	for (sets = 1;
+	     (__s64)sets * 2 * CRUSH_CACHE_WAYS * cache->num_shards <= size;
+	     sets *= 2)
+		;
+	for (i = 0; i < cache->num_shards; i++) {
+		struct crush_cache_shard *shard = &cache->shards[i];
+
+		shard->sets = sets;
+		shard->entries = calloc(sets * CRUSH_CACHE_WAYS,
+					sizeof(*shard->entries));
+		shard->results = malloc(sizeof(int) * result_max *
+					sets * CRUSH_CACHE_WAYS);
+		shard->hands = calloc(sets, 1);
+		if (!shard->entries || !shard->results || !shard->hands) {
+			crush_cache_destroy(cache);
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+void crush_cache_destroy(struct crush_cache *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < cache->num_shards; i++) {
+		free(cache->shards[i].entries);
+		free(cache->shards[i].results);
+		free(cache->shards[i].hands);
+	}
+	free(cache->shards);
+	free(cache);
+}
+
+void crush_cache_bind(struct crush_cache *cache,
+		      const struct crush_map *map,
+		      const __u32 *weights, int weight_max,
+		      const struct crush_choose_arg *choose_args)
+{
+	int i;
+
+	cache->map = map;
+	cache->weights = weights;
+	cache->weight_max = weight_max;
+	cache->choose_args = choose_args;
+	if (++cache->generation == 0) {
+		/* the tags of the entries could be reused, forget them */
+		for (i = 0; i < cache->num_shards; i++)
+			memset(cache->shards[i].entries, 0,
+			       sizeof(struct crush_cache_entry) *
+			       cache->shards[i].sets * CRUSH_CACHE_WAYS);
+		cache->generation = 1;
+	}
+}
+
+int crush_cache_do_rule(struct crush_cache *cache, int ruleno, int x,
+			int *result, int result_max, void *cwin)
+{
+	const struct crush_map *map = cache->map;
+	struct crush_cache_shard *shard;
+	struct crush_cache_entry *set;
+	int *results;
+	__u64 tag;
+	__u64 h;
+	__u32 s;
+	int len;
+	int i;
+
+	if (result_max > cache->result_max)
+		return crush_do_rule(map, ruleno, x, result, result_max,
+				     cache->weights, cache->weight_max,
+				     cwin, cache->choose_args);
+
+	/* never 0 because the generation is never 0 */
+	tag = ((__u64)cache->generation << 32) | map->epoch;
+	h = mix64(((__u64)(__u32)ruleno << 32) | (__u32)x);
+	shard = &cache->shards[(h >> 32) % cache->num_shards];
+	s = h & (shard->sets - 1);
+	set = &shard->entries[s * CRUSH_CACHE_WAYS];
+	results = shard->results + (size_t)s * CRUSH_CACHE_WAYS *
+		cache->result_max;
+
+	shard_lock(shard);
+	for (i = 0; i < CRUSH_CACHE_WAYS; i++) {
+		struct crush_cache_entry *e = &set[i];
+
+		if (e->tag != tag || e->x != x || e->ruleno != ruleno ||
+		    e->result_max != result_max)
+			continue;
+		e->referenced = 1;
+		len = e->len;
+		memcpy(result, results + i * cache->result_max,
+		       sizeof(int) * len);
+		shard->hits++;
+		shard_unlock(shard);
+		return len;
+	}
+	shard->misses++;
+	shard_unlock(shard);
+
+	len = crush_do_rule(map, ruleno, x, result, result_max,
+			    cache->weights, cache->weight_max,
+			    cwin, cache->choose_args);
+
+	shard_lock(shard);
+	/* CLOCK: stale and unreferenced entries are replaced first */
+	for (;;) {
+		struct crush_cache_entry *e = &set[shard->hands[s]];
+
+		if (e->tag != tag || !e->referenced)
+			break;
+		e->referenced = 0;
+		shard->hands[s] = (shard->hands[s] + 1) % CRUSH_CACHE_WAYS;
+	}
+	i = shard->hands[s];
+	dprintk("cache %d at set %u way %d\n", x, s, i);
+	set[i].tag = tag;
+	set[i].x = x;
+	set[i].ruleno = ruleno;
+	set[i].result_max = result_max;
+	set[i].len = len;
+	set[i].referenced = 0;
+	memcpy(results + i * cache->result_max, result, sizeof(int) * len);
+	shard->hands[s] = (i + 1) % CRUSH_CACHE_WAYS;
+	shard_unlock(shard);
+	return len;
+}
+
+void crush_cache_stats(const struct crush_cache *cache,
+		       __u64 *hits, __u64 *misses)
+{
+	int i;
+
+	*hits = 0;
+	*misses = 0;
+	for (i = 0; i < cache->num_shards; i++) {
+		*hits += cache->shards[i].hits;
+		*misses += cache->shards[i].misses;
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef CEPH_CRUSH_CACHE_H
+#define CEPH_CRUSH_CACHE_H
+
+/*
+ * A bounded cache of crush_do_rule() results, shared by threads.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/*
+ * Opaque, see crush_cache_create().
+ */
+struct crush_cache;
+
+/** @ingroup API
+ *
+ * Allocate a cache for at most __size__ results of up to
+ * __result_max__ items, or 8 results if __size__ is smaller than
+ * that. The cache is split in __num_shards__ shards
+ * (crush_parallel_threads(__num_shards__) if __num_shards__ <= 0),
+ * or fewer if __size__ is too small to give 8 results to each shard,
+ * each with its own lock, so that threads mapping different values
+ * rarely wait for each other. A value always goes to the same shard.
+ * Within a shard, the results are stored in sets of a few entries
+ * and, when a set is full, the entry to replace is chosen with the
+ * CLOCK algorithm: entries that were used since the last time the
+ * hand went over them get a second chance.
+ *
+ * The cache must be bound to a map with crush_cache_bind() before it
+ * is used and deallocated with crush_cache_destroy().
+ *
+ * - return NULL if __size__ <= 0 or __result_max__ <= 0
+ * - return NULL if __malloc(3)__ fails
+ *
+ * @param num_shards the number of shards or <= 0
+ * @param size the maximum number of results
+ * @param result_max the maximum size of a result
+ *
+ * @returns the cache or NULL
+ */
+extern struct crush_cache *crush_cache_create(int num_shards, int size,
+					      int result_max);
+
+/** @ingroup API
+ *
+ * Deallocate a cache returned by crush_cache_create().
+ *
+ * @param cache the cache or NULL
+ */
+extern void crush_cache_destroy(struct crush_cache *cache);
+
+/** @ingroup API
+ *
+ * Use __map__, __weights__ and __choose_args__ to compute the results
+ * of crush_cache_do_rule(). The results cached before the call are
+ * never returned, even if the arguments are the same. Neither is a
+ * result cached before __map->epoch__ changed, which happens each
+ * time a function of builder.h modifies the __map__.
+ *
+ * The arguments are not copied and must stay valid while the cache
+ * is bound to them. If the content of __weights__ or __choose_args__
+ * is modified, crush_cache_bind() must be called again. It must not
+ * be called while another thread is in crush_cache_do_rule().
+ *
+ * @param cache the cache
+ * @param map the crush_map
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args NULL or weights and ids for each known bucket
+ */
+extern void crush_cache_bind(struct crush_cache *cache,
+			     const struct crush_map *map,
+			     const __u32 *weights, int weight_max,
+			     const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Same as crush_do_rule() with the map, the weights and the
+ * choose_args given to crush_cache_bind(), except that the result is
+ * copied from the cache if it is there. Otherwise it is computed with
+ * the __cwin__ workspace and added to the cache. It can be called
+ * concurrently by several threads, each with its own workspace.
+ *
+ * If __result_max__ is greater than the __result_max__ of the cache,
+ * the result is computed and not cached.
+ *
+ * @param cache the cache
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ *
+ * @return the number of items in __result__
+ */
+extern int crush_cache_do_rule(struct crush_cache *cache, int ruleno, int x,
+			       int *result, int result_max, void *cwin);
+
+/** @ingroup API
+ *
+ * Set __hits__ and __misses__ to the number of calls to
+ * crush_cache_do_rule() that found the result in the cache and that
+ * did not.
+ *
+ * @param cache the cache
+ * @param hits set to the number of hits
+ * @param misses set to the number of misses
+ */
+extern void crush_cache_stats(const struct crush_cache *cache,
+			      __u64 *hits, __u64 *misses);
+
+#endif
@@ -0,0 +1,264 @@
+#include "compiled.h"
+#include "helpers.h"
+
+#define CRUSH_CACHE_LINE 64
+
+/*
+ * The layout is computed twice: a first time with a NULL __base__ to
+ * get the size of the block and a second time to copy the map into
+ * it.
+ */
+struct crush_arena {
+	char *base;
+	size_t offset;
+};
+
+static void *arena_take(struct crush_arena *arena, size_t size, size_t align)
+{
+	void *p;
+
+	arena->offset = (arena->offset + align - 1) & ~(align - 1);
+	p = arena->base ? arena->base + arena->offset : NULL;
+	arena->offset += size;
+	return p;
+}
+
+static void *arena_copy(struct crush_arena *arena, const void *src,
+			size_t size, size_t align)
+{
+	void *p = arena_take(arena, size, align);
+
+	if (p && size)
+		memcpy(p, src, size);
+	return p;
+}
+
+static struct crush_bucket *compile_bucket(struct crush_arena *arena,
+					   const struct crush_bucket *b)
+{
+	size_t header_size;
+	struct crush_bucket *c;
+	__s32 *items;
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		header_size = sizeof(struct crush_bucket_uniform);
+		break;
+	case CRUSH_BUCKET_LIST:
+		header_size = sizeof(struct crush_bucket_list);
+		break;
+	case CRUSH_BUCKET_TREE:
+		header_size = sizeof(struct crush_bucket_tree);
+		break;
+	case CRUSH_BUCKET_STRAW:
+		header_size = sizeof(struct crush_bucket_straw);
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		header_size = sizeof(struct crush_bucket_straw2);
+		break;
+	default:
+		header_size = sizeof(struct crush_bucket);
+		break;
+	}
+	c = arena_copy(arena, b, header_size, CRUSH_CACHE_LINE);
+	items = arena_copy(arena, b->items, sizeof(__s32) * b->size,
+			   sizeof(__s32));
+	if (c)
+		c->items = items;
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)b;
+		__u32 *item_weights = arena_copy(arena, l->item_weights,
+						 sizeof(__u32) * b->size,
+						 sizeof(__u32));
+		__u32 *sum_weights = arena_copy(arena, l->sum_weights,
+						sizeof(__u32) * b->size,
+						sizeof(__u32));
+		if (c) {
+			((struct crush_bucket_list *)c)->item_weights =
+				item_weights;
+			((struct crush_bucket_list *)c)->sum_weights =
+				sum_weights;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)b;
+		__u32 *node_weights = arena_copy(arena, t->node_weights,
+						 sizeof(__u32) * t->num_nodes,
+						 sizeof(__u32));
+		if (c)
+			((struct crush_bucket_tree *)c)->node_weights =
+				node_weights;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)b;
+		__u32 *item_weights = arena_copy(arena, s->item_weights,
+						 sizeof(__u32) * b->size,
+						 sizeof(__u32));
+		__u32 *straws = arena_copy(arena, s->straws,
+					   sizeof(__u32) * b->size,
+					   sizeof(__u32));
+		if (c) {
+			((struct crush_bucket_straw *)c)->item_weights =
+				item_weights;
+			((struct crush_bucket_straw *)c)->straws = straws;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *s =
+			(const struct crush_bucket_straw2 *)b;
+		__u32 *item_weights = arena_copy(arena, s->item_weights,
+						 sizeof(__u32) * b->size,
+						 sizeof(__u32));
+		struct crush_reciprocal *item_reciprocals = NULL;
+
+		if (s->item_reciprocals)
+			item_reciprocals = arena_copy(
+				arena, s->item_reciprocals,
+				sizeof(struct crush_reciprocal) * b->size,
+				sizeof(__u64));
+		if (c) {
+			((struct crush_bucket_straw2 *)c)->item_weights =
+				item_weights;
+			((struct crush_bucket_straw2 *)c)->item_reciprocals =
+				item_reciprocals;
+		}
+		break;
+	}
+	}
+	return c;
+}
+
+static void compile_map(struct crush_arena *arena,
+			const struct crush_map *map, const int *order,
+			int order_size)
+{
+	struct crush_map *c;
+	struct crush_bucket **buckets;
+	struct crush_rule **rules;
+	int i;
+	__u32 r;
+
+	c = arena_copy(arena, map, sizeof(*map), CRUSH_CACHE_LINE);
+	buckets = arena_take(arena,
+			     sizeof(struct crush_bucket *) * map->max_buckets,
+			     sizeof(void *));
+	rules = arena_take(arena, sizeof(struct crush_rule *) * map->max_rules,
+			   sizeof(void *));
+	if (c) {
+		memset(buckets, 0,
+		       sizeof(struct crush_bucket *) * map->max_buckets);
+		memset(rules, 0, sizeof(struct crush_rule *) * map->max_rules);
+		c->buckets = buckets;
+		c->rules = rules;
+		c->changes = NULL;
+	}
+
+	for (i = 0; i < order_size; i++) {
+		struct crush_bucket *b =
+			compile_bucket(arena, map->buckets[order[i]]);
+		if (c)
+			buckets[order[i]] = b;
+	}
+
+	for (r = 0; r < map->max_rules; r++) {
+		struct crush_rule *rule;
+
+		if (!map->rules[r])
+			continue;
+		rule = arena_copy(arena, map->rules[r],
+				  crush_rule_size(map->rules[r]->len),
+				  CRUSH_CACHE_LINE);
+		if (c)
+			rules[r] = rule;
+	}
+}
+
+/*
+ * Breadth first order of the buckets, starting from the roots. The
+ * buckets that cannot be reached from a root (loops) come last.
+ */
+static int *descent_order(const struct crush_map *map, int *order_size)
+{
+	int *order;
+	char *seen;
+	int *roots;
+	int roots_size;
+	int head, tail;
+	int b;
+	__u32 i;
+
+	order = malloc(sizeof(int) * (map->max_buckets + 1));
+	seen = calloc(map->max_buckets + 1, 1);
+	if (!order || !seen)
+		goto err;
+
+	tail = 0;
+	roots_size = crush_find_roots((struct crush_map *)map, &roots);
+	if (roots_size > 0) {
+		for (i = 0; i < (__u32)roots_size; i++) {
+			order[tail++] = -1-roots[i];
+			seen[-1-roots[i]] = 1;
+		}
+		free(roots);
+	}
+	for (head = 0; head < tail; head++) {
+		const struct crush_bucket *bucket = map->buckets[order[head]];
+
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+
+			if (item >= 0 || -1-item >= map->max_buckets ||
+			    seen[-1-item] || !map->buckets[-1-item])
+				continue;
+			seen[-1-item] = 1;
+			order[tail++] = -1-item;
+		}
+	}
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b] && !seen[b])
+			order[tail++] = b;
+
+	free(seen);
+	*order_size = tail;
+	return order;
+err:
+	free(seen);
+	free(order);
+	return NULL;
+}
+
+struct crush_map *crush_compile(const struct crush_map *map)
+{
+	struct crush_arena arena = { NULL, 0 };
+	int *order;
+	int order_size;
+
+	order = descent_order(map, &order_size);
+	if (!order)
+		return NULL;
+
+	compile_map(&arena, map, order, order_size);
+	if (posix_memalign((void **)&arena.base, CRUSH_CACHE_LINE,
+			   arena.offset)) {
+		free(order);
+		return NULL;
+	}
+	arena.offset = 0;
+	compile_map(&arena, map, order, order_size);
+
+	free(order);
+	return (struct crush_map *)arena.base;
+}
+
+void crush_destroy_compiled(struct crush_map *compiled)
+{
+	free(compiled);
+}
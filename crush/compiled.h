@@ -0,0 +1,48 @@
+#ifndef CEPH_CRUSH_COMPILED_H
+#define CEPH_CRUSH_COMPILED_H
+
+/*
+ * A copy of a crush_map in a single allocation, laid out in the order
+ * the mapper reads it.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Copy the finalized __map__ into a single cache line aligned block
+ * of memory and return a pointer to the copy. The copy is a regular
+ * crush_map that can be given to crush_do_rule(), crush_do_rule_batch(),
+ * crush_work_size(), etc. and maps exactly as __map__ does.
+ *
+ * The buckets are stored in descent order, starting from the buckets
+ * that have no parent and going down the hierarchy level by level.
+ * Each bucket header starts a cache line and is immediately followed by
+ * its items and the arrays specific to its algorithm (weights,
+ * reciprocals, straws, etc.) so that choosing an item from a bucket
+ * touches a few adjacent cache lines instead of several separately
+ * allocated blocks. The rules follow the buckets.
+ *
+ * The copy is read only: it must not be modified with the functions
+ * from builder.h and must be deallocated with crush_destroy_compiled().
+ * The __map__ is not modified and can be destroyed independently.
+ *
+ * If __malloc(3)__ fails, return NULL.
+ *
+ * @param map a crush_map on which crush_finalize() was called
+ *
+ * @returns the compiled copy of __map__ or NULL
+ */
+extern struct crush_map *crush_compile(const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_map returned by crush_compile().
+ *
+ * @param compiled the compiled crush_map or NULL
+ */
+extern void crush_destroy_compiled(struct crush_map *compiled);
+
+#endif
@@ -74,6 +74,7 @@ void crush_destroy_bucket_straw(struct crush_bucket_straw *b)
 
 void crush_destroy_bucket_straw2(struct crush_bucket_straw2 *b)
 {
+	kfree(b->item_reciprocals);
 	kfree(b->item_weights);
 	kfree(b->h.items);
 	kfree(b);
@@ -124,13 +125,24 @@ void crush_destroy(struct crush_map *map)
 			crush_destroy_rule(map->rules[b]);
 		kfree(map->rules);
 	}
-
 #ifndef __KERNEL__
-	kfree(map->choose_tries);
+	crush_destroy_map_changes(map->changes);
 #endif
 	kfree(map);
 }
 
+#ifndef __KERNEL__
+void crush_destroy_map_changes(struct crush_map_changes *changes)
+{
+	if (changes == NULL)
+		return;
+	kfree(changes->device_refs);
+	kfree(changes->dirty);
+	kfree(changes->dirty_buckets);
+	kfree(changes);
+}
+#endif
+
 void crush_destroy_rule(struct crush_rule *rule)
 {
 	kfree(rule);
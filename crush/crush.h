@@ -66,7 +66,12 @@ enum crush_opcodes {
 	CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES = 10,
 	CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES = 11,
 	CRUSH_RULE_SET_CHOOSELEAF_VARY_R = 12,
-	CRUSH_RULE_SET_CHOOSELEAF_STABLE = 13
+	CRUSH_RULE_SET_CHOOSELEAF_STABLE = 13,
+
+	/*! userspace only: arg1 = num items to pick, arg2 = type. Not
+	 * a legacy mode, see crush_rule_set_step() */
+	CRUSH_RULE_CHOOSE_TOPK = 14,
+	CRUSH_RULE_CHOOSELEAF_TOPK = 15
 };
 
 /*
@@ -238,6 +243,22 @@ struct crush_bucket {
         __s32 *items;    /*!< array of children: < 0 are buckets, >= 0 items */
 };
 
+/** @ingroup API
+ *
+ * Multiply and shift replacing the division of a straw2 draw by
+ * __weight__: for any 0 <= n < 2^__CRUSH_RECIPROCAL_BITS__ the quotient n / __weight__ is
+ * (n * __magic__) >> __shift__, computed with 128 bits. The mapper only
+ * uses it if __weight__ is equal to the weight of the item, otherwise
+ * it divides. See crush_set_reciprocal().
+ */
+#define CRUSH_RECIPROCAL_BITS 49
+
+struct crush_reciprocal {
+	__u64 magic; /*!< multiplier */
+	__u32 weight; /*!< 16.16 fixed point weight the multiplier is for */
+	__u32 shift; /*!< right shift of the product */
+};
+
 /** @ingroup API
  *
  * Replacement weights for each item in a bucket. The size of the
@@ -328,6 +349,10 @@ struct crush_bucket_straw {
 	struct crush_bucket h;
 	__u32 *item_weights;   /* 16-bit fixed point */
 	__u32 *straws;         /* 16-bit fixed point */
+#ifndef __KERNEL__
+	/* the straws are recomputed by the next crush_finalize() */
+	__u32 straws_stale;
+#endif
 };
 
 /** @ingroup API
@@ -336,13 +361,34 @@ struct crush_bucket_straw {
  *
  * The weight of __h.items[i]__ is __item_weights[i]__ for i in
  * [0,__h.size__[.
+ *
+ * The __item_reciprocals__ are set by crush_finalize() and reset to NULL
+ * when the size of the bucket changes.
  */
 struct crush_bucket_straw2 {
         struct crush_bucket h; /*!< generic bucket information */
 	__u32 *item_weights;   /*!< 16.16 fixed point weight for each item */
+	struct crush_reciprocal *item_reciprocals; /*!< NULL or one for each item */
 };
 
-
+#ifndef __KERNEL__
+/*
+ * What the functions of builder.h changed in a crush_map since the
+ * last crush_finalize(), so that the next one does not have to look
+ * at the whole map.
+ */
+struct crush_map_changes {
+	__u32 *device_refs;      /* how many times each device is an item */
+	__s32 device_refs_size;  /* the size of device_refs */
+	__s32 max_devices;       /* the highest referenced device + 1 */
+	__u32 num_buckets;       /* the number of buckets in the map */
+	__u64 num_items;         /* the sum of the sizes of the buckets */
+	__u8 *dirty;             /* set for each dirty bucket position */
+	__s32 *dirty_buckets;    /* the positions of the dirty buckets */
+	__s32 dirty_size;        /* the size of dirty and dirty_buckets */
+	__s32 num_dirty;         /* the number of dirty_buckets */
+};
+#endif
 
 /** @ingroup API
  *
@@ -454,10 +500,20 @@ struct crush_map {
 	 * minimize confusion (bucket type values start at 1).
 	 */
 	__u32 allowed_bucket_algs;
+	/*! @endcond */
 
-	__u32 *choose_tries;
+	/*! Incremented by the functions of builder.h each time they
+	 * modify the map, so that a crush_cache can tell its results
+	 * are stale. A caller that modifies the map directly (tunables,
+	 * rule steps, etc.) must increment it as well.
+	 */
+	__u32 epoch;
+
+	/*! NULL until crush_finalize() is first called, then kept up
+	 * to date by the functions of builder.h.
+	 */
+	struct crush_map_changes *changes;
 #endif
-	/*! @endcond */
 };
 
 
@@ -500,6 +556,9 @@ extern void crush_destroy_rule(struct crush_rule *r);
  * @param map the crush map
  */
 extern void crush_destroy(struct crush_map *map);
+#ifndef __KERNEL__
+extern void crush_destroy_map_changes(struct crush_map_changes *changes);
+#endif
 
 static inline int crush_calc_tree_node(int i)
 {
@@ -524,8 +583,129 @@ struct crush_work_bucket {
 	__u32 *perm;  /* Permutation of the bucket's items */
 };
 
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * The size of the crush_stats::choose_tries histogram.
+ */
+#define CRUSH_STATS_MAX_TRIES 256
+
+/** @ingroup API
+ *
+ * Counters updated by the mapper when a crush_stats is attached to
+ * its workspace with crush_work_set_stats(). A workspace is used by a
+ * single thread at a time, so counting does not write to memory
+ * shared with other threads. The counters of several workspaces are
+ * added together with crush_stats_merge().
+ */
+struct crush_stats {
+	__u64 descents;      /*!< items chosen from a bucket */
+	__u64 collisions;    /*!< items rejected because they were already chosen */
+	__u64 rejects;       /*!< items rejected because of an empty bucket, a bad item or a failed recursion */
+	__u64 is_out;        /*!< devices rejected by their __weight__ */
+	__u64 local_retries; /*!< retries in the same bucket instead of a new descent */
+	/*! __choose_tries[n]__ is the number of times an item (firstn) or
+	 * a set of positions (indep) needed __n__ retries. The last
+	 * entry counts __CRUSH_STATS_MAX_TRIES - 1__ retries or more. */
+	__u32 choose_tries[CRUSH_STATS_MAX_TRIES];
+};
+
+/** @ingroup API
+ *
+ * The buckets and devices visited by the mapper, recorded when a
+ * crush_trace is attached to its workspace with crush_work_set_trace().
+ * Each time an item is chosen from a bucket, the id of the bucket and
+ * the id of the item are added to __items__ unless they are already
+ * there. The caller owns the __items__ array and resets __size__
+ * before mapping a value.
+ */
+struct crush_trace {
+	__s32 *items;  /*!< the buckets and devices visited, without duplicates */
+	__u32 size;    /*!< the number of ids in __items__ */
+	__u32 max;     /*!< the size of the __items__ array */
+	int overflow;  /*!< set to 1 when an id did not fit in __items__ */
+};
+
+/** @ingroup API
+ *
+ * The state of a device in a crush_device_state, derived from its
+ * weight.
+ */
+enum {
+	CRUSH_DEVICE_OUT = 0,     /*!< weight == 0x00000, always ignored */
+	CRUSH_DEVICE_IN = 1,      /*!< weight >= 0x10000, never ignored */
+	CRUSH_DEVICE_PARTIAL = 2, /*!< ignored depending on the weight and the value mapped */
+};
+
+/** @ingroup API
+ *
+ * A weight vector prepared by crush_device_state_prepare() and
+ * attached to a workspace with crush_work_set_device_state(). The
+ * mapper reads the one byte __state__ of a device instead of its
+ * weight and only hashes the devices that are ::CRUSH_DEVICE_PARTIAL.
+ * It must be zeroed before it is prepared for the first time.
+ */
+struct crush_device_state {
+	const __u32 *weights; /*!< the weights the table was prepared from */
+	int weight_max;       /*!< the size of __weights__ and __state__ */
+	__u8 *state;          /*!< CRUSH_DEVICE_* for each device */
+};
+
+/** @ingroup API
+ *
+ * The reciprocals of the weight sets of one bucket in a
+ * crush_choose_reciprocals table.
+ */
+struct crush_weight_set_reciprocals {
+	struct crush_reciprocal *reciprocals; /*!< __size__ for each position or NULL */
+	__u32 positions; /*!< the number of weight sets */
+	__u32 size;      /*!< the size of each weight set */
+};
+
+/** @ingroup API
+ *
+ * The reciprocals of the weight sets of a crush_choose_arg array,
+ * prepared by crush_choose_reciprocals_prepare() and attached to a
+ * workspace with crush_work_set_choose_reciprocals(). The mapper only
+ * uses them with the __choose_args__ they were prepared from, for
+ * buckets that still have __size__ items and weights that still match
+ * their reciprocal: it divides by the weight otherwise. It must be
+ * zeroed before it is prepared for the first time.
+ */
+struct crush_choose_reciprocals {
+	const struct crush_choose_arg *choose_args; /*!< the array the table was prepared from */
+	int max_buckets; /*!< the size of __choose_args__ and __buckets__ */
+	struct crush_weight_set_reciprocals *buckets; /*!< one for each bucket */
+};
+
+/* the number of slots of a crush_item_set, a power of two */
+#define CRUSH_ITEM_SET_BITS 7
+#define CRUSH_ITEM_SET_SIZE (1 << CRUSH_ITEM_SET_BITS)
+
+/*
+ * The items already chosen by crush_choose_firstn() or
+ * crush_choose_indep() when there can be many of them: an open
+ * addressing hash set that replaces the linear scan of the result for
+ * collision detection. A slot whose gens[] is not gen is empty, so
+ * that the set is emptied by incrementing gen.
+ */
+struct crush_item_set {
+	__u32 gen;
+	__s32 items[CRUSH_ITEM_SET_SIZE];
+	__u32 gens[CRUSH_ITEM_SET_SIZE];
+};
+#endif
+
 struct crush_work {
 	struct crush_work_bucket **work; /* Per-bucket working store */
+#ifndef __KERNEL__
+	struct crush_stats *stats; /* NULL or where the mapper counts */
+	struct crush_trace *trace; /* NULL or where the mapper records */
+	const struct crush_device_state *devices; /* NULL or the prepared weights */
+	const struct crush_choose_reciprocals *reciprocals; /* NULL or of the choose_args */
+	struct crush_item_set chosen; /* the items chosen by a wide rule */
+	struct crush_item_set leaves; /* and their leaves */
+#endif
 };
 
 #endif
@@ -0,0 +1,12 @@
+#include "crush_ln_table.h"
+#include "crush_ln_full.h"
+
+__s64 crush_ln_full[CRUSH_LN_FULL_SIZE] __attribute__((aligned(64)));
+
+static void __attribute__((constructor)) crush_ln_full_init(void)
+{
+	unsigned int u;
+
+	for (u = 0; u < CRUSH_LN_FULL_SIZE; u++)
+		crush_ln_full[u] = crush_ln(u) - 0x1000000000000ll;
+}
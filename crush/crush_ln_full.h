@@ -0,0 +1,29 @@
+#ifndef CEPH_CRUSH_LN_FULL_H
+#define CEPH_CRUSH_LN_FULL_H
+
+/*
+ * The straw2 draw only ever needs crush_ln() of a 16 bits value: the
+ * result of crush_ln(u) - 0x1000000000000 for every u in [0,0xffff] is
+ * precomputed when the library is loaded so that each draw costs a
+ * single load instead of a normalization, two table lookups and a
+ * multiplication.
+ *
+ * Userspace only: the kernel keeps computing crush_ln() to save the
+ * 512KB of the table.
+ *
+ * LGPL2
+ */
+
+#include "crush_compat.h"
+
+#ifndef __KERNEL__
+#define CRUSH_HAVE_LN_FULL 1
+
+#define CRUSH_LN_FULL_SIZE 0x10000
+
+/* crush_ln_full[u] == crush_ln(u) - 0x1000000000000 */
+extern __s64 crush_ln_full[CRUSH_LN_FULL_SIZE];
+
+#endif
+
+#endif
@@ -0,0 +1,415 @@
+#include <errno.h>
+
+#include "diff.h"
+#include "mapper.h"
+#include "parallel.h"
+
+#define dprintk(args...) /* printf(args) */
+
+#define CRUSH_DIFF_GRAIN 256
+#define CRUSH_DIFF_TRACE_MAX 256
+
+struct crush_diff_worker {
+	void *cwin_before;
+	void *cwin_after;
+	int *result_before;
+	int *result_after;
+	__s32 trace_items[CRUSH_DIFF_TRACE_MAX];
+	struct crush_trace trace;
+	__u32 *device_in;
+	__u32 *device_out;
+	__u32 changed;
+	__u32 skipped;
+	__u64 mapped;
+	__u64 moved;
+};
+
+struct crush_diff_ctx {
+	const struct crush_diff_map *before;
+	const struct crush_diff_map *after;
+	struct crush_plan *plan_before;
+	struct crush_plan *plan_after;
+	int result_max;
+	int can_skip;   /* the rule and the tunables are the same */
+	char *same;     /* same[b] if the bucket -1-b is the same */
+	struct crush_diff_worker *workers;
+	struct crush_diff *diff;
+};
+
+static int same_array(const void *a, const void *b, size_t size)
+{
+	if (a == b || size == 0)
+		return 1;
+	if (!a || !b)
+		return 0;
+	return memcmp(a, b, size) == 0;
+}
+
+static int same_bucket(const struct crush_bucket *a,
+		       const struct crush_bucket *b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->id != b->id || a->type != b->type || a->alg != b->alg ||
+	    a->hash != b->hash || a->weight != b->weight ||
+	    a->size != b->size ||
+	    !same_array(a->items, b->items, sizeof(__s32) * a->size))
+		return 0;
+
+	switch (a->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return ((const struct crush_bucket_uniform *)a)->item_weight ==
+			((const struct crush_bucket_uniform *)b)->item_weight;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *la =
+			(const struct crush_bucket_list *)a;
+		const struct crush_bucket_list *lb =
+			(const struct crush_bucket_list *)b;
+		return same_array(la->item_weights, lb->item_weights,
+				  sizeof(__u32) * a->size) &&
+			same_array(la->sum_weights, lb->sum_weights,
+				   sizeof(__u32) * a->size);
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *ta =
+			(const struct crush_bucket_tree *)a;
+		const struct crush_bucket_tree *tb =
+			(const struct crush_bucket_tree *)b;
+		return ta->num_nodes == tb->num_nodes &&
+			same_array(ta->node_weights, tb->node_weights,
+				   sizeof(__u32) * ta->num_nodes);
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *sa =
+			(const struct crush_bucket_straw *)a;
+		const struct crush_bucket_straw *sb =
+			(const struct crush_bucket_straw *)b;
+		return same_array(sa->item_weights, sb->item_weights,
+				  sizeof(__u32) * a->size) &&
+			same_array(sa->straws, sb->straws,
+				   sizeof(__u32) * a->size);
+	}
+	case CRUSH_BUCKET_STRAW2:
+		return same_array(
+			((const struct crush_bucket_straw2 *)a)->item_weights,
+			((const struct crush_bucket_straw2 *)b)->item_weights,
+			sizeof(__u32) * a->size);
+	default:
+		return 0;
+	}
+}
+
+static int same_choose_arg(const struct crush_choose_arg *a,
+			   const struct crush_choose_arg *b)
+{
+	static const struct crush_choose_arg none;
+	__u32 i;
+
+	if (!a)
+		a = &none;
+	if (!b)
+		b = &none;
+	if (a->ids_size != b->ids_size ||
+	    !same_array(a->ids, b->ids, sizeof(int) * a->ids_size) ||
+	    a->weight_set_size != b->weight_set_size)
+		return 0;
+	for (i = 0; i < a->weight_set_size; i++)
+		if (a->weight_set[i].size != b->weight_set[i].size ||
+		    !same_array(a->weight_set[i].weights,
+				b->weight_set[i].weights,
+				sizeof(__u32) * a->weight_set[i].size))
+			return 0;
+	return 1;
+}
+
+static int same_rule(const struct crush_map *a, const struct crush_map *b,
+		     int ruleno)
+{
+	const struct crush_rule *ra = a->rules[ruleno];
+	const struct crush_rule *rb = b->rules[ruleno];
+
+	return a->max_devices == b->max_devices &&
+		a->choose_local_tries == b->choose_local_tries &&
+		a->choose_local_fallback_tries ==
+		b->choose_local_fallback_tries &&
+		a->choose_total_tries == b->choose_total_tries &&
+		a->chooseleaf_descend_once == b->chooseleaf_descend_once &&
+		a->chooseleaf_vary_r == b->chooseleaf_vary_r &&
+		a->chooseleaf_stable == b->chooseleaf_stable &&
+		ra->len == rb->len &&
+		same_array(ra->steps, rb->steps,
+			   sizeof(struct crush_rule_step) * ra->len);
+}
+
+static __u32 device_weight(const struct crush_diff_map *m, int device)
+{
+	return device < m->weight_max ? m->weights[device] : 0;
+}
+
+/* true if everything visited by the last mapping with before is the same */
+static int same_trace(const struct crush_diff_ctx *ctx,
+		      const struct crush_trace *trace)
+{
+	__u32 i;
+
+	if (trace->overflow)
+		return 0;
+	for (i = 0; i < trace->size; i++) {
+		int item = trace->items[i];
+
+		if (item < 0) {
+			if (-1-item >= ctx->before->map->max_buckets ||
+			    !ctx->same[-1-item])
+				return 0;
+		} else if (device_weight(ctx->before, item) !=
+			   device_weight(ctx->after, item)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int contains(const int *result, int len, int item)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (result[i] == item)
+			return 1;
+	return 0;
+}
+
+static void diff_value(struct crush_diff_ctx *ctx,
+		       struct crush_diff_worker *w, int i,
+		       int len_before, int len_after)
+{
+	const int *before = w->result_before;
+	const int *after = w->result_after;
+	int max_devices = ctx->diff->max_devices;
+	__u32 changed = 0;
+	int j;
+
+	for (j = 0; j < len_before || j < len_after; j++)
+		if (j >= len_before || j >= len_after ||
+		    before[j] != after[j])
+			changed++;
+	ctx->diff->changed_positions[i] = changed;
+	if (changed)
+		w->changed++;
+
+	for (j = 0; j < len_before; j++)
+		if (before[j] >= 0 && before[j] < max_devices &&
+		    !contains(after, len_after, before[j]))
+			w->device_out[before[j]]++;
+	for (j = 0; j < len_after; j++) {
+		if (after[j] < 0 || after[j] >= max_devices)
+			continue;
+		w->mapped++;
+		if (!contains(before, len_before, after[j])) {
+			w->device_in[after[j]]++;
+			w->moved++;
+		}
+	}
+}
+
+static void crush_diff_chunk(void *arg, int worker, int begin, int end)
+{
+	struct crush_diff_ctx *ctx = arg;
+	struct crush_diff_worker *w = &ctx->workers[worker];
+	const struct crush_diff_map *before = ctx->before;
+	const struct crush_diff_map *after = ctx->after;
+	int i, j;
+
+	for (i = begin; i < end; i++) {
+		int x = ctx->diff->x_start + i;
+		int len_before, len_after;
+
+		w->trace.size = 0;
+		w->trace.overflow = 0;
+		len_before = crush_do_plan(before->map, ctx->plan_before, x,
+					   w->result_before, ctx->result_max,
+					   before->weights, before->weight_max,
+					   w->cwin_before, before->choose_args);
+		if (ctx->can_skip && same_trace(ctx, &w->trace)) {
+			dprintk("skip %d\n", x);
+			ctx->diff->changed_positions[i] = 0;
+			w->skipped++;
+			for (j = 0; j < len_before; j++)
+				if (w->result_before[j] >= 0 &&
+				    w->result_before[j] < ctx->diff->max_devices)
+					w->mapped++;
+			continue;
+		}
+		len_after = crush_do_plan(after->map, ctx->plan_after, x,
+					  w->result_after, ctx->result_max,
+					  after->weights, after->weight_max,
+					  w->cwin_after, after->choose_args);
+		diff_value(ctx, w, i, len_before, len_after);
+	}
+}
+
+static void free_workers(struct crush_diff_worker *workers, int num_threads)
+{
+	int i;
+
+	if (!workers)
+		return;
+	for (i = 0; i < num_threads; i++) {
+		free(workers[i].cwin_before);
+		free(workers[i].cwin_after);
+		free(workers[i].result_before);
+		free(workers[i].result_after);
+		free(workers[i].device_in);
+		free(workers[i].device_out);
+	}
+	free(workers);
+}
+
+static int init_workers(struct crush_diff_ctx *ctx, int num_threads)
+{
+	const struct crush_map *before = ctx->before->map;
+	const struct crush_map *after = ctx->after->map;
+	int max_devices = ctx->diff->max_devices;
+	int i;
+
+	ctx->workers = calloc(num_threads, sizeof(*ctx->workers));
+	if (!ctx->workers)
+		return -ENOMEM;
+	for (i = 0; i < num_threads; i++) {
+		struct crush_diff_worker *w = &ctx->workers[i];
+
+		w->cwin_before = malloc(crush_work_size(before,
+							ctx->result_max));
+		w->cwin_after = malloc(crush_work_size(after, ctx->result_max));
+		w->result_before = malloc(sizeof(int) * ctx->result_max);
+		w->result_after = malloc(sizeof(int) * ctx->result_max);
+		w->device_in = calloc(max_devices + 1, sizeof(__u32));
+		w->device_out = calloc(max_devices + 1, sizeof(__u32));
+		if (!w->cwin_before || !w->cwin_after ||
+		    !w->result_before || !w->result_after ||
+		    !w->device_in || !w->device_out)
+			return -ENOMEM;
+		crush_init_workspace(before, w->cwin_before);
+		crush_init_workspace(after, w->cwin_after);
+		w->trace.items = w->trace_items;
+		w->trace.max = CRUSH_DIFF_TRACE_MAX;
+		crush_work_set_trace(w->cwin_before, &w->trace);
+	}
+	return 0;
+}
+
+static void merge_workers(struct crush_diff_ctx *ctx, int num_threads)
+{
+	struct crush_diff *diff = ctx->diff;
+	int i, d;
+
+	for (i = 0; i < num_threads; i++) {
+		struct crush_diff_worker *w = &ctx->workers[i];
+
+		for (d = 0; d < diff->max_devices; d++) {
+			diff->device_in[d] += w->device_in[d];
+			diff->device_out[d] += w->device_out[d];
+		}
+		diff->changed += w->changed;
+		diff->skipped += w->skipped;
+		diff->mapped += w->mapped;
+		diff->moved += w->moved;
+	}
+	if (diff->mapped)
+		diff->moved_fraction = (double)diff->moved / diff->mapped;
+}
+
+static char *same_buckets(const struct crush_diff_map *before,
+			  const struct crush_diff_map *after)
+{
+	char *same;
+	int b;
+
+	same = calloc(before->map->max_buckets + 1, 1);
+	if (!same)
+		return NULL;
+	for (b = 0; b < before->map->max_buckets; b++) {
+		if (b >= after->map->max_buckets)
+			break;
+		same[b] = same_bucket(before->map->buckets[b],
+				      after->map->buckets[b]) &&
+			same_choose_arg(before->choose_args ?
+					&before->choose_args[b] : NULL,
+					after->choose_args ?
+					&after->choose_args[b] : NULL);
+	}
+	return same;
+}
+
+struct crush_diff *crush_diff(const struct crush_diff_map *before,
+			      const struct crush_diff_map *after,
+			      int ruleno, int x_start, int count,
+			      int result_max, int num_threads)
+{
+	struct crush_diff_ctx ctx;
+	struct crush_diff *diff;
+	int r;
+
+	if (count < 0 || result_max <= 0)
+		return NULL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.before = before;
+	ctx.after = after;
+	ctx.result_max = result_max;
+	num_threads = crush_parallel_threads(num_threads);
+
+	diff = calloc(1, sizeof(*diff));
+	if (!diff)
+		return NULL;
+	ctx.diff = diff;
+	diff->x_start = x_start;
+	diff->count = count;
+	diff->max_devices = before->map->max_devices > after->map->max_devices ?
+		before->map->max_devices : after->map->max_devices;
+	diff->changed_positions = calloc(count + 1, sizeof(__u32));
+	diff->device_in = calloc(diff->max_devices + 1, sizeof(__u32));
+	diff->device_out = calloc(diff->max_devices + 1, sizeof(__u32));
+	if (!diff->changed_positions || !diff->device_in || !diff->device_out)
+		goto err;
+
+	ctx.plan_before = crush_compile_rule(before->map, ruleno);
+	ctx.plan_after = crush_compile_rule(after->map, ruleno);
+	if (!ctx.plan_before || !ctx.plan_after)
+		goto err;
+	ctx.can_skip = same_rule(before->map, after->map, ruleno);
+	ctx.same = same_buckets(before, after);
+	if (!ctx.same)
+		goto err;
+	if (init_workers(&ctx, num_threads) < 0)
+		goto err;
+
+	r = crush_parallel_for(count, num_threads, CRUSH_DIFF_GRAIN,
+			       crush_diff_chunk, &ctx);
+	if (r < 0)
+		goto err;
+	merge_workers(&ctx, num_threads);
+
+	free_workers(ctx.workers, num_threads);
+	free(ctx.same);
+	crush_destroy_plan(ctx.plan_before);
+	crush_destroy_plan(ctx.plan_after);
+	return diff;
+err:
+	free_workers(ctx.workers, num_threads);
+	free(ctx.same);
+	crush_destroy_plan(ctx.plan_before);
+	crush_destroy_plan(ctx.plan_after);
+	crush_diff_destroy(diff);
+	return NULL;
+}
+
+void crush_diff_destroy(struct crush_diff *diff)
+{
+	if (!diff)
+		return;
+	free(diff->changed_positions);
+	free(diff->device_in);
+	free(diff->device_out);
+	free(diff);
+}
@@ -0,0 +1,97 @@
+#ifndef CEPH_CRUSH_DIFF_H
+#define CEPH_CRUSH_DIFF_H
+
+/*
+ * Compare how two versions of a crush_map map the same values, to
+ * know what moves before applying a change.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * A crush_map with the arguments given to crush_do_rule() when
+ * mapping with it.
+ */
+struct crush_diff_map {
+	const struct crush_map *map;               /*!< the crush_map */
+	const __u32 *weights;                      /*!< an array of weights of size __weight_max__ */
+	int weight_max;                            /*!< the size of the __weights__ array */
+	const struct crush_choose_arg *choose_args; /*!< NULL or weights and ids for each known bucket */
+};
+
+/** @ingroup API
+ *
+ * The differences between the mapping of __count__ values, from
+ * __x_start__ to __x_start + count - 1__, before and after a change,
+ * as returned by crush_diff().
+ */
+struct crush_diff {
+	int x_start;                /*!< the first value */
+	int count;                  /*!< the number of values */
+	/*! __changed_positions[i]__ is the number of positions of the
+	 * result of __x_start + i__ that are not the same item, including
+	 * the positions that are only in one of the results */
+	__u32 *changed_positions;
+	int max_devices;            /*!< the size of __device_in__ and __device_out__ */
+	/*! __device_in[d]__ is the number of values mapped to the device
+	 * __d__ after the change and not before */
+	__u32 *device_in;
+	/*! __device_out[d]__ is the number of values mapped to the device
+	 * __d__ before the change and not after */
+	__u32 *device_out;
+	__u32 changed;              /*!< the number of values with at least one changed position */
+	/*! the number of values known to map to the same result without
+	 * mapping them after the change */
+	__u32 skipped;
+	__u64 mapped;               /*!< the number of devices the values are mapped to after the change */
+	__u64 moved;                /*!< the sum of __device_in__ */
+	double moved_fraction;      /*!< __moved__ / __mapped__ or 0 if nothing is mapped */
+};
+
+/** @ingroup API
+ *
+ * Map the values in [__x_start__,__x_start + count__[ with the rule
+ * __ruleno__ of both __before__ and __after__ and return what changed.
+ * The values are spread over crush_parallel_threads(__num_threads__)
+ * threads and the result does not depend on the number of threads.
+ *
+ * A value is not mapped with __after__ when it is known to map to the
+ * same result: the rule and the tunables are the same in both maps,
+ * each bucket visited when mapping the value with __before__ is
+ * identical (items, weights, choose_args) in __after__ and the
+ * devices visited have the same weight.
+ *
+ * The returned crush_diff must be deallocated with
+ * crush_diff_destroy().
+ *
+ * - return NULL if __ruleno__ is not a rule of both maps
+ * - return NULL if __count__ < 0 or __result_max__ <= 0
+ * - return NULL if __malloc(3)__ fails or a thread cannot be created
+ *
+ * @param before the map before the change
+ * @param after the map after the change
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x_start the first value to map
+ * @param count the number of values to map
+ * @param result_max the maximum number of items mapped to each value
+ * @param num_threads the number of threads, see crush_parallel_threads()
+ *
+ * @returns the differences or NULL
+ */
+extern struct crush_diff *crush_diff(const struct crush_diff_map *before,
+				     const struct crush_diff_map *after,
+				     int ruleno, int x_start, int count,
+				     int result_max, int num_threads);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_diff returned by crush_diff().
+ *
+ * @param diff the crush_diff or NULL
+ */
+extern void crush_diff_destroy(struct crush_diff *diff);
+
+#endif
@@ -0,0 +1,822 @@
+#include <errno.h>
+
+#include "encoding.h"
+#include "builder.h"
+
+#define dprintk(args...) /* printf(args) */
+
+/* Ceph encodes in little endian */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define CRUSH_HOST_LE 1
+#else
+# define CRUSH_HOST_LE 0
+#endif
+
+static inline __u32 le32(__u32 v)
+{
+	return CRUSH_HOST_LE ? v : __builtin_bswap32(v);
+}
+
+static inline __u64 le64(__u64 v)
+{
+	return CRUSH_HOST_LE ? v : __builtin_bswap64(v);
+}
+
+/*
+ * The encoding is done twice: a first time with a NULL __buf__ to get
+ * its size and a second time to write it.
+ */
+struct crush_encoder {
+	unsigned char *buf;
+	size_t pos;
+};
+
+static void enc_bytes(struct crush_encoder *e, const void *p, size_t n)
+{
+	if (e->buf && n)
+		memcpy(e->buf + e->pos, p, n);
+	e->pos += n;
+}
+
+static void enc_u8(struct crush_encoder *e, __u8 v)
+{
+	enc_bytes(e, &v, sizeof(v));
+}
+
+static void enc_u16(struct crush_encoder *e, __u16 v)
+{
+	v = CRUSH_HOST_LE ? v : __builtin_bswap16(v);
+	enc_bytes(e, &v, sizeof(v));
+}
+
+static void enc_u32(struct crush_encoder *e, __u32 v)
+{
+	v = le32(v);
+	enc_bytes(e, &v, sizeof(v));
+}
+
+static void enc_u64(struct crush_encoder *e, __u64 v)
+{
+	v = le64(v);
+	enc_bytes(e, &v, sizeof(v));
+}
+
+static void enc_array32(struct crush_encoder *e, const void *a, __u32 n)
+{
+	const __u32 *v = a;
+	__u32 i;
+
+	if (CRUSH_HOST_LE) {
+		enc_bytes(e, a, sizeof(__u32) * n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		enc_u32(e, v[i]);
+}
+
+static void encode_bucket(struct crush_encoder *e,
+			  const struct crush_bucket *b)
+{
+	__u32 j;
+
+	if (!b) {
+		enc_u32(e, 0);
+		return;
+	}
+	enc_u32(e, b->alg);
+	enc_u32(e, b->id);
+	enc_u16(e, b->type);
+	enc_u8(e, b->alg);
+	enc_u8(e, b->hash);
+	enc_u32(e, b->weight);
+	enc_u32(e, b->size);
+	enc_array32(e, b->items, b->size);
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		enc_u32(e, ((const struct crush_bucket_uniform *)b)->
+			item_weight);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)b;
+		for (j = 0; j < b->size; j++) {
+			enc_u32(e, l->item_weights[j]);
+			enc_u32(e, l->sum_weights[j]);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)b;
+		enc_u8(e, t->num_nodes);
+		enc_array32(e, t->node_weights, t->num_nodes);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)b;
+		for (j = 0; j < b->size; j++) {
+			enc_u32(e, s->item_weights[j]);
+			enc_u32(e, s->straws[j]);
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2:
+		enc_array32(e, ((const struct crush_bucket_straw2 *)b)->
+			    item_weights, b->size);
+		break;
+	}
+}
+
+static void encode_rule(struct crush_encoder *e, const struct crush_rule *r)
+{
+	__u32 j;
+
+	if (!r) {
+		enc_u32(e, 0);
+		return;
+	}
+	enc_u32(e, 1);
+	enc_u32(e, r->len);
+	enc_u8(e, r->mask.ruleset);
+	enc_u8(e, r->mask.type);
+	enc_u8(e, r->mask.min_size);
+	enc_u8(e, r->mask.max_size);
+	for (j = 0; j < r->len; j++) {
+		enc_u32(e, r->steps[j].op);
+		enc_u32(e, r->steps[j].arg1);
+		enc_u32(e, r->steps[j].arg2);
+	}
+}
+
+static void encode_choose_args(struct crush_encoder *e,
+			       const struct crush_choose_arg_set *set)
+{
+	const struct crush_choose_arg_map *map = &set->map;
+	__u32 i, j, size = 0;
+
+	enc_u64(e, set->id);
+	for (i = 0; i < map->size; i++)
+		if (map->args[i].weight_set_size || map->args[i].ids_size)
+			size++;
+	enc_u32(e, size);
+	for (i = 0; i < map->size; i++) {
+		const struct crush_choose_arg *arg = &map->args[i];
+
+		if (!arg->weight_set_size && !arg->ids_size)
+			continue;
+		enc_u32(e, i);
+		enc_u32(e, arg->weight_set_size);
+		for (j = 0; j < arg->weight_set_size; j++) {
+			enc_u32(e, arg->weight_set[j].size);
+			enc_array32(e, arg->weight_set[j].weights,
+				    arg->weight_set[j].size);
+		}
+		enc_u32(e, arg->ids_size);
+		enc_array32(e, arg->ids, arg->ids_size);
+	}
+}
+
+static void encode_map(struct crush_encoder *e,
+		       const struct crush_ceph_map *cm)
+{
+	const struct crush_map *m = cm->map;
+	int b;
+	__u32 i;
+
+	enc_u32(e, CRUSH_MAGIC);
+	enc_u32(e, m->max_buckets);
+	enc_u32(e, m->max_rules);
+	enc_u32(e, m->max_devices);
+	for (b = 0; b < m->max_buckets; b++)
+		encode_bucket(e, m->buckets[b]);
+	for (i = 0; i < m->max_rules; i++)
+		encode_rule(e, m->rules[i]);
+
+	/* type, item and rule names */
+	if (cm->names) {
+		enc_bytes(e, cm->names, cm->names_size);
+	} else {
+		for (i = 0; i < 3; i++)
+			enc_u32(e, 0);
+	}
+
+	enc_u32(e, m->choose_local_tries);
+	enc_u32(e, m->choose_local_fallback_tries);
+	enc_u32(e, m->choose_total_tries);
+	enc_u32(e, m->chooseleaf_descend_once);
+	enc_u8(e, m->chooseleaf_vary_r);
+	enc_u8(e, m->straw_calc_version);
+	enc_u32(e, m->allowed_bucket_algs);
+	enc_u8(e, m->chooseleaf_stable);
+
+	/* class map, class names and class buckets */
+	if (cm->classes) {
+		enc_bytes(e, cm->classes, cm->classes_size);
+	} else {
+		for (i = 0; i < 3; i++)
+			enc_u32(e, 0);
+	}
+
+	enc_u32(e, cm->choose_args_size);
+	for (i = 0; i < cm->choose_args_size; i++)
+		encode_choose_args(e, &cm->choose_args[i]);
+}
+
+size_t crush_encode(const struct crush_ceph_map *cm, void *buf, size_t size)
+{
+	struct crush_encoder e = { NULL, 0 };
+
+	encode_map(&e, cm);
+	if (buf && e.pos <= size) {
+		e.buf = buf;
+		e.pos = 0;
+		encode_map(&e, cm);
+	}
+	return e.pos;
+}
+
+/*
+ * The decoding is done twice, as the encoding: a first time with a
+ * NULL __block__ to check the buffer and get the size of the block
+ * in which the result is stored and a second time to fill it.
+ */
+struct crush_decoder {
+	const unsigned char *buf;
+	size_t size;
+	size_t pos;
+	int zero_copy;
+	char *block;
+	size_t offset;  /* of the first free byte of the block */
+	int error;
+};
+
+/* the crush_ceph_map returned by crush_decode() and its crush_map */
+struct crush_ceph_map_block {
+	struct crush_ceph_map cm;
+	struct crush_map map;
+};
+
+static void *block_take(struct crush_decoder *d, size_t size, size_t align)
+{
+	void *p;
+
+	d->offset = (d->offset + align - 1) & ~(align - 1);
+	p = d->block ? d->block + d->offset : NULL;
+	d->offset += size;
+	return p;
+}
+
+/* the next @count * @size bytes of the buffer or NULL */
+static const unsigned char *dec_need(struct crush_decoder *d,
+				     size_t count, size_t size)
+{
+	const unsigned char *p;
+
+	if (d->error || (count && size > (d->size - d->pos) / count)) {
+		d->error = 1;
+		return NULL;
+	}
+	p = d->buf + d->pos;
+	d->pos += count * size;
+	return p;
+}
+
+static __u8 dec_u8(struct crush_decoder *d)
+{
+	const unsigned char *p = dec_need(d, 1, 1);
+
+	return p ? *p : 0;
+}
+
+static __u16 dec_u16(struct crush_decoder *d)
+{
+	const unsigned char *p = dec_need(d, 1, 2);
+
+	return p ? p[0] | p[1] << 8 : 0;
+}
+
+static __u32 get_u32(const unsigned char *p)
+{
+	__u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32(v);
+}
+
+static __u32 dec_u32(struct crush_decoder *d)
+{
+	const unsigned char *p = dec_need(d, 1, 4);
+
+	return p ? get_u32(p) : 0;
+}
+
+static __u64 dec_u64(struct crush_decoder *d)
+{
+	const unsigned char *p = dec_need(d, 1, 8);
+	__u64 v;
+
+	if (!p)
+		return 0;
+	memcpy(&v, p, sizeof(v));
+	return le64(v);
+}
+
+/* true if the @p bytes of the buffer can be used in place */
+static int dec_in_place(const struct crush_decoder *d, const void *p)
+{
+	return d->zero_copy && CRUSH_HOST_LE && (unsigned long)p % 4 == 0;
+}
+
+/* an array of @n 32 bits values, in the buffer or copied in the block */
+static void *dec_array32(struct crush_decoder *d, __u32 n)
+{
+	const unsigned char *p = dec_need(d, n, 4);
+	__u32 *a;
+	__u32 i;
+
+	if (!p)
+		return NULL;
+	if (dec_in_place(d, p))
+		return d->block ? (void *)p : NULL;
+	a = block_take(d, sizeof(__u32) * n, sizeof(__u32));
+	if (a)
+		for (i = 0; i < n; i++)
+			a[i] = get_u32(p + 4 * i);
+	return a;
+}
+
+/* two interleaved arrays of @n 32 bits values, copied in the block */
+static void dec_pairs32(struct crush_decoder *d, __u32 n,
+			__u32 **a, __u32 **b)
+{
+	const unsigned char *p = dec_need(d, n, 8);
+	__u32 i;
+
+	*a = block_take(d, sizeof(__u32) * n, sizeof(__u32));
+	*b = block_take(d, sizeof(__u32) * n, sizeof(__u32));
+	if (!p || !*a)
+		return;
+	for (i = 0; i < n; i++) {
+		(*a)[i] = get_u32(p + 8 * i);
+		(*b)[i] = get_u32(p + 8 * i + 4);
+	}
+}
+
+/* @n reciprocals of @weights, in the block */
+static struct crush_reciprocal *dec_reciprocals(struct crush_decoder *d,
+						const __u32 *weights, __u32 n)
+{
+	struct crush_reciprocal *r;
+	__u32 i;
+
+	if (d->error)
+		return NULL;
+	r = block_take(d, sizeof(*r) * n, sizeof(__u64));
+	if (r)
+		for (i = 0; i < n; i++)
+			crush_set_reciprocal(&r[i], weights[i]);
+	return r;
+}
+
+static size_t bucket_header_size(__u32 alg)
+{
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return sizeof(struct crush_bucket_uniform);
+	case CRUSH_BUCKET_LIST:
+		return sizeof(struct crush_bucket_list);
+	case CRUSH_BUCKET_TREE:
+		return sizeof(struct crush_bucket_tree);
+	case CRUSH_BUCKET_STRAW:
+		return sizeof(struct crush_bucket_straw);
+	case CRUSH_BUCKET_STRAW2:
+		return sizeof(struct crush_bucket_straw2);
+	default:
+		return 0;
+	}
+}
+
+static struct crush_bucket *decode_bucket(struct crush_decoder *d, int b)
+{
+	__u32 alg = dec_u32(d);
+	struct crush_bucket h;
+	struct crush_bucket *bucket;
+	__s32 *items;
+
+	if (!alg)
+		return NULL;
+	if (!bucket_header_size(alg)) {
+		dprintk("bucket %d: unknown alg %u\n", b, alg);
+		d->error = 1;
+		return NULL;
+	}
+	bucket = block_take(d, bucket_header_size(alg), sizeof(__u64));
+	h.id = dec_u32(d);
+	h.type = dec_u16(d);
+	h.alg = dec_u8(d);
+	h.hash = dec_u8(d);
+	h.weight = dec_u32(d);
+	h.size = dec_u32(d);
+	if (h.id != -1-b || h.alg != alg) {
+		dprintk("bucket %d: bad id %d or alg %d\n", b, h.id, h.alg);
+		d->error = 1;
+		return NULL;
+	}
+	items = dec_array32(d, h.size);
+	if (bucket) {
+		*bucket = h;
+		bucket->items = items;
+	}
+
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM: {
+		__u32 item_weight = dec_u32(d);
+
+		if (bucket)
+			((struct crush_bucket_uniform *)bucket)->item_weight =
+				item_weight;
+		break;
+	}
+	case CRUSH_BUCKET_LIST: {
+		struct crush_bucket_list *l =
+			(struct crush_bucket_list *)bucket;
+		__u32 *item_weights, *sum_weights;
+
+		dec_pairs32(d, h.size, &item_weights, &sum_weights);
+		if (l) {
+			l->item_weights = item_weights;
+			l->sum_weights = sum_weights;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		struct crush_bucket_tree *t =
+			(struct crush_bucket_tree *)bucket;
+		__u8 num_nodes = dec_u8(d);
+		__u32 *node_weights = dec_array32(d, num_nodes);
+
+		/*
+		 * the mapper descends from node num_nodes / 2 to the
+		 * leaves of the items, an emptied bucket keeps one node
+		 */
+		if (h.size ? num_nodes != crush_calc_tree_num_nodes(h.size) :
+		    num_nodes > 1) {
+			d->error = 1;
+			return NULL;
+		}
+		if (t) {
+			t->num_nodes = num_nodes;
+			t->node_weights = node_weights;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		struct crush_bucket_straw *s =
+			(struct crush_bucket_straw *)bucket;
+		__u32 *item_weights, *straws;
+
+		dec_pairs32(d, h.size, &item_weights, &straws);
+		if (s) {
+			s->item_weights = item_weights;
+			s->straws = straws;
+		}
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		struct crush_bucket_straw2 *s =
+			(struct crush_bucket_straw2 *)bucket;
+		__u32 *item_weights = dec_array32(d, h.size);
+		struct crush_reciprocal *reciprocals =
+			dec_reciprocals(d, item_weights, h.size);
+
+		if (s) {
+			s->item_weights = item_weights;
+			s->item_reciprocals = reciprocals;
+		}
+		break;
+	}
+	}
+	return bucket;
+}
+
+static struct crush_rule *decode_rule(struct crush_decoder *d)
+{
+	const unsigned char *p;
+	struct crush_rule *rule;
+	__u32 len, j;
+
+	if (!dec_u32(d))
+		return NULL;
+	len = dec_u32(d);
+	d->pos -= d->error ? 0 : 4;
+	/* the len, the mask and the steps, as in a struct crush_rule */
+	if (len > (d->size - d->pos) / sizeof(struct crush_rule_step)) {
+		d->error = 1;
+		return NULL;
+	}
+	p = dec_need(d, 1, crush_rule_size(len));
+	if (!p)
+		return NULL;
+	if (dec_in_place(d, p))
+		return (struct crush_rule *)p;
+	rule = block_take(d, crush_rule_size(len), sizeof(__u32));
+	if (!rule)
+		return NULL;
+	rule->len = len;
+	rule->mask.ruleset = p[4];
+	rule->mask.type = p[5];
+	rule->mask.min_size = p[6];
+	rule->mask.max_size = p[7];
+	for (j = 0; j < len; j++) {
+		const unsigned char *s = p + 8 + 12 * j;
+
+		rule->steps[j].op = get_u32(s);
+		rule->steps[j].arg1 = get_u32(s + 4);
+		rule->steps[j].arg2 = get_u32(s + 8);
+	}
+	return rule;
+}
+
+/* skip a map<int32, string> */
+static void skip_string_map(struct crush_decoder *d)
+{
+	__u32 n = dec_u32(d);
+
+	while (n-- > 0 && !d->error) {
+		dec_need(d, 1, 4);
+		dec_need(d, dec_u32(d), 1);
+	}
+}
+
+/* skip a map<int32, int32> */
+static void skip_int_map(struct crush_decoder *d)
+{
+	dec_need(d, dec_u32(d), 8);
+}
+
+/* the opaque bytes from @start to the current position */
+static const void *dec_opaque(struct crush_decoder *d, size_t start,
+			      __u32 *size)
+{
+	void *p;
+
+	*size = d->pos - start;
+	if (d->error)
+		return NULL;
+	if (dec_in_place(d, d->buf + start))
+		return d->block ? d->buf + start : NULL;
+	p = block_take(d, *size, 1);
+	if (p)
+		memcpy(p, d->buf + start, *size);
+	return p;
+}
+
+static void decode_choose_args(struct crush_decoder *d,
+			       const struct crush_map *m,
+			       struct crush_choose_arg_set *set)
+{
+	struct crush_choose_arg *args;
+	__u64 id = dec_u64(d);
+	__u32 size = dec_u32(d);
+	__u32 i, j;
+
+	args = block_take(d, sizeof(*args) * m->max_buckets, sizeof(__u64));
+	if (set) {
+		set->id = id;
+		set->map.args = args;
+		set->map.size = m->max_buckets;
+	}
+	for (i = 0; i < size && !d->error; i++) {
+		__u32 b = dec_u32(d);
+		__u32 weight_set_size = dec_u32(d);
+		struct crush_weight_set *weight_set;
+		struct crush_choose_arg *arg = NULL;
+		const struct crush_bucket *bucket = NULL;
+		__u32 ids_size;
+		__s32 *ids;
+
+		/* each weight set takes at least 4 bytes */
+		if (b >= (__u32)m->max_buckets ||
+		    weight_set_size > (d->size - d->pos) / 4) {
+			d->error = 1;
+			return;
+		}
+		if (args) {
+			arg = &args[b];
+			bucket = m->buckets[b];
+			if (!bucket) {
+				d->error = 1;
+				return;
+			}
+		}
+		weight_set = block_take(d, sizeof(*weight_set) *
+					weight_set_size, sizeof(__u64));
+		for (j = 0; j < weight_set_size && !d->error; j++) {
+			__u32 n = dec_u32(d);
+			__u32 *weights = dec_array32(d, n);
+
+			if (bucket && n != bucket->size) {
+				d->error = 1;
+				return;
+			}
+			if (weight_set) {
+				weight_set[j].weights = weights;
+				weight_set[j].size = n;
+			}
+		}
+		ids_size = dec_u32(d);
+		ids = dec_array32(d, ids_size);
+		if (bucket && ids_size && ids_size != bucket->size) {
+			d->error = 1;
+			return;
+		}
+		if (arg) {
+			arg->weight_set = weight_set;
+			arg->weight_set_size = weight_set_size;
+			arg->ids = ids;
+			arg->ids_size = ids_size;
+		}
+	}
+}
+
+static void decode_map(struct crush_decoder *d)
+{
+	struct crush_ceph_map_block *block;
+	struct crush_ceph_map *cm = NULL;
+	struct crush_map *m;
+	struct crush_map header;
+	struct crush_bucket **buckets;
+	struct crush_rule **rules;
+	size_t start;
+	int b;
+	__u32 i;
+
+	block = block_take(d, sizeof(*block), sizeof(__u64));
+	/* the first pass reads the map header in a local copy */
+	m = block ? &block->map : &header;
+	if (block) {
+		cm = &block->cm;
+		cm->map = m;
+	}
+	memset(m, 0, sizeof(*m));
+	set_legacy_crush_map(m);
+
+	if (dec_u32(d) != CRUSH_MAGIC) {
+		d->error = 1;
+		return;
+	}
+	m->max_buckets = dec_u32(d);
+	m->max_rules = dec_u32(d);
+	m->max_devices = dec_u32(d);
+	/* each bucket and rule takes at least 4 bytes */
+	if (m->max_buckets < 0 || m->max_devices < 0 ||
+	    m->max_rules > CRUSH_MAX_RULES ||
+	    (__u32)m->max_buckets > (d->size - d->pos) / 4) {
+		d->error = 1;
+		return;
+	}
+	buckets = block_take(d, sizeof(*buckets) * m->max_buckets,
+			     sizeof(void *));
+	rules = block_take(d, sizeof(*rules) * m->max_rules, sizeof(void *));
+	if (block) {
+		m->buckets = buckets;
+		m->rules = rules;
+	}
+
+	for (b = 0; b < m->max_buckets && !d->error; b++) {
+		struct crush_bucket *bucket = decode_bucket(d, b);
+
+		if (block)
+			buckets[b] = bucket;
+	}
+	for (i = 0; i < m->max_rules && !d->error; i++) {
+		struct crush_rule *rule = decode_rule(d);
+
+		if (block)
+			rules[i] = rule;
+	}
+
+	start = d->pos;
+	skip_string_map(d); /* type names */
+	skip_string_map(d); /* item names */
+	skip_string_map(d); /* rule names */
+	if (block)
+		cm->names = dec_opaque(d, start, &cm->names_size);
+	else
+		dec_opaque(d, start, &i);
+
+	/* the tunables that were added over time */
+	if (d->pos < d->size) {
+		m->choose_local_tries = dec_u32(d);
+		m->choose_local_fallback_tries = dec_u32(d);
+		m->choose_total_tries = dec_u32(d);
+	}
+	if (d->pos < d->size)
+		m->chooseleaf_descend_once = dec_u32(d);
+	if (d->pos < d->size)
+		m->chooseleaf_vary_r = dec_u8(d);
+	if (d->pos < d->size)
+		m->straw_calc_version = dec_u8(d);
+	if (d->pos < d->size)
+		m->allowed_bucket_algs = dec_u32(d);
+	if (d->pos < d->size)
+		m->chooseleaf_stable = dec_u8(d);
+
+	if (d->pos < d->size) {
+		start = d->pos;
+		skip_int_map(d);    /* class of each device */
+		skip_string_map(d); /* class names */
+		/* shadow bucket of each bucket and class */
+		i = dec_u32(d);
+		while (i-- > 0 && !d->error) {
+			dec_need(d, 1, 4);
+			skip_int_map(d);
+		}
+		if (block)
+			cm->classes = dec_opaque(d, start,
+						 &cm->classes_size);
+		else
+			dec_opaque(d, start, &i);
+	}
+
+	if (d->pos < d->size) {
+		__u32 n = dec_u32(d);
+		struct crush_choose_arg_set *sets;
+
+		/* each set takes at least 12 bytes */
+		if (n > (d->size - d->pos) / 12) {
+			d->error = 1;
+			return;
+		}
+		sets = block_take(d, sizeof(*sets) * n, sizeof(__u64));
+		if (block) {
+			cm->choose_args = sets;
+			cm->choose_args_size = n;
+		}
+		for (i = 0; i < n && !d->error; i++)
+			decode_choose_args(d, m, sets ? &sets[i] : NULL);
+	}
+}
+
+/* as crush_finalize() does, and check the items are known buckets */
+static int decode_finalize(struct crush_map *m)
+{
+	int b;
+	__u32 i;
+
+	m->working_size = sizeof(struct crush_work) +
+		m->max_buckets * sizeof(struct crush_work_bucket *);
+	for (b = 0; b < m->max_buckets; b++) {
+		const struct crush_bucket *bucket = m->buckets[b];
+
+		if (!bucket)
+			continue;
+		m->working_size += sizeof(struct crush_work_bucket) +
+			bucket->size * sizeof(__u32);
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+
+			if (item >= m->max_devices)
+				m->max_devices = item + 1;
+			if (item < 0 && (-1-item >= m->max_buckets ||
+					 !m->buckets[-1-item]))
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+int crush_decode(const void *buf, size_t size, int flags,
+		 struct crush_ceph_map **cm)
+{
+	struct crush_decoder d;
+
+	memset(&d, 0, sizeof(d));
+	d.buf = buf;
+	d.size = size;
+	d.zero_copy = flags & CRUSH_DECODE_ZERO_COPY;
+	decode_map(&d);
+	if (d.error)
+		return -EINVAL;
+
+	d.block = calloc(1, d.offset);
+	if (!d.block)
+		return -ENOMEM;
+	d.pos = 0;
+	d.offset = 0;
+	decode_map(&d);
+	if (d.error || decode_finalize(
+		    &((struct crush_ceph_map_block *)d.block)->map)) {
+		free(d.block);
+		return -EINVAL;
+	}
+	*cm = (struct crush_ceph_map *)d.block;
+	return 0;
+}
+
+void crush_destroy_ceph_map(struct crush_ceph_map *cm)
+{
+	free(cm);
+}
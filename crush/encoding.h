@@ -0,0 +1,108 @@
+#ifndef CEPH_CRUSH_ENCODING_H
+#define CEPH_CRUSH_ENCODING_H
+
+/*
+ * The binary encoding of a crush_map used by Ceph, as written by
+ * CrushWrapper::encode() and read by CrushWrapper::decode().
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The choose_args Ceph stores with a map are identified by an __id__,
+ * the id of a pool or -1 for the default ones.
+ */
+struct crush_choose_arg_set {
+	__s64 id;                        /*!< pool id or -1 */
+	struct crush_choose_arg_map map; /*!< __map.size__ is __max_buckets__ */
+};
+
+/** @ingroup API
+ *
+ * A crush_map and what Ceph encodes along with it. The names of the
+ * types, the items and the rules and the device classes are not used
+ * by libcrush: they are kept as they are encoded so that a
+ * crush_decode() followed by a crush_encode() does not lose them.
+ */
+struct crush_ceph_map {
+	struct crush_map *map;                   /*!< the map */
+	struct crush_choose_arg_set *choose_args; /*!< NULL or the choose_args */
+	__u32 choose_args_size;                  /*!< the size of __choose_args__ */
+	const void *names;   /*!< NULL or the encoded type, item and rule names */
+	__u32 names_size;    /*!< the size of __names__ */
+	const void *classes; /*!< NULL or the encoded device classes */
+	__u32 classes_size;  /*!< the size of __classes__ */
+};
+
+/*
+ * crush_decode() points to the arrays of the buffer instead of
+ * copying them, when their alignment allows it.
+ */
+#define CRUSH_DECODE_ZERO_COPY 1
+
+/** @ingroup API
+ *
+ * Encode __cm__ in the __size__ bytes of __buf__ as Ceph does,
+ * tunables and choose_args included, and return the size of the
+ * encoding. If __buf__ is NULL or __size__ is too small, nothing is
+ * written: call it with a NULL __buf__ first to know how much memory is
+ * needed. Empty names and device classes are encoded if __cm->names__
+ * or __cm->classes__ are NULL.
+ *
+ * @param cm the crush_map and its choose_args
+ * @param buf NULL or where the encoding is written
+ * @param size the size of __buf__
+ *
+ * @returns the size of the encoding in bytes
+ */
+extern size_t crush_encode(const struct crush_ceph_map *cm,
+			   void *buf, size_t size);
+
+/** @ingroup API
+ *
+ * Decode the __size__ bytes of __buf__, encoded by Ceph or
+ * crush_encode(), and set __*cm__ to the result. The tunables that are
+ * not in __buf__, because an older version of Ceph encoded it, are set
+ * to their legacy values as Ceph does.
+ *
+ * The buckets, the rules and the choose_args are all stored in a
+ * single allocation, with the reciprocals of the straw2 bucket
+ * weights (see crush_choose_reciprocals_prepare() for those of the
+ * choose_args). If
+ * __flags__ has __CRUSH_DECODE_ZERO_COPY__ and the byte order of the
+ * machine is little endian, the arrays of items and straw2 weights,
+ * the rules, the choose_args, the names and the device classes are
+ * not copied when they are aligned on 4 bytes in __buf__: they point
+ * to it and __buf__ must not be modified or deallocated before
+ * crush_destroy_ceph_map() is called.
+ *
+ * The __(*cm)->map__ is read only: it must not be modified with the
+ * functions from builder.h. The encoding is checked so that a
+ * corrupted one cannot make the mapper read outside of the map.
+ *
+ * - return -EINVAL if __buf__ is not a valid encoding
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param buf the encoded map
+ * @param size the size of __buf__
+ * @param flags 0 or __CRUSH_DECODE_ZERO_COPY__
+ * @param cm set to the decoded map on success
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_decode(const void *buf, size_t size, int flags,
+			struct crush_ceph_map **cm);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_ceph_map set by crush_decode(), including its
+ * crush_map and choose_args.
+ *
+ * @param cm the crush_ceph_map or NULL
+ */
+extern void crush_destroy_ceph_map(struct crush_ceph_map *cm);
+
+#endif
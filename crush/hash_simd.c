@@ -0,0 +1,265 @@
+#include "hash.h"
+#include "hash_simd.h"
+
+/*
+ * Each implementation hashes as many full vectors as possible and
+ * leaves the remaining hashes to crush_hash_lanes_tail().
+ */
+
+static void crush_hash_lanes_tail(int n, const __u32 *const *in,
+				  const int *stride, __u32 *hash,
+				  int begin, int count)
+{
+	__u32 v[5];
+	int i, k;
+
+	for (i = begin; i < count; i++) {
+		for (k = 0; k < n; k++)
+			v[k] = in[k][(ssize_t)i * stride[k]];
+		switch (n) {
+		case 2:
+			hash[i] = crush_hash32_2(CRUSH_HASH_RJENKINS1,
+						 v[0], v[1]);
+			break;
+		case 3:
+			hash[i] = crush_hash32_3(CRUSH_HASH_RJENKINS1,
+						 v[0], v[1], v[2]);
+			break;
+		case 4:
+			hash[i] = crush_hash32_4(CRUSH_HASH_RJENKINS1,
+						 v[0], v[1], v[2], v[3]);
+			break;
+		case 5:
+			hash[i] = crush_hash32_5(CRUSH_HASH_RJENKINS1,
+						 v[0], v[1], v[2], v[3], v[4]);
+			break;
+		}
+	}
+}
+
+void crush_hash_lanes_scalar(int n, const __u32 *const *in,
+			     const int *stride, __u32 *hash, int count)
+{
+	crush_hash_lanes_tail(n, in, stride, hash, 0, count);
+}
+
+#ifdef CRUSH_HAVE_HASH_SIMD
+
+/*
+ * Define crush_hash_lanes_<isa>(): load the lanes of each input with
+ * load(), which deals with the stride, and hash them.
+ */
+#define CRUSH_HASH_LANES_DEFINE(isa, vec, lanes, target, load, store)	\
+void target crush_hash_lanes_##isa(int n, const __u32 *const *in,	\
+				   const int *stride, __u32 *hash,	\
+				   int count)				\
+{									\
+	vec v[5];							\
+	int i, k;							\
+									\
+	for (i = 0; i + lanes <= count; i += lanes) {			\
+		for (k = 0; k < n; k++)					\
+			v[k] = load(in[k], stride[k], i);		\
+		switch (n) {						\
+		case 2:							\
+			v[0] = crush_hash32_rjenkins1_2_##isa(v[0], v[1]); \
+			break;						\
+		case 3:							\
+			v[0] = crush_hash32_rjenkins1_3_##isa(v[0], v[1], \
+							      v[2]);	\
+			break;						\
+		case 4:							\
+			v[0] = crush_hash32_rjenkins1_4_##isa(v[0], v[1], \
+							      v[2], v[3]); \
+			break;						\
+		case 5:							\
+			v[0] = crush_hash32_rjenkins1_5_##isa(v[0], v[1], \
+							      v[2], v[3], \
+							      v[4]);	\
+			break;						\
+		default:						\
+			/* as crush_hash_lanes_tail(), nothing is stored */ \
+			continue;					\
+		}							\
+		store(hash + i, v[0]);					\
+	}								\
+	crush_hash_lanes_tail(n, in, stride, hash, i, count);		\
+}
+
+/* SSE4.1 */
+
+int crush_hash_lanes_sse41_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static inline CRUSH_TARGET_SSE41
+__m128i load_sse41(const __u32 *p, int stride, int i)
+{
+	p += (ssize_t)i * stride;
+	if (stride == 0)
+		return _mm_set1_epi32(p[0]);
+	if (stride == 1)
+		return _mm_loadu_si128((const __m128i *)p);
+	return _mm_insert_epi32(_mm_insert_epi32(_mm_insert_epi32(
+		_mm_cvtsi32_si128(p[0]), p[stride], 1),
+						 p[2 * stride], 2),
+				p[3 * stride], 3);
+}
+
+static inline CRUSH_TARGET_SSE41
+void store_sse41(__u32 *p, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)p, v);
+}
+
+CRUSH_HASH_LANES_DEFINE(sse41, __m128i, 4, CRUSH_TARGET_SSE41,
+			load_sse41, store_sse41)
+
+/* AVX2 */
+
+int crush_hash_lanes_avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static inline CRUSH_TARGET_AVX2
+__m256i load_avx2(const __u32 *p, int stride, int i)
+{
+	p += (ssize_t)i * stride;
+	if (stride == 0)
+		return _mm256_set1_epi32(p[0]);
+	if (stride == 1)
+		return _mm256_loadu_si256((const __m256i *)p);
+	return _mm256_i32gather_epi32(
+		(const int *)p,
+		_mm256_mullo_epi32(_mm256_set1_epi32(stride),
+				   _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0)),
+		4);
+}
+
+static inline CRUSH_TARGET_AVX2
+void store_avx2(__u32 *p, __m256i v)
+{
+	_mm256_storeu_si256((__m256i *)p, v);
+}
+
+CRUSH_HASH_LANES_DEFINE(avx2, __m256i, 8, CRUSH_TARGET_AVX2,
+			load_avx2, store_avx2)
+
+/* AVX-512 */
+
+int crush_hash_lanes_avx512_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512dq");
+}
+
+static inline CRUSH_TARGET_AVX512
+__m512i load_avx512(const __u32 *p, int stride, int i)
+{
+	p += (ssize_t)i * stride;
+	if (stride == 0)
+		return _mm512_set1_epi32(p[0]);
+	if (stride == 1)
+		return _mm512_loadu_si512(p);
+	return _mm512_i32gather_epi32(
+		_mm512_mullo_epi32(_mm512_set1_epi32(stride),
+				   _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+						    7, 6, 5, 4, 3, 2, 1, 0)),
+		p, 4);
+}
+
+static inline CRUSH_TARGET_AVX512
+void store_avx512(__u32 *p, __m512i v)
+{
+	_mm512_storeu_si512(p, v);
+}
+
+CRUSH_HASH_LANES_DEFINE(avx512, __m512i, 16, CRUSH_TARGET_AVX512,
+			load_avx512, store_avx512)
+
+crush_hash_lanes_fn crush_hash_lanes = crush_hash_lanes_scalar;
+
+static void __attribute__((constructor)) crush_hash_lanes_init(void)
+{
+	if (crush_hash_lanes_avx512_supported())
+		crush_hash_lanes = crush_hash_lanes_avx512;
+	else if (crush_hash_lanes_avx2_supported())
+		crush_hash_lanes = crush_hash_lanes_avx2;
+	else if (crush_hash_lanes_sse41_supported())
+		crush_hash_lanes = crush_hash_lanes_sse41;
+}
+
+#else
+
+crush_hash_lanes_fn crush_hash_lanes = crush_hash_lanes_scalar;
+
+#endif
+
+static void crush_hash_lanes_type(int type, int n, const __u32 *const *in,
+				  const int *stride, __u32 *hash, int count)
+{
+	switch (type) {
+	case CRUSH_HASH_RJENKINS1:
+		crush_hash_lanes(n, in, stride, hash, count);
+		break;
+	default:
+		memset(hash, 0, sizeof(*hash) * count);
+		break;
+	}
+}
+
+void crush_hash32_2_lanes(int type,
+			  const __u32 *a, int a_stride,
+			  const __u32 *b, int b_stride,
+			  __u32 *hash, int count)
+{
+	const __u32 *in[] = { a, b };
+	const int stride[] = { a_stride, b_stride };
+
+	crush_hash_lanes_type(type, 2, in, stride, hash, count);
+}
+
+void crush_hash32_3_lanes(int type,
+			  const __u32 *a, int a_stride,
+			  const __u32 *b, int b_stride,
+			  const __u32 *c, int c_stride,
+			  __u32 *hash, int count)
+{
+	const __u32 *in[] = { a, b, c };
+	const int stride[] = { a_stride, b_stride, c_stride };
+
+	crush_hash_lanes_type(type, 3, in, stride, hash, count);
+}
+
+void crush_hash32_4_lanes(int type,
+			  const __u32 *a, int a_stride,
+			  const __u32 *b, int b_stride,
+			  const __u32 *c, int c_stride,
+			  const __u32 *d, int d_stride,
+			  __u32 *hash, int count)
+{
+	const __u32 *in[] = { a, b, c, d };
+	const int stride[] = { a_stride, b_stride, c_stride, d_stride };
+
+	crush_hash_lanes_type(type, 4, in, stride, hash, count);
+}
+
+void crush_hash32_5_lanes(int type,
+			  const __u32 *a, int a_stride,
+			  const __u32 *b, int b_stride,
+			  const __u32 *c, int c_stride,
+			  const __u32 *d, int d_stride,
+			  const __u32 *e, int e_stride,
+			  __u32 *hash, int count)
+{
+	const __u32 *in[] = { a, b, c, d, e };
+	const int stride[] = { a_stride, b_stride, c_stride, d_stride,
+			       e_stride };
+
+	crush_hash_lanes_type(type, 5, in, stride, hash, count);
+}
@@ -0,0 +1,226 @@
+#ifndef CEPH_CRUSH_HASH_SIMD_H
+#define CEPH_CRUSH_HASH_SIMD_H
+
+/*
+ * Lane parallel versions of the rjenkins1 hash: each 32 bits lane of
+ * the vectors is hashed independently and the result of every lane is
+ * bit-exact with crush_hash32_rjenkins1_*() in hash.c.
+ *
+ * The inline functions are compiled for the instruction set in their
+ * name regardless of the compiler flags. The caller must make sure the
+ * CPU supports it before calling them. The crush_hash32_*_lanes()
+ * functions do that and are available on all platforms.
+ *
+ * Userspace only.
+ *
+ * LGPL2
+ */
+
+#include "crush_compat.h"
+
+/** @ingroup API
+ *
+ * Compute __count__ hashes with __n__ inputs each, __n__ being in
+ * [2,5]. The input __k__ of the hash __i__ is __in[k][i * stride[k]]__:
+ * a __stride__ of 1 reads consecutive values and a __stride__ of 0
+ * uses the same value for all hashes. The hash __i__ is stored in
+ * __hash[i]__.
+ */
+typedef void (*crush_hash_lanes_fn)(int n, const __u32 *const *in,
+				    const int *stride, __u32 *hash,
+				    int count);
+
+/*
+ * The best implementation supported by the CPU, set when the library
+ * is loaded. It may be overridden, for instance to compare
+ * implementations.
+ */
+extern crush_hash_lanes_fn crush_hash_lanes;
+
+extern void crush_hash_lanes_scalar(int n, const __u32 *const *in,
+				    const int *stride, __u32 *hash,
+				    int count);
+
+/** @ingroup API
+ *
+ * Compute __count__ hashes of type __type__: __hash[i]__ is set to
+ * crush_hash32_2(__type__, __a[i * a_stride]__, __b[i * b_stride]__).
+ * A stride of 0 uses the same value for all hashes, for instance
+ * to hash a fixed __a__ with a vector of __b__. If __type__ is not
+ * known, all hashes are 0, as with crush_hash32_2().
+ *
+ * The hashes are computed with the widest vector instructions
+ * supported by the CPU (SSE4.1, AVX2 or AVX-512 on x86_64).
+ *
+ * @param type the hash function, only __CRUSH_HASH_RJENKINS1__
+ * @param a the first inputs
+ * @param a_stride the distance between two first inputs
+ * @param b the second inputs
+ * @param b_stride the distance between two second inputs
+ * @param hash the array of __count__ hashes
+ * @param count the number of hashes
+ */
+extern void crush_hash32_2_lanes(int type,
+				 const __u32 *a, int a_stride,
+				 const __u32 *b, int b_stride,
+				 __u32 *hash, int count);
+
+/** @ingroup API
+ *
+ * Same as crush_hash32_2_lanes() with three inputs.
+ */
+extern void crush_hash32_3_lanes(int type,
+				 const __u32 *a, int a_stride,
+				 const __u32 *b, int b_stride,
+				 const __u32 *c, int c_stride,
+				 __u32 *hash, int count);
+
+/** @ingroup API
+ *
+ * Same as crush_hash32_2_lanes() with four inputs.
+ */
+extern void crush_hash32_4_lanes(int type,
+				 const __u32 *a, int a_stride,
+				 const __u32 *b, int b_stride,
+				 const __u32 *c, int c_stride,
+				 const __u32 *d, int d_stride,
+				 __u32 *hash, int count);
+
+/** @ingroup API
+ *
+ * Same as crush_hash32_2_lanes() with five inputs.
+ */
+extern void crush_hash32_5_lanes(int type,
+				 const __u32 *a, int a_stride,
+				 const __u32 *b, int b_stride,
+				 const __u32 *c, int c_stride,
+				 const __u32 *d, int d_stride,
+				 const __u32 *e, int e_stride,
+				 __u32 *hash, int count);
+
+#if !defined(__KERNEL__) && defined(__x86_64__) && defined(__GNUC__)
+#define CRUSH_HAVE_HASH_SIMD 1
+
+#include <immintrin.h>
+
+#define CRUSH_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CRUSH_TARGET_AVX2 __attribute__((target("avx2")))
+#define CRUSH_TARGET_AVX512 __attribute__((target("avx512f,avx512dq")))
+
+extern int crush_hash_lanes_sse41_supported(void);
+extern void crush_hash_lanes_sse41(int n, const __u32 *const *in,
+				   const int *stride, __u32 *hash,
+				   int count);
+extern int crush_hash_lanes_avx2_supported(void);
+extern void crush_hash_lanes_avx2(int n, const __u32 *const *in,
+				  const int *stride, __u32 *hash,
+				  int count);
+extern int crush_hash_lanes_avx512_supported(void);
+extern void crush_hash_lanes_avx512(int n, const __u32 *const *in,
+				    const int *stride, __u32 *hash,
+				    int count);
+
+#define crush_hash_seed_simd 1315423911
+
+/* same as crush_hashmix() in hash.c, with the vector operations given */
+#define crush_hashmix_simd(a, b, c, sub, eor, srl, sll) do {		\
+		a = sub(a, b); a = sub(a, c); a = eor(a, srl(c, 13));	\
+		b = sub(b, c); b = sub(b, a); b = eor(b, sll(a, 8));	\
+		c = sub(c, a); c = sub(c, b); c = eor(c, srl(b, 13));	\
+		a = sub(a, b); a = sub(a, c); a = eor(a, srl(c, 12));	\
+		b = sub(b, c); b = sub(b, a); b = eor(b, sll(a, 16));	\
+		c = sub(c, a); c = sub(c, b); c = eor(c, srl(b, 5));	\
+		a = sub(a, b); a = sub(a, c); a = eor(a, srl(c, 3));	\
+		b = sub(b, c); b = sub(b, a); b = eor(b, sll(a, 10));	\
+		c = sub(c, a); c = sub(c, b); c = eor(c, srl(b, 15));	\
+	} while (0)
+
+#define crush_hashmix_sse41(a, b, c)					\
+	crush_hashmix_simd(a, b, c, _mm_sub_epi32, _mm_xor_si128,	\
+			   _mm_srli_epi32, _mm_slli_epi32)
+#define crush_hashmix_avx2(a, b, c)					\
+	crush_hashmix_simd(a, b, c, _mm256_sub_epi32, _mm256_xor_si256,	\
+			   _mm256_srli_epi32, _mm256_slli_epi32)
+#define crush_hashmix_avx512(a, b, c)					\
+	crush_hashmix_simd(a, b, c, _mm512_sub_epi32, _mm512_xor_si512,	\
+			   _mm512_srli_epi32, _mm512_slli_epi32)
+
+/*
+ * Define crush_hash32_rjenkins1_[2-5]_<isa>(), the same sequences of
+ * crush_hashmix() as crush_hash32_rjenkins1_[2-5]() in hash.c.
+ */
+#define CRUSH_HASH_SIMD_DEFINE(isa, vec, target, set1, eor)		\
+static inline target							\
+vec crush_hash32_rjenkins1_2_##isa(vec a, vec b)			\
+{									\
+	vec hash = eor(set1(crush_hash_seed_simd), eor(a, b));		\
+	vec x = set1(231232);						\
+	vec y = set1(1232);						\
+									\
+	crush_hashmix_##isa(a, b, hash);				\
+	crush_hashmix_##isa(x, a, hash);				\
+	crush_hashmix_##isa(b, y, hash);				\
+	return hash;							\
+}									\
+									\
+static inline target							\
+vec crush_hash32_rjenkins1_3_##isa(vec a, vec b, vec c)		\
+{									\
+	vec hash = eor(set1(crush_hash_seed_simd), eor(a, eor(b, c)));	\
+	vec x = set1(231232);						\
+	vec y = set1(1232);						\
+									\
+	crush_hashmix_##isa(a, b, hash);				\
+	crush_hashmix_##isa(c, x, hash);				\
+	crush_hashmix_##isa(y, a, hash);				\
+	crush_hashmix_##isa(b, x, hash);				\
+	crush_hashmix_##isa(y, c, hash);				\
+	return hash;							\
+}									\
+									\
+static inline target							\
+vec crush_hash32_rjenkins1_4_##isa(vec a, vec b, vec c, vec d)		\
+{									\
+	vec hash = eor(set1(crush_hash_seed_simd),			\
+		       eor(eor(a, b), eor(c, d)));			\
+	vec x = set1(231232);						\
+	vec y = set1(1232);						\
+									\
+	crush_hashmix_##isa(a, b, hash);				\
+	crush_hashmix_##isa(c, d, hash);				\
+	crush_hashmix_##isa(a, x, hash);				\
+	crush_hashmix_##isa(y, b, hash);				\
+	crush_hashmix_##isa(c, x, hash);				\
+	crush_hashmix_##isa(y, d, hash);				\
+	return hash;							\
+}									\
+									\
+static inline target							\
+vec crush_hash32_rjenkins1_5_##isa(vec a, vec b, vec c, vec d, vec e)	\
+{									\
+	vec hash = eor(set1(crush_hash_seed_simd),			\
+		       eor(eor(a, b), eor(eor(c, d), e)));		\
+	vec x = set1(231232);						\
+	vec y = set1(1232);						\
+									\
+	crush_hashmix_##isa(a, b, hash);				\
+	crush_hashmix_##isa(c, d, hash);				\
+	crush_hashmix_##isa(e, x, hash);				\
+	crush_hashmix_##isa(y, a, hash);				\
+	crush_hashmix_##isa(b, x, hash);				\
+	crush_hashmix_##isa(y, c, hash);				\
+	crush_hashmix_##isa(d, x, hash);				\
+	crush_hashmix_##isa(y, e, hash);				\
+	return hash;							\
+}
+
+CRUSH_HASH_SIMD_DEFINE(sse41, __m128i, CRUSH_TARGET_SSE41,
+		       _mm_set1_epi32, _mm_xor_si128)
+CRUSH_HASH_SIMD_DEFINE(avx2, __m256i, CRUSH_TARGET_AVX2,
+		       _mm256_set1_epi32, _mm256_xor_si256)
+CRUSH_HASH_SIMD_DEFINE(avx512, __m512i, CRUSH_TARGET_AVX512,
+		       _mm512_set1_epi32, _mm512_xor_si512)
+
+#endif
+
+#endif
@@ -0,0 +1,538 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "builder.h"
+
+#define CRUSH_IMAGE_BYTE_ORDER 0x01020304
+
+struct crush_image_header {
+	__u32 magic;          /* CRUSH_IMAGE_MAGIC */
+	__u32 version;        /* CRUSH_IMAGE_VERSION */
+	__u32 byte_order;     /* CRUSH_IMAGE_BYTE_ORDER as written */
+	__u32 header_size;    /* sizeof(struct crush_image_header) */
+	__u64 size;           /* of the image, header included */
+	__s32 max_buckets;
+	__u32 max_rules;
+	__u64 buckets;        /* max_buckets struct crush_image_bucket */
+	__u64 rules;          /* max_rules offsets, 0 for a missing rule */
+
+	/* the tunables of the crush_map */
+	__u32 choose_local_tries;
+	__u32 choose_local_fallback_tries;
+	__u32 choose_total_tries;
+	__u32 chooseleaf_descend_once;
+	__u8 chooseleaf_vary_r;
+	__u8 chooseleaf_stable;
+	__u8 straw_calc_version;
+	__u8 pad;
+	__u32 allowed_bucket_algs;
+};
+
+struct crush_image_bucket {
+	__s32 id;             /* 0 for a missing bucket */
+	__u16 type;
+	__u8 alg;
+	__u8 hash;
+	__u32 weight;
+	__u32 size;
+	__u32 param;          /* uniform item_weight or tree num_nodes */
+	__u32 pad;
+	__u64 items;
+	/*
+	 * list: item_weights, sum_weights
+	 * tree: node_weights
+	 * straw: item_weights, straws
+	 * straw2: item_weights, item_reciprocals (0 if none)
+	 */
+	__u64 arrays[2];
+};
+
+/*
+ * The image is laid out twice: a first time with a NULL __base__ to
+ * get its size and a second time to write it.
+ */
+struct crush_image_writer {
+	char *base;
+	__u64 offset;
+};
+
+static __u64 image_take(struct crush_image_writer *w, __u64 size)
+{
+	__u64 offset;
+
+	w->offset = (w->offset + 7) & ~(__u64)7;
+	offset = w->offset;
+	w->offset += size;
+	return offset;
+}
+
+static __u64 image_copy(struct crush_image_writer *w, const void *src,
+			__u64 size)
+{
+	__u64 offset = image_take(w, size);
+
+	if (w->base && size)
+		memcpy(w->base + offset, src, size);
+	return offset;
+}
+
+static void image_bucket(struct crush_image_writer *w,
+			 const struct crush_bucket *b,
+			 struct crush_image_bucket *r)
+{
+	struct crush_image_bucket record;
+
+	memset(&record, 0, sizeof(record));
+	record.id = b->id;
+	record.type = b->type;
+	record.alg = b->alg;
+	record.hash = b->hash;
+	record.weight = b->weight;
+	record.size = b->size;
+	record.items = image_copy(w, b->items, sizeof(__s32) * b->size);
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		record.param = ((const struct crush_bucket_uniform *)b)->
+			item_weight;
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)b;
+		record.arrays[0] = image_copy(w, l->item_weights,
+					      sizeof(__u32) * b->size);
+		record.arrays[1] = image_copy(w, l->sum_weights,
+					      sizeof(__u32) * b->size);
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)b;
+		record.param = t->num_nodes;
+		record.arrays[0] = image_copy(w, t->node_weights,
+					      sizeof(__u32) * t->num_nodes);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)b;
+		record.arrays[0] = image_copy(w, s->item_weights,
+					      sizeof(__u32) * b->size);
+		record.arrays[1] = image_copy(w, s->straws,
+					      sizeof(__u32) * b->size);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *s =
+			(const struct crush_bucket_straw2 *)b;
+		record.arrays[0] = image_copy(w, s->item_weights,
+					      sizeof(__u32) * b->size);
+		if (s->item_reciprocals)
+			record.arrays[1] = image_copy(
+				w, s->item_reciprocals,
+				sizeof(struct crush_reciprocal) * b->size);
+		break;
+	}
+	}
+	if (w->base)
+		memcpy(r, &record, sizeof(record));
+}
+
+static void image_map(struct crush_image_writer *w,
+		      const struct crush_map *map)
+{
+	struct crush_image_header header;
+	struct crush_image_bucket *buckets = NULL;
+	__u64 *rules = NULL;
+	__u64 header_offset, buckets_offset, rules_offset;
+	int b;
+	__u32 r;
+
+	memset(&header, 0, sizeof(header));
+	header_offset = image_take(w, sizeof(header));
+	buckets_offset = image_take(w, sizeof(*buckets) * map->max_buckets);
+	rules_offset = image_take(w, sizeof(*rules) * map->max_rules);
+	if (w->base) {
+		buckets = (struct crush_image_bucket *)(w->base +
+							buckets_offset);
+		rules = (__u64 *)(w->base + rules_offset);
+		memset(buckets, 0, sizeof(*buckets) * map->max_buckets);
+		memset(rules, 0, sizeof(*rules) * map->max_rules);
+	}
+
+	for (b = 0; b < map->max_buckets; b++)
+		if (map->buckets[b])
+			image_bucket(w, map->buckets[b],
+				     buckets ? &buckets[b] : NULL);
+	for (r = 0; r < map->max_rules; r++) {
+		__u64 offset;
+
+		if (!map->rules[r])
+			continue;
+		offset = image_copy(w, map->rules[r],
+				    crush_rule_size(map->rules[r]->len));
+		if (rules)
+			rules[r] = offset;
+	}
+
+	header.magic = CRUSH_IMAGE_MAGIC;
+	header.version = CRUSH_IMAGE_VERSION;
+	header.byte_order = CRUSH_IMAGE_BYTE_ORDER;
+	header.header_size = sizeof(header);
+	header.size = w->offset;
+	header.max_buckets = map->max_buckets;
+	header.max_rules = map->max_rules;
+	header.buckets = buckets_offset;
+	header.rules = rules_offset;
+	header.choose_local_tries = map->choose_local_tries;
+	header.choose_local_fallback_tries = map->choose_local_fallback_tries;
+	header.choose_total_tries = map->choose_total_tries;
+	header.chooseleaf_descend_once = map->chooseleaf_descend_once;
+	header.chooseleaf_vary_r = map->chooseleaf_vary_r;
+	header.chooseleaf_stable = map->chooseleaf_stable;
+	header.straw_calc_version = map->straw_calc_version;
+	header.allowed_bucket_algs = map->allowed_bucket_algs;
+	if (w->base)
+		memcpy(w->base + header_offset, &header, sizeof(header));
+}
+
+size_t crush_image_encode(const struct crush_map *map,
+			  void *image, size_t size)
+{
+	struct crush_image_writer w = { NULL, 0 };
+
+	image_map(&w, map);
+	if (image && w.offset <= size) {
+		w.base = image;
+		w.offset = 0;
+		image_map(&w, map);
+	}
+	return w.offset;
+}
+
+int crush_image_save(const struct crush_map *map, const char *path)
+{
+	size_t size = crush_image_encode(map, NULL, 0);
+	char *image;
+	size_t done;
+	ssize_t n;
+	int fd;
+	int err = 0;
+
+	/* calloc so that the padding is written as zeros */
+	image = calloc(1, size);
+	if (!image)
+		return -ENOMEM;
+	crush_image_encode(map, image, size);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	for (done = 0; done < size; done += n) {
+		n = write(fd, image + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err = -errno;
+			break;
+		}
+	}
+	if (close(fd) < 0 && !err)
+		err = -errno;
+out:
+	free(image);
+	return err;
+}
+
+/*
+ * The crush_map returned by crush_image_load(), followed by the
+ * buckets and rules pointers arrays and the bucket headers.
+ */
+struct crush_image_map {
+	struct crush_map map;
+	void *mapping;        /* NULL or the file mapped by crush_image_open */
+	size_t mapping_size;
+};
+
+/* true if [offset, offset + count * size[ is within the image */
+static int image_has(__u64 image_size, __u64 offset, __u64 count,
+		     __u64 size, __u64 align)
+{
+	if (offset % align || offset > image_size)
+		return 0;
+	return !count || size <= (image_size - offset) / count;
+}
+
+static size_t bucket_header_size(int alg)
+{
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return sizeof(struct crush_bucket_uniform);
+	case CRUSH_BUCKET_LIST:
+		return sizeof(struct crush_bucket_list);
+	case CRUSH_BUCKET_TREE:
+		return sizeof(struct crush_bucket_tree);
+	case CRUSH_BUCKET_STRAW:
+		return sizeof(struct crush_bucket_straw);
+	case CRUSH_BUCKET_STRAW2:
+		return sizeof(struct crush_bucket_straw2);
+	default:
+		return 0;
+	}
+}
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* check the arrays of the bucket @r are within the image */
+static int image_bucket_is_valid(const struct crush_image_header *h,
+				 const struct crush_image_bucket *r, int b)
+{
+	__u64 n = r->size;
+
+	if (r->id != -1-b || !bucket_header_size(r->alg))
+		return 0;
+	if (!image_has(h->size, r->items, n, sizeof(__s32), sizeof(__s32)))
+		return 0;
+	switch (r->alg) {
+	case CRUSH_BUCKET_LIST:
+	case CRUSH_BUCKET_STRAW:
+		return image_has(h->size, r->arrays[0], n, sizeof(__u32),
+				 sizeof(__u32)) &&
+			image_has(h->size, r->arrays[1], n, sizeof(__u32),
+				  sizeof(__u32));
+	case CRUSH_BUCKET_TREE:
+		/*
+		 * the mapper descends from node num_nodes / 2 to the
+		 * leaves of the items, an emptied bucket keeps one node
+		 */
+		if (n ? r->param != crush_calc_tree_num_nodes(n) :
+		    r->param > 1)
+			return 0;
+		return r->param <= U8_MAX &&
+			image_has(h->size, r->arrays[0], r->param,
+				  sizeof(__u32), sizeof(__u32));
+	case CRUSH_BUCKET_STRAW2:
+		return image_has(h->size, r->arrays[0], n, sizeof(__u32),
+				 sizeof(__u32)) &&
+			(!r->arrays[1] ||
+			 image_has(h->size, r->arrays[1], n,
+				   sizeof(struct crush_reciprocal), 8));
+	}
+	return 1;
+}
+
+static void image_set_bucket(const char *base,
+			     const struct crush_image_bucket *r,
+			     struct crush_bucket *b)
+{
+	b->id = r->id;
+	b->type = r->type;
+	b->alg = r->alg;
+	b->hash = r->hash;
+	b->weight = r->weight;
+	b->size = r->size;
+	b->items = (__s32 *)(base + r->items);
+	switch (r->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		((struct crush_bucket_uniform *)b)->item_weight = r->param;
+		break;
+	case CRUSH_BUCKET_LIST:
+		((struct crush_bucket_list *)b)->item_weights =
+			(__u32 *)(base + r->arrays[0]);
+		((struct crush_bucket_list *)b)->sum_weights =
+			(__u32 *)(base + r->arrays[1]);
+		break;
+	case CRUSH_BUCKET_TREE:
+		((struct crush_bucket_tree *)b)->num_nodes = r->param;
+		((struct crush_bucket_tree *)b)->node_weights =
+			(__u32 *)(base + r->arrays[0]);
+		break;
+	case CRUSH_BUCKET_STRAW:
+		((struct crush_bucket_straw *)b)->item_weights =
+			(__u32 *)(base + r->arrays[0]);
+		((struct crush_bucket_straw *)b)->straws =
+			(__u32 *)(base + r->arrays[1]);
+		break;
+	case CRUSH_BUCKET_STRAW2:
+		((struct crush_bucket_straw2 *)b)->item_weights =
+			(__u32 *)(base + r->arrays[0]);
+		((struct crush_bucket_straw2 *)b)->item_reciprocals =
+			r->arrays[1] ?
+			(struct crush_reciprocal *)(base + r->arrays[1]) :
+			NULL;
+		break;
+	}
+}
+
+int crush_image_load(const void *image, size_t size, struct crush_map **map)
+{
+	const char *base = image;
+	const struct crush_image_header *h = image;
+	const struct crush_image_bucket *records;
+	const __u64 *rule_offsets;
+	struct crush_image_map *im;
+	struct crush_map *m;
+	size_t block_size;
+	char *p;
+	int b;
+	__u32 i;
+
+	if ((unsigned long)image % 8 || size < sizeof(*h) ||
+	    h->magic != CRUSH_IMAGE_MAGIC ||
+	    h->version != CRUSH_IMAGE_VERSION ||
+	    h->byte_order != CRUSH_IMAGE_BYTE_ORDER ||
+	    h->header_size != sizeof(*h) || h->size > size ||
+	    h->max_buckets < 0 || h->max_rules > CRUSH_MAX_RULES ||
+	    !image_has(h->size, h->buckets, h->max_buckets,
+		       sizeof(*records), 8) ||
+	    !image_has(h->size, h->rules, h->max_rules, sizeof(__u64), 8))
+		return -EINVAL;
+	records = (const struct crush_image_bucket *)(base + h->buckets);
+	rule_offsets = (const __u64 *)(base + h->rules);
+
+	/* the crush_map, the pointers and the bucket headers */
+	block_size = ALIGN8(sizeof(*im)) +
+		sizeof(struct crush_bucket *) * h->max_buckets +
+		sizeof(struct crush_rule *) * h->max_rules;
+	for (b = 0; b < h->max_buckets; b++) {
+		const struct crush_image_bucket *r = &records[b];
+
+		if (r->id == 0)
+			continue;
+		if (!image_bucket_is_valid(h, r, b))
+			return -EINVAL;
+		block_size = ALIGN8(block_size) + bucket_header_size(r->alg);
+	}
+	for (i = 0; i < h->max_rules; i++) {
+		const struct crush_rule *rule;
+
+		if (!rule_offsets[i])
+			continue;
+		if (!image_has(h->size, rule_offsets[i], 1,
+			       sizeof(struct crush_rule), sizeof(__u32)))
+			return -EINVAL;
+		rule = (const struct crush_rule *)(base + rule_offsets[i]);
+		if (!image_has(h->size, rule_offsets[i] + sizeof(*rule),
+			       rule->len, sizeof(struct crush_rule_step),
+			       sizeof(__u32)))
+			return -EINVAL;
+	}
+
+	im = calloc(1, block_size);
+	if (!im)
+		return -ENOMEM;
+	m = &im->map;
+	p = (char *)im + ALIGN8(sizeof(*im));
+	m->buckets = (struct crush_bucket **)p;
+	p += sizeof(struct crush_bucket *) * h->max_buckets;
+	m->rules = (struct crush_rule **)p;
+	p += sizeof(struct crush_rule *) * h->max_rules;
+	m->max_buckets = h->max_buckets;
+	m->max_rules = h->max_rules;
+	m->choose_local_tries = h->choose_local_tries;
+	m->choose_local_fallback_tries = h->choose_local_fallback_tries;
+	m->choose_total_tries = h->choose_total_tries;
+	m->chooseleaf_descend_once = h->chooseleaf_descend_once;
+	m->chooseleaf_vary_r = h->chooseleaf_vary_r;
+	m->chooseleaf_stable = h->chooseleaf_stable;
+	m->straw_calc_version = h->straw_calc_version;
+	m->allowed_bucket_algs = h->allowed_bucket_algs;
+
+	/* as crush_finalize() does */
+	m->working_size = sizeof(struct crush_work) +
+		m->max_buckets * sizeof(struct crush_work_bucket *);
+	m->max_devices = 0;
+	for (b = 0; b < m->max_buckets; b++) {
+		const struct crush_image_bucket *r = &records[b];
+
+		if (r->id == 0)
+			continue;
+		p = (char *)ALIGN8((size_t)p);
+		m->buckets[b] = (struct crush_bucket *)p;
+		p += bucket_header_size(r->alg);
+		image_set_bucket(base, r, m->buckets[b]);
+		m->working_size += sizeof(struct crush_work_bucket) +
+			r->size * sizeof(__u32);
+	}
+	for (i = 0; i < m->max_rules; i++)
+		if (rule_offsets[i])
+			m->rules[i] = (struct crush_rule *)(base +
+							    rule_offsets[i]);
+
+	/* the mapper trusts the items to be existing buckets */
+	for (b = 0; b < m->max_buckets; b++) {
+		const struct crush_bucket *bucket = m->buckets[b];
+
+		if (!bucket)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+
+			if (item >= m->max_devices)
+				m->max_devices = item + 1;
+			if (item < 0 && (-1-item >= m->max_buckets ||
+					 !m->buckets[-1-item])) {
+				free(im);
+				return -EINVAL;
+			}
+		}
+	}
+
+	*map = m;
+	return 0;
+}
+
+int crush_image_open(const char *path, struct crush_map **map)
+{
+	struct crush_image_map *im;
+	struct stat st;
+	void *mapping;
+	int fd;
+	int err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return -EINVAL;
+	}
+	mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = mapping == MAP_FAILED ? -errno : 0;
+	close(fd);
+	if (err)
+		return err;
+
+	err = crush_image_load(mapping, st.st_size, map);
+	if (err) {
+		munmap(mapping, st.st_size);
+		return err;
+	}
+	im = (struct crush_image_map *)*map;
+	im->mapping = mapping;
+	im->mapping_size = st.st_size;
+	return 0;
+}
+
+void crush_image_close(struct crush_map *map)
+{
+	struct crush_image_map *im = (struct crush_image_map *)map;
+
+	if (!im)
+		return;
+	if (im->mapping)
+		munmap(im->mapping, im->mapping_size);
+	free(im);
+}
@@ -0,0 +1,113 @@
+#ifndef CEPH_CRUSH_IMAGE_H
+#define CEPH_CRUSH_IMAGE_H
+
+/*
+ * A flat, position independent binary format of a crush_map that can
+ * be mapped in memory and used by the mapper without decoding it.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/*
+ * The image starts with a header, followed by a fixed size record for
+ * each bucket, the offset of each rule and then the data: the items
+ * and weights arrays of the buckets and the rules. All references are
+ * offsets from the start of the image and all values are in the byte
+ * order of the machine that wrote it, which is recorded in the header.
+ */
+#define CRUSH_IMAGE_MAGIC 0x48535243 /* "CRSH" */
+#define CRUSH_IMAGE_VERSION 1
+
+/** @ingroup API
+ *
+ * Write the image of the finalized __map__ in the __size__ bytes of
+ * __image__ and return the size of the image. If __image__ is NULL or
+ * __size__ is too small, nothing is written: call it with a NULL
+ * __image__ first to know how much memory is needed. The choose_args
+ * are not part of the image.
+ *
+ * @param map a crush_map on which crush_finalize() was called
+ * @param image NULL or where the image is written
+ * @param size the size of __image__
+ *
+ * @returns the size of the image in bytes
+ */
+extern size_t crush_image_encode(const struct crush_map *map,
+				 void *image, size_t size);
+
+/** @ingroup API
+ *
+ * Write the image of the finalized __map__ in the file __path__,
+ * which is created or truncated.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -errno if __open(2)__ or __write(2)__ fail
+ *
+ * @param map a crush_map on which crush_finalize() was called
+ * @param path the file name
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_image_save(const struct crush_map *map, const char *path);
+
+/** @ingroup API
+ *
+ * Set __*map__ to a crush_map that reads the buckets and the rules
+ * from the __size__ bytes of __image__, as written by
+ * crush_image_encode(). The headers of the buckets are set in a single
+ * allocation, with the pointers to the map, the buckets and the rules.
+ * The items, the weights and the rules are not copied: __image__ must
+ * not be modified or deallocated before crush_image_close() is called.
+ *
+ * The __*map__ can be given to crush_do_rule(), crush_do_rule_batch(),
+ * crush_work_size(), etc. and maps exactly as the map the image was
+ * written from. It is read only: it must not be modified with the
+ * functions from builder.h and must be deallocated with
+ * crush_image_close().
+ *
+ * The image is checked so that a corrupted one cannot make the
+ * mapper read outside of it.
+ *
+ * - return -EINVAL if __image__ is not aligned on 8 bytes
+ * - return -EINVAL if __image__ is not a valid image of this version
+ *   and byte order
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param image the image
+ * @param size the size of __image__
+ * @param map set to the crush_map on success
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_image_load(const void *image, size_t size,
+			    struct crush_map **map);
+
+/** @ingroup API
+ *
+ * Map the file __path__, written by crush_image_save(), read only in
+ * memory and set __*map__ as crush_image_load() does. The pages of the
+ * file are shared by all the processes that open it, only the bucket
+ * headers are allocated. The file is unmapped by crush_image_close().
+ *
+ * - return -errno if __open(2)__, __fstat(2)__ or __mmap(2)__ fail
+ * - return the errors of crush_image_load()
+ *
+ * @param path the file name
+ * @param map set to the crush_map on success
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_image_open(const char *path, struct crush_map **map);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_map set by crush_image_load() or
+ * crush_image_open() and unmap its file, if any.
+ *
+ * @param map the crush_map or NULL
+ */
+extern void crush_image_close(struct crush_map *map);
+
+#endif
@@ -18,15 +18,148 @@
 # include <linux/crush/crush.h>
 # include <linux/crush/hash.h>
 #else
+# include <errno.h>
 # include "crush_compat.h"
 # include "crush.h"
 # include "hash.h"
 #endif
 #include "crush_ln_table.h"
 #include "mapper.h"
+#ifndef __KERNEL__
+# include "crush_ln_full.h"
+# include "mapper_simd.h"
+# include "builder.h"
+#endif
 
 #define dprintk(args...) /* printf(args) */
 
+#ifndef __KERNEL__
+/* count an event in the crush_stats attached to the workspace, if any */
+#define crush_stat(work, counter) do {			\
+		if ((work)->stats)			\
+			(work)->stats->counter++;	\
+	} while (0)
+
+static inline void crush_stat_tries(struct crush_work *work,
+				    unsigned int ftotal)
+{
+	if (!work->stats)
+		return;
+	if (ftotal >= CRUSH_STATS_MAX_TRIES)
+		ftotal = CRUSH_STATS_MAX_TRIES - 1;
+	work->stats->choose_tries[ftotal]++;
+}
+
+/* add an item to the crush_trace attached to the workspace, if any */
+static inline void crush_trace_item(struct crush_work *work, int item)
+{
+	struct crush_trace *trace = work->trace;
+	__u32 i;
+
+	if (!trace)
+		return;
+	for (i = 0; i < trace->size; i++)
+		if (trace->items[i] == item)
+			return;
+	if (trace->size == trace->max) {
+		trace->overflow = 1;
+		return;
+	}
+	trace->items[trace->size++] = item;
+}
+
+#define crush_trace_choice(work, bucket, item) do {	\
+		crush_trace_item(work, bucket);		\
+		crush_trace_item(work, item);		\
+	} while (0)
+
+/*
+ * Collision detection for wide rules: when more than CRUSH_ITEM_SET_MIN
+ * items may be chosen, they are also added to a crush_item_set of the
+ * workspace, in which candidates are looked up instead of scanning the
+ * items chosen so far.
+ */
+#define CRUSH_ITEM_SET_MIN 8
+
+static inline int crush_item_set_is_wide(int n)
+{
+	return n > CRUSH_ITEM_SET_MIN && n <= CRUSH_ITEM_SET_SIZE / 2;
+}
+
+static inline __u32 crush_item_set_slot(int item)
+{
+	return ((__u32)item * 0x9e3779b1u) >> (32 - CRUSH_ITEM_SET_BITS);
+}
+
+#define crush_item_set_next(i) (((i) + 1) & (CRUSH_ITEM_SET_SIZE - 1))
+
+static inline int crush_item_set_contains(const struct crush_item_set *set,
+					  int item)
+{
+	__u32 i;
+
+	for (i = crush_item_set_slot(item); set->gens[i] == set->gen;
+	     i = crush_item_set_next(i))
+		if (set->items[i] == item)
+			return 1;
+	return 0;
+}
+
+static inline void crush_item_set_add(struct crush_item_set *set, int item)
+{
+	__u32 i;
+
+	if (!set)
+		return;
+	for (i = crush_item_set_slot(item); set->gens[i] == set->gen;
+	     i = crush_item_set_next(i))
+		if (set->items[i] == item)
+			return;
+	set->items[i] = item;
+	set->gens[i] = set->gen;
+}
+
+/* empty @set, add the @n first @items to it and return it */
+static struct crush_item_set *crush_item_set_init(struct crush_item_set *set,
+						  const int *items, int n)
+{
+	int i;
+
+	if (++set->gen == 0) {
+		memset(set->gens, 0, sizeof(set->gens));
+		set->gen = 1;
+	}
+	for (i = 0; i < n; i++)
+		crush_item_set_add(set, items[i]);
+	return set;
+}
+#else
+#define crush_stat(work, counter) do { } while (0)
+#define crush_stat_tries(work, ftotal) do { } while (0)
+#define crush_trace_choice(work, bucket, item) do { } while (0)
+#define crush_item_set_add(set, item) do { } while (0)
+#endif
+
+/*
+ * true if @item was already chosen: if @set is not NULL it has all the
+ * chosen items, otherwise they are @items[@begin] to @items[@end - 1]
+ */
+static inline int crush_is_chosen(const struct crush_item_set *set,
+				  const int *items, int begin, int end,
+				  int item)
+{
+	int i;
+
+#ifndef __KERNEL__
+	if (set)
+		return crush_item_set_contains(set, item);
+#endif
+	for (i = begin; i < end; i++)
+		if (items[i] == item)
+			return 1;
+	return 0;
+}
+
 /*
  * Implement the core CRUSH mapping algorithm.
  */
@@ -244,52 +377,6 @@ static int bucket_straw_choose(const struct crush_bucket_straw *bucket,
 	return bucket->h.items[high];
 }
 
-/* compute 2^44*log2(input+1) */
-static __u64 crush_ln(unsigned int xin)
-{
-	unsigned int x = xin;
-	int iexpon, index1, index2;
-	__u64 RH, LH, LL, xl64, result;
-
-	x++;
-
-	/* normalize input */
-	iexpon = 15;
-
-	// figure out number of bits we need to shift and
-	// do it in one step instead of iteratively
-	if (!(x & 0x18000)) {
-	  int bits = __builtin_clz(x & 0x1FFFF) - 16;
-	  x <<= bits;
-	  iexpon = 15 - bits;
-	}
-
-	index1 = (x >> 8) << 1;
-	/* RH ~ 2^56/index1 */
-	RH = __RH_LH_tbl[index1 - 256];
-	/* LH ~ 2^48 * log2(index1/256) */
-	LH = __RH_LH_tbl[index1 + 1 - 256];
-
-	/* RH*x ~ 2^48 * (2^15 + xf), xf<2^8 */
-	xl64 = (__s64)x * RH;
-	xl64 >>= 48;
-
-	result = iexpon;
-	result <<= (12 + 32);
-
-	index2 = xl64 & 0xff;
-	/* LL ~ 2^48*log2(1.0+index2/2^15) */
-	LL = __LL_tbl[index2];
-
-	LH = LH + LL;
-
-	LH >>= (48 - 12 - 32);
-	result += LH;
-
-	return result;
-}
-
-
 /*
  * straw2
  *
@@ -320,44 +407,123 @@ static inline int *get_choose_arg_ids(const struct crush_bucket_straw2 *bucket,
   return arg->ids;
 }
 
-static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
+/*
+ * the reciprocals of the weights get_choose_arg_weights() returns or
+ * NULL: the weight sets are never read for reciprocals, they come
+ * from the table attached to @work if it was prepared for @arg
+ */
+static inline const struct crush_reciprocal *
+get_choose_arg_reciprocals(const struct crush_work *work,
+			   const struct crush_bucket_straw2 *bucket,
+			   const struct crush_choose_arg *arg,
+			   int position)
+{
+#ifndef __KERNEL__
+	const struct crush_choose_reciprocals *t = work->reciprocals;
+	const struct crush_weight_set_reciprocals *r;
+	int b = -1 - bucket->h.id;
+#endif
+
+	if ((arg == NULL) ||
+	    (arg->weight_set == NULL) ||
+	    (arg->weight_set_size == 0))
+		return bucket->item_reciprocals;
+#ifndef __KERNEL__
+	if (t == NULL || b >= t->max_buckets || &t->choose_args[b] != arg)
+		return NULL;
+	r = &t->buckets[b];
+	if (position >= arg->weight_set_size)
+		position = arg->weight_set_size - 1;
+	if (r->reciprocals == NULL || r->size != bucket->h.size ||
+	    (__u32)position >= r->positions)
+		return NULL;
+	return r->reciprocals + (size_t)position * r->size;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * ln / weight with ln <= 0, rounded toward zero as div64_s64() does,
+ * with a multiplication if the reciprocal matches the weight
+ */
+static inline __s64 straw2_divide(__s64 ln, __u32 weight,
+				  const struct crush_reciprocal *reciprocal)
+{
+#ifdef __SIZEOF_INT128__
+	if (reciprocal && reciprocal->weight == weight)
+		return -(__s64)(((unsigned __int128)(__u64)-ln *
+				 reciprocal->magic) >> reciprocal->shift);
+#endif
+	return div64_s64(ln, weight);
+}
+
+/* the straw of an item of weight @weight > 0 from its hash @u */
+static inline __s64 straw2_hash_draw(unsigned int u, __u32 weight,
+				     const struct crush_reciprocal *reciprocal)
+{
+	__s64 ln;
+
+	u &= 0xffff;
+
+	/*
+	 * for some reason slightly less than 0x10000 produces
+	 * a slightly more accurate distribution... probably a
+	 * rounding effect.
+	 *
+	 * the natural log lookup table maps [0,0xffff]
+	 * (corresponding to real numbers [1/0x10000, 1] to
+	 * [0, 0xffffffffffff] (corresponding to real numbers
+	 * [-11.090355,0]).
+	 */
+#ifdef CRUSH_HAVE_LN_FULL
+	ln = crush_ln_full[u];
+#else
+	ln = crush_ln(u) - 0x1000000000000ll;
+#endif
+
+	/*
+	 * divide by 16.16 fixed-point weight.  note
+	 * that the ln value is negative, so a larger
+	 * weight means a larger (less negative) value
+	 * for draw.
+	 */
+	return straw2_divide(ln, weight, reciprocal);
+}
+
+/* the straw of the item @id of weight @weight for @x and @r */
+static inline __s64 straw2_draw(const struct crush_bucket_straw2 *bucket,
+				int x, int r, int id, __u32 weight,
+				const struct crush_reciprocal *reciprocal)
+{
+	if (!weight)
+		return S64_MIN;
+	return straw2_hash_draw(crush_hash32_3(bucket->h.hash, x, id, r),
+				weight, reciprocal);
+}
+
+static int bucket_straw2_choose(const struct crush_work *work,
+				const struct crush_bucket_straw2 *bucket,
 				int x, int r, const struct crush_choose_arg *arg,
                                 int position)
 {
 	unsigned int i, high = 0;
-	unsigned int u;
-	__s64 ln, draw, high_draw = 0;
+	__s64 draw, high_draw = 0;
         __u32 *weights = get_choose_arg_weights(bucket, arg, position);
         int *ids = get_choose_arg_ids(bucket, arg);
+	const struct crush_reciprocal *reciprocals =
+		get_choose_arg_reciprocals(work, bucket, arg, position);
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+	if (crush_straw2_simd &&
+	    bucket->h.size >= CRUSH_STRAW2_SIMD_MIN_SIZE &&
+	    bucket->h.hash == CRUSH_HASH_RJENKINS1)
+		return bucket->h.items[crush_straw2_simd(x, r, ids, weights,
+							 bucket->h.size)];
+#endif
 	for (i = 0; i < bucket->h.size; i++) {
                 dprintk("weight 0x%x item %d\n", weights[i], ids[i]);
-		if (weights[i]) {
-			u = crush_hash32_3(bucket->h.hash, x, ids[i], r);
-			u &= 0xffff;
-
-			/*
-			 * for some reason slightly less than 0x10000 produces
-			 * a slightly more accurate distribution... probably a
-			 * rounding effect.
-			 *
-			 * the natural log lookup table maps [0,0xffff]
-			 * (corresponding to real numbers [1/0x10000, 1] to
-			 * [0, 0xffffffffffff] (corresponding to real numbers
-			 * [-11.090355,0]).
-			 */
-			ln = crush_ln(u) - 0x1000000000000ll;
-
-			/*
-			 * divide by 16.16 fixed-point weight.  note
-			 * that the ln value is negative, so a larger
-			 * weight means a larger (less negative) value
-			 * for draw.
-			 */
-			draw = div64_s64(ln, weights[i]);
-		} else {
-			draw = S64_MIN;
-		}
-
+		draw = straw2_draw(bucket, x, r, ids[i], weights[i],
+				   reciprocals ? &reciprocals[i] : NULL);
 		if (i == 0 || draw > high_draw) {
 			high = i;
 			high_draw = draw;
@@ -369,7 +535,7 @@ static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
 
 
 static int crush_bucket_choose(const struct crush_bucket *in,
-			       struct crush_work_bucket *work,
+			       const struct crush_work *work,
 			       int x, int r,
                                const struct crush_choose_arg *arg,
                                int position)
@@ -380,7 +546,7 @@ static int crush_bucket_choose(const struct crush_bucket *in,
 	case CRUSH_BUCKET_UNIFORM:
 		return bucket_uniform_choose(
 			(const struct crush_bucket_uniform *)in,
-			work, x, r);
+			work->work[-1-in->id], x, r);
 	case CRUSH_BUCKET_LIST:
 		return bucket_list_choose((const struct crush_bucket_list *)in,
 					  x, r);
@@ -393,7 +559,7 @@ static int crush_bucket_choose(const struct crush_bucket *in,
 			x, r);
 	case CRUSH_BUCKET_STRAW2:
 		return bucket_straw2_choose(
-			(const struct crush_bucket_straw2 *)in,
+			work, (const struct crush_bucket_straw2 *)in,
 			x, r, arg, position);
 	default:
 		dprintk("unknown bucket %d alg %d\n", in->id, in->alg);
@@ -406,21 +572,185 @@ static int crush_bucket_choose(const struct crush_bucket *in,
  * of the cluster
  */
 static int is_out(const struct crush_map *map,
+		  const struct crush_work *work,
 		  const __u32 *weight, int weight_max,
 		  int item, int x)
 {
 	if (item >= weight_max)
 		return 1;
+#ifndef __KERNEL__
+	if (work->devices && work->devices->weights == weight &&
+	    work->devices->weight_max == weight_max) {
+		switch (work->devices->state[item]) {
+		case CRUSH_DEVICE_IN:
+			return 0;
+		case CRUSH_DEVICE_OUT:
+			return 1;
+		}
+		goto partial;
+	}
+#endif
 	if (weight[item] >= 0x10000)
 		return 0;
 	if (weight[item] == 0)
 		return 1;
+#ifndef __KERNEL__
+partial:
+#endif
 	if ((crush_hash32_2(CRUSH_HASH_RJENKINS1, x, item) & 0xffff)
 	    < weight[item])
 		return 0;
 	return 1;
 }
 
+/**
+ * crush_choose_leaf_firstn - choose a device under a bucket for chooseleaf
+ * @map: the crush_map
+ * @bucket: the bucket chosen by crush_choose_firstn
+ * @x: crush input value
+ * @rep: the replica rank
+ * @out: pointer to the leaf vector
+ * @outpos: the position of the leaf in that vector
+ * @tries: number of attempts to make
+ * @local_retries: localized retries
+ * @local_fallback_retries: localized fallback retries
+ * @parent_r: r value passed from the parent
+ * @leaves: NULL or the set of the first @outpos items of @out
+ *
+ * This is what a recursive crush_choose_firstn call for one device
+ * does, without the recursion: the descent is a loop and the devices
+ * are not chosen under them. Returns 1 and sets @out[@outpos] if a
+ * device was found, 0 otherwise.
+ */
+static int crush_choose_leaf_firstn(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int rep,
+				    int *out, int outpos,
+				    unsigned int tries,
+				    unsigned int local_retries,
+				    unsigned int local_fallback_retries,
+				    int parent_r,
+				    const struct crush_item_set *leaves,
+				    const struct crush_choose_arg *choose_args)
+{
+	unsigned int ftotal = 0, flocal;
+	int retry_descent, retry_bucket;
+	const struct crush_bucket *in;
+	int r;
+	int item = 0;
+	int itemtype;
+	int collide, reject;
+
+	dprintk("CHOOSE leaf bucket %d x %d outpos %d rep %d tries %d \
+parent_r %d\n", bucket->id, x, outpos, rep, tries, parent_r);
+
+	/* keep trying until we get a non-out, non-colliding device */
+	do {
+		retry_descent = 0;
+		in = bucket;              /* initial bucket */
+
+		/* choose through intervening buckets */
+		flocal = 0;
+		do {
+			collide = 0;
+			retry_bucket = 0;
+			/* r' = r + f_total */
+			r = rep + parent_r + ftotal;
+
+			/* bucket choose */
+			if (in->size == 0) {
+				crush_stat(work, rejects);
+				reject = 1;
+				goto reject;
+			}
+			if (local_fallback_retries > 0 &&
+			    flocal >= (in->size>>1) &&
+			    flocal > local_fallback_retries)
+				item = bucket_perm_choose(
+					in, work->work[-1-in->id],
+					x, r);
+			else
+				item = crush_bucket_choose(
+					in, work,
+					x, r,
+					(choose_args ? &choose_args[-1-in->id] : 0),
+					outpos);
+			crush_stat(work, descents);
+			crush_trace_choice(work, in->id, item);
+			if (item >= map->max_devices) {
+				dprintk("   bad item %d\n", item);
+				crush_stat(work, rejects);
+				return 0;
+			}
+
+			/* a device? */
+			if (item < 0)
+				itemtype = map->buckets[-1-item]->type;
+			else
+				itemtype = 0;
+			dprintk("  item %d type %d\n", item, itemtype);
+
+			/* keep going? */
+			if (itemtype != 0) {
+				if ((-1-item) >= map->max_buckets) {
+					dprintk("   bad item type 0\n");
+					crush_stat(work, rejects);
+					return 0;
+				}
+				in = map->buckets[-1-item];
+				retry_bucket = 1;
+				continue;
+			}
+
+			/* collision? */
+			collide = crush_is_chosen(leaves, out, 0, outpos, item);
+			if (collide)
+				crush_stat(work, collisions);
+
+			/* out? */
+			reject = 0;
+			if (!collide &&
+			    is_out(map, work, weight, weight_max, item, x)) {
+				crush_stat(work, is_out);
+				reject = 1;
+			}
+
+reject:
+			if (reject || collide) {
+				ftotal++;
+				flocal++;
+
+				if (collide && flocal <= local_retries)
+					/* retry locally a few times */
+					retry_bucket = 1;
+				else if (local_fallback_retries > 0 &&
+					 flocal <= in->size + local_fallback_retries)
+					/* exhaustive bucket search */
+					retry_bucket = 1;
+				else if (ftotal < tries)
+					/* then retry descent */
+					retry_descent = 1;
+				else
+					/* else give up */
+					return 0;
+				if (retry_bucket)
+					crush_stat(work, local_retries);
+				dprintk("  reject %d  collide %d  "
+					"ftotal %u  flocal %u\n",
+					reject, collide, ftotal,
+					flocal);
+			}
+		} while (retry_bucket);
+	} while (retry_descent);
+
+	dprintk("CHOOSE leaf got %d\n", item);
+	out[outpos] = item;
+	crush_stat_tries(work, ftotal);
+	return 1;
+}
+
 /**
  * crush_choose_firstn - choose numrep distinct items of given type
  * @map: the crush_map
@@ -429,14 +759,14 @@ static int is_out(const struct crush_map *map,
  * @numrep: the number of items to choose
  * @type: the type of item to choose
  * @out: pointer to output vector
- * @outpos: our position in that vector
+ * @outpos: our position in that vector, the first @outpos replicas are already in @out (and @out2)
  * @out_size: size of the out vector
  * @tries: number of attempts to make
  * @recurse_tries: number of attempts to have recursive chooseleaf make
  * @local_retries: localized retries
  * @local_fallback_retries: localized fallback retries
  * @recurse_to_leaf: true if we want one device under each item of given type (chooseleaf instead of choose)
- * @stable: stable mode starts rep=0 in the recursive call for all replicas
+ * @stable: stable mode starts rep=0 in the leaf descent for all replicas
  * @vary_r: pass r to recursive calls
  * @out2: second output vector for leaf items (if @recurse_to_leaf)
  * @parent_r: r value passed from the parent
@@ -463,8 +793,8 @@ static int crush_choose_firstn(const struct crush_map *map,
 	unsigned int ftotal, flocal;
 	int retry_descent, retry_bucket, skip_rep;
 	const struct crush_bucket *in = bucket;
+	struct crush_item_set *chosen = NULL, *leaves = NULL;
 	int r;
-	int i;
 	int item = 0;
 	int itemtype;
 	int collide, reject;
@@ -478,7 +808,17 @@ parent_r %d stable %d\n",
 		tries, recurse_tries, local_retries, local_fallback_retries,
 		parent_r, stable);
 
-	for (rep = stable ? 0 : outpos; rep < numrep && count > 0 ; rep++) {
+#ifndef __KERNEL__
+	if (crush_item_set_is_wide(numrep < outpos + out_size ?
+				   numrep : outpos + out_size)) {
+		chosen = crush_item_set_init(&work->chosen, out, outpos);
+		if (recurse_to_leaf)
+			leaves = crush_item_set_init(&work->leaves, out2,
+						     outpos);
+	}
+#endif
+
+	for (rep = outpos; rep < numrep && count > 0 ; rep++) {
 		/* keep trying until we get a non-out, non-colliding item */
 		ftotal = 0;
 		skip_rep = 0;
@@ -497,6 +837,7 @@ parent_r %d stable %d\n",
 
 				/* bucket choose */
 				if (in->size == 0) {
+					crush_stat(work, rejects);
 					reject = 1;
 					goto reject;
 				}
@@ -508,12 +849,15 @@ parent_r %d stable %d\n",
 						x, r);
 				else
 					item = crush_bucket_choose(
-						in, work->work[-1-in->id],
+						in, work,
 						x, r,
                                                 (choose_args ? &choose_args[-1-in->id] : 0),
                                                 outpos);
+				crush_stat(work, descents);
+				crush_trace_choice(work, in->id, item);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
+					crush_stat(work, rejects);
 					skip_rep = 1;
 					break;
 				}
@@ -530,6 +874,7 @@ parent_r %d stable %d\n",
 					if (item >= 0 ||
 					    (-1-item) >= map->max_buckets) {
 						dprintk("   bad item type %d\n", type);
+						crush_stat(work, rejects);
 						skip_rep = 1;
 						break;
 					}
@@ -539,12 +884,10 @@ parent_r %d stable %d\n",
 				}
 
 				/* collision? */
-				for (i = 0; i < outpos; i++) {
-					if (out[i] == item) {
-						collide = 1;
-						break;
-					}
-				}
+				collide = crush_is_chosen(chosen, out, 0,
+							  outpos, item);
+				if (collide)
+					crush_stat(work, collisions);
 
 				reject = 0;
 				if (!collide && recurse_to_leaf) {
@@ -554,24 +897,23 @@ parent_r %d stable %d\n",
 							sub_r = r >> (vary_r-1);
 						else
 							sub_r = 0;
-						if (crush_choose_firstn(
+						if (!crush_choose_leaf_firstn(
 							    map,
 							    work,
 							    map->buckets[-1-item],
 							    weight, weight_max,
-							    x, stable ? 1 : outpos+1, 0,
-							    out2, outpos, count,
-							    recurse_tries, 0,
+							    x, stable ? 0 : outpos,
+							    out2, outpos,
+							    recurse_tries,
 							    local_retries,
 							    local_fallback_retries,
-							    0,
-							    vary_r,
-							    stable,
-							    NULL,
 							    sub_r,
-                                                            choose_args) <= outpos)
+							    leaves,
+							    choose_args)) {
 							/* didn't get leaf */
+							crush_stat(work, rejects);
 							reject = 1;
+						}
 					} else {
 						/* we already have a leaf! */
 						out2[outpos] = item;
@@ -580,10 +922,12 @@ parent_r %d stable %d\n",
 
 				if (!reject && !collide) {
 					/* out? */
-					if (itemtype == 0)
-						reject = is_out(map, weight,
-								weight_max,
-								item, x);
+					if (itemtype == 0 &&
+					    is_out(map, work, weight, weight_max,
+						   item, x)) {
+						crush_stat(work, is_out);
+						reject = 1;
+					}
 				}
 
 reject:
@@ -604,6 +948,8 @@ reject:
 					else
 						/* else give up */
 						skip_rep = 1;
+					if (retry_bucket)
+						crush_stat(work, local_retries);
 					dprintk("  reject %d  collide %d  "
 						"ftotal %u  flocal %u\n",
 						reject, collide, ftotal,
@@ -619,12 +965,12 @@ reject:
 
 		dprintk("CHOOSE got %d\n", item);
 		out[outpos] = item;
+		crush_item_set_add(chosen, item);
+		if (recurse_to_leaf)
+			crush_item_set_add(leaves, out2[outpos]);
 		outpos++;
 		count--;
-#ifndef __KERNEL__
-		if (map->choose_tries && ftotal <= map->choose_total_tries)
-			map->choose_tries[ftotal]++;
-#endif
+		crush_stat_tries(work, ftotal);
 	}
 
 	dprintk("CHOOSE returns %d\n", outpos);
@@ -632,6 +978,114 @@ reject:
 }
 
 
+/**
+ * crush_choose_leaf_indep - choose a device under a bucket for chooseleaf
+ * @map: the crush_map
+ * @bucket: the bucket chosen by crush_choose_indep
+ * @x: crush input value
+ * @numrep: the number of items chosen by crush_choose_indep
+ * @out: pointer to the leaf vector
+ * @rep: the position of the leaf in that vector
+ * @tries: number of attempts to make
+ * @parent_r: r value passed from the parent
+ *
+ * This is what a recursive crush_choose_indep call for one device
+ * does, without the recursion. Sets @out[@rep] to the device or to
+ * CRUSH_ITEM_NONE.
+ */
+static void crush_choose_leaf_indep(const struct crush_map *map,
+				    struct crush_work *work,
+				    const struct crush_bucket *bucket,
+				    const __u32 *weight, int weight_max,
+				    int x, int numrep,
+				    int *out, int rep,
+				    unsigned int tries,
+				    int parent_r,
+				    const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *in;
+	unsigned int ftotal;
+	int r;
+	int item;
+	int itemtype;
+
+	dprintk("CHOOSE leaf INDEP bucket %d x %d rep %d numrep %d\n",
+		bucket->id, x, rep, numrep);
+
+	out[rep] = CRUSH_ITEM_UNDEF;
+	for (ftotal = 0; out[rep] == CRUSH_ITEM_UNDEF && ftotal < tries;
+	     ftotal++) {
+		in = bucket;  /* initial bucket */
+
+		/* choose through intervening buckets */
+		for (;;) {
+			r = rep + parent_r;
+
+			/* be careful */
+			if (in->alg == CRUSH_BUCKET_UNIFORM &&
+			    in->size % numrep == 0)
+				/* r'=r+(n+1)*f_total */
+				r += (numrep+1) * ftotal;
+			else
+				/* r' = r + n*f_total */
+				r += numrep * ftotal;
+
+			/* bucket choose */
+			if (in->size == 0) {
+				dprintk("   empty bucket\n");
+				crush_stat(work, rejects);
+				break;
+			}
+
+			item = crush_bucket_choose(
+				in, work,
+				x, r,
+				(choose_args ? &choose_args[-1-in->id] : 0),
+				rep);
+			crush_stat(work, descents);
+			crush_trace_choice(work, in->id, item);
+			if (item >= map->max_devices) {
+				dprintk("   bad item %d\n", item);
+				crush_stat(work, rejects);
+				out[rep] = CRUSH_ITEM_NONE;
+				break;
+			}
+
+			/* a device? */
+			if (item < 0)
+				itemtype = map->buckets[-1-item]->type;
+			else
+				itemtype = 0;
+			dprintk("  item %d type %d\n", item, itemtype);
+
+			/* keep going? */
+			if (itemtype != 0) {
+				if ((-1-item) >= map->max_buckets) {
+					dprintk("   bad item type 0\n");
+					crush_stat(work, rejects);
+					out[rep] = CRUSH_ITEM_NONE;
+					break;
+				}
+				in = map->buckets[-1-item];
+				continue;
+			}
+
+			/* out? */
+			if (is_out(map, work, weight, weight_max, item, x)) {
+				crush_stat(work, is_out);
+				break;
+			}
+
+			/* yay! */
+			out[rep] = item;
+			break;
+		}
+	}
+	if (out[rep] == CRUSH_ITEM_UNDEF)
+		out[rep] = CRUSH_ITEM_NONE;
+	crush_stat_tries(work, ftotal);
+}
+
 /**
  * crush_choose_indep: alternative breadth-first positionally stable mapping
  *
@@ -650,11 +1104,11 @@ static void crush_choose_indep(const struct crush_map *map,
                                const struct crush_choose_arg *choose_args)
 {
 	const struct crush_bucket *in = bucket;
+	struct crush_item_set *chosen = NULL;
 	int endpos = outpos + left;
 	int rep;
 	unsigned int ftotal;
 	int r;
-	int i;
 	int item = 0;
 	int itemtype;
 	int collide;
@@ -668,6 +1122,10 @@ static void crush_choose_indep(const struct crush_map *map,
 		if (out2)
 			out2[rep] = CRUSH_ITEM_UNDEF;
 	}
+#ifndef __KERNEL__
+	if (crush_item_set_is_wide(left))
+		chosen = crush_item_set_init(&work->chosen, out, 0);
+#endif
 
 	for (ftotal = 0; left > 0 && ftotal < tries; ftotal++) {
 #ifdef DEBUG_INDEP
@@ -714,16 +1172,20 @@ static void crush_choose_indep(const struct crush_map *map,
 				/* bucket choose */
 				if (in->size == 0) {
 					dprintk("   empty bucket\n");
+					crush_stat(work, rejects);
 					break;
 				}
 
 				item = crush_bucket_choose(
-					in, work->work[-1-in->id],
+					in, work,
 					x, r,
                                         (choose_args ? &choose_args[-1-in->id] : 0),
                                         outpos);
+				crush_stat(work, descents);
+				crush_trace_choice(work, in->id, item);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
+					crush_stat(work, rejects);
 					out[rep] = CRUSH_ITEM_NONE;
 					if (out2)
 						out2[rep] = CRUSH_ITEM_NONE;
@@ -743,6 +1205,7 @@ static void crush_choose_indep(const struct crush_map *map,
 					if (item >= 0 ||
 					    (-1-item) >= map->max_buckets) {
 						dprintk("   bad item type %d\n", type);
+						crush_stat(work, rejects);
 						out[rep] = CRUSH_ITEM_NONE;
 						if (out2)
 							out2[rep] =
@@ -755,29 +1218,27 @@ static void crush_choose_indep(const struct crush_map *map,
 				}
 
 				/* collision? */
-				collide = 0;
-				for (i = outpos; i < endpos; i++) {
-					if (out[i] == item) {
-						collide = 1;
-						break;
-					}
-				}
-				if (collide)
+				collide = crush_is_chosen(chosen, out, outpos,
+							  endpos, item);
+				if (collide) {
+					crush_stat(work, collisions);
 					break;
+				}
 
 				if (recurse_to_leaf) {
 					if (item < 0) {
-						crush_choose_indep(
+						crush_choose_leaf_indep(
 							map,
 							work,
 							map->buckets[-1-item],
 							weight, weight_max,
-							x, 1, numrep, 0,
+							x, numrep,
 							out2, rep,
-							recurse_tries, 0,
-							0, NULL, r, choose_args);
+							recurse_tries,
+							r, choose_args);
 						if (out2[rep] == CRUSH_ITEM_NONE) {
 							/* placed nothing; no leaf */
+							crush_stat(work, rejects);
 							break;
 						}
 					} else {
@@ -788,11 +1249,14 @@ static void crush_choose_indep(const struct crush_map *map,
 
 				/* out? */
 				if (itemtype == 0 &&
-				    is_out(map, weight, weight_max, item, x))
+				    is_out(map, work, weight, weight_max, item, x)) {
+					crush_stat(work, is_out);
 					break;
+				}
 
 				/* yay! */
 				out[rep] = item;
+				crush_item_set_add(chosen, item);
 				left--;
 				break;
 			}
@@ -806,10 +1270,7 @@ static void crush_choose_indep(const struct crush_map *map,
 			out2[rep] = CRUSH_ITEM_NONE;
 		}
 	}
-#ifndef __KERNEL__
-	if (map->choose_tries && ftotal <= map->choose_total_tries)
-		map->choose_tries[ftotal]++;
-#endif
+	crush_stat_tries(work, ftotal);
 #ifdef DEBUG_INDEP
 	if (out2) {
 		dprintk("%u %d a: ", ftotal, left);
@@ -827,116 +1288,731 @@ static void crush_choose_indep(const struct crush_map *map,
 }
 
 
-/* This takes a chunk of memory and sets it up to be a shiny new
-   working area for a CRUSH placement computation. It must be called
-   on any newly allocated memory before passing it in to
-   crush_do_rule. It may be used repeatedly after that, so long as the
-   map has not changed. If the map /has/ changed, you must make sure
-   the working size is no smaller than what was allocated and re-run
-   crush_init_workspace.
-
-   If you do retain the working space between calls to crush, make it
-   thread-local. If you reinstitute the locking I've spent so much
-   time getting rid of, I will be very unhappy with you. */
+#ifndef __KERNEL__
+/*
+ * The items of a straw2 bucket in decreasing order of their draw (and increasing position for equal draws), for the TOPK steps.
+ * Each pass over the bucket keeps the CRUSH_TOPK_MAX best items that
+ * follow the last one returned, so that a few rejections do not cost
+ * a pass each.
+ */
+#define CRUSH_TOPK_MAX 16
+
+struct crush_topk_rank {
+	const struct crush_bucket_straw2 *bucket;
+	const __u32 *weights;
+	const int *ids;
+	const struct crush_reciprocal *reciprocals;
+	int x;
+	int r;
+	int batch;       /* the number of items kept by a pass */
+	int size;        /* the number of items in pos[] */
+	int next;        /* the next one to return */
+	int last;        /* the position of the last item returned or -1 */
+	__s64 last_draw; /* and its draw */
+	int pos[CRUSH_TOPK_MAX];
+	__s64 draw[CRUSH_TOPK_MAX];
+};
+
+static void crush_topk_rank_init(struct crush_topk_rank *rank,
+				 const struct crush_work *work,
+				 const struct crush_bucket_straw2 *bucket,
+				 int x, int r, int batch,
+				 const struct crush_choose_arg *arg)
+{
+	rank->bucket = bucket;
+	rank->weights = get_choose_arg_weights(bucket, arg, 0);
+	rank->ids = get_choose_arg_ids(bucket, arg);
+	rank->reciprocals = get_choose_arg_reciprocals(work, bucket, arg, 0);
+	rank->x = x;
+	rank->r = r;
+	rank->batch = batch < 1 ? 1 :
+		batch > CRUSH_TOPK_MAX ? CRUSH_TOPK_MAX : batch;
+	rank->size = 0;
+	rank->next = 0;
+	rank->last = -1;
+	rank->last_draw = 0;
+}
 
-void crush_init_workspace(const struct crush_map *m, void *v) {
-	/* We work by moving through the available space and setting
-	   values and pointers as we go.
+/* the number of items hashed together by crush_topk_rank_fill() */
+#define CRUSH_TOPK_CHUNK 64
 
-	   It's a bit like Forth's use of the 'allot' word since we
-	   set the pointer first and then reserve the space for it to
-	   point to by incrementing the point. */
-	struct crush_work *w = (struct crush_work *)v;
-	char *point = (char *)v;
-	__s32 b;
-	point += sizeof(struct crush_work);
-	w->work = (struct crush_work_bucket **)point;
-	point += m->max_buckets * sizeof(struct crush_work_bucket *);
-	for (b = 0; b < m->max_buckets; ++b) {
-		if (m->buckets[b] == 0)
+/* keep the rank->batch best items ranked after the last one returned */
+static void crush_topk_rank_fill(struct crush_topk_rank *rank)
+{
+	const struct crush_bucket_straw2 *bucket = rank->bucket;
+	__u32 x = rank->x, r = rank->r;
+	__u32 hash[CRUSH_TOPK_CHUNK];
+	__u32 i, n = 0;
+	int j;
+	__s64 draw;
+
+	rank->size = 0;
+	rank->next = 0;
+	for (i = 0; i < bucket->h.size; i++) {
+		if (i % CRUSH_TOPK_CHUNK == 0) {
+			n = bucket->h.size - i;
+			if (n > CRUSH_TOPK_CHUNK)
+				n = CRUSH_TOPK_CHUNK;
+			crush_hash32_3_lanes(bucket->h.hash, &x, 0,
+					     (const __u32 *)rank->ids + i, 1,
+					     &r, 0, hash, n);
+		}
+		if (!rank->weights[i])
 			continue;
-
-		w->work[b] = (struct crush_work_bucket *) point;
-		switch (m->buckets[b]->alg) {
-		default:
-			point += sizeof(struct crush_work_bucket);
-			break;
+		draw = straw2_hash_draw(hash[i % CRUSH_TOPK_CHUNK],
+					rank->weights[i],
+					rank->reciprocals ?
+					&rank->reciprocals[i] : NULL);
+		if (rank->last >= 0 &&
+		    (draw > rank->last_draw ||
+		     (draw == rank->last_draw && (int)i <= rank->last)))
+			continue;
+		if (rank->size == rank->batch &&
+		    draw <= rank->draw[rank->size - 1])
+			continue;
+		if (rank->size < rank->batch)
+			rank->size++;
+		for (j = rank->size - 1; j > 0 && draw > rank->draw[j - 1]; j--) {
+			rank->pos[j] = rank->pos[j - 1];
+			rank->draw[j] = rank->draw[j - 1];
 		}
-		w->work[b]->perm_x = 0;
-		w->work[b]->perm_n = 0;
-		w->work[b]->perm = (__u32 *)point;
-		point += m->buckets[b]->size * sizeof(__u32);
+		rank->pos[j] = i;
+		rank->draw[j] = draw;
 	}
-	BUG_ON((char *)point - (char *)w != m->working_size);
 }
 
-/**
- * crush_do_rule - calculate a mapping with the given input and rule
- * @map: the crush_map
- * @ruleno: the rule id
- * @x: hash input
- * @result: pointer to result vector
- * @result_max: maximum result size
- * @weight: weight vector (for map leaves)
- * @weight_max: size of weight vector
- * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+/* the position of the next best item of the bucket or -1 */
+static int crush_topk_rank_next(struct crush_topk_rank *rank)
+{
+	if (rank->next == rank->size) {
+		if (rank->size > 0 && rank->size < rank->batch)
+			return -1; /* the last pass saw all the items */
+		crush_topk_rank_fill(rank);
+		if (rank->size == 0)
+			return -1;
+	}
+	rank->last = rank->pos[rank->next];
+	rank->last_draw = rank->draw[rank->next];
+	rank->next++;
+	return rank->last;
+}
+
+/*
+ * crush_topk_descend - follow the @r choices from @item down to an
+ * item of type @type and return it, or CRUSH_ITEM_NONE if an empty
+ * bucket, a bad item or a device is found on the way.
  */
-int crush_do_rule(const struct crush_map *map,
-		  int ruleno, int x, int *result, int result_max,
-		  const __u32 *weight, int weight_max,
-		  void *cwin, const struct crush_choose_arg *choose_args)
+static int crush_topk_descend(const struct crush_map *map,
+			      struct crush_work *work,
+			      int item, int type, int x, int r,
+			      const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *in;
+
+	for (;;) {
+		if (item >= map->max_devices)
+			return CRUSH_ITEM_NONE;
+		if (item >= 0)
+			return type == 0 ? item : CRUSH_ITEM_NONE;
+		if (-1-item >= map->max_buckets || !map->buckets[-1-item])
+			return CRUSH_ITEM_NONE;
+		in = map->buckets[-1-item];
+		if (in->type == type)
+			return item;
+		if (in->size == 0)
+			return CRUSH_ITEM_NONE;
+		item = crush_bucket_choose(in, work, x, r,
+					   choose_args ?
+					   &choose_args[-1-in->id] : NULL, 0);
+		crush_stat(work, descents);
+		crush_trace_choice(work, in->id, item);
+	}
+}
+
+/*
+ * crush_topk_leaf - follow the @r choices from the bucket @item down
+ * to a device. If it is out or already in @leaves[0] to
+ * @leaves[@n - 1] and its bucket is straw2, the in device of that bucket
+ * with the highest draw is used instead. Returns the device or
+ * CRUSH_ITEM_NONE.
+ */
+static int crush_topk_leaf(const struct crush_map *map,
+			   struct crush_work *work,
+			   int item, int x, int r,
+			   const __u32 *weight, int weight_max,
+			   const struct crush_item_set *set,
+			   const int *leaves, int n,
+			   const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *in = NULL;
+	const struct crush_choose_arg *arg = NULL;
+	struct crush_topk_rank rank;
+	int i;
+
+	while (item < 0) {
+		if (-1-item >= map->max_buckets || !map->buckets[-1-item])
+			return CRUSH_ITEM_NONE;
+		in = map->buckets[-1-item];
+		if (in->size == 0)
+			return CRUSH_ITEM_NONE;
+		arg = choose_args ? &choose_args[-1-in->id] : NULL;
+		item = crush_bucket_choose(in, work, x, r,
+					   arg, 0);
+		crush_stat(work, descents);
+		crush_trace_choice(work, in->id, item);
+	}
+	if (item >= map->max_devices) {
+		crush_stat(work, rejects);
+		return CRUSH_ITEM_NONE;
+	}
+	if (crush_is_chosen(set, leaves, 0, n, item)) {
+		crush_stat(work, collisions);
+	} else if (is_out(map, work, weight, weight_max, item, x)) {
+		crush_stat(work, is_out);
+	} else {
+		return item;
+	}
+	if (!in || in->alg != CRUSH_BUCKET_STRAW2)
+		return CRUSH_ITEM_NONE;
+
+	/* the @r choice is the first of the ranking, skip it */
+	crush_topk_rank_init(&rank, work, (const struct crush_bucket_straw2 *)in,
+			     x, r, CRUSH_TOPK_MAX, arg);
+	crush_topk_rank_next(&rank);
+	while ((i = crush_topk_rank_next(&rank)) >= 0) {
+		item = in->items[i];
+		crush_stat(work, descents);
+		crush_trace_choice(work, in->id, item);
+		if (item < 0 || item >= map->max_devices) {
+			crush_stat(work, rejects);
+		} else if (crush_is_chosen(set, leaves, 0, n, item)) {
+			crush_stat(work, collisions);
+		} else if (is_out(map, work, weight, weight_max, item, x)) {
+			crush_stat(work, is_out);
+		} else {
+			return item;
+		}
+	}
+	return CRUSH_ITEM_NONE;
+}
+
+/**
+ * crush_choose_topk - choose the items with the highest draws
+ * @map: the crush_map
+ * @bucket: the straw2 bucket to choose the items from
+ * @x: crush input value
+ * @count: the number of items to choose
+ * @type: the type of item to choose
+ * @out: pointer to output vector
+ * @tries: the number of rankings to try
+ * @recurse_to_leaf: true if we want one device under each item of given type
+ * @out2: second output vector for leaf items (if @recurse_to_leaf)
+ *
+ * The items of @bucket are ranked by their r = 0 straw2 draw and the
+ * first @count of them that lead to an acceptable item of @type (and
+ * device if @recurse_to_leaf) are chosen. If there are not enough of
+ * them, the items are ranked again with r = 1, 2, ... and those that
+ * lead to an item already chosen are skipped. Returns the number of
+ * items in @out.
+ */
+static int crush_choose_topk(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket_straw2 *bucket,
+			     const __u32 *weight, int weight_max,
+			     int x, int count, int type,
+			     int *out, unsigned int tries,
+			     int recurse_to_leaf, int *out2,
+			     const struct crush_choose_arg *choose_args)
+{
+	struct crush_item_set *chosen = NULL, *leaves = NULL;
+	struct crush_topk_rank rank;
+	unsigned int ftotal = 0;
+	unsigned int r;
+	int outpos = 0;
+	int i, item, leaf;
+
+	dprintk("CHOOSE%s_TOPK bucket %d x %d count %d\n",
+		recurse_to_leaf ? "LEAF" : "", bucket->h.id, x, count);
+
+	if (crush_item_set_is_wide(count)) {
+		chosen = crush_item_set_init(&work->chosen, out, 0);
+		if (recurse_to_leaf)
+			leaves = crush_item_set_init(&work->leaves, out2, 0);
+	}
+
+	for (r = 0; r < tries && outpos < count; r++) {
+		crush_topk_rank_init(&rank, work, bucket, x, r, count - outpos + 2,
+				     choose_args ?
+				     &choose_args[-1-bucket->h.id] : NULL);
+		while (outpos < count &&
+		       (i = crush_topk_rank_next(&rank)) >= 0) {
+			item = bucket->h.items[i];
+			crush_stat(work, descents);
+			crush_trace_choice(work, bucket->h.id, item);
+			item = crush_topk_descend(map, work, item, type, x, r,
+						  choose_args);
+			if (item == CRUSH_ITEM_NONE) {
+				crush_stat(work, rejects);
+				ftotal++;
+				continue;
+			}
+			if (crush_is_chosen(chosen, out, 0, outpos, item)) {
+				crush_stat(work, collisions);
+				ftotal++;
+				continue;
+			}
+			if (item >= 0 && is_out(map, work, weight, weight_max,
+						item, x)) {
+				crush_stat(work, is_out);
+				ftotal++;
+				continue;
+			}
+			if (recurse_to_leaf) {
+				if (item >= 0)
+					leaf = item;
+				else
+					leaf = crush_topk_leaf(map, work, item,
+							       x, r,
+							       weight,
+							       weight_max,
+							       leaves, out2,
+							       outpos,
+							       choose_args);
+				if (leaf == CRUSH_ITEM_NONE) {
+					crush_stat(work, rejects);
+					ftotal++;
+					continue;
+				}
+				out2[outpos] = leaf;
+				crush_item_set_add(leaves, leaf);
+			}
+			dprintk("CHOOSE_TOPK got %d\n", item);
+			out[outpos++] = item;
+			crush_item_set_add(chosen, item);
+			crush_stat_tries(work, ftotal);
+			ftotal = 0;
+		}
+	}
+
+	dprintk("CHOOSE_TOPK returns %d\n", outpos);
+	return outpos;
+}
+#endif
+
+/* This takes a chunk of memory and sets it up to be a shiny new
+   working area for a CRUSH placement computation. It must be called
+   on any newly allocated memory before passing it in to
+   crush_do_rule. It may be used repeatedly after that, so long as the
+   map has not changed. If the map /has/ changed, you must make sure
+   the working size is no smaller than what was allocated and re-run
+   crush_init_workspace.
+
+   If you do retain the working space between calls to crush, make it
+   thread-local. If you reinstitute the locking I've spent so much
+   time getting rid of, I will be very unhappy with you. */
+
+void crush_init_workspace(const struct crush_map *m, void *v) {
+	/* We work by moving through the available space and setting
+	   values and pointers as we go.
+
+	   It's a bit like Forth's use of the 'allot' word since we
+	   set the pointer first and then reserve the space for it to
+	   point to by incrementing the point. */
+	struct crush_work *w = (struct crush_work *)v;
+	char *point = (char *)v;
+	__s32 b;
+#ifndef __KERNEL__
+	w->stats = NULL;
+	w->trace = NULL;
+	w->devices = NULL;
+	w->reciprocals = NULL;
+	memset(&w->chosen, 0, sizeof(w->chosen));
+	memset(&w->leaves, 0, sizeof(w->leaves));
+#endif
+	point += sizeof(struct crush_work);
+	w->work = (struct crush_work_bucket **)point;
+	point += m->max_buckets * sizeof(struct crush_work_bucket *);
+	for (b = 0; b < m->max_buckets; ++b) {
+		if (m->buckets[b] == 0)
+			continue;
+
+		w->work[b] = (struct crush_work_bucket *) point;
+		switch (m->buckets[b]->alg) {
+		default:
+			point += sizeof(struct crush_work_bucket);
+			break;
+		}
+		w->work[b]->perm_x = 0;
+		w->work[b]->perm_n = 0;
+		w->work[b]->perm = (__u32 *)point;
+		point += m->buckets[b]->size * sizeof(__u32);
+	}
+	BUG_ON((char *)point - (char *)w != m->working_size);
+}
+
+#ifndef __KERNEL__
+void crush_work_set_stats(void *cwin, struct crush_stats *stats)
+{
+	((struct crush_work *)cwin)->stats = stats;
+}
+
+void crush_work_set_trace(void *cwin, struct crush_trace *trace)
+{
+	((struct crush_work *)cwin)->trace = trace;
+}
+
+void crush_work_set_device_state(void *cwin,
+				 const struct crush_device_state *devices)
+{
+	((struct crush_work *)cwin)->devices = devices;
+}
+
+int crush_device_state_prepare(struct crush_device_state *devices,
+			       const __u32 *weights, int weight_max)
+{
+	__u8 *state;
+	int i;
+
+	state = realloc(devices->state, weight_max > 0 ? weight_max : 1);
+	if (!state)
+		return -ENOMEM;
+	for (i = 0; i < weight_max; i++) {
+		if (weights[i] >= 0x10000)
+			state[i] = CRUSH_DEVICE_IN;
+		else if (weights[i] == 0)
+			state[i] = CRUSH_DEVICE_OUT;
+		else
+			state[i] = CRUSH_DEVICE_PARTIAL;
+	}
+	devices->weights = weights;
+	devices->weight_max = weight_max;
+	devices->state = state;
+	return 1;
+}
+
+void crush_device_state_destroy(struct crush_device_state *devices)
+{
+	free(devices->state);
+	memset(devices, 0, sizeof(*devices));
+}
+
+void crush_work_set_choose_reciprocals(
+	void *cwin, const struct crush_choose_reciprocals *reciprocals)
+{
+	((struct crush_work *)cwin)->reciprocals = reciprocals;
+}
+
+/* the size of the weight sets of @arg, 0 if they differ or are empty */
+static __u32 crush_weight_set_size(const struct crush_choose_arg *arg)
+{
+	__u32 size, j;
+
+	if (arg->weight_set == NULL || arg->weight_set_size == 0)
+		return 0;
+	size = arg->weight_set[0].size;
+	for (j = 1; j < arg->weight_set_size; j++)
+		if (arg->weight_set[j].size != size)
+			return 0;
+	return size;
+}
+
+int crush_choose_reciprocals_prepare(
+	struct crush_choose_reciprocals *reciprocals,
+	const struct crush_choose_arg *choose_args, int max_buckets)
+{
+	struct crush_weight_set_reciprocals *buckets;
+	struct crush_reciprocal *r;
+	size_t count = 0;
+	__u32 size, i, j;
+	int b;
+
+	if (max_buckets < 0)
+		max_buckets = 0;
+	for (b = 0; b < max_buckets; b++)
+		count += (size_t)crush_weight_set_size(&choose_args[b]) *
+			choose_args[b].weight_set_size;
+	/* the buckets and their reciprocals in one allocation */
+	buckets = realloc(reciprocals->buckets,
+			  sizeof(*buckets) * max_buckets +
+			  sizeof(*r) * count + 1);
+	if (!buckets)
+		return -ENOMEM;
+	r = (struct crush_reciprocal *)(buckets + max_buckets);
+	for (b = 0; b < max_buckets; b++) {
+		const struct crush_choose_arg *arg = &choose_args[b];
+
+		size = crush_weight_set_size(arg);
+		buckets[b].reciprocals = size ? r : NULL;
+		buckets[b].positions = size ? arg->weight_set_size : 0;
+		buckets[b].size = size;
+		for (j = 0; j < buckets[b].positions; j++)
+			for (i = 0; i < size; i++)
+				crush_set_reciprocal(r++,
+						     arg->weight_set[j].weights[i]);
+	}
+	reciprocals->choose_args = choose_args;
+	reciprocals->max_buckets = max_buckets;
+	reciprocals->buckets = buckets;
+	return 1;
+}
+
+void crush_choose_reciprocals_destroy(
+	struct crush_choose_reciprocals *reciprocals)
+{
+	free(reciprocals->buckets);
+	memset(reciprocals, 0, sizeof(*reciprocals));
+}
+
+void crush_stats_merge(struct crush_stats *stats,
+		       const struct crush_stats *other)
+{
+	int i;
+
+	stats->descents += other->descents;
+	stats->collisions += other->collisions;
+	stats->rejects += other->rejects;
+	stats->is_out += other->is_out;
+	stats->local_retries += other->local_retries;
+	for (i = 0; i < CRUSH_STATS_MAX_TRIES; i++)
+		stats->choose_tries[i] += other->choose_tries[i];
+}
+#endif
+
+/*
+ * The tunables in effect when a rule starts executing, before any of
+ * its SET_* steps override them. They only depend on the map and are
+ * derived once per crush_do_rule() or crush_do_rule_batch() call.
+ */
+struct crush_rule_params {
+	int choose_tries;
+	int choose_leaf_tries;
+	int choose_local_retries;
+	int choose_local_fallback_retries;
+	int vary_r;
+	int stable;
+};
+
+static void crush_init_rule_params(const struct crush_map *map,
+				   struct crush_rule_params *p)
 {
-	int result_len;
-	struct crush_work *cw = cwin;
-	int *a = (int *)((char *)cw + map->working_size);
-	int *b = a + result_max;
-	int *c = b + result_max;
-	int *w = a;
-	int *o = b;
-	int recurse_to_leaf;
-	int wsize = 0;
-	int osize;
-	int *tmp;
-	const struct crush_rule *rule;
-	__u32 step;
-	int i, j;
-	int numrep;
-	int out_size;
 	/*
 	 * the original choose_total_tries value was off by one (it
 	 * counted "retries" and not "tries").  add one.
 	 */
-	int choose_tries = map->choose_total_tries + 1;
-	int choose_leaf_tries = 0;
+	p->choose_tries = map->choose_total_tries + 1;
+	p->choose_leaf_tries = 0;
 	/*
 	 * the local tries values were counted as "retries", though,
 	 * and need no adjustment
 	 */
-	int choose_local_retries = map->choose_local_tries;
-	int choose_local_fallback_retries = map->choose_local_fallback_tries;
+	p->choose_local_retries = map->choose_local_tries;
+	p->choose_local_fallback_retries = map->choose_local_fallback_tries;
 
-	int vary_r = map->chooseleaf_vary_r;
-	int stable = map->chooseleaf_stable;
+	p->vary_r = map->chooseleaf_vary_r;
+	p->stable = map->chooseleaf_stable;
+}
 
-	if ((__u32)ruleno >= map->max_rules) {
-		dprintk(" bad ruleno %d\n", ruleno);
-		return 0;
+/*
+ * A CHOOSE* step with the tunables in effect when it runs: see
+ * crush_init_choose_step().
+ */
+struct crush_choose_step {
+	int numrep;
+	int type;
+	int firstn;
+	int recurse_to_leaf;
+	int tries;
+	int recurse_tries;
+	int local_retries;
+	int local_fallback_retries;
+	int vary_r;
+	int stable;
+	int topk;
+};
+
+static void crush_init_choose_step(const struct crush_map *map,
+				   const struct crush_rule_step *curstep,
+				   const struct crush_rule_params *p,
+				   struct crush_choose_step *s)
+{
+	s->numrep = curstep->arg1;
+	s->type = curstep->arg2;
+	/* TOPK explores the buckets that are not straw2 as FIRSTN does */
+	s->topk = curstep->op == CRUSH_RULE_CHOOSELEAF_TOPK ||
+		curstep->op == CRUSH_RULE_CHOOSE_TOPK;
+	s->firstn = curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+		curstep->op == CRUSH_RULE_CHOOSE_FIRSTN || s->topk;
+	s->recurse_to_leaf = curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+		curstep->op == CRUSH_RULE_CHOOSELEAF_INDEP ||
+		curstep->op == CRUSH_RULE_CHOOSELEAF_TOPK;
+	s->tries = p->choose_tries;
+	if (s->firstn) {
+		if (p->choose_leaf_tries)
+			s->recurse_tries = p->choose_leaf_tries;
+		else if (map->chooseleaf_descend_once)
+			s->recurse_tries = 1;
+		else
+			s->recurse_tries = p->choose_tries;
+	} else {
+		s->recurse_tries = p->choose_leaf_tries ?
+			p->choose_leaf_tries : 1;
 	}
+	s->local_retries = p->choose_local_retries;
+	s->local_fallback_retries = p->choose_local_fallback_retries;
+	s->vary_r = p->vary_r;
+	s->stable = p->stable;
+}
+
+/*
+ * crush_do_choose_step - run the CHOOSE* step @s from the @wsize
+ * items of @w into @o, using @c as a scratch array for the leaves, and
+ * return the number of items in @o.
+ */
+static int crush_do_choose_step(const struct crush_map *map,
+				const struct crush_choose_step *s,
+				struct crush_work *cw, int x,
+				const int *w, int wsize, int *o, int *c,
+				int result_max,
+				const __u32 *weight, int weight_max,
+				const struct crush_choose_arg *choose_args)
+{
+	int osize = 0;
+	int numrep;
+	int out_size;
+	int i, j;
+
+	for (i = 0; i < wsize; i++) {
+		int bno;
+		/*
+		 * see CRUSH_N, CRUSH_N_MINUS macros.
+		 * basically, numrep <= 0 means relative to
+		 * the provided result_max
+		 */
+		numrep = s->numrep;
+		if (numrep <= 0) {
+			numrep += result_max;
+			if (numrep <= 0)
+				continue;
+		}
+		j = 0;
+		/* make sure bucket id is valid */
+		bno = -1 - w[i];
+		if (bno < 0 || bno >= map->max_buckets) {
+			// w[i] is probably CRUSH_ITEM_NONE
+			dprintk("  bad w[i] %d\n", w[i]);
+			continue;
+		}
+#ifndef __KERNEL__
+		if (s->topk &&
+		    map->buckets[bno]->alg == CRUSH_BUCKET_STRAW2) {
+			out_size = ((numrep < (result_max-osize)) ?
+				    numrep : (result_max-osize));
+			osize += crush_choose_topk(
+				map,
+				cw,
+				(const struct crush_bucket_straw2 *)
+				map->buckets[bno],
+				weight, weight_max,
+				x, out_size,
+				s->type,
+				o+osize,
+				s->tries,
+				s->recurse_to_leaf,
+				c+osize,
+				choose_args);
+		} else
+#endif
+		if (s->firstn) {
+			osize += crush_choose_firstn(
+				map,
+				cw,
+				map->buckets[bno],
+				weight, weight_max,
+				x, numrep,
+				s->type,
+				o+osize, j,
+				result_max-osize,
+				s->tries,
+				s->recurse_tries,
+				s->local_retries,
+				s->local_fallback_retries,
+				s->recurse_to_leaf,
+				s->vary_r,
+				s->stable,
+				c+osize,
+				0,
+				choose_args);
+		} else {
+			out_size = ((numrep < (result_max-osize)) ?
+				    numrep : (result_max-osize));
+			crush_choose_indep(
+				map,
+				cw,
+				map->buckets[bno],
+				weight, weight_max,
+				x, out_size, numrep,
+				s->type,
+				o+osize, j,
+				s->tries,
+				s->recurse_tries,
+				s->recurse_to_leaf,
+				c+osize,
+				0,
+				choose_args);
+			osize += out_size;
+		}
+	}
+
+	if (s->recurse_to_leaf)
+		/* copy final _leaf_ values to output set */
+		memcpy(o, c, osize*sizeof(*o));
+
+	return osize;
+}
+
+/* true if @item can be used by a TAKE step */
+static int crush_take_is_valid(const struct crush_map *map, int item)
+{
+	return (item >= 0 && item < map->max_devices) ||
+		(-1-item >= 0 && -1-item < map->max_buckets &&
+		 map->buckets[-1-item]);
+}
+
+/*
+ * crush_do_rule_steps - interpret the steps of @rule for input @x
+ *
+ * @params is the set of tunables derived from the map; it is copied
+ * so that the SET_* steps of the rule only apply to this input.
+ */
+static int crush_do_rule_steps(const struct crush_map *map,
+			       const struct crush_rule *rule,
+			       const struct crush_rule_params *params,
+			       int x, int *result, int result_max,
+			       const __u32 *weight, int weight_max,
+			       struct crush_work *cw,
+			       const struct crush_choose_arg *choose_args)
+{
+	int result_len;
+	int *a = (int *)((char *)cw + map->working_size);
+	int *b = a + result_max;
+	int *c = b + result_max;
+	int *w = a;
+	int *o = b;
+	int wsize = 0;
+	int *tmp;
+	__u32 step;
+	int i;
+	struct crush_rule_params p = *params;
+	struct crush_choose_step choose;
 
-	rule = map->rules[ruleno];
 	result_len = 0;
 
 	for (step = 0; step < rule->len; step++) {
-		int firstn = 0;
 		const struct crush_rule_step *curstep = &rule->steps[step];
 
 		switch (curstep->op) {
 		case CRUSH_RULE_TAKE:
-			if ((curstep->arg1 >= 0 &&
-			     curstep->arg1 < map->max_devices) ||
-			    (-1-curstep->arg1 >= 0 &&
-			     -1-curstep->arg1 < map->max_buckets &&
-			     map->buckets[-1-curstep->arg1])) {
+			if (crush_take_is_valid(map, curstep->arg1)) {
 				w[0] = curstep->arg1;
 				wsize = 1;
 			} else {
@@ -946,132 +2022,56 @@ int crush_do_rule(const struct crush_map *map,
 
 		case CRUSH_RULE_SET_CHOOSE_TRIES:
 			if (curstep->arg1 > 0)
-				choose_tries = curstep->arg1;
+				p.choose_tries = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
 			if (curstep->arg1 > 0)
-				choose_leaf_tries = curstep->arg1;
+				p.choose_leaf_tries = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
 			if (curstep->arg1 >= 0)
-				choose_local_retries = curstep->arg1;
+				p.choose_local_retries = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
 			if (curstep->arg1 >= 0)
-				choose_local_fallback_retries = curstep->arg1;
+				p.choose_local_fallback_retries = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
 			if (curstep->arg1 >= 0)
-				vary_r = curstep->arg1;
+				p.vary_r = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
 			if (curstep->arg1 >= 0)
-				stable = curstep->arg1;
+				p.stable = curstep->arg1;
 			break;
 
 		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
 		case CRUSH_RULE_CHOOSE_FIRSTN:
-			firstn = 1;
-			/* fall through */
 		case CRUSH_RULE_CHOOSELEAF_INDEP:
 		case CRUSH_RULE_CHOOSE_INDEP:
+#ifndef __KERNEL__
+		case CRUSH_RULE_CHOOSELEAF_TOPK:
+		case CRUSH_RULE_CHOOSE_TOPK:
+#endif
 			if (wsize == 0)
 				break;
 
-			recurse_to_leaf =
-				curstep->op ==
-				 CRUSH_RULE_CHOOSELEAF_FIRSTN ||
-				curstep->op ==
-				CRUSH_RULE_CHOOSELEAF_INDEP;
-
-			/* reset output */
-			osize = 0;
-
-			for (i = 0; i < wsize; i++) {
-				int bno;
-				/*
-				 * see CRUSH_N, CRUSH_N_MINUS macros.
-				 * basically, numrep <= 0 means relative to
-				 * the provided result_max
-				 */
-				numrep = curstep->arg1;
-				if (numrep <= 0) {
-					numrep += result_max;
-					if (numrep <= 0)
-						continue;
-				}
-				j = 0;
-				/* make sure bucket id is valid */
-				bno = -1 - w[i];
-				if (bno < 0 || bno >= map->max_buckets) {
-					// w[i] is probably CRUSH_ITEM_NONE
-					dprintk("  bad w[i] %d\n", w[i]);
-					continue;
-				}
-				if (firstn) {
-					int recurse_tries;
-					if (choose_leaf_tries)
-						recurse_tries =
-							choose_leaf_tries;
-					else if (map->chooseleaf_descend_once)
-						recurse_tries = 1;
-					else
-						recurse_tries = choose_tries;
-					osize += crush_choose_firstn(
-						map,
-						cw,
-						map->buckets[bno],
-						weight, weight_max,
-						x, numrep,
-						curstep->arg2,
-						o+osize, j,
-						result_max-osize,
-						choose_tries,
-						recurse_tries,
-						choose_local_retries,
-						choose_local_fallback_retries,
-						recurse_to_leaf,
-						vary_r,
-						stable,
-						c+osize,
-						0,
-						choose_args);
-				} else {
-					out_size = ((numrep < (result_max-osize)) ?
-						    numrep : (result_max-osize));
-					crush_choose_indep(
-						map,
-						cw,
-						map->buckets[bno],
-						weight, weight_max,
-						x, out_size, numrep,
-						curstep->arg2,
-						o+osize, j,
-						choose_tries,
-						choose_leaf_tries ?
-						   choose_leaf_tries : 1,
-						recurse_to_leaf,
-						c+osize,
-						0,
-						choose_args);
-					osize += out_size;
-				}
-			}
-
-			if (recurse_to_leaf)
-				/* copy final _leaf_ values to output set */
-				memcpy(o, c, osize*sizeof(*o));
+			crush_init_choose_step(map, curstep, &p, &choose);
+			wsize = crush_do_choose_step(map, &choose, cw, x,
+						     w, wsize, o, c,
+						     result_max,
+						     weight, weight_max,
+						     choose_args);
 
 			/* swap o and w arrays */
 			tmp = o;
 			o = w;
 			w = tmp;
-			wsize = osize;
 			break;
 
 
@@ -1092,3 +2092,955 @@ int crush_do_rule(const struct crush_map *map,
 
 	return result_len;
 }
+
+/**
+ * crush_do_rule - calculate a mapping with the given input and rule
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: hash input
+ * @result: pointer to result vector
+ * @result_max: maximum result size
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+ */
+int crush_do_rule(const struct crush_map *map,
+		  int ruleno, int x, int *result, int result_max,
+		  const __u32 *weight, int weight_max,
+		  void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_rule_params params;
+
+	if ((__u32)ruleno >= map->max_rules) {
+		dprintk(" bad ruleno %d\n", ruleno);
+		return 0;
+	}
+
+	crush_init_rule_params(map, &params);
+	return crush_do_rule_steps(map, map->rules[ruleno], &params,
+				   x, result, result_max,
+				   weight, weight_max,
+				   cwin, choose_args);
+}
+
+/**
+ * crush_do_rule_batch - calculate the mappings of an array of inputs
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: array of @count hash inputs
+ * @count: number of inputs
+ * @result: result vectors, the one for x[i] starts at result + i * @result_stride
+ * @result_max: maximum result size
+ * @result_stride: distance between two result vectors, >= @result_max
+ * @result_len: if not NULL, result_len[i] is set to the size of the x[i] result
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: Pointer to at least crush_work_size(@map, @result_max) bytes
+ */
+int crush_do_rule_batch(const struct crush_map *map,
+			int ruleno, const int *x, int count,
+			int *result, int result_max, int result_stride,
+			int *result_len,
+			const __u32 *weight, int weight_max,
+			void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_rule_params params;
+	const struct crush_rule *rule;
+	int i, len;
+
+	if ((__u32)ruleno >= map->max_rules) {
+		dprintk(" bad ruleno %d\n", ruleno);
+		return 0;
+	}
+	BUG_ON(result_stride < result_max);
+
+	rule = map->rules[ruleno];
+	crush_init_rule_params(map, &params);
+	for (i = 0; i < count; i++) {
+		len = crush_do_rule_steps(map, rule, &params,
+					  x[i], result, result_max,
+					  weight, weight_max,
+					  cwin, choose_args);
+		if (result_len)
+			result_len[i] = len;
+		result += result_stride;
+	}
+
+	return count;
+}
+
+#ifndef __KERNEL__
+
+enum {
+	CRUSH_PLAN_TAKE,
+	CRUSH_PLAN_CHOOSE,
+	CRUSH_PLAN_EMIT,
+};
+
+struct crush_plan_step {
+	int op;                       /* CRUSH_PLAN_* */
+	int take;                     /* the item of a valid TAKE */
+	struct crush_choose_step choose;
+};
+
+/*
+ * A rule with the SET_* steps folded into the CHOOSE* steps that follow
+ * them and the TAKE steps validated. The steps that do nothing
+ * (invalid TAKE, NOOP, unknown ops) are dropped.
+ */
+struct crush_plan {
+	int take_choose_emit;         /* a single TAKE bucket, CHOOSE*, EMIT */
+	int lockstep;                 /* and FIRSTN over straw2 buckets */
+	__u32 len;
+	struct crush_plan_step steps[0];
+};
+
+/*
+ * true if @id and all the buckets under it are non empty straw2
+ * buckets hashed with rjenkins1, of a type other than 0, and if all
+ * their items are valid devices or buckets: crush_do_lockstep() then
+ * never has to reject an item because of the map itself.
+ */
+static int crush_is_straw2_tree(const struct crush_map *map, int id)
+{
+	__u8 *visited;
+	int *stack;
+	int depth = 0;
+	int ok = 1;
+	__u32 i;
+
+	visited = calloc(map->max_buckets, 1);
+	stack = malloc(sizeof(*stack) * map->max_buckets);
+	if (!visited || !stack) {
+		ok = 0;
+		goto out;
+	}
+	visited[-1-id] = 1;
+	stack[depth++] = id;
+	while (ok && depth > 0) {
+		const struct crush_bucket *b = map->buckets[-1-stack[--depth]];
+
+		if (b->alg != CRUSH_BUCKET_STRAW2 ||
+		    b->hash != CRUSH_HASH_RJENKINS1 ||
+		    b->size == 0 || b->type == 0) {
+			ok = 0;
+			break;
+		}
+		for (i = 0; i < b->size; i++) {
+			int item = b->items[i];
+
+			if (item >= map->max_devices ||
+			    (item < 0 && (-1-item >= map->max_buckets ||
+					  !map->buckets[-1-item]))) {
+				ok = 0;
+				break;
+			}
+			if (item < 0 && !visited[-1-item]) {
+				visited[-1-item] = 1;
+				stack[depth++] = item;
+			}
+		}
+	}
+out:
+	free(visited);
+	free(stack);
+	return ok;
+}
+
+struct crush_plan *crush_compile_rule(const struct crush_map *map,
+				      int ruleno)
+{
+	const struct crush_rule *rule;
+	struct crush_rule_params p;
+	struct crush_plan *plan;
+	struct crush_plan_step *s;
+	__u32 step;
+
+	if ((__u32)ruleno >= map->max_rules || !map->rules[ruleno])
+		return NULL;
+	rule = map->rules[ruleno];
+
+	plan = malloc(sizeof(*plan) + rule->len * sizeof(plan->steps[0]));
+	if (!plan)
+		return NULL;
+	plan->len = 0;
+
+	crush_init_rule_params(map, &p);
+	for (step = 0; step < rule->len; step++) {
+		const struct crush_rule_step *curstep = &rule->steps[step];
+
+		s = &plan->steps[plan->len];
+		switch (curstep->op) {
+		case CRUSH_RULE_TAKE:
+			if (!crush_take_is_valid(map, curstep->arg1))
+				break;
+			s->op = CRUSH_PLAN_TAKE;
+			s->take = curstep->arg1;
+			plan->len++;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_TRIES:
+			if (curstep->arg1 > 0)
+				p.choose_tries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
+			if (curstep->arg1 > 0)
+				p.choose_leaf_tries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
+			if (curstep->arg1 >= 0)
+				p.choose_local_retries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
+			if (curstep->arg1 >= 0)
+				p.choose_local_fallback_retries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
+			if (curstep->arg1 >= 0)
+				p.vary_r = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
+			if (curstep->arg1 >= 0)
+				p.stable = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+		case CRUSH_RULE_CHOOSE_FIRSTN:
+		case CRUSH_RULE_CHOOSELEAF_INDEP:
+		case CRUSH_RULE_CHOOSE_INDEP:
+		case CRUSH_RULE_CHOOSELEAF_TOPK:
+		case CRUSH_RULE_CHOOSE_TOPK:
+			s->op = CRUSH_PLAN_CHOOSE;
+			crush_init_choose_step(map, curstep, &p, &s->choose);
+			plan->len++;
+			break;
+
+		case CRUSH_RULE_EMIT:
+			s->op = CRUSH_PLAN_EMIT;
+			plan->len++;
+			break;
+
+		default:
+			dprintk(" unknown op %d at step %d\n",
+				curstep->op, step);
+			break;
+		}
+	}
+
+	plan->take_choose_emit = plan->len == 3 &&
+		plan->steps[0].op == CRUSH_PLAN_TAKE &&
+		plan->steps[0].take < 0 &&
+		plan->steps[1].op == CRUSH_PLAN_CHOOSE &&
+		!plan->steps[1].choose.topk &&
+		plan->steps[2].op == CRUSH_PLAN_EMIT;
+	plan->lockstep = plan->take_choose_emit &&
+		plan->steps[1].choose.firstn &&
+		crush_is_straw2_tree(map, plan->steps[0].take);
+
+	return plan;
+}
+
+void crush_destroy_plan(struct crush_plan *plan)
+{
+	free(plan);
+}
+
+/*
+ * TAKE bucket, CHOOSE*, EMIT: the items are chosen directly in
+ * @result instead of going through the working vectors.
+ */
+static int crush_do_take_choose_emit(const struct crush_map *map,
+				     const struct crush_plan *plan,
+				     int x, int *result, int result_max,
+				     const __u32 *weight, int weight_max,
+				     struct crush_work *cw,
+				     const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *bucket =
+		map->buckets[-1-plan->steps[0].take];
+	const struct crush_choose_step *s = &plan->steps[1].choose;
+	int *a = (int *)((char *)cw + map->working_size);
+	int *out = s->recurse_to_leaf ? a : result;
+	int *out2 = s->recurse_to_leaf ? result : a;
+	int numrep = s->numrep;
+	int out_size;
+
+	if (numrep <= 0) {
+		numrep += result_max;
+		if (numrep <= 0)
+			return 0;
+	}
+	if (s->firstn)
+		return crush_choose_firstn(map, cw, bucket,
+					   weight, weight_max,
+					   x, numrep, s->type,
+					   out, 0, result_max,
+					   s->tries,
+					   s->recurse_tries,
+					   s->local_retries,
+					   s->local_fallback_retries,
+					   s->recurse_to_leaf,
+					   s->vary_r,
+					   s->stable,
+					   out2, 0, choose_args);
+
+	out_size = numrep < result_max ? numrep : result_max;
+	crush_choose_indep(map, cw, bucket,
+			   weight, weight_max,
+			   x, out_size, numrep, s->type,
+			   out, 0,
+			   s->tries,
+			   s->recurse_tries,
+			   s->recurse_to_leaf,
+			   out2, 0, choose_args);
+	return out_size;
+}
+
+/* the largest result mapped by crush_do_lockstep() */
+#define CRUSH_LOCKSTEP_MAX_RESULT 16
+
+/*
+ * Descend from the buckets @in of the @active lanes until an item of
+ * @type is found and store it in @item. The lanes that find an item
+ * crush_choose_firstn() would reject are removed from @active.
+ */
+static void crush_lockstep_descend(const struct crush_map *map,
+				   const struct crush_bucket **in,
+				   const int *x, int r, int type, int position,
+				   const struct crush_choose_arg *choose_args,
+				   unsigned int *active, int *item)
+{
+	const __s32 *ids[CRUSH_STRAW2_LANES];
+	const __u32 *weights[CRUSH_STRAW2_LANES];
+	__u32 size[CRUSH_STRAW2_LANES];
+	int high[CRUSH_STRAW2_LANES];
+	int lane_high[CRUSH_STRAW2_LANES];
+	unsigned int pending = *active;
+	unsigned int lanes;
+	int l;
+
+	while (pending) {
+		lanes = 0;
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+			const struct crush_bucket_straw2 *b =
+				(const struct crush_bucket_straw2 *)in[l];
+			const struct crush_choose_arg *arg;
+
+			if (!(pending & (1u << l))) {
+				size[l] = 0;
+				continue;
+			}
+			arg = choose_args ? &choose_args[-1-b->h.id] : NULL;
+			ids[l] = get_choose_arg_ids(b, arg);
+			weights[l] = get_choose_arg_weights(b, arg, position);
+			size[l] = b->h.size;
+			/* large buckets are vectorized across their items */
+			if (crush_straw2_simd &&
+			    size[l] >= CRUSH_STRAW2_SIMD_MIN_SIZE) {
+				high[l] = crush_straw2_simd(x[l], r, ids[l],
+							    weights[l],
+							    size[l]);
+				size[l] = 0;
+				lanes &= ~(1u << l);
+			} else {
+				lanes |= 1u << l;
+			}
+		}
+		if (lanes) {
+			crush_straw2_lanes_simd(x, r, ids, weights, size,
+						lane_high);
+			for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+				if (lanes & (1u << l))
+					high[l] = lane_high[l];
+		}
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+			int it;
+
+			if (!(pending & (1u << l)))
+				continue;
+			it = in[l]->items[high[l]];
+			if (it >= 0 && type != 0) {
+				/* a device above the type */
+				*active &= ~(1u << l);
+				pending &= ~(1u << l);
+			} else if (it < 0 && map->buckets[-1-it]->type != type) {
+				in[l] = map->buckets[-1-it];
+			} else {
+				item[l] = it;
+				pending &= ~(1u << l);
+			}
+		}
+	}
+}
+
+/*
+ * crush_do_lockstep - map CRUSH_STRAW2_LANES inputs at once
+ *
+ * For a plan->lockstep plan, run the first attempt of each replica of
+ * crush_choose_firstn() for all the inputs together, so that the
+ * straw2 draws are vectorized across inputs. A lane that collides or
+ * finds an out device would retry: it leaves the lockstep and
+ * crush_choose_firstn() maps its remaining replicas. The results are
+ * the same as crush_do_plan().
+ */
+static void crush_do_lockstep(const struct crush_map *map,
+			      const struct crush_plan *plan,
+			      const int *x, int *result,
+			      int result_max, int result_stride,
+			      int *result_len,
+			      const __u32 *weight, int weight_max,
+			      struct crush_work *cw,
+			      const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *take =
+		map->buckets[-1-plan->steps[0].take];
+	const struct crush_choose_step *s = &plan->steps[1].choose;
+	const struct crush_bucket *in[CRUSH_STRAW2_LANES];
+	int out[CRUSH_STRAW2_LANES][CRUSH_LOCKSTEP_MAX_RESULT];
+	int item[CRUSH_STRAW2_LANES];
+	int leaf[CRUSH_STRAW2_LANES];
+	int done[CRUSH_STRAW2_LANES];
+	unsigned int active = (1u << CRUSH_STRAW2_LANES) - 1;
+	unsigned int leaves, before;
+	int numrep = s->numrep;
+	int reps;
+	int rep, i, l, len;
+
+	if (numrep <= 0)
+		numrep += result_max;
+	reps = numrep < result_max ? numrep : result_max;
+	if (reps <= 0 || reps > CRUSH_LOCKSTEP_MAX_RESULT) {
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+			len = crush_do_take_choose_emit(
+				map, plan, x[l], result + l * result_stride,
+				result_max, weight, weight_max,
+				cw, choose_args);
+			if (result_len)
+				result_len[l] = len;
+		}
+		return;
+	}
+
+	for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+		done[l] = reps;
+	for (rep = 0; rep < reps && active; rep++) {
+		before = active;
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+			in[l] = take;
+		crush_lockstep_descend(map, in, x, rep, s->type, rep,
+				       choose_args, &active, item);
+
+		leaves = 0;
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+			if (!(active & (1u << l)))
+				continue;
+			for (i = 0; i < rep; i++)
+				if (out[l][i] == item[l])
+					active &= ~(1u << l);
+			leaf[l] = item[l];
+			if (s->recurse_to_leaf && item[l] < 0) {
+				in[l] = map->buckets[-1-item[l]];
+				leaves |= 1u << l;
+			}
+		}
+		leaves &= active;
+
+		if (leaves) {
+			int leaf_r = (s->stable ? 0 : rep) +
+				(s->vary_r ? rep >> (s->vary_r - 1) : 0);
+			unsigned int found = leaves;
+
+			crush_lockstep_descend(map, in, x, leaf_r, 0, rep,
+					       choose_args, &found, leaf);
+			active &= ~(leaves & ~found);
+			for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+				int *o = result + l * result_stride;
+
+				if (!(found & (1u << l)))
+					continue;
+				for (i = 0; i < rep; i++)
+					if (o[i] == leaf[l])
+						active &= ~(1u << l);
+			}
+		}
+
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+			if (!(active & (1u << l)))
+				continue;
+			if (leaf[l] >= 0 &&
+			    is_out(map, cw, weight, weight_max, leaf[l], x[l])) {
+				active &= ~(1u << l);
+				continue;
+			}
+			out[l][rep] = item[l];
+			result[l * result_stride + rep] =
+				s->recurse_to_leaf ? leaf[l] : item[l];
+		}
+		for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+			if ((before & ~active) & (1u << l))
+				done[l] = rep;
+	}
+
+	for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+		int *o = result + l * result_stride;
+		int *a = (int *)((char *)cw + map->working_size);
+
+		len = done[l];
+		if (!(active & (1u << l))) {
+			/* the first done[l] replicas are in out[l] and o */
+			if (s->recurse_to_leaf)
+				memcpy(a, out[l], sizeof(int) * done[l]);
+			len = crush_choose_firstn(map, cw, take,
+						  weight, weight_max,
+						  x[l], numrep, s->type,
+						  s->recurse_to_leaf ? a : o,
+						  done[l],
+						  result_max - done[l],
+						  s->tries,
+						  s->recurse_tries,
+						  s->local_retries,
+						  s->local_fallback_retries,
+						  s->recurse_to_leaf,
+						  s->vary_r,
+						  s->stable,
+						  s->recurse_to_leaf ? o : a,
+						  0, choose_args);
+		}
+		if (result_len)
+			result_len[l] = len;
+	}
+}
+
+int crush_do_plan(const struct crush_map *map,
+		  const struct crush_plan *plan,
+		  int x, int *result, int result_max,
+		  const __u32 *weight, int weight_max,
+		  void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_work *cw = cwin;
+	int result_len;
+	int *a = (int *)((char *)cw + map->working_size);
+	int *b = a + result_max;
+	int *c = b + result_max;
+	int *w = a;
+	int *o = b;
+	int wsize = 0;
+	int *tmp;
+	__u32 step;
+	int i;
+
+	if (plan->take_choose_emit)
+		return crush_do_take_choose_emit(map, plan, x,
+						 result, result_max,
+						 weight, weight_max,
+						 cw, choose_args);
+
+	result_len = 0;
+	for (step = 0; step < plan->len; step++) {
+		const struct crush_plan_step *s = &plan->steps[step];
+
+		switch (s->op) {
+		case CRUSH_PLAN_TAKE:
+			w[0] = s->take;
+			wsize = 1;
+			break;
+
+		case CRUSH_PLAN_CHOOSE:
+			if (wsize == 0)
+				break;
+			wsize = crush_do_choose_step(map, &s->choose, cw, x,
+						     w, wsize, o, c,
+						     result_max,
+						     weight, weight_max,
+						     choose_args);
+			/* swap o and w arrays */
+			tmp = o;
+			o = w;
+			w = tmp;
+			break;
+
+		case CRUSH_PLAN_EMIT:
+			for (i = 0; i < wsize && result_len < result_max; i++) {
+				result[result_len] = w[i];
+				result_len++;
+			}
+			wsize = 0;
+			break;
+		}
+	}
+
+	return result_len;
+}
+
+int crush_do_plan_batch(const struct crush_map *map,
+			const struct crush_plan *plan,
+			const int *x, int count,
+			int *result, int result_max, int result_stride,
+			int *result_len,
+			const __u32 *weight, int weight_max,
+			void *cwin,
+			const struct crush_choose_arg *choose_args)
+{
+	struct crush_work *cw = cwin;
+	int i = 0;
+	int len;
+
+	/* the lockstep mapper does not count or record */
+	if (plan->lockstep && crush_straw2_lanes_simd &&
+	    !cw->stats && !cw->trace) {
+		for (; i + CRUSH_STRAW2_LANES <= count;
+		     i += CRUSH_STRAW2_LANES) {
+			crush_do_lockstep(map, plan, x + i, result,
+					  result_max, result_stride,
+					  result_len ? result_len + i : NULL,
+					  weight, weight_max, cw, choose_args);
+			result += CRUSH_STRAW2_LANES * result_stride;
+		}
+	}
+	for (; i < count; i++) {
+		len = crush_do_plan(map, plan, x[i],
+				    result, result_max,
+				    weight, weight_max,
+				    cwin, choose_args);
+		if (result_len)
+			result_len[i] = len;
+		result += result_stride;
+	}
+	return count;
+}
+
+/* true if @item is @bucket or is below it */
+static int crush_subtree_contains(const struct crush_map *map,
+				  int bucket, int item)
+{
+	const struct crush_bucket *b;
+	__u32 i;
+
+	if (bucket == item)
+		return 1;
+	if (bucket >= 0 || -1-bucket >= map->max_buckets)
+		return 0;
+	b = map->buckets[-1-bucket];
+	for (i = 0; b && i < b->size; i++)
+		if (crush_subtree_contains(map, b->items[i], item))
+			return 1;
+	return 0;
+}
+
+/* true if no device at or below @item can be chosen for @x */
+static int crush_subtree_is_out(const struct crush_map *map,
+				const struct crush_work *work,
+				const __u32 *weight, int weight_max,
+				int item, int x)
+{
+	const struct crush_bucket *b;
+	__u32 i;
+
+	if (item >= 0)
+		return item >= map->max_devices ||
+			is_out(map, work, weight, weight_max, item, x);
+	if (-1-item >= map->max_buckets)
+		return 1;
+	b = map->buckets[-1-item];
+	for (i = 0; b && i < b->size; i++)
+		if (!crush_subtree_is_out(map, work, weight, weight_max,
+					  b->items[i], x))
+			return 0;
+	return 1;
+}
+
+/*
+ * The item of @type crush_choose_indep() draws from @bucket for the
+ * position @rep at the attempt @ftotal. CRUSH_ITEM_UNDEF if it finds
+ * an empty bucket (the position is tried again) and CRUSH_ITEM_NONE
+ * if it finds a bad item (the position is given up). The r of the
+ * last draw is stored in @rp.
+ */
+static int crush_indep_draw(const struct crush_map *map,
+			    struct crush_work *work,
+			    const struct crush_bucket *bucket,
+			    int type, int x, int numrep, int rep,
+			    unsigned int ftotal, int *rp,
+			    const struct crush_choose_arg *choose_args)
+{
+	const struct crush_bucket *in = bucket;
+	int item;
+	int itemtype;
+	int r;
+
+	for (;;) {
+		r = rep;
+		if (in->alg == CRUSH_BUCKET_UNIFORM &&
+		    in->size % numrep == 0)
+			r += (numrep+1) * ftotal;
+		else
+			r += numrep * ftotal;
+		*rp = r;
+
+		if (in->size == 0) {
+			crush_stat(work, rejects);
+			return CRUSH_ITEM_UNDEF;
+		}
+
+		item = crush_bucket_choose(
+			in, work, x, r,
+			(choose_args ? &choose_args[-1-in->id] : 0), 0);
+		crush_stat(work, descents);
+		crush_trace_choice(work, in->id, item);
+		if (item >= map->max_devices) {
+			crush_stat(work, rejects);
+			return CRUSH_ITEM_NONE;
+		}
+
+		if (item < 0)
+			itemtype = map->buckets[-1-item]->type;
+		else
+			itemtype = 0;
+		if (itemtype == type)
+			return item;
+		if (item >= 0 || (-1-item) >= map->max_buckets) {
+			crush_stat(work, rejects);
+			return CRUSH_ITEM_NONE;
+		}
+		in = map->buckets[-1-item];
+	}
+}
+
+/*
+ * True if the kept position @rep chose @item, which it holds, during
+ * one of its first @attempts attempts. The first attempt that draws
+ * @item chooses it if it finds a leaf: with higher weights, it found
+ * one too.
+ */
+static int crush_repair_held(const struct crush_map *map,
+			     struct crush_work *work,
+			     const struct crush_bucket *bucket,
+			     const struct crush_choose_step *s,
+			     const __u32 *weight, int weight_max,
+			     int x, int numrep, int *result,
+			     int rep, int item, unsigned int attempts,
+			     const struct crush_choose_arg *choose_args)
+{
+	unsigned int ftotal;
+	int kept = result[rep];
+	int r;
+
+	for (ftotal = 0; ftotal < attempts; ftotal++) {
+		if (crush_indep_draw(map, work, bucket, s->type, x, numrep,
+				     rep, ftotal, &r, choose_args) != item)
+			continue;
+		if (!s->recurse_to_leaf || item >= 0)
+			return 1;
+		crush_choose_leaf_indep(map, work, map->buckets[-1-item],
+					weight, weight_max, x, numrep,
+					result, rep, s->recurse_tries,
+					r, choose_args);
+		if (result[rep] != CRUSH_ITEM_NONE) {
+			result[rep] = kept;
+			return 1;
+		}
+		result[rep] = kept;
+	}
+	return 0;
+}
+
+/*
+ * crush_repair_indep - crush_choose_indep() for some positions only
+ *
+ * The @size items of @result were chosen by crush_choose_indep() with
+ * weights greater or equal to @weight. Choose again the positions in
+ * @repair, the positions whose item is now out and the positions that
+ * have no item, with the same r sequence and keeping the other items.
+ *
+ * crush_choose_indep() would keep them too unless a repaired position
+ * draws one of them before its position does, or one of them was
+ * rejected because a repaired position held an item it no longer
+ * holds. The first is seen while repairing, the second cannot happen
+ * if the item given up is out (for chooseleaf, all the devices of its
+ * bucket). Otherwise return -1 and leave @result undefined: only a
+ * full mapping is exact.
+ */
+static int crush_repair_indep(const struct crush_map *map,
+			      struct crush_work *work,
+			      const struct crush_bucket *bucket,
+			      const struct crush_choose_step *s,
+			      const __u32 *weight, int weight_max,
+			      int x, int numrep, int *result, int size,
+			      __u64 repair,
+			      const struct crush_choose_arg *choose_args)
+{
+	int *out = (int *)((char *)work + map->working_size);
+	int *old = out + size;   /* @result as given */
+	int *host = old + size;  /* the item drawn when old[rep] was chosen */
+	int leaf = s->recurse_to_leaf && s->type != 0;
+	int left = 0;
+	unsigned int ftotal;
+	int rep, q;
+	int r;
+	int item;
+
+	for (rep = 0; rep < size; rep++) {
+		old[rep] = result[rep];
+		host[rep] = CRUSH_ITEM_NONE;
+		if (result[rep] < 0 ||
+		    is_out(map, work, weight, weight_max, result[rep], x))
+			repair |= (__u64)1 << rep;
+		if (repair & ((__u64)1 << rep)) {
+			out[rep] = CRUSH_ITEM_UNDEF;
+			result[rep] = CRUSH_ITEM_UNDEF;
+			left++;
+		} else {
+			/* the buckets of the kept leaves are not known */
+			out[rep] = leaf ? CRUSH_ITEM_NONE : old[rep];
+		}
+	}
+
+	for (ftotal = 0; left > 0 && ftotal < s->tries; ftotal++) {
+		for (rep = 0; rep < size; rep++) {
+			if (out[rep] != CRUSH_ITEM_UNDEF)
+				continue;
+
+			item = crush_indep_draw(map, work, bucket, s->type,
+						x, numrep, rep, ftotal, &r,
+						choose_args);
+			if (item == CRUSH_ITEM_UNDEF)
+				continue;
+			if (item == CRUSH_ITEM_NONE) {
+				out[rep] = CRUSH_ITEM_NONE;
+				result[rep] = CRUSH_ITEM_NONE;
+				left--;
+				continue;
+			}
+
+			/* the attempt that chose old[rep] before */
+			if (host[rep] == CRUSH_ITEM_NONE && old[rep] >= 0 &&
+			    crush_subtree_contains(map, item, old[rep]))
+				host[rep] = item;
+
+			/* collision? */
+			for (q = 0; q < size; q++)
+				if (out[q] == item ||
+				    (leaf && !(repair & ((__u64)1 << q)) &&
+				     crush_subtree_contains(map, item, old[q])))
+					break;
+			if (q < size) {
+				/*
+				 * Until old[rep] is drawn again, a kept item
+				 * drawn was already held by its position:
+				 * it would have been chosen otherwise.
+				 */
+				if (!(repair & ((__u64)1 << q)) &&
+				    host[rep] != CRUSH_ITEM_NONE &&
+				    !crush_repair_held(map, work, bucket, s,
+						       weight, weight_max,
+						       x, numrep, result,
+						       q, item,
+						       ftotal + (q < rep),
+						       choose_args))
+					return -1;
+				crush_stat(work, collisions);
+				continue;
+			}
+
+			if (leaf) {
+				crush_choose_leaf_indep(map, work,
+							map->buckets[-1-item],
+							weight, weight_max,
+							x, numrep,
+							result, rep,
+							s->recurse_tries,
+							r, choose_args);
+				if (result[rep] == CRUSH_ITEM_NONE) {
+					crush_stat(work, rejects);
+					continue;
+				}
+			} else if (is_out(map, work, weight, weight_max,
+					  item, x)) {
+				crush_stat(work, is_out);
+				continue;
+			}
+
+			out[rep] = item;
+			if (!leaf)
+				result[rep] = item;
+			left--;
+		}
+	}
+	crush_stat_tries(work, ftotal);
+
+	for (rep = 0; rep < size; rep++) {
+		if (out[rep] == CRUSH_ITEM_UNDEF) {
+			out[rep] = CRUSH_ITEM_NONE;
+			result[rep] = CRUSH_ITEM_NONE;
+		}
+		/* an item given up must not be chosen by another position */
+		if (!(repair & ((__u64)1 << rep)) || old[rep] < 0 ||
+		    result[rep] == old[rep])
+			continue;
+		if (leaf ? host[rep] == CRUSH_ITEM_NONE ||
+		    !crush_subtree_is_out(map, work, weight, weight_max,
+					  host[rep], x) :
+		    !is_out(map, work, weight, weight_max, old[rep], x))
+			return -1;
+	}
+	return 0;
+}
+
+int crush_do_plan_repair(const struct crush_map *map,
+			 const struct crush_plan *plan,
+			 int x, int *result, int result_max,
+			 __u64 failed,
+			 const __u32 *weight, int weight_max,
+			 void *cwin, const struct crush_choose_arg *choose_args)
+{
+	const struct crush_choose_step *s;
+	int numrep, size;
+	int r = -1;
+
+	if (plan->take_choose_emit && !plan->steps[1].choose.firstn) {
+		s = &plan->steps[1].choose;
+		numrep = s->numrep;
+		if (numrep <= 0)
+			numrep += result_max;
+		size = numrep < result_max ? numrep : result_max;
+		if (size <= 0)
+			r = 0;
+		else if (!s->recurse_to_leaf && s->type != 0)
+			/* no device is chosen, the weights are not used */
+			r = size;
+		else if (size <= 64)
+			r = crush_repair_indep(
+				map, cwin, map->buckets[-1-plan->steps[0].take],
+				s, weight, weight_max, x, numrep,
+				result, size, failed, choose_args) ?
+				-1 : size;
+	}
+	if (r < 0)
+		r = crush_do_plan(map, plan, x, result, result_max,
+				  weight, weight_max, cwin, choose_args);
+	return r;
+}
+
+int crush_do_rule_repair(const struct crush_map *map,
+			 int ruleno, int x, int *result, int result_max,
+			 __u64 failed,
+			 const __u32 *weight, int weight_max,
+			 void *cwin, const struct crush_choose_arg *choose_args)
+{
+	struct crush_plan *plan = crush_compile_rule(map, ruleno);
+	int r;
+
+	if (!plan)
+		return crush_do_rule(map, ruleno, x, result, result_max,
+				     weight, weight_max, cwin, choose_args);
+	r = crush_do_plan_repair(map, plan, x, result, result_max, failed,
+				 weight, weight_max, cwin, choose_args);
+	crush_destroy_plan(plan);
+	return r;
+}
+#endif
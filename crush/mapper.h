@@ -77,6 +77,50 @@ extern int crush_do_rule(const struct crush_map *map,
 			 int x, int *result, int result_max,
 			 const __u32 *weights, int weight_max,
 			 void *cwin, const struct crush_choose_arg *choose_args);
+/** @ingroup API
+ *
+ * Map each of the __count__ values of the __x__ array with the rule
+ * __ruleno__, as if crush_do_rule() was called for each of them with
+ * the same __map__, __weights__, __cwin__ and __choose_args__
+ * arguments. The results are bit-identical to such a loop but the
+ * rule and the tunables are only looked up once for the whole batch.
+ *
+ * The rule is not compiled: to map many batches with the same rule,
+ * compile it once with crush_compile_rule() and call
+ * crush_do_plan_batch() instead.
+ *
+ * The __result_max__ items found for __x[i]__ are stored in the
+ * __result__ array, starting at __result + i * result_stride__. The
+ * __result_stride__ must be greater or equal to __result_max__. If
+ * __result_len__ is not NULL, __result_len[i]__ is set to the value
+ * crush_do_rule() would return for __x[i]__.
+ *
+ * The __cwin__ argument must be initialized as explained in
+ * crush_do_rule() and is reused for every input of the batch.
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the array of values to map
+ * @param count the size of the __x__ array
+ * @param result an array of at least __count * result_stride__ items
+ * @param result_max the maximum number of items mapped to each value
+ * @param result_stride the distance between two result vectors
+ * @param result_len an array of size __count__ or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return 0 on error or __count__ on success
+ */
+extern int crush_do_rule_batch(const struct crush_map *map,
+			       int ruleno,
+			       const int *x, int count,
+			       int *result, int result_max, int result_stride,
+			       int *result_len,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
 
 /* Returns the exact amount of workspace that will need to be used
    for a given combination of crush_map and result_max. The caller can
@@ -90,4 +134,323 @@ static inline size_t crush_work_size(const struct crush_map *map,
 
 extern void crush_init_workspace(const struct crush_map *m, void *v);
 
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * Attach __stats__ to the workspace __cwin__ so that the mapper adds
+ * to its counters each time __cwin__ is used. crush_init_workspace()
+ * detaches the statistics, which is also done by setting __stats__ to
+ * NULL. The counters are not reset: the caller must zero a crush_stats
+ * before it is used for the first time.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param stats NULL or the counters to update
+ */
+extern void crush_work_set_stats(void *cwin, struct crush_stats *stats);
+
+/** @ingroup API
+ *
+ * Attach __trace__ to the workspace __cwin__ so that the mapper
+ * records the buckets and devices it visits each time __cwin__ is
+ * used. crush_init_workspace() detaches the trace, which is also done
+ * by setting __trace__ to NULL.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param trace NULL or where the visited items are recorded
+ */
+extern void crush_work_set_trace(void *cwin, struct crush_trace *trace);
+
+/** @ingroup API
+ *
+ * Prepare __devices__ for the weight vector __weights__ of size
+ * __weight_max__: the state of each device (in, out or partially
+ * in) is computed once so that the mapper does not need to look at
+ * the weight of a device that is fully in or fully out. The table is
+ * computed again on each call, reusing the memory of the previous
+ * one. It must be called again each time __weights__ is modified.
+ *
+ * __devices__ must be zeroed before it is prepared for the first time
+ * and deallocated with crush_device_state_destroy().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param devices the table to prepare
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ *
+ * @returns 1 when the table is computed, < 0 on error
+ */
+extern int crush_device_state_prepare(struct crush_device_state *devices,
+				      const __u32 *weights, int weight_max);
+
+/** @ingroup API
+ *
+ * Deallocate the table of __devices__ and zero it.
+ *
+ * @param devices a table prepared by crush_device_state_prepare()
+ */
+extern void crush_device_state_destroy(struct crush_device_state *devices);
+
+/** @ingroup API
+ *
+ * Attach __devices__ to the workspace __cwin__ so that the mapper
+ * uses it instead of the weights, when it is given the same
+ * __weights__ and __weight_max__ __devices__ was prepared from. The
+ * mapping results are the same with or without it.
+ * crush_init_workspace() detaches the table, which is also done by
+ * setting __devices__ to NULL.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param devices NULL or a table prepared by crush_device_state_prepare()
+ */
+extern void crush_work_set_device_state(void *cwin,
+					const struct crush_device_state *devices);
+
+/** @ingroup API
+ *
+ * Prepare __reciprocals__ for the weight sets of __choose_args__, an
+ * array of __max_buckets__ elements as returned by
+ * crush_make_choose_args() or crush_decode(), so that the mapper can
+ * replace the divisions of the straw2 draws by multiplications (see
+ * crush_set_reciprocal()). A bucket whose weight sets do not all have
+ * the same size is left out and its draws are divided. The table is
+ * computed again on each call, reusing the memory of the previous
+ * one. It should be called again each time the weight sets are
+ * modified: the weights that no longer match their reciprocal are
+ * divided.
+ *
+ * __reciprocals__ must be zeroed before it is prepared for the first
+ * time and deallocated with crush_choose_reciprocals_destroy().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param reciprocals the table to prepare
+ * @param choose_args weights and ids for each known bucket
+ * @param max_buckets the size of the __choose_args__ array
+ *
+ * @returns 1 when the table is computed, < 0 on error
+ */
+extern int crush_choose_reciprocals_prepare(
+	struct crush_choose_reciprocals *reciprocals,
+	const struct crush_choose_arg *choose_args, int max_buckets);
+
+/** @ingroup API
+ *
+ * Deallocate the table of __reciprocals__ and zero it.
+ *
+ * @param reciprocals a table prepared by crush_choose_reciprocals_prepare()
+ */
+extern void crush_choose_reciprocals_destroy(
+	struct crush_choose_reciprocals *reciprocals);
+
+/** @ingroup API
+ *
+ * Attach __reciprocals__ to the workspace __cwin__ so that the mapper
+ * uses them when it is given the __choose_args__ they were prepared
+ * from. Without it, the weight sets of all __choose_args__ are
+ * divided. The mapping results are the same with or without it.
+ * crush_init_workspace() detaches the table, which is also done by
+ * setting __reciprocals__ to NULL.
+ *
+ * @param cwin a workspace initialized by crush_init_workspace()
+ * @param reciprocals NULL or a table prepared by crush_choose_reciprocals_prepare()
+ */
+extern void crush_work_set_choose_reciprocals(
+	void *cwin, const struct crush_choose_reciprocals *reciprocals);
+
+/** @ingroup API
+ *
+ * Add the counters of __other__ to the counters of __stats__, for
+ * instance to sum the statistics gathered by each thread.
+ *
+ * @param stats the counters to update
+ * @param other the counters to add
+ */
+extern void crush_stats_merge(struct crush_stats *stats,
+			      const struct crush_stats *other);
+
+/*
+ * A rule compiled by crush_compile_rule(). Opaque, userspace only.
+ */
+struct crush_plan;
+
+/** @ingroup API
+ *
+ * Compile the rule __ruleno__ of __map__ into an execution plan for
+ * crush_do_plan(). The SET_* steps are folded with the tunables of
+ * __map__ into the CHOOSE* steps they apply to, the TAKE steps are
+ * validated and the steps that have no effect are removed, so that
+ * crush_do_plan() does not interpret the rule again for each value.
+ * A rule made of a single TAKE, CHOOSE* and EMIT, which is the most
+ * common, is mapped directly in the result.
+ *
+ * The plan is only valid for __map__ as it was when compiled: it must
+ * be compiled again if the rule or the tunables are modified. It must
+ * be deallocated with crush_destroy_plan().
+ *
+ * - return NULL if __ruleno__ is not a rule of __map__
+ * - return NULL if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ *
+ * @returns the plan or NULL
+ */
+extern struct crush_plan *crush_compile_rule(const struct crush_map *map,
+					     int ruleno);
+
+/** @ingroup API
+ *
+ * Map __x__ with the rule compiled in __plan__. The arguments and the
+ * return value are the same as crush_do_rule() and the __result__ is
+ * identical to what crush_do_rule() would store for the rule the
+ * __plan__ was compiled from.
+ *
+ * @param map the crush_map the __plan__ was compiled from
+ * @param plan the value returned by crush_compile_rule()
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return the number of items in __result__
+ */
+extern int crush_do_plan(const struct crush_map *map,
+			 const struct crush_plan *plan,
+			 int x, int *result, int result_max,
+			 const __u32 *weights, int weight_max,
+			 void *cwin,
+			 const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Deallocate a plan returned by crush_compile_rule().
+ *
+ * @param plan the plan or NULL
+ */
+extern void crush_destroy_plan(struct crush_plan *plan);
+
+/** @ingroup API
+ *
+ * Map each of the __count__ values of the __x__ array with the rule
+ * compiled in __plan__. The arguments and the return value are the
+ * same as crush_do_rule_batch() and the results are identical to
+ * what crush_do_plan() would store for each value. The __plan__ is
+ * not modified and can be shared by threads that each have their
+ * own __cwin__.
+ *
+ * When the rule is a TAKE, a CHOOSE_FIRSTN or CHOOSELEAF_FIRSTN and
+ * an EMIT over straw2 buckets and the CPU has vector instructions,
+ * the values are mapped in groups of CRUSH_STRAW2_LANES, each straw2
+ * draw being computed for all the values of the group at once. A
+ * value that needs to retry (collision, out device) leaves its group
+ * and is mapped alone. This is not done if statistics or a trace are
+ * attached to __cwin__.
+ *
+ * @param map the crush_map the __plan__ was compiled from
+ * @param plan the value returned by crush_compile_rule()
+ * @param x the array of values to map
+ * @param count the size of the __x__ array
+ * @param result an array of at least __count * result_stride__ items
+ * @param result_max the maximum number of items mapped to each value
+ * @param result_stride the distance between two result vectors
+ * @param result_len an array of size __count__ or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return __count__
+ */
+extern int crush_do_plan_batch(const struct crush_map *map,
+			       const struct crush_plan *plan,
+			       const int *x, int count,
+			       int *result, int result_max, int result_stride,
+			       int *result_len,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Update the __result__ of crush_do_rule() for __x__ after some
+ * devices were marked out, without mapping __x__ again when possible.
+ * On return, __result__ is what crush_do_rule() would store with the
+ * new __weights__ and the return value is what it would return.
+ *
+ * __result__ must contain the items crush_do_rule() stored for the
+ * same __map__, __ruleno__, __x__, __result_max__ and __choose_args__
+ * and weights that are all greater or equal to __weights__. The bit
+ * __i__ of __failed__ is set if the device in __result[i]__ is now out.
+ * The positions whose device is now out or that have no device
+ * (::CRUSH_ITEM_NONE) are also repaired when they are not in __failed__.
+ *
+ * When the rule is a TAKE, a CHOOSE_INDEP or CHOOSELEAF_INDEP and an
+ * EMIT, only the repaired positions are chosen again, with the same
+ * r sequence as crush_do_rule(). crush_do_rule() would not always
+ * keep the other positions: it moves one of them if a repaired
+ * position now draws its item, or if the item it drew before was
+ * only rejected because a repaired position held it. When it cannot
+ * rule that out, crush_do_rule_repair() maps __x__ with
+ * crush_do_rule() instead. This happens when a device is
+ * marked out but other devices of its bucket of the chooseleaf type
+ * are still in. Other rules, and rules that map more than 64 items,
+ * are always mapped again.
+ *
+ * The __cwin__ argument must be initialized as explained in
+ * crush_do_rule(). The rule is compiled with crush_compile_rule() on
+ * each call: to repair many values, compile it once and call
+ * crush_do_plan_repair() instead.
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value mapped to __result__
+ * @param result the previous result, replaced by the new one
+ * @param result_max the size of the __result__ array
+ * @param failed a mask of the positions of __result__ to repair
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return the number of items in __result__
+ */
+extern int crush_do_rule_repair(const struct crush_map *map,
+				int ruleno, int x,
+				int *result, int result_max,
+				__u64 failed,
+				const __u32 *weights, int weight_max,
+				void *cwin,
+				const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Same as crush_do_rule_repair() with the rule compiled in __plan__.
+ * Values that cannot be repaired are mapped with crush_do_plan().
+ *
+ * @param map the crush_map the __plan__ was compiled from
+ * @param plan the value returned by crush_compile_rule()
+ * @param x the value mapped to __result__
+ * @param result the previous result, replaced by the new one
+ * @param result_max the size of the __result__ array
+ * @param failed a mask of the positions of __result__ to repair
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be an char array initialized by crush_init_workspace
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @return the number of items in __result__
+ */
+extern int crush_do_plan_repair(const struct crush_map *map,
+				const struct crush_plan *plan, int x,
+				int *result, int result_max,
+				__u64 failed,
+				const __u32 *weights, int weight_max,
+				void *cwin,
+				const struct crush_choose_arg *choose_args);
+#endif
+
 #endif
@@ -0,0 +1,445 @@
+#include "crush_compat.h"
+#include "crush.h"
+#include "hash.h"
+#include "crush_ln_full.h"
+#include "mapper_simd.h"
+
+/*
+ * The straw2 draw of an item is ln(u)/w where u is 16 bits of
+ * hash(x, id, r) and w the item weight: see bucket_straw2_choose() in
+ * mapper.c. The kernels below compute it for 8 or 16 items at once:
+ *
+ * - hash the items in 32 bits lanes
+ * - gather crush_ln(u) - 0x1000000000000 from crush_ln_full
+ * - divide the (negated) ln by the weight in double precision. The
+ *   dividend is < 2^49 and the divisor < 2^32, both are exact and
+ *   the correctly rounded quotient is either the integer quotient or
+ *   one more. A multiplication tells which.
+ * - keep, for each lane, the highest draw and the index of the first
+ *   item that reached it. Zero weight items draw S64_MIN.
+ *
+ * The lanes are then reduced to the highest draw with the lowest
+ * index, which is what the scalar loop finds.
+ */
+
+int crush_straw2_scalar(int x, int r, const __s32 *ids,
+			const __u32 *weights, __u32 size)
+{
+	unsigned int i, high = 0;
+	unsigned int u;
+	__s64 ln, draw, high_draw = 0;
+
+	for (i = 0; i < size; i++) {
+		if (weights[i]) {
+			u = crush_hash32_3(CRUSH_HASH_RJENKINS1, x, ids[i], r);
+			u &= 0xffff;
+			ln = crush_ln_full[u];
+			draw = div64_s64(ln, weights[i]);
+		} else {
+			draw = S64_MIN;
+		}
+		if (i == 0 || draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+	return high;
+}
+
+void crush_straw2_lanes_scalar(const __s32 *x, int r,
+			       const __s32 *const *ids,
+			       const __u32 *const *weights,
+			       const __u32 *size, int *high)
+{
+	int l;
+
+	for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+		high[l] = size[l] ?
+			crush_straw2_scalar(x[l], r, ids[l], weights[l],
+					    size[l]) : 0;
+}
+
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+
+/*
+ * Transpose the items at index __i__ of the buckets of the lanes into
+ * __ids__ and __weights__. The lanes whose bucket is smaller get a
+ * zero weight, which never wins a draw.
+ */
+static inline void gather_lanes(__u32 i, const __s32 *const *ids,
+				const __u32 *const *weights,
+				const __u32 *size,
+				__s32 *lane_ids, __u32 *lane_weights)
+{
+	int l;
+
+	for (l = 0; l < CRUSH_STRAW2_LANES; l++) {
+		if (i < size[l]) {
+			lane_ids[l] = ids[l][i];
+			lane_weights[l] = weights[l][i];
+		} else {
+			lane_ids[l] = 0;
+			lane_weights[l] = 0;
+		}
+	}
+}
+
+static __u32 max_size(const __u32 *size)
+{
+	__u32 max = 0;
+	int l;
+
+	for (l = 0; l < CRUSH_STRAW2_LANES; l++)
+		if (size[l] > max)
+			max = size[l];
+	return max;
+}
+
+static int reduce_lanes(const __s64 *draw, const __s64 *index, int lanes)
+{
+	__s64 high_draw = S64_MIN;
+	__s64 high = 0;
+	int i;
+
+	for (i = 0; i < lanes; i++) {
+		if (draw[i] > high_draw ||
+		    (draw[i] == high_draw && draw[i] != S64_MIN &&
+		     index[i] < high)) {
+			high_draw = draw[i];
+			high = index[i];
+		}
+	}
+	/* if all items have a zero weight the first one wins */
+	return high_draw == S64_MIN ? 0 : (int)high;
+}
+
+/* AVX2 */
+
+int crush_straw2_avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+/* 2^52 + v is exact in double precision for v < 2^52 */
+#define CRUSH_2_52 0x4330000000000000ll
+
+static inline CRUSH_TARGET_AVX2
+__m256i mul64_avx2(__m256i a, __m256i b)
+{
+	/* low 64 bits of a * b, b < 2^32 */
+	return _mm256_add_epi64(
+		_mm256_mul_epu32(a, b),
+		_mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+				  32));
+}
+
+static inline CRUSH_TARGET_AVX2
+__m256d u64_to_pd_avx2(__m256i v)
+{
+	return _mm256_sub_pd(
+		_mm256_castsi256_pd(_mm256_or_si256(
+			v, _mm256_set1_epi64x(CRUSH_2_52))),
+		_mm256_castsi256_pd(_mm256_set1_epi64x(CRUSH_2_52)));
+}
+
+/* draws of 4 items: u is 16 bits of the hash, 32 bits lanes */
+static inline CRUSH_TARGET_AVX2
+__m256i draw4_avx2(__m128i u, __m128i w)
+{
+	__m256i n, w64, wzero, q, qw;
+	__m256d qd;
+
+	/* n = -(crush_ln(u) - 0x1000000000000) */
+	n = _mm256_sub_epi64(_mm256_setzero_si256(),
+			     _mm256_i32gather_epi64((const long long *)crush_ln_full,
+						    u, 8));
+
+	w64 = _mm256_cvtepu32_epi64(w);
+	wzero = _mm256_cmpeq_epi64(w64, _mm256_setzero_si256());
+	w64 = _mm256_or_si256(w64, _mm256_and_si256(
+				      wzero, _mm256_set1_epi64x(1)));
+
+	qd = _mm256_round_pd(_mm256_div_pd(u64_to_pd_avx2(n),
+					   u64_to_pd_avx2(w64)),
+			     _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+	q = _mm256_sub_epi64(
+		_mm256_castpd_si256(_mm256_add_pd(
+			qd,
+			_mm256_castsi256_pd(_mm256_set1_epi64x(CRUSH_2_52)))),
+		_mm256_set1_epi64x(CRUSH_2_52));
+	qw = mul64_avx2(q, w64);
+	/* the rounded quotient was one too many */
+	q = _mm256_add_epi64(q, _mm256_cmpgt_epi64(qw, n));
+
+	return _mm256_blendv_epi8(_mm256_sub_epi64(_mm256_setzero_si256(), q),
+				  _mm256_set1_epi64x(S64_MIN), wzero);
+}
+
+int CRUSH_TARGET_AVX2 crush_straw2_avx2(int x, int r, const __s32 *ids,
+					const __u32 *weights, __u32 size)
+{
+	__m256i vx = _mm256_set1_epi32(x);
+	__m256i vr = _mm256_set1_epi32(r);
+	__m256i high_draw[2], high[2], index[2];
+	__s64 draws[8] __attribute__((aligned(32)));
+	__s64 indexes[8] __attribute__((aligned(32)));
+	__s32 tail_ids[8];
+	__u32 tail_weights[8];
+	__u32 i;
+	int h;
+
+	for (h = 0; h < 2; h++) {
+		high_draw[h] = _mm256_set1_epi64x(S64_MIN);
+		high[h] = _mm256_setzero_si256();
+		index[h] = _mm256_set_epi64x(4 * h + 3, 4 * h + 2,
+					     4 * h + 1, 4 * h);
+	}
+
+	for (i = 0; i < size; i += 8) {
+		__m256i vids, vw, u;
+		const __s32 *pids = ids + i;
+		const __u32 *pw = weights + i;
+
+		if (size - i < 8) {
+			memset(tail_ids, 0, sizeof(tail_ids));
+			memset(tail_weights, 0, sizeof(tail_weights));
+			memcpy(tail_ids, pids, (size - i) * sizeof(*pids));
+			memcpy(tail_weights, pw, (size - i) * sizeof(*pw));
+			pids = tail_ids;
+			pw = tail_weights;
+		}
+		vids = _mm256_loadu_si256((const __m256i *)pids);
+		vw = _mm256_loadu_si256((const __m256i *)pw);
+
+		u = crush_hash32_rjenkins1_3_avx2(vx, vids, vr);
+		u = _mm256_and_si256(u, _mm256_set1_epi32(0xffff));
+
+		for (h = 0; h < 2; h++) {
+			__m256i draw, better;
+
+			draw = draw4_avx2(
+				h ? _mm256_extracti128_si256(u, 1) :
+				    _mm256_castsi256_si128(u),
+				h ? _mm256_extracti128_si256(vw, 1) :
+				    _mm256_castsi256_si128(vw));
+			better = _mm256_cmpgt_epi64(draw, high_draw[h]);
+			high_draw[h] = _mm256_blendv_epi8(high_draw[h], draw,
+							  better);
+			high[h] = _mm256_blendv_epi8(high[h], index[h], better);
+			index[h] = _mm256_add_epi64(index[h],
+						    _mm256_set1_epi64x(8));
+		}
+	}
+
+	_mm256_store_si256((__m256i *)draws, high_draw[0]);
+	_mm256_store_si256((__m256i *)(draws + 4), high_draw[1]);
+	_mm256_store_si256((__m256i *)indexes, high[0]);
+	_mm256_store_si256((__m256i *)(indexes + 4), high[1]);
+	return reduce_lanes(draws, indexes, 8);
+}
+
+void CRUSH_TARGET_AVX2 crush_straw2_lanes_avx2(const __s32 *x, int r,
+						const __s32 *const *ids,
+						const __u32 *const *weights,
+						const __u32 *size, int *high)
+{
+	__m256i vx = _mm256_loadu_si256((const __m256i *)x);
+	__m256i vr = _mm256_set1_epi32(r);
+	__m256i high_draw[2], high_index[2];
+	__s32 lane_ids[CRUSH_STRAW2_LANES] __attribute__((aligned(32)));
+	__u32 lane_weights[CRUSH_STRAW2_LANES] __attribute__((aligned(32)));
+	__s64 indexes[CRUSH_STRAW2_LANES] __attribute__((aligned(32)));
+	__u32 i, n = max_size(size);
+	int h;
+
+	for (h = 0; h < 2; h++) {
+		high_draw[h] = _mm256_set1_epi64x(S64_MIN);
+		high_index[h] = _mm256_setzero_si256();
+	}
+
+	for (i = 0; i < n; i++) {
+		__m256i vw, u, index = _mm256_set1_epi64x(i);
+
+		gather_lanes(i, ids, weights, size, lane_ids, lane_weights);
+		vw = _mm256_load_si256((const __m256i *)lane_weights);
+		u = crush_hash32_rjenkins1_3_avx2(
+			vx, _mm256_load_si256((const __m256i *)lane_ids), vr);
+		u = _mm256_and_si256(u, _mm256_set1_epi32(0xffff));
+
+		for (h = 0; h < 2; h++) {
+			__m256i draw, better;
+
+			draw = draw4_avx2(
+				h ? _mm256_extracti128_si256(u, 1) :
+				    _mm256_castsi256_si128(u),
+				h ? _mm256_extracti128_si256(vw, 1) :
+				    _mm256_castsi256_si128(vw));
+			better = _mm256_cmpgt_epi64(draw, high_draw[h]);
+			high_draw[h] = _mm256_blendv_epi8(high_draw[h], draw,
+							  better);
+			high_index[h] = _mm256_blendv_epi8(high_index[h], index,
+							   better);
+		}
+	}
+
+	_mm256_store_si256((__m256i *)indexes, high_index[0]);
+	_mm256_store_si256((__m256i *)(indexes + 4), high_index[1]);
+	for (h = 0; h < CRUSH_STRAW2_LANES; h++)
+		high[h] = (int)indexes[h];
+}
+
+/* AVX-512 */
+
+int crush_straw2_avx512_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512dq");
+}
+
+/* draws of 8 items: u is 16 bits of the hash, 32 bits lanes */
+static inline CRUSH_TARGET_AVX512
+__m512i draw8_avx512(__m256i u, __m256i w)
+{
+	__m512i n, w64, q;
+	__mmask8 wzero, over;
+
+	/* n = -(crush_ln(u) - 0x1000000000000) */
+	n = _mm512_sub_epi64(_mm512_setzero_si512(),
+			     _mm512_i32gather_epi64(u, crush_ln_full, 8));
+
+	w64 = _mm512_cvtepu32_epi64(w);
+	wzero = _mm512_cmpeq_epi64_mask(w64, _mm512_setzero_si512());
+	w64 = _mm512_mask_mov_epi64(w64, wzero, _mm512_set1_epi64(1));
+
+	q = _mm512_cvt_roundpd_epu64(
+		_mm512_div_pd(_mm512_cvtepu64_pd(n), _mm512_cvtepu64_pd(w64)),
+		_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+	/* the rounded quotient was one too many */
+	over = _mm512_cmpgt_epi64_mask(_mm512_mullo_epi64(q, w64), n);
+	q = _mm512_mask_sub_epi64(q, over, q, _mm512_set1_epi64(1));
+
+	return _mm512_mask_mov_epi64(
+		_mm512_sub_epi64(_mm512_setzero_si512(), q),
+		wzero, _mm512_set1_epi64(S64_MIN));
+}
+
+int CRUSH_TARGET_AVX512 crush_straw2_avx512(int x, int r, const __s32 *ids,
+					    const __u32 *weights, __u32 size)
+{
+	__m512i vx = _mm512_set1_epi32(x);
+	__m512i vr = _mm512_set1_epi32(r);
+	__m512i high_draw[2], high[2], index[2];
+	__s64 draws[16] __attribute__((aligned(64)));
+	__s64 indexes[16] __attribute__((aligned(64)));
+	__u32 i;
+	int h;
+
+	for (h = 0; h < 2; h++) {
+		high_draw[h] = _mm512_set1_epi64(S64_MIN);
+		high[h] = _mm512_setzero_si512();
+		index[h] = _mm512_set_epi64(8 * h + 7, 8 * h + 6,
+					    8 * h + 5, 8 * h + 4,
+					    8 * h + 3, 8 * h + 2,
+					    8 * h + 1, 8 * h);
+	}
+
+	for (i = 0; i < size; i += 16) {
+		__mmask16 valid = size - i >= 16 ?
+			0xffff : (__mmask16)((1u << (size - i)) - 1);
+		__m512i vids, vw, u;
+
+		/* the lanes past the end of the bucket have a zero weight */
+		vids = _mm512_maskz_loadu_epi32(valid, ids + i);
+		vw = _mm512_maskz_loadu_epi32(valid, weights + i);
+
+		u = crush_hash32_rjenkins1_3_avx512(vx, vids, vr);
+		u = _mm512_and_si512(u, _mm512_set1_epi32(0xffff));
+
+		for (h = 0; h < 2; h++) {
+			__m512i draw;
+			__mmask8 better;
+
+			if (h)
+				draw = draw8_avx512(
+					_mm512_extracti64x4_epi64(u, 1),
+					_mm512_extracti64x4_epi64(vw, 1));
+			else
+				draw = draw8_avx512(
+					_mm512_castsi512_si256(u),
+					_mm512_castsi512_si256(vw));
+			better = _mm512_cmpgt_epi64_mask(draw, high_draw[h]);
+			high_draw[h] = _mm512_mask_mov_epi64(high_draw[h],
+							     better, draw);
+			high[h] = _mm512_mask_mov_epi64(high[h], better,
+							index[h]);
+			index[h] = _mm512_add_epi64(index[h],
+						    _mm512_set1_epi64(16));
+		}
+	}
+
+	_mm512_store_si512(draws, high_draw[0]);
+	_mm512_store_si512(draws + 8, high_draw[1]);
+	_mm512_store_si512(indexes, high[0]);
+	_mm512_store_si512(indexes + 8, high[1]);
+	return reduce_lanes(draws, indexes, 16);
+}
+
+/* the 8 lanes fit in 256 bits, only the draws use 512 bits vectors */
+void CRUSH_TARGET_AVX512 crush_straw2_lanes_avx512(const __s32 *x, int r,
+						    const __s32 *const *ids,
+						    const __u32 *const *weights,
+						    const __u32 *size,
+						    int *high)
+{
+	__m256i vx = _mm256_loadu_si256((const __m256i *)x);
+	__m256i vr = _mm256_set1_epi32(r);
+	__m512i high_draw = _mm512_set1_epi64(S64_MIN);
+	__m512i high_index = _mm512_setzero_si512();
+	__s32 lane_ids[CRUSH_STRAW2_LANES] __attribute__((aligned(32)));
+	__u32 lane_weights[CRUSH_STRAW2_LANES] __attribute__((aligned(32)));
+	__u32 i, n = max_size(size);
+
+	for (i = 0; i < n; i++) {
+		__m256i vw, u;
+		__m512i draw;
+		__mmask8 better;
+
+		gather_lanes(i, ids, weights, size, lane_ids, lane_weights);
+		vw = _mm256_load_si256((const __m256i *)lane_weights);
+		u = crush_hash32_rjenkins1_3_avx2(
+			vx, _mm256_load_si256((const __m256i *)lane_ids), vr);
+		u = _mm256_and_si256(u, _mm256_set1_epi32(0xffff));
+
+		draw = draw8_avx512(u, vw);
+		better = _mm512_cmpgt_epi64_mask(draw, high_draw);
+		high_draw = _mm512_mask_mov_epi64(high_draw, better, draw);
+		high_index = _mm512_mask_mov_epi64(high_index, better,
+						   _mm512_set1_epi64(i));
+	}
+
+	_mm256_storeu_si256((__m256i *)high,
+			    _mm512_cvtepi64_epi32(high_index));
+}
+
+crush_straw2_fn crush_straw2_simd;
+crush_straw2_lanes_fn crush_straw2_lanes_simd;
+
+static void __attribute__((constructor)) crush_straw2_simd_init(void)
+{
+	if (crush_straw2_avx512_supported()) {
+		crush_straw2_simd = crush_straw2_avx512;
+		crush_straw2_lanes_simd = crush_straw2_lanes_avx512;
+	} else if (crush_straw2_avx2_supported()) {
+		crush_straw2_simd = crush_straw2_avx2;
+		crush_straw2_lanes_simd = crush_straw2_lanes_avx2;
+	}
+}
+
+#else
+
+crush_straw2_fn crush_straw2_simd;
+crush_straw2_lanes_fn crush_straw2_lanes_simd;
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef CEPH_CRUSH_MAPPER_SIMD_H
+#define CEPH_CRUSH_MAPPER_SIMD_H
+
+/*
+ * Straw2 draw kernels using SIMD instructions, selected at runtime
+ * depending on the features of the CPU.
+ *
+ * A kernel returns the index, in [0,size[, of the item that
+ * bucket_straw2_choose() in mapper.c would choose, given the same
+ * input __x__, replica __r__, __ids__ and __weights__. The bucket hash
+ * must be CRUSH_HASH_RJENKINS1.
+ *
+ * Userspace only.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+#include "hash_simd.h"
+
+#ifdef CRUSH_HAVE_HASH_SIMD
+#define CRUSH_HAVE_STRAW2_SIMD 1
+#endif
+
+/* buckets smaller than this are not worth the vector setup */
+#define CRUSH_STRAW2_SIMD_MIN_SIZE 8
+
+typedef int (*crush_straw2_fn)(int x, int r, const __s32 *ids,
+			       const __u32 *weights, __u32 size);
+
+/*
+ * The best kernel supported by the CPU or NULL if the scalar code in
+ * mapper.c must be used. It is set when the library is loaded and may
+ * be overridden, for instance to compare kernels.
+ */
+extern crush_straw2_fn crush_straw2_simd;
+
+extern int crush_straw2_scalar(int x, int r, const __s32 *ids,
+			       const __u32 *weights, __u32 size);
+/*
+ * The number of inputs carried by a lockstep kernel.
+ */
+#define CRUSH_STRAW2_LANES 8
+
+/*
+ * A lockstep kernel runs the straw2 draw for CRUSH_STRAW2_LANES inputs
+ * at once, each in its own bucket: the lane __l__ sets __high[l]__ to
+ * the index that crush_straw2_scalar(__x[l]__, __r__, __ids[l]__,
+ * __weights[l]__, __size[l]__) returns, or 0 if __size[l]__ is 0. The
+ * hashes of the items at the same index in all buckets are computed
+ * together, so that small buckets, for which crush_straw2_simd is not
+ * worth it, are vectorized across inputs instead.
+ */
+typedef void (*crush_straw2_lanes_fn)(const __s32 *x, int r,
+				      const __s32 *const *ids,
+				      const __u32 *const *weights,
+				      const __u32 *size, int *high);
+
+/*
+ * The best lockstep kernel supported by the CPU or NULL, set when the
+ * library is loaded.
+ */
+extern crush_straw2_lanes_fn crush_straw2_lanes_simd;
+
+extern void crush_straw2_lanes_scalar(const __s32 *x, int r,
+				      const __s32 *const *ids,
+				      const __u32 *const *weights,
+				      const __u32 *size, int *high);
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+extern void crush_straw2_lanes_avx2(const __s32 *x, int r,
+				    const __s32 *const *ids,
+				    const __u32 *const *weights,
+				    const __u32 *size, int *high);
+extern void crush_straw2_lanes_avx512(const __s32 *x, int r,
+				      const __s32 *const *ids,
+				      const __u32 *const *weights,
+				      const __u32 *size, int *high);
+extern int crush_straw2_avx2_supported(void);
+extern int crush_straw2_avx2(int x, int r, const __s32 *ids,
+			     const __u32 *weights, __u32 size);
+extern int crush_straw2_avx512_supported(void);
+extern int crush_straw2_avx512(int x, int r, const __s32 *ids,
+			       const __u32 *weights, __u32 size);
+#endif
+
+#endif
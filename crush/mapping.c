@@ -0,0 +1,311 @@
+#include <errno.h>
+
+#include "mapping.h"
+#include "mapper.h"
+
+#define dprintk(args...) /* printf(args) */
+
+/*
+ * Each bucket and device has a key: the devices are [0,max_devices[
+ * and the bucket id is [max_devices,max_devices+max_buckets[. The
+ * index of a key lists the values that visited it. The trace of a
+ * value lists the keys it visited. Both sides know where the other is
+ * stored, so a value is removed from the index in constant time when
+ * it is mapped again.
+ */
+struct crush_mapping_ref {
+	__u32 key;   /* the key visited */
+	__u32 pos;   /* the position of the value in the index of key */
+};
+
+struct crush_mapping_entry {
+	__u32 x;     /* the value that visited the key */
+	__u32 slot;  /* the position of the key in the trace of x */
+};
+
+struct crush_mapping_trace {
+	struct crush_mapping_ref *refs;
+	__u32 size;
+};
+
+struct crush_mapping_index {
+	struct crush_mapping_entry *entries;
+	__u32 size;
+	__u32 max;
+};
+
+struct crush_mapping {
+	const struct crush_map *map;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	struct crush_plan *plan;
+	int count;
+	int result_max;
+	int *results;       /* count * result_max items */
+	int *result_len;    /* count lengths */
+	struct crush_mapping_trace *traces; /* count traces */
+	int max_devices;
+	int max_keys;
+	struct crush_mapping_index *index; /* max_keys indices */
+	char *dirty;        /* count flags */
+	int *dirty_list;    /* the dirty values, in the order to map them */
+	int dirty_size;
+	struct crush_trace trace;
+	void *cwin;
+};
+
+static int mapping_key(const struct crush_mapping *mapping, int item)
+{
+	if (item >= 0)
+		return item < mapping->max_devices ? item : -1;
+	if (-1-item >= mapping->map->max_buckets)
+		return -1;
+	return mapping->max_devices + (-1-item);
+}
+
+static void mark_dirty(struct crush_mapping *mapping, int x)
+{
+	if (mapping->dirty[x])
+		return;
+	mapping->dirty[x] = 1;
+	mapping->dirty_list[mapping->dirty_size++] = x;
+}
+
+/* make room in the index of each key visited by the last trace */
+static int reserve_index(struct crush_mapping *mapping)
+{
+	__u32 i;
+
+	for (i = 0; i < mapping->trace.size; i++) {
+		int key = mapping_key(mapping, mapping->trace.items[i]);
+		struct crush_mapping_index *index;
+		void *_realloc;
+		__u32 max;
+
+		if (key < 0)
+			continue;
+		index = &mapping->index[key];
+		if (index->size < index->max)
+			continue;
+		max = index->max ? index->max * 2 : 8;
+		_realloc = realloc(index->entries, sizeof(*index->entries) * max);
+		if (!_realloc)
+			return -ENOMEM;
+		index->entries = _realloc;
+		index->max = max;
+	}
+	return 0;
+}
+
+static void unlink_trace(struct crush_mapping *mapping, int x)
+{
+	struct crush_mapping_trace *trace = &mapping->traces[x];
+	__u32 slot;
+
+	for (slot = 0; slot < trace->size; slot++) {
+		struct crush_mapping_ref *ref = &trace->refs[slot];
+		struct crush_mapping_index *index = &mapping->index[ref->key];
+		struct crush_mapping_entry *last = &index->entries[--index->size];
+
+		if (ref->pos == index->size)
+			continue;
+		index->entries[ref->pos] = *last;
+		mapping->traces[last->x].refs[last->slot].pos = ref->pos;
+	}
+	free(trace->refs);
+	trace->refs = NULL;
+	trace->size = 0;
+}
+
+static int map_value(struct crush_mapping *mapping, int x)
+{
+	struct crush_mapping_trace *trace = &mapping->traces[x];
+	struct crush_mapping_ref *refs;
+	void *_realloc;
+	__u32 i;
+
+	for (;;) {
+		mapping->trace.size = 0;
+		mapping->trace.overflow = 0;
+		mapping->result_len[x] =
+			crush_do_plan(mapping->map, mapping->plan, x,
+				      mapping->results + x * mapping->result_max,
+				      mapping->result_max,
+				      mapping->weights, mapping->weight_max,
+				      mapping->cwin, mapping->choose_args);
+		if (!mapping->trace.overflow)
+			break;
+		/* map again with twice the room to trace */
+		_realloc = realloc(mapping->trace.items,
+				   sizeof(__s32) * mapping->trace.max * 2);
+		if (!_realloc)
+			return -ENOMEM;
+		mapping->trace.items = _realloc;
+		mapping->trace.max *= 2;
+	}
+
+	refs = malloc(sizeof(*refs) * mapping->trace.size);
+	if (!refs && mapping->trace.size > 0)
+		return -ENOMEM;
+	if (reserve_index(mapping) < 0) {
+		free(refs);
+		return -ENOMEM;
+	}
+
+	unlink_trace(mapping, x);
+	trace->refs = refs;
+	for (i = 0; i < mapping->trace.size; i++) {
+		int key = mapping_key(mapping, mapping->trace.items[i]);
+		struct crush_mapping_index *index;
+
+		if (key < 0)
+			continue;
+		index = &mapping->index[key];
+		refs[trace->size].key = key;
+		refs[trace->size].pos = index->size;
+		index->entries[index->size].x = x;
+		index->entries[index->size].slot = trace->size;
+		index->size++;
+		trace->size++;
+	}
+	return 0;
+}
+
+struct crush_mapping *
+crush_mapping_create(const struct crush_map *map, int ruleno, int count,
+		     int result_max, const __u32 *weights, int weight_max,
+		     const struct crush_choose_arg *choose_args)
+{
+	struct crush_mapping *mapping;
+	int x;
+
+	if (count < 0 || result_max <= 0)
+		return NULL;
+	mapping = calloc(1, sizeof(*mapping));
+	if (!mapping)
+		return NULL;
+	mapping->map = map;
+	mapping->weights = weights;
+	mapping->weight_max = weight_max;
+	mapping->choose_args = choose_args;
+	mapping->count = count;
+	mapping->result_max = result_max;
+	mapping->max_devices = map->max_devices;
+	mapping->max_keys = map->max_devices + map->max_buckets;
+	mapping->plan = crush_compile_rule(map, ruleno);
+	if (!mapping->plan)
+		goto err;
+	mapping->results = malloc(sizeof(int) * result_max * count);
+	mapping->result_len = malloc(sizeof(int) * count);
+	mapping->traces = calloc(count, sizeof(*mapping->traces));
+	mapping->index = calloc(mapping->max_keys, sizeof(*mapping->index));
+	mapping->dirty = calloc(count, 1);
+	mapping->dirty_list = malloc(sizeof(int) * count);
+	mapping->trace.max = 64;
+	mapping->trace.items = malloc(sizeof(__s32) * mapping->trace.max);
+	mapping->cwin = malloc(crush_work_size(map, result_max));
+	if ((count && (!mapping->results || !mapping->result_len ||
+		       !mapping->traces || !mapping->dirty ||
+		       !mapping->dirty_list)) ||
+	    (mapping->max_keys && !mapping->index) ||
+	    !mapping->trace.items || !mapping->cwin)
+		goto err;
+	crush_init_workspace(map, mapping->cwin);
+	crush_work_set_trace(mapping->cwin, &mapping->trace);
+
+	/* the values are popped from the end of the list */
+	for (x = count - 1; x >= 0; x--)
+		mark_dirty(mapping, x);
+	if (crush_mapping_update(mapping) < 0)
+		goto err;
+	return mapping;
+err:
+	crush_mapping_destroy(mapping);
+	return NULL;
+}
+
+void crush_mapping_destroy(struct crush_mapping *mapping)
+{
+	int i;
+
+	if (!mapping)
+		return;
+	if (mapping->traces)
+		for (i = 0; i < mapping->count; i++)
+			free(mapping->traces[i].refs);
+	if (mapping->index)
+		for (i = 0; i < mapping->max_keys; i++)
+			free(mapping->index[i].entries);
+	crush_destroy_plan(mapping->plan);
+	free(mapping->results);
+	free(mapping->result_len);
+	free(mapping->traces);
+	free(mapping->index);
+	free(mapping->dirty);
+	free(mapping->dirty_list);
+	free(mapping->trace.items);
+	free(mapping->cwin);
+	free(mapping);
+}
+
+int crush_mapping_get(const struct crush_mapping *mapping, int x,
+		      const int **result)
+{
+	if (x < 0 || x >= mapping->count)
+		return -EINVAL;
+	*result = mapping->results + x * mapping->result_max;
+	return mapping->result_len[x];
+}
+
+static void mark_key(struct crush_mapping *mapping, int key)
+{
+	const struct crush_mapping_index *index = &mapping->index[key];
+	__u32 i;
+
+	for (i = 0; i < index->size; i++)
+		mark_dirty(mapping, index->entries[i].x);
+}
+
+int crush_mapping_bucket_changed(struct crush_mapping *mapping, int id)
+{
+	int key;
+
+	if (id >= 0)
+		return -EINVAL;
+	key = mapping_key(mapping, id);
+	if (key < 0)
+		return -EINVAL;
+	mark_key(mapping, key);
+	return 0;
+}
+
+int crush_mapping_device_changed(struct crush_mapping *mapping, int device)
+{
+	int key;
+
+	if (device < 0)
+		return -EINVAL;
+	key = mapping_key(mapping, device);
+	if (key < 0)
+		return -EINVAL;
+	mark_key(mapping, key);
+	return 0;
+}
+
+int crush_mapping_update(struct crush_mapping *mapping)
+{
+	int mapped = 0;
+
+	while (mapping->dirty_size > 0) {
+		int x = mapping->dirty_list[mapping->dirty_size - 1];
+
+		if (map_value(mapping, x) < 0)
+			return -ENOMEM;
+		dprintk("mapped %d again\n", x);
+		mapping->dirty[x] = 0;
+		mapping->dirty_size--;
+		mapped++;
+	}
+	return mapped;
+}
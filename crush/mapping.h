@@ -0,0 +1,128 @@
+#ifndef CEPH_CRUSH_MAPPING_H
+#define CEPH_CRUSH_MAPPING_H
+
+/*
+ * The mapping of a range of values, kept up to date when weights
+ * change by mapping again only the values that depend on them.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/*
+ * Opaque, see crush_mapping_create().
+ */
+struct crush_mapping;
+
+/** @ingroup API
+ *
+ * Map all values in [0,__count__[ with the rule __ruleno__ and keep
+ * the results, as crush_do_rule() returns them, until
+ * crush_mapping_destroy() is called. For each value, the mapping also
+ * remembers the buckets and devices visited while mapping it (see
+ * crush_work_set_trace()). When the weight of an item or of a device
+ * changes, the values that never visited it are not mapped again by
+ * crush_mapping_update().
+ *
+ * The __map__, the __choose_args__ and the __weights__ are not copied
+ * and must stay valid until crush_mapping_destroy(). After the
+ * __map__ or the __choose_args__ are modified, the values that depend
+ * on the modification must be marked with crush_mapping_bucket_changed()
+ * or crush_mapping_device_changed() before calling
+ * crush_mapping_update(). Only the weights may change: if buckets,
+ * devices, rules or tunables are added, removed or modified, the
+ * mapping must be created again.
+ *
+ * - return NULL if __ruleno__ is not a rule of __map__
+ * - return NULL if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param count the number of values to map
+ * @param result_max the maximum number of items mapped to each value
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ *
+ * @returns the mapping or NULL
+ */
+extern struct crush_mapping *
+crush_mapping_create(const struct crush_map *map, int ruleno, int count,
+		     int result_max, const __u32 *weights, int weight_max,
+		     const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Deallocate a mapping returned by crush_mapping_create().
+ *
+ * @param mapping the mapping or NULL
+ */
+extern void crush_mapping_destroy(struct crush_mapping *mapping);
+
+/** @ingroup API
+ *
+ * Set __*result__ to the items __x__ is mapped to, as of the last
+ * crush_mapping_update(). The array is owned by the __mapping__ and
+ * is valid until the next crush_mapping_update().
+ *
+ * - return -EINVAL if __x__ is not in [0,__count__[
+ *
+ * @param mapping the mapping
+ * @param x the value
+ * @param result set to the items __x__ is mapped to
+ *
+ * @returns the number of items in __*result__ or < 0 on error
+ */
+extern int crush_mapping_get(const struct crush_mapping *mapping, int x,
+			     const int **result);
+
+/** @ingroup API
+ *
+ * Mark the values that visited the bucket __id__ so that they are
+ * mapped again by the next crush_mapping_update(). It must be called
+ * for each bucket of which the weight of an item is modified, for
+ * instance with crush_bucket_adjust_item_weight() or in the
+ * __choose_args__.
+ *
+ * - return -EINVAL if __id__ is not a bucket of the map
+ *
+ * @param mapping the mapping
+ * @param id the id of the modified bucket (< 0)
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_mapping_bucket_changed(struct crush_mapping *mapping, int id);
+
+/** @ingroup API
+ *
+ * Mark the values that visited the device __device__ so that they are
+ * mapped again by the next crush_mapping_update(). It must be called
+ * when the value of __weights[device]__ is modified.
+ *
+ * - return -EINVAL if __device__ is not a device of the map
+ *
+ * @param mapping the mapping
+ * @param device the id of the device (>= 0)
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_mapping_device_changed(struct crush_mapping *mapping,
+					int device);
+
+/** @ingroup API
+ *
+ * Map again the values marked by crush_mapping_bucket_changed() or
+ * crush_mapping_device_changed() since the last update. The results
+ * of the other values are known to be the same and are not computed.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails, the values that are not
+ *   mapped yet stay marked
+ *
+ * @param mapping the mapping
+ *
+ * @returns the number of values mapped again or < 0 on error
+ */
+extern int crush_mapping_update(struct crush_mapping *mapping);
+
+#endif
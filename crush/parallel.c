@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "mapper.h"
+
+#define dprintk(args...) /* printf(args) */
+
+/*
+ * The indices a worker has left to process are [begin,end[, packed in
+ * a single 64 bits word so that the owner (taking chunks from the
+ * front) and thieves (taking half of what is left from the back) can
+ * both update it with a compare and swap.
+ */
+#define RANGE(begin, end) (((__u64)(__u32)(end) << 32) | (__u32)(begin))
+#define RANGE_BEGIN(range) ((int)((range) & 0xffffffff))
+#define RANGE_END(range) ((int)((range) >> 32))
+
+struct crush_parallel_worker {
+	__u64 range;
+	/* keep each range in its own cache line */
+	char pad[64 - sizeof(__u64)];
+};
+
+struct crush_parallel_ctx {
+	struct crush_parallel_worker *workers;
+	int num_threads;
+	int grain;
+	crush_parallel_fn fn;
+	void *arg;
+};
+
+struct crush_parallel_thread {
+	struct crush_parallel_ctx *ctx;
+	int worker;
+};
+
+int crush_parallel_threads(int num_threads)
+{
+	long online;
+
+	if (num_threads > 0)
+		return num_threads;
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	return online > 0 ? (int)online : 1;
+}
+
+/* take up to grain indices from the front of the worker own range */
+static int take_chunk(struct crush_parallel_worker *self, int grain,
+		      int *begin, int *end)
+{
+	__u64 range = __atomic_load_n(&self->range, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		int b = RANGE_BEGIN(range);
+		int e = RANGE_END(range);
+		int n;
+
+		if (b >= e)
+			return 0;
+		n = e - b < grain ? e - b : grain;
+		if (__atomic_compare_exchange_n(&self->range, &range,
+						RANGE(b + n, e), 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			*begin = b;
+			*end = b + n;
+			return 1;
+		}
+	}
+}
+
+/* move half of what is left to another worker into the worker range */
+static int steal(struct crush_parallel_ctx *ctx, int worker)
+{
+	int i;
+
+	for (i = 1; i < ctx->num_threads; i++) {
+		struct crush_parallel_worker *victim =
+			&ctx->workers[(worker + i) % ctx->num_threads];
+		__u64 range = __atomic_load_n(&victim->range,
+					      __ATOMIC_ACQUIRE);
+
+		for (;;) {
+			int b = RANGE_BEGIN(range);
+			int e = RANGE_END(range);
+			int half;
+
+			if (b >= e)
+				break;
+			half = (e - b + 1) / 2;
+			if (__atomic_compare_exchange_n(&victim->range, &range,
+							RANGE(b, e - half), 0,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE)) {
+				dprintk("worker %d steals [%d,%d[ from %d\n",
+					worker, e - half, e,
+					(worker + i) % ctx->num_threads);
+				__atomic_store_n(&ctx->workers[worker].range,
+						 RANGE(e - half, e),
+						 __ATOMIC_RELEASE);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void crush_parallel_run(struct crush_parallel_ctx *ctx, int worker)
+{
+	struct crush_parallel_worker *self = &ctx->workers[worker];
+	int begin, end;
+
+	do {
+		while (take_chunk(self, ctx->grain, &begin, &end))
+			ctx->fn(ctx->arg, worker, begin, end);
+	} while (steal(ctx, worker));
+}
+
+static void *crush_parallel_thread_main(void *p)
+{
+	struct crush_parallel_thread *thread = p;
+
+	crush_parallel_run(thread->ctx, thread->worker);
+	return NULL;
+}
+
+int crush_parallel_for(int count, int num_threads, int grain,
+		       crush_parallel_fn fn, void *arg)
+{
+	struct crush_parallel_ctx ctx;
+	struct crush_parallel_thread *threads;
+	pthread_t *tids;
+	int started;
+	int r = 0;
+	int i;
+
+	if (count < 0 || grain <= 0)
+		return -EINVAL;
+	if (count == 0)
+		return 0;
+
+	num_threads = crush_parallel_threads(num_threads);
+	if (num_threads > (count + grain - 1) / grain)
+		num_threads = (count + grain - 1) / grain;
+
+	ctx.num_threads = num_threads;
+	ctx.grain = grain;
+	ctx.fn = fn;
+	ctx.arg = arg;
+	if (posix_memalign((void **)&ctx.workers, 64,
+			   sizeof(*ctx.workers) * num_threads))
+		return -ENOMEM;
+	for (i = 0; i < num_threads; i++)
+		ctx.workers[i].range =
+			RANGE((__s64)count * i / num_threads,
+			      (__s64)count * (i + 1) / num_threads);
+
+	threads = malloc(sizeof(*threads) * num_threads);
+	tids = malloc(sizeof(*tids) * num_threads);
+	if (!threads || !tids) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (started = 1; started < num_threads; started++) {
+		threads[started].ctx = &ctx;
+		threads[started].worker = started;
+		if (pthread_create(&tids[started], NULL,
+				   crush_parallel_thread_main,
+				   &threads[started])) {
+			/* the started workers will steal from the others */
+			r = -EAGAIN;
+			break;
+		}
+	}
+	crush_parallel_run(&ctx, 0);
+	for (i = 1; i < started; i++)
+		pthread_join(tids[i], NULL);
+	if (r < 0) {
+		/* finish the ranges of the workers that did not start */
+		for (i = started; i < num_threads; i++)
+			crush_parallel_run(&ctx, i);
+		r = 0;
+	}
+out:
+	free(tids);
+	free(threads);
+	free(ctx.workers);
+	return r;
+}
+
+struct crush_do_rule_parallel_ctx {
+	const struct crush_map *map;
+	int ruleno;
+	const struct crush_plan *plan;
+	const int *x;
+	int x_start;
+	int *result;
+	int result_max;
+	int result_stride;
+	int *result_len;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	char **cwin;
+	struct crush_stats *stats;
+};
+
+#define CRUSH_PARALLEL_GRAIN 64
+
+static void crush_do_rule_chunk(void *arg, int worker, int begin, int end)
+{
+	struct crush_do_rule_parallel_ctx *ctx = arg;
+	int xs[CRUSH_PARALLEL_GRAIN];
+	const int *x = ctx->x ? ctx->x + begin : xs;
+	int i;
+
+	if (!ctx->x)
+		for (i = begin; i < end; i++)
+			xs[i - begin] = ctx->x_start + i;
+	if (ctx->plan)
+		crush_do_plan_batch(ctx->map, ctx->plan, x, end - begin,
+				    ctx->result +
+				    (size_t)begin * ctx->result_stride,
+				    ctx->result_max, ctx->result_stride,
+				    ctx->result_len ?
+				    ctx->result_len + begin : NULL,
+				    ctx->weights, ctx->weight_max,
+				    ctx->cwin[worker], ctx->choose_args);
+	else
+		crush_do_rule_batch(ctx->map, ctx->ruleno, x, end - begin,
+				    ctx->result +
+				    (size_t)begin * ctx->result_stride,
+				    ctx->result_max, ctx->result_stride,
+				    ctx->result_len ?
+				    ctx->result_len + begin : NULL,
+				    ctx->weights, ctx->weight_max,
+				    ctx->cwin[worker], ctx->choose_args);
+}
+
+int crush_do_rule_parallel(const struct crush_map *map,
+			   int ruleno,
+			   const int *x, int x_start, int count,
+			   int *result, int result_max,
+			   int result_stride, int *result_len,
+			   const __u32 *weights, int weight_max,
+			   const struct crush_choose_arg *choose_args,
+			   int num_threads,
+			   struct crush_stats *stats)
+{
+	struct crush_do_rule_parallel_ctx ctx;
+	struct crush_device_state devices;
+	struct crush_choose_reciprocals reciprocals;
+	struct crush_plan *plan;
+	size_t work_size = crush_work_size(map, result_max);
+	int i;
+	int r;
+
+	if ((__u32)ruleno >= map->max_rules || !map->rules[ruleno])
+		return -EINVAL;
+
+	/* prepared once for all the workers, the mapping works without */
+	memset(&devices, 0, sizeof(devices));
+	if (crush_device_state_prepare(&devices, weights, weight_max) < 0)
+		crush_device_state_destroy(&devices);
+	memset(&reciprocals, 0, sizeof(reciprocals));
+	if (choose_args &&
+	    crush_choose_reciprocals_prepare(&reciprocals, choose_args,
+					     map->max_buckets) < 0)
+		crush_choose_reciprocals_destroy(&reciprocals);
+	/* compiled once for all the chunks, interpreted if malloc fails */
+	plan = crush_compile_rule(map, ruleno);
+
+	num_threads = crush_parallel_threads(num_threads);
+	ctx.map = map;
+	ctx.ruleno = ruleno;
+	ctx.plan = plan;
+	ctx.x = x;
+	ctx.x_start = x_start;
+	ctx.result = result;
+	ctx.result_max = result_max;
+	ctx.result_stride = result_stride;
+	ctx.result_len = result_len;
+	ctx.weights = weights;
+	ctx.weight_max = weight_max;
+	ctx.choose_args = choose_args;
+	ctx.cwin = calloc(num_threads, sizeof(*ctx.cwin));
+	ctx.stats = NULL;
+	if (stats)
+		ctx.stats = calloc(num_threads, sizeof(*ctx.stats));
+	if (!ctx.cwin || (stats && !ctx.stats)) {
+		r = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		ctx.cwin[i] = malloc(work_size);
+		if (!ctx.cwin[i]) {
+			r = -ENOMEM;
+			goto out;
+		}
+		crush_init_workspace(map, ctx.cwin[i]);
+		if (devices.state)
+			crush_work_set_device_state(ctx.cwin[i], &devices);
+		if (reciprocals.buckets)
+			crush_work_set_choose_reciprocals(ctx.cwin[i],
+							  &reciprocals);
+		if (stats)
+			crush_work_set_stats(ctx.cwin[i], &ctx.stats[i]);
+	}
+
+	r = crush_parallel_for(count, num_threads, CRUSH_PARALLEL_GRAIN,
+			       crush_do_rule_chunk, &ctx);
+	if (r == 0 && stats)
+		for (i = 0; i < num_threads; i++)
+			crush_stats_merge(stats, &ctx.stats[i]);
+out:
+	if (ctx.cwin)
+		for (i = 0; i < num_threads; i++)
+			free(ctx.cwin[i]);
+	free(ctx.cwin);
+	free(ctx.stats);
+	crush_destroy_plan(plan);
+	crush_choose_reciprocals_destroy(&reciprocals);
+	crush_device_state_destroy(&devices);
+	return r;
+}
@@ -0,0 +1,117 @@
+#ifndef CEPH_CRUSH_PARALLEL_H
+#define CEPH_CRUSH_PARALLEL_H
+
+/*
+ * Spread the mapping of many inputs over a pool of threads.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Function called by crush_parallel_for() to process the indices in
+ * [__begin__,__end__[. The __worker__ argument is the zero based index
+ * of the calling thread, it is < __num_threads__ and can be used to
+ * address per thread data (a workspace, counters, etc.) without
+ * locking.
+ */
+typedef void (*crush_parallel_fn)(void *arg, int worker, int begin, int end);
+
+/** @ingroup API
+ *
+ * Return the number of threads crush_parallel_for() and
+ * crush_do_rule_parallel() will use when given __num_threads__: the
+ * number of online processors if __num_threads__ <= 0, __num_threads__
+ * otherwise.
+ *
+ * @param num_threads the number of threads or <= 0
+ *
+ * @returns the effective number of threads, always > 0
+ */
+extern int crush_parallel_threads(int num_threads);
+
+/** @ingroup API
+ *
+ * Call __fn__ on chunks of at most __grain__ indices until all the
+ * indices in [0,__count__[ have been processed exactly once. The range
+ * is initially split evenly among crush_parallel_threads(__num_threads__)
+ * workers. A worker that runs out of indices steals half of the
+ * remaining indices of another worker, so that inputs that are much
+ * slower than the others (many retries, deep hierarchies) do not leave
+ * threads idle. The calling thread is used as worker 0.
+ *
+ * The order in which the chunks are processed is not defined: __fn__
+ * must write the result for an index at a place that only depends on
+ * the index for the outcome to be deterministic.
+ *
+ * If a thread cannot be created, the workers that did start (at
+ * least the calling thread) process all the indices: it degrades to
+ * fewer threads and still returns 0.
+ *
+ * - return -EINVAL if __count__ < 0 or __grain__ <= 0
+ * - return -ENOMEM if memory cannot be allocated
+ *
+ * @param count the number of indices
+ * @param num_threads the number of threads, see crush_parallel_threads()
+ * @param grain the maximum number of indices given to __fn__ at once
+ * @param fn the function processing a chunk of indices
+ * @param arg the first argument of __fn__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_parallel_for(int count, int num_threads, int grain,
+			      crush_parallel_fn fn, void *arg);
+
+/** @ingroup API
+ *
+ * Map __count__ values with the rule __ruleno__ using
+ * crush_parallel_threads(__num_threads__) threads. The values are
+ * __x[i]__ for i in [0,__count__[ or, if __x__ is NULL, __x_start + i__.
+ *
+ * The __result__, __result_max__, __result_stride__ and __result_len__
+ * arguments have the same meaning as for crush_do_rule_batch() and
+ * the results are identical to what crush_do_rule_batch() returns,
+ * regardless of the number of threads. Each thread allocates and
+ * initializes its own workspace and, if __stats__ is not NULL, counts
+ * in its own crush_stats. They are added to __stats__ with
+ * crush_stats_merge() when all values are mapped. The __weights__ are
+ * prepared once with crush_device_state_prepare() and the table is
+ * shared by all the workspaces, as are the reciprocals of the
+ * __choose_args__ prepared with crush_choose_reciprocals_prepare().
+ * Likewise, the rule is compiled once
+ * with crush_compile_rule() and the plan is shared by all the
+ * threads, see crush_do_plan_batch().
+ *
+ * - return -EINVAL if __ruleno__ is not a valid rule
+ * - see crush_parallel_for() for other errors
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the array of values to map or NULL
+ * @param x_start the first value to map if __x__ is NULL
+ * @param count the number of values to map
+ * @param result an array of at least __count * result_stride__ items
+ * @param result_max the maximum number of items mapped to each value
+ * @param result_stride the distance between two result vectors
+ * @param result_len an array of size __count__ or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args weights and ids for each known bucket
+ * @param num_threads the number of threads, see crush_parallel_threads()
+ * @param stats NULL or the counters to add the statistics to
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_do_rule_parallel(const struct crush_map *map,
+				  int ruleno,
+				  const int *x, int x_start, int count,
+				  int *result, int result_max,
+				  int result_stride, int *result_len,
+				  const __u32 *weights, int weight_max,
+				  const struct crush_choose_arg *choose_args,
+				  int num_threads,
+				  struct crush_stats *stats);
+
+#endif
@@ -0,0 +1,175 @@
+#include <errno.h>
+
+#include "reverse.h"
+#include "parallel.h"
+
+#define dprintk(args...) /* printf(args) */
+
+struct crush_reverse_ctx {
+	const int *x;
+	int x_start;
+	int count;
+	const int *result;
+	int result_stride;
+	const int *result_len;
+	int blocks;
+	/* blocks rows of max_devices: the number of entries of each
+	 * device in the block, then where the block stores the next one */
+	__u32 *cursors;
+	struct crush_reverse_index *index;
+};
+
+#define BLOCK_BEGIN(ctx, block) \
+	((int)((__s64)(ctx)->count * (block) / (ctx)->blocks))
+
+static void count_block(void *arg, int worker, int begin, int end)
+{
+	struct crush_reverse_ctx *ctx = arg;
+	int max_devices = ctx->index->max_devices;
+	int block, i, j;
+
+	for (block = begin; block < end; block++) {
+		__u32 *histogram = ctx->cursors + (size_t)block * max_devices;
+
+		for (i = BLOCK_BEGIN(ctx, block);
+		     i < BLOCK_BEGIN(ctx, block + 1); i++) {
+			const int *result = ctx->result +
+				(size_t)i * ctx->result_stride;
+
+			for (j = 0; j < ctx->result_len[i]; j++)
+				if (result[j] >= 0 && result[j] < max_devices)
+					histogram[result[j]]++;
+		}
+	}
+}
+
+static void store_block(void *arg, int worker, int begin, int end)
+{
+	struct crush_reverse_ctx *ctx = arg;
+	int max_devices = ctx->index->max_devices;
+	int block, i, j;
+
+	for (block = begin; block < end; block++) {
+		__u32 *cursor = ctx->cursors + (size_t)block * max_devices;
+
+		for (i = BLOCK_BEGIN(ctx, block);
+		     i < BLOCK_BEGIN(ctx, block + 1); i++) {
+			const int *result = ctx->result +
+				(size_t)i * ctx->result_stride;
+			int x = ctx->x ? ctx->x[i] : ctx->x_start + i;
+
+			for (j = 0; j < ctx->result_len[i]; j++) {
+				struct crush_reverse_entry *entry;
+
+				if (result[j] < 0 || result[j] >= max_devices)
+					continue;
+				entry = &ctx->index->entries[cursor[result[j]]++];
+				entry->x = x;
+				entry->position = j;
+			}
+		}
+	}
+}
+
+/*
+ * Sum the histograms of the blocks into the offsets and replace each
+ * count with the position of the first entry of the block.
+ */
+static void prefix_sum(struct crush_reverse_ctx *ctx)
+{
+	struct crush_reverse_index *index = ctx->index;
+	__u32 offset = 0;
+	int block, d;
+
+	for (d = 0; d < index->max_devices; d++) {
+		index->offsets[d] = offset;
+		for (block = 0; block < ctx->blocks; block++) {
+			__u32 *count = &ctx->cursors[
+				(size_t)block * index->max_devices + d];
+			__u32 n = *count;
+
+			*count = offset;
+			offset += n;
+		}
+	}
+	index->offsets[index->max_devices] = offset;
+}
+
+struct crush_reverse_index *
+crush_reverse_index_build(const int *x, int x_start, int count,
+			  const int *result, int result_stride,
+			  const int *result_len, int max_devices,
+			  int num_threads)
+{
+	struct crush_reverse_ctx ctx;
+	struct crush_reverse_index *index;
+
+	if (count < 0 || max_devices < 0)
+		return NULL;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+	index->max_devices = max_devices;
+	index->offsets = calloc(max_devices + 1, sizeof(__u32));
+	if (!index->offsets)
+		goto err;
+
+	ctx.x = x;
+	ctx.x_start = x_start;
+	ctx.count = count;
+	ctx.result = result;
+	ctx.result_stride = result_stride;
+	ctx.result_len = result_len;
+	ctx.index = index;
+	ctx.blocks = crush_parallel_threads(num_threads);
+	if (ctx.blocks > count)
+		ctx.blocks = count;
+	if (ctx.blocks == 0 || max_devices == 0) {
+		index->entries = malloc(sizeof(*index->entries));
+		if (!index->entries)
+			goto err;
+		return index;
+	}
+	ctx.cursors = calloc((size_t)ctx.blocks * max_devices, sizeof(__u32));
+	if (!ctx.cursors)
+		goto err;
+
+	if (crush_parallel_for(ctx.blocks, ctx.blocks, 1, count_block, &ctx))
+		goto err_cursors;
+	prefix_sum(&ctx);
+	dprintk("%u entries\n", index->offsets[max_devices]);
+	index->entries = malloc(sizeof(*index->entries) *
+				(index->offsets[max_devices] + 1));
+	if (!index->entries)
+		goto err_cursors;
+	if (crush_parallel_for(ctx.blocks, ctx.blocks, 1, store_block, &ctx))
+		goto err_cursors;
+
+	free(ctx.cursors);
+	return index;
+err_cursors:
+	free(ctx.cursors);
+err:
+	crush_reverse_index_destroy(index);
+	return NULL;
+}
+
+int crush_reverse_index_lookup(const struct crush_reverse_index *index,
+			       int device,
+			       const struct crush_reverse_entry **entries)
+{
+	if (device < 0 || device >= index->max_devices)
+		return -EINVAL;
+	*entries = index->entries + index->offsets[device];
+	return index->offsets[device + 1] - index->offsets[device];
+}
+
+void crush_reverse_index_destroy(struct crush_reverse_index *index)
+{
+	if (!index)
+		return;
+	free(index->offsets);
+	free(index->entries);
+	free(index);
+}
@@ -0,0 +1,97 @@
+#ifndef CEPH_CRUSH_REVERSE_H
+#define CEPH_CRUSH_REVERSE_H
+
+/*
+ * Index from each device to the values mapped to it.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * A value mapped to a device and the position of the device in the
+ * result of the value.
+ */
+struct crush_reverse_entry {
+	int x;         /*!< the value */
+	int position;  /*!< the index of the device in the result of __x__ */
+};
+
+/** @ingroup API
+ *
+ * The values mapped to each device, in compressed sparse row format:
+ * the values mapped to the device __d__ are __entries[offsets[d]]__
+ * to __entries[offsets[d + 1] - 1]__, in the order of the results
+ * they were found in.
+ */
+struct crush_reverse_index {
+	int max_devices;                     /*!< the number of devices */
+	__u32 *offsets;                      /*!< __max_devices + 1__ offsets in __entries__ */
+	struct crush_reverse_entry *entries; /*!< __offsets[max_devices]__ entries */
+};
+
+/** @ingroup API
+ *
+ * Build the reverse index of __count__ results, for instance returned
+ * by crush_do_rule_parallel() with the same arguments. The result of
+ * the value __x[i]__ (or __x_start + i__ if __x__ is NULL) is
+ * __result_len[i]__ items starting at __result + i * result_stride__.
+ * The items that are not devices in [0,__max_devices__[ (buckets,
+ * __CRUSH_ITEM_NONE__) are not indexed.
+ *
+ * The results are split in blocks, one or more per thread. Each
+ * thread counts the devices of its blocks, the counts are summed into
+ * the offsets and each thread then stores the entries of its blocks
+ * at positions computed from the counts of the blocks before it. The
+ * index is the same regardless of the number of threads.
+ *
+ * The returned index must be deallocated with
+ * crush_reverse_index_destroy().
+ *
+ * - return NULL if __count__ < 0 or __max_devices__ < 0
+ * - return NULL if __malloc(3)__ fails or a thread cannot be created
+ *
+ * @param x the array of values or NULL
+ * @param x_start the first value if __x__ is NULL
+ * @param count the number of results
+ * @param result an array of at least __count * result_stride__ items
+ * @param result_stride the distance between two results
+ * @param result_len an array of size __count__
+ * @param max_devices the number of devices
+ * @param num_threads the number of threads, see crush_parallel_threads()
+ *
+ * @returns the reverse index or NULL
+ */
+extern struct crush_reverse_index *
+crush_reverse_index_build(const int *x, int x_start, int count,
+			  const int *result, int result_stride,
+			  const int *result_len, int max_devices,
+			  int num_threads);
+
+/** @ingroup API
+ *
+ * Set __*entries__ to the values mapped to __device__.
+ *
+ * - return -EINVAL if __device__ is not in [0,__max_devices__[
+ *
+ * @param index the reverse index
+ * @param device the device
+ * @param entries set to the first entry of __device__
+ *
+ * @returns the number of entries or < 0 on error
+ */
+extern int crush_reverse_index_lookup(const struct crush_reverse_index *index,
+				      int device,
+				      const struct crush_reverse_entry **entries);
+
+/** @ingroup API
+ *
+ * Deallocate a reverse index returned by crush_reverse_index_build().
+ *
+ * @param index the reverse index or NULL
+ */
+extern void crush_reverse_index_destroy(struct crush_reverse_index *index);
+
+#endif
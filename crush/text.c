@@ -0,0 +1,1170 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "text.h"
+#include "builder.h"
+#include "hash.h"
+
+#define dprintk(args...) /* printf(args) */
+
+#define CRUSH_TEXT_MAX_TYPES 65536 /* the type of a bucket is a __u16 */
+
+struct token {
+	const char *s;
+	size_t len;
+	int line;
+};
+
+/* open addressing hash table from names to ids */
+struct name_entry {
+	const char *name; /* NULL if the entry is free */
+	__u32 len;
+	int id;
+};
+
+struct name_table {
+	struct name_entry *entries;
+	__u32 mask;  /* the number of entries - 1 */
+	__u32 count; /* the number of names */
+};
+
+/* names indexed by id */
+struct name_array {
+	char **names;
+	int size;
+};
+
+/* an item of the bucket being compiled */
+struct bucket_item {
+	int item;
+	int weight;
+	int pos; /* -1 if not given */
+};
+
+struct compiler {
+	const char *p;
+	const char *end;
+	int line;
+	struct token tok;   /* the current token */
+	int pushed;         /* next() returns the current token again */
+	int error_line;
+	struct crush_map *map;
+	char *strings;      /* the names, one byte per byte of text at most */
+	size_t strings_used;
+	struct name_table items; /* devices and buckets */
+	struct name_table types;
+	struct name_array devices;
+	struct name_array buckets;
+	struct name_array rules;
+	struct name_array type_names;
+	int max_devices;    /* the highest declared device + 1 */
+
+	/* reused by each bucket */
+	struct bucket_item *bucket_items;
+	int *order;
+	int *placed_items;
+	int *placed_weights;
+	int bucket_items_max;
+
+	/* reused by each rule */
+	struct crush_rule_step *steps;
+	int steps_max;
+};
+
+/* read the next token, return 0 at the end of the text */
+static int next(struct compiler *c)
+{
+	const char *p = c->p;
+
+	if (c->pushed) {
+		c->pushed = 0;
+		return c->tok.len > 0;
+	}
+	for (;;) {
+		while (p < c->end && (*p == ' ' || *p == '\t' ||
+				      *p == '\r' || *p == '\n')) {
+			if (*p == '\n')
+				c->line++;
+			p++;
+		}
+		if (p == c->end || *p != '#')
+			break;
+		while (p < c->end && *p != '\n')
+			p++;
+	}
+	c->tok.s = p;
+	c->tok.line = c->line;
+	if (p < c->end && (*p == '{' || *p == '}')) {
+		p++;
+	} else {
+		while (p < c->end && *p != ' ' && *p != '\t' &&
+		       *p != '\r' && *p != '\n' && *p != '#' &&
+		       *p != '{' && *p != '}')
+			p++;
+	}
+	c->tok.len = p - c->tok.s;
+	c->p = p;
+	return c->tok.len > 0;
+}
+
+/* make the next call to next() return the current token */
+static void unget(struct compiler *c)
+{
+	c->pushed = 1;
+}
+
+static int is(const struct compiler *c, const char *word)
+{
+	size_t len = strlen(word);
+
+	return c->tok.len == len && !memcmp(c->tok.s, word, len);
+}
+
+static int fail(struct compiler *c)
+{
+	dprintk("line %d: unexpected '%.*s'\n", c->tok.line,
+		(int)c->tok.len, c->tok.s);
+	c->error_line = c->tok.line;
+	return -EINVAL;
+}
+
+/* read a word, that is a token that is not a brace */
+static int next_word(struct compiler *c)
+{
+	if (!next(c) || is(c, "{") || is(c, "}"))
+		return fail(c);
+	return 0;
+}
+
+static int expect(struct compiler *c, const char *word)
+{
+	if (!next(c) || !is(c, word))
+		return fail(c);
+	return 0;
+}
+
+static int next_int(struct compiler *c, int min, int max, int *value)
+{
+	const char *p, *end;
+	int negative;
+	__s64 v = 0;
+
+	if (!next(c))
+		return fail(c);
+	p = c->tok.s;
+	end = p + c->tok.len;
+	negative = *p == '-';
+	if (negative)
+		p++;
+	if (p == end)
+		return fail(c);
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			return fail(c);
+		v = v * 10 + (*p - '0');
+		if (v > (__s64)INT_MAX + 1)
+			return fail(c);
+	}
+	if (negative)
+		v = -v;
+	if (v < min || v > max)
+		return fail(c);
+	*value = v;
+	return 0;
+}
+
+/* a decimal weight such as 1.5, in 16.16 fixed point */
+static int next_weight(struct compiler *c, int *weight)
+{
+	const char *p, *end;
+	__u64 integer = 0, fraction = 0, scale = 1;
+	int digits = 0;
+
+	if (!next(c))
+		return fail(c);
+	p = c->tok.s;
+	end = p + c->tok.len;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		integer = integer * 10 + (*p - '0');
+		if (integer > 0x7fff)
+			return fail(c);
+	}
+	if (p < end && *p == '.') {
+		/* the digits after the ninth do not change the result */
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			if (scale < 1000000000) {
+				fraction = fraction * 10 + (*p - '0');
+				scale *= 10;
+			}
+		}
+	}
+	if (p != end || !digits)
+		return fail(c);
+	*weight = (integer << 16) + (fraction * 0x10000 + scale / 2) / scale;
+	return 0;
+}
+
+/* a copy of the current token that lives as long as the map */
+static char *intern(struct compiler *c)
+{
+	char *name = c->strings + c->strings_used;
+
+	memcpy(name, c->tok.s, c->tok.len);
+	name[c->tok.len] = '\0';
+	c->strings_used += c->tok.len + 1;
+	return name;
+}
+
+static __u32 name_hash(const char *name, size_t len)
+{
+	__u32 h = 2166136261u; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static struct name_entry *table_slot(const struct name_table *t,
+				     const char *name, size_t len)
+{
+	__u32 i = name_hash(name, len) & t->mask;
+
+	for (;; i = (i + 1) & t->mask) {
+		struct name_entry *e = &t->entries[i];
+
+		if (!e->name || (e->len == len && !memcmp(e->name, name, len)))
+			return e;
+	}
+}
+
+/* the id of the current token in __t__ or 0 if it is not there */
+static int table_find(const struct name_table *t, const struct token *tok,
+		      int *id)
+{
+	const struct name_entry *e;
+
+	if (!t->entries)
+		return 0;
+	e = table_slot(t, tok->s, tok->len);
+	if (!e->name)
+		return 0;
+	*id = e->id;
+	return 1;
+}
+
+/* the table is kept at most half full */
+static int table_insert(struct name_table *t, const char *name, int id)
+{
+	struct name_entry *e;
+
+	if (2 * (t->count + 1) > t->mask + 1) {
+		struct name_table grown;
+		__u32 i;
+
+		grown.mask = t->entries ? 2 * t->mask + 1 : 63;
+		grown.count = t->count;
+		grown.entries = calloc(grown.mask + 1, sizeof(*grown.entries));
+		if (!grown.entries)
+			return -ENOMEM;
+		for (i = 0; t->entries && i <= t->mask; i++)
+			if (t->entries[i].name)
+				*table_slot(&grown, t->entries[i].name,
+					    t->entries[i].len) = t->entries[i];
+		free(t->entries);
+		*t = grown;
+	}
+	e = table_slot(t, name, strlen(name));
+	e->name = name;
+	e->len = strlen(name);
+	e->id = id;
+	t->count++;
+	return 0;
+}
+
+/* set the size of __a__ to __size__, the new names are NULL */
+static int array_resize(struct name_array *a, int size)
+{
+	char **names = realloc(a->names, sizeof(char *) * (size ? size : 1));
+
+	if (!names)
+		return -ENOMEM;
+	if (size > a->size)
+		memset(names + a->size, 0, sizeof(char *) * (size - a->size));
+	a->names = names;
+	a->size = size;
+	return 0;
+}
+
+static int array_set(struct name_array *a, int index, char *name)
+{
+	if (index >= a->size) {
+		int size = a->size ? a->size : 16;
+		int r;
+
+		while (size <= index)
+			size = size > INT_MAX / 2 ? INT_MAX : 2 * size;
+		r = array_resize(a, size);
+		if (r)
+			return r;
+	}
+	a->names[index] = name;
+	return 0;
+}
+
+static int parse_tunable(struct compiler *c)
+{
+	struct crush_map *m = c->map;
+	struct token name;
+	int value;
+	int r;
+
+	r = next_word(c);
+	if (r)
+		return r;
+	name = c->tok;
+	r = next_int(c, 0, INT_MAX, &value);
+	if (r)
+		return r;
+	c->tok = name;
+	if (is(c, "choose_local_tries"))
+		m->choose_local_tries = value;
+	else if (is(c, "choose_local_fallback_tries"))
+		m->choose_local_fallback_tries = value;
+	else if (is(c, "choose_total_tries"))
+		m->choose_total_tries = value;
+	else if (is(c, "chooseleaf_descend_once"))
+		m->chooseleaf_descend_once = value;
+	else if (is(c, "chooseleaf_vary_r") && value <= U8_MAX)
+		m->chooseleaf_vary_r = value;
+	else if (is(c, "chooseleaf_stable") && value <= U8_MAX)
+		m->chooseleaf_stable = value;
+	else if (is(c, "straw_calc_version") && value <= U8_MAX)
+		m->straw_calc_version = value;
+	else if (is(c, "allowed_bucket_algs"))
+		m->allowed_bucket_algs = value;
+	else
+		return fail(c);
+	return 0;
+}
+
+static int parse_device(struct compiler *c)
+{
+	char *name;
+	int id;
+	int line;
+	int r;
+
+	r = next_int(c, 0, INT_MAX - 1, &id);
+	if (r)
+		return r;
+	r = next_word(c);
+	if (r)
+		return r;
+	if (table_find(&c->items, &c->tok, &r) ||
+	    (id < c->devices.size && c->devices.names[id]))
+		return fail(c);
+	name = intern(c);
+	r = table_insert(&c->items, name, id);
+	if (r)
+		return r;
+	r = array_set(&c->devices, id, name);
+	if (r)
+		return r;
+	if (id >= c->max_devices)
+		c->max_devices = id + 1;
+
+	/* the attributes that libcrush does not use */
+	line = c->tok.line;
+	while (next(c) && c->tok.line == line) {
+		if (is(c, "class") || is(c, "offload")) {
+			r = next_word(c);
+			if (r)
+				return r;
+		} else if (!is(c, "down")) {
+			return fail(c);
+		}
+	}
+	unget(c);
+	return 0;
+}
+
+static int parse_type(struct compiler *c)
+{
+	char *name;
+	int id;
+	int r;
+
+	r = next_int(c, 0, CRUSH_TEXT_MAX_TYPES - 1, &id);
+	if (r)
+		return r;
+	r = next_word(c);
+	if (r)
+		return r;
+	if (table_find(&c->types, &c->tok, &r) ||
+	    (id < c->type_names.size && c->type_names.names[id]))
+		return fail(c);
+	name = intern(c);
+	r = table_insert(&c->types, name, id);
+	if (r)
+		return r;
+	return array_set(&c->type_names, id, name);
+}
+
+/* append the __n__th item of the bucket being compiled */
+static int add_bucket_item(struct compiler *c, int n,
+			   int item, int weight, int pos)
+{
+	if (n == c->bucket_items_max) {
+		int size = n ? 2 * n : 64;
+		void *p;
+
+		p = realloc(c->bucket_items, sizeof(*c->bucket_items) * size);
+		if (!p)
+			return -ENOMEM;
+		c->bucket_items = p;
+		p = realloc(c->order, sizeof(int) * size);
+		if (!p)
+			return -ENOMEM;
+		c->order = p;
+		p = realloc(c->placed_items, sizeof(int) * size);
+		if (!p)
+			return -ENOMEM;
+		c->placed_items = p;
+		p = realloc(c->placed_weights, sizeof(int) * size);
+		if (!p)
+			return -ENOMEM;
+		c->placed_weights = p;
+		c->bucket_items_max = size;
+	}
+	c->bucket_items[n].item = item;
+	c->bucket_items[n].weight = weight;
+	c->bucket_items[n].pos = pos;
+	return 0;
+}
+
+/*
+ * Order the __n__ items of the bucket in __c->placed_items__ and
+ * __c->placed_weights__: the items with a pos first, then the others
+ * in the positions left.
+ */
+static int place_bucket_items(struct compiler *c, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++)
+		c->order[i] = -1;
+	for (i = 0; i < n; i++) {
+		int pos = c->bucket_items[i].pos;
+
+		if (pos < 0)
+			continue;
+		if (pos >= n || c->order[pos] >= 0)
+			return -EINVAL;
+		c->order[pos] = i;
+	}
+	for (i = 0, j = 0; i < n; i++) {
+		if (c->bucket_items[i].pos >= 0)
+			continue;
+		while (c->order[j] >= 0)
+			j++;
+		c->order[j] = i;
+	}
+	for (i = 0; i < n; i++) {
+		c->placed_items[i] = c->bucket_items[c->order[i]].item;
+		c->placed_weights[i] = c->bucket_items[c->order[i]].weight;
+	}
+	return 0;
+}
+
+static int parse_bucket(struct compiler *c)
+{
+	struct crush_bucket *bucket;
+	struct token name;
+	int type, id = 0, alg = CRUSH_BUCKET_STRAW2, hash = CRUSH_HASH_DEFAULT;
+	int n = 0;
+	int i;
+	int r;
+
+	if (!table_find(&c->types, &c->tok, &type))
+		return fail(c);
+	r = next_word(c);
+	if (r)
+		return r;
+	if (table_find(&c->items, &c->tok, &r))
+		return fail(c);
+	name = c->tok;
+	r = expect(c, "{");
+	if (r)
+		return r;
+
+	for (;;) {
+		if (!next(c))
+			return fail(c);
+		if (is(c, "}")) {
+			break;
+		} else if (is(c, "id")) {
+			r = next_int(c, INT_MIN + 1, -1, &id);
+		} else if (is(c, "alg")) {
+			r = next_word(c);
+			if (r)
+				return r;
+			if (is(c, "uniform"))
+				alg = CRUSH_BUCKET_UNIFORM;
+			else if (is(c, "list"))
+				alg = CRUSH_BUCKET_LIST;
+			else if (is(c, "tree"))
+				alg = CRUSH_BUCKET_TREE;
+			else if (is(c, "straw"))
+				alg = CRUSH_BUCKET_STRAW;
+			else if (is(c, "straw2"))
+				alg = CRUSH_BUCKET_STRAW2;
+			else
+				return fail(c);
+		} else if (is(c, "hash")) {
+			r = next_word(c);
+			if (r)
+				return r;
+			if (!is(c, "rjenkins1")) {
+				unget(c);
+				r = next_int(c, CRUSH_HASH_RJENKINS1,
+					     CRUSH_HASH_RJENKINS1, &hash);
+			}
+		} else if (is(c, "item")) {
+			int item, weight, pos = -1;
+
+			r = next_word(c);
+			if (r)
+				return r;
+			if (!table_find(&c->items, &c->tok, &item))
+				return fail(c);
+			weight = item >= 0 ? 0x10000 :
+				(int)c->map->buckets[-1-item]->weight;
+			for (;;) {
+				if (!next(c))
+					return fail(c);
+				if (is(c, "weight")) {
+					r = next_weight(c, &weight);
+				} else if (is(c, "pos")) {
+					r = next_int(c, 0, INT_MAX, &pos);
+				} else {
+					unget(c);
+					break;
+				}
+				if (r)
+					return r;
+			}
+			r = add_bucket_item(c, n++, item, weight, pos);
+		} else {
+			return fail(c);
+		}
+		if (r)
+			return r;
+	}
+
+	if (place_bucket_items(c, n))
+		return fail(c);
+	if (alg == CRUSH_BUCKET_UNIFORM)
+		for (i = 1; i < n; i++)
+			if (c->placed_weights[i] != c->placed_weights[0])
+				return fail(c);
+	bucket = crush_make_bucket(c->map, alg, hash, type, n,
+				   c->placed_items, c->placed_weights);
+	if (!bucket)
+		return fail(c);
+	r = crush_add_bucket(c->map, id, bucket, &id);
+	if (r) {
+		crush_destroy_bucket(bucket);
+		return r == -EEXIST ? fail(c) : r;
+	}
+	c->tok = name;
+	name.s = intern(c);
+	r = table_insert(&c->items, name.s, id);
+	if (r)
+		return r;
+	return array_set(&c->buckets, -1-id, (char *)name.s);
+}
+
+static int parse_step(struct compiler *c, struct crush_rule_step *step)
+{
+	static const struct {
+		const char *name;
+		int op;
+	} set_steps[] = {
+		{ "set_choose_tries", CRUSH_RULE_SET_CHOOSE_TRIES },
+		{ "set_chooseleaf_tries", CRUSH_RULE_SET_CHOOSELEAF_TRIES },
+		{ "set_choose_local_tries", CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES },
+		{ "set_choose_local_fallback_tries",
+		  CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES },
+		{ "set_chooseleaf_vary_r", CRUSH_RULE_SET_CHOOSELEAF_VARY_R },
+		{ "set_chooseleaf_stable", CRUSH_RULE_SET_CHOOSELEAF_STABLE },
+	};
+	int leaf;
+	size_t i;
+	int r;
+
+	step->arg1 = 0;
+	step->arg2 = 0;
+	r = next_word(c);
+	if (r)
+		return r;
+	if (is(c, "take")) {
+		step->op = CRUSH_RULE_TAKE;
+		r = next_word(c);
+		if (r)
+			return r;
+		if (!table_find(&c->items, &c->tok, &step->arg1))
+			return fail(c);
+		return 0;
+	}
+	if (is(c, "emit")) {
+		step->op = CRUSH_RULE_EMIT;
+		return 0;
+	}
+	if (is(c, "noop")) {
+		step->op = CRUSH_RULE_NOOP;
+		return 0;
+	}
+	for (i = 0; i < sizeof(set_steps) / sizeof(set_steps[0]); i++)
+		if (is(c, set_steps[i].name)) {
+			step->op = set_steps[i].op;
+			return next_int(c, INT_MIN, INT_MAX, &step->arg1);
+		}
+	if (!is(c, "choose") && !is(c, "chooseleaf"))
+		return fail(c);
+	leaf = is(c, "chooseleaf");
+	r = next_word(c);
+	if (r)
+		return r;
+	if (is(c, "firstn"))
+		step->op = leaf ? CRUSH_RULE_CHOOSELEAF_FIRSTN :
+			CRUSH_RULE_CHOOSE_FIRSTN;
+	else if (is(c, "indep"))
+		step->op = leaf ? CRUSH_RULE_CHOOSELEAF_INDEP :
+			CRUSH_RULE_CHOOSE_INDEP;
+	else if (is(c, "topk"))
+		step->op = leaf ? CRUSH_RULE_CHOOSELEAF_TOPK :
+			CRUSH_RULE_CHOOSE_TOPK;
+	else
+		return fail(c);
+	r = next_int(c, INT_MIN, INT_MAX, &step->arg1);
+	if (r)
+		return r;
+	r = expect(c, "type");
+	if (r)
+		return r;
+	r = next_word(c);
+	if (r)
+		return r;
+	if (!table_find(&c->types, &c->tok, &step->arg2))
+		return fail(c);
+	return 0;
+}
+
+static int parse_rule(struct compiler *c)
+{
+	struct crush_map *m = c->map;
+	struct crush_rule *rule;
+	char *name = NULL;
+	int ruleno = -1, ruleset = -1, type = 1, min_size = 1, max_size = 10;
+	int len = 0;
+	int r;
+
+	if (!next(c) || is(c, "}"))
+		return fail(c);
+	if (!is(c, "{")) {
+		name = intern(c);
+		r = expect(c, "{");
+		if (r)
+			return r;
+	}
+
+	for (;;) {
+		if (!next(c))
+			return fail(c);
+		if (is(c, "}")) {
+			break;
+		} else if (is(c, "id")) {
+			r = next_int(c, 0, CRUSH_MAX_RULES - 1, &ruleno);
+		} else if (is(c, "ruleset") || is(c, "pool")) {
+			r = next_int(c, 0, U8_MAX, &ruleset);
+		} else if (is(c, "type")) {
+			r = next_word(c);
+			if (r)
+				return r;
+			if (is(c, "replicated")) {
+				type = 1;
+			} else if (is(c, "erasure")) {
+				type = 3;
+			} else {
+				unget(c);
+				r = next_int(c, 0, U8_MAX, &type);
+			}
+		} else if (is(c, "min_size")) {
+			r = next_int(c, 0, U8_MAX, &min_size);
+		} else if (is(c, "max_size")) {
+			r = next_int(c, 0, U8_MAX, &max_size);
+		} else if (is(c, "step")) {
+			if (len == c->steps_max) {
+				int size = len ? 2 * len : 16;
+				void *p = realloc(c->steps,
+						  sizeof(*c->steps) * size);
+
+				if (!p)
+					return -ENOMEM;
+				c->steps = p;
+				c->steps_max = size;
+			}
+			r = parse_step(c, &c->steps[len++]);
+		} else {
+			return fail(c);
+		}
+		if (r)
+			return r;
+	}
+
+	if (ruleno < 0) {
+		for (ruleno = 0; ruleno < (int)m->max_rules; ruleno++)
+			if (!m->rules[ruleno])
+				break;
+		if (ruleno == CRUSH_MAX_RULES)
+			return fail(c);
+	} else if (ruleno < (int)m->max_rules && m->rules[ruleno]) {
+		return fail(c);
+	}
+	rule = crush_make_rule(len, ruleset < 0 ? ruleno : ruleset, type,
+			       min_size, max_size);
+	if (!rule)
+		return -ENOMEM;
+	memcpy(rule->steps, c->steps, sizeof(*c->steps) * len);
+	r = crush_add_rule(m, rule, ruleno);
+	if (r < 0) {
+		crush_destroy_rule(rule);
+		return r;
+	}
+	return name ? array_set(&c->rules, ruleno, name) : 0;
+}
+
+static int compile(struct compiler *c)
+{
+	int r;
+
+	while (next(c)) {
+		if (is(c, "tunable"))
+			r = parse_tunable(c);
+		else if (is(c, "device"))
+			r = parse_device(c);
+		else if (is(c, "type"))
+			r = parse_type(c);
+		else if (is(c, "rule"))
+			r = parse_rule(c);
+		else
+			r = parse_bucket(c);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+int crush_text_compile(const char *text, size_t size,
+		       struct crush_text_map **tm, int *line)
+{
+	struct compiler c;
+	struct crush_text_map *t = NULL;
+	int r = -ENOMEM;
+
+	memset(&c, 0, sizeof(c));
+	c.p = text;
+	c.end = text + size;
+	c.line = 1;
+	c.map = crush_create();
+	/* each name is a token followed by a separator or the end */
+	c.strings = malloc(size + 1);
+	if (!c.map || !c.strings)
+		goto out;
+	r = compile(&c);
+	if (r)
+		goto out;
+
+	crush_finalize(c.map);
+	if (c.max_devices > c.map->max_devices)
+		c.map->max_devices = c.max_devices;
+	r = -ENOMEM;
+	t = calloc(1, sizeof(*t));
+	if (!t ||
+	    array_resize(&c.devices, c.map->max_devices) ||
+	    array_resize(&c.buckets, c.map->max_buckets) ||
+	    array_resize(&c.rules, c.map->max_rules))
+		goto out;
+	t->map = c.map;
+	t->device_names = c.devices.names;
+	t->bucket_names = c.buckets.names;
+	t->rule_names = c.rules.names;
+	t->type_names = c.type_names.names;
+	t->max_types = c.type_names.size;
+	t->strings = c.strings;
+	*tm = t;
+	t = NULL;
+	c.map = NULL;
+	c.devices.names = c.buckets.names = c.rules.names = NULL;
+	c.type_names.names = NULL;
+	c.strings = NULL;
+	r = 0;
+out:
+	if (r == -EINVAL && line)
+		*line = c.error_line;
+	free(t);
+	if (c.map)
+		crush_destroy(c.map);
+	free(c.strings);
+	free(c.items.entries);
+	free(c.types.entries);
+	free(c.devices.names);
+	free(c.buckets.names);
+	free(c.rules.names);
+	free(c.type_names.names);
+	free(c.bucket_items);
+	free(c.order);
+	free(c.placed_items);
+	free(c.placed_weights);
+	free(c.steps);
+	return r;
+}
+
+void crush_destroy_text_map(struct crush_text_map *tm)
+{
+	if (!tm)
+		return;
+	crush_destroy(tm->map);
+	free(tm->device_names);
+	free(tm->bucket_names);
+	free(tm->rule_names);
+	free(tm->type_names);
+	free(tm->strings);
+	free(tm);
+}
+
+struct output {
+	char *buf;
+	size_t size;
+	size_t len;
+	int error;
+};
+
+static void out(struct output *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (o->error)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+	va_end(ap);
+	if (o->len + n >= o->size) {
+		size_t size = 2 * o->size > o->len + n + 1 ?
+			2 * o->size : o->len + n + 1;
+		char *buf = realloc(o->buf, size);
+
+		if (!buf) {
+			o->error = -ENOMEM;
+			return;
+		}
+		o->buf = buf;
+		o->size = size;
+		va_start(ap, fmt);
+		vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+		va_end(ap);
+	}
+	o->len += n;
+}
+
+/* the name of __index__ in __names__ or __prefix__ followed by __index__ */
+static const char *name_of(char **names, int size, int index,
+			   const char *prefix, char *tmp)
+{
+	if (names && index >= 0 && index < size && names[index])
+		return names[index];
+	sprintf(tmp, "%s%d", prefix, index);
+	return tmp;
+}
+
+static const char *item_name(const struct crush_text_map *tm, int item,
+			     char *tmp)
+{
+	if (item >= 0)
+		return name_of(tm->device_names, tm->map->max_devices, item,
+			       "device", tmp);
+	return name_of(tm->bucket_names, tm->map->max_buckets, -1-item,
+		       "bucket", tmp);
+}
+
+static const char *type_name(const struct crush_text_map *tm, int type,
+			     char *tmp)
+{
+	return name_of(tm->type_names, tm->max_types, type, "type", tmp);
+}
+
+/* a 16.16 fixed point weight with enough decimals to be read back */
+static void out_weight(struct output *o, __u32 weight)
+{
+	__u32 integer = weight >> 16;
+	__u32 fraction = ((weight & 0xffff) * 100000ull + 0x8000) >> 16;
+
+	if (fraction == 100000) {
+		integer++;
+		fraction = 0;
+	}
+	out(o, "%u.%05u", integer, fraction);
+}
+
+static const char *alg_name(int alg)
+{
+	switch (alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return "uniform";
+	case CRUSH_BUCKET_LIST:
+		return "list";
+	case CRUSH_BUCKET_TREE:
+		return "tree";
+	case CRUSH_BUCKET_STRAW:
+		return "straw";
+	default:
+		return "straw2";
+	}
+}
+
+/*
+ * Write the bucket __b__ after the buckets it contains. The __state__
+ * of a bucket is 1 once it is being written.
+ */
+static void out_bucket(struct output *o, const struct crush_text_map *tm,
+		       int b, char *state)
+{
+	const struct crush_bucket *bucket = tm->map->buckets[b];
+	char tmp[2][32];
+	__u32 i;
+
+	if (!bucket || state[b])
+		return;
+	state[b] = 1;
+	for (i = 0; i < bucket->size; i++) {
+		int child = -1-bucket->items[i];
+
+		if (child >= 0 && child < tm->map->max_buckets)
+			out_bucket(o, tm, child, state);
+	}
+	out(o, "%s %s {\n", type_name(tm, bucket->type, tmp[0]),
+	    item_name(tm, bucket->id, tmp[1]));
+	out(o, "\tid %d\n", bucket->id);
+	out(o, "\talg %s\n", alg_name(bucket->alg));
+	out(o, "\thash %d\n", bucket->hash);
+	for (i = 0; i < bucket->size; i++) {
+		out(o, "\titem %s weight ",
+		    item_name(tm, bucket->items[i], tmp[0]));
+		out_weight(o, crush_get_bucket_item_weight(bucket, i));
+		out(o, "\n");
+	}
+	out(o, "}\n");
+}
+
+static int out_step(struct output *o, const struct crush_text_map *tm,
+		    const struct crush_rule_step *step)
+{
+	static const char *const steps[] = {
+		[CRUSH_RULE_NOOP] = "noop",
+		[CRUSH_RULE_TAKE] = "take",
+		[CRUSH_RULE_CHOOSE_FIRSTN] = "choose firstn",
+		[CRUSH_RULE_CHOOSE_INDEP] = "choose indep",
+		[CRUSH_RULE_EMIT] = "emit",
+		[CRUSH_RULE_CHOOSELEAF_FIRSTN] = "chooseleaf firstn",
+		[CRUSH_RULE_CHOOSELEAF_INDEP] = "chooseleaf indep",
+		[CRUSH_RULE_SET_CHOOSE_TRIES] = "set_choose_tries",
+		[CRUSH_RULE_SET_CHOOSELEAF_TRIES] = "set_chooseleaf_tries",
+		[CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES] = "set_choose_local_tries",
+		[CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES] =
+			"set_choose_local_fallback_tries",
+		[CRUSH_RULE_SET_CHOOSELEAF_VARY_R] = "set_chooseleaf_vary_r",
+		[CRUSH_RULE_SET_CHOOSELEAF_STABLE] = "set_chooseleaf_stable",
+		[CRUSH_RULE_CHOOSE_TOPK] = "choose topk",
+		[CRUSH_RULE_CHOOSELEAF_TOPK] = "chooseleaf topk",
+	};
+	char tmp[32];
+
+	if (step->op >= sizeof(steps) / sizeof(steps[0]) || !steps[step->op])
+		return -EINVAL;
+	out(o, "\tstep %s", steps[step->op]);
+	switch (step->op) {
+	case CRUSH_RULE_NOOP:
+	case CRUSH_RULE_EMIT:
+		break;
+	case CRUSH_RULE_TAKE:
+		out(o, " %s", item_name(tm, step->arg1, tmp));
+		break;
+	case CRUSH_RULE_CHOOSE_FIRSTN:
+	case CRUSH_RULE_CHOOSE_INDEP:
+	case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+	case CRUSH_RULE_CHOOSELEAF_INDEP:
+	case CRUSH_RULE_CHOOSE_TOPK:
+	case CRUSH_RULE_CHOOSELEAF_TOPK:
+		out(o, " %d type %s", step->arg1,
+		    type_name(tm, step->arg2, tmp));
+		break;
+	default:
+		out(o, " %d", step->arg1);
+		break;
+	}
+	out(o, "\n");
+	return 0;
+}
+
+static int out_rule(struct output *o, const struct crush_text_map *tm,
+		    int ruleno)
+{
+	const struct crush_rule *rule = tm->map->rules[ruleno];
+	char tmp[32];
+	__u32 j;
+	int r;
+
+	out(o, "rule %s {\n", name_of(tm->rule_names, tm->map->max_rules,
+				      ruleno, "rule", tmp));
+	out(o, "\tid %d\n", ruleno);
+	out(o, "\truleset %d\n", rule->mask.ruleset);
+	if (rule->mask.type == 1)
+		out(o, "\ttype replicated\n");
+	else if (rule->mask.type == 3)
+		out(o, "\ttype erasure\n");
+	else
+		out(o, "\ttype %d\n", rule->mask.type);
+	out(o, "\tmin_size %d\n", rule->mask.min_size);
+	out(o, "\tmax_size %d\n", rule->mask.max_size);
+	for (j = 0; j < rule->len; j++) {
+		r = out_step(o, tm, &rule->steps[j]);
+		if (r)
+			return r;
+	}
+	out(o, "}\n");
+	return 0;
+}
+
+/* mark the devices and types that must be declared */
+static void mark_used(const struct crush_text_map *tm, char *devices,
+		      unsigned char *types)
+{
+	const struct crush_map *m = tm->map;
+	int b;
+	__u32 i, j;
+
+	for (b = 0; b < m->max_buckets; b++) {
+		const struct crush_bucket *bucket = m->buckets[b];
+
+		if (!bucket)
+			continue;
+		types[bucket->type / 8] |= 1 << bucket->type % 8;
+		for (i = 0; i < bucket->size; i++)
+			if (bucket->items[i] >= 0 &&
+			    bucket->items[i] < m->max_devices)
+				devices[bucket->items[i]] = 1;
+	}
+	for (i = 0; i < m->max_rules; i++) {
+		const struct crush_rule *rule = m->rules[i];
+
+		for (j = 0; rule && j < rule->len; j++) {
+			const struct crush_rule_step *s = &rule->steps[j];
+
+			switch (s->op) {
+			case CRUSH_RULE_TAKE:
+				if (s->arg1 >= 0 && s->arg1 < m->max_devices)
+					devices[s->arg1] = 1;
+				break;
+			case CRUSH_RULE_CHOOSE_FIRSTN:
+			case CRUSH_RULE_CHOOSE_INDEP:
+			case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+			case CRUSH_RULE_CHOOSELEAF_INDEP:
+			case CRUSH_RULE_CHOOSE_TOPK:
+			case CRUSH_RULE_CHOOSELEAF_TOPK:
+				if (s->arg2 >= 0 &&
+				    s->arg2 < CRUSH_TEXT_MAX_TYPES)
+					types[s->arg2 / 8] |= 1 << s->arg2 % 8;
+				break;
+			}
+		}
+	}
+}
+
+int crush_text_decompile(const struct crush_text_map *tm,
+			 char **text, size_t *size)
+{
+	const struct crush_map *m = tm->map;
+	struct output o;
+	unsigned char types[CRUSH_TEXT_MAX_TYPES / 8];
+	char *devices, *state;
+	char tmp[32];
+	int b, d, t;
+	__u32 i;
+	int r = 0;
+
+	memset(&o, 0, sizeof(o));
+	memset(types, 0, sizeof(types));
+	devices = calloc(m->max_devices + 1, 1);
+	state = calloc(m->max_buckets + 1, 1);
+	o.size = 4096;
+	o.buf = malloc(o.size);
+	if (!devices || !state || !o.buf) {
+		r = -ENOMEM;
+		goto out;
+	}
+	mark_used(tm, devices, types);
+
+	out(&o, "# begin crush map\n");
+	out(&o, "tunable choose_local_tries %u\n", m->choose_local_tries);
+	out(&o, "tunable choose_local_fallback_tries %u\n",
+	    m->choose_local_fallback_tries);
+	out(&o, "tunable choose_total_tries %u\n", m->choose_total_tries);
+	out(&o, "tunable chooseleaf_descend_once %u\n",
+	    m->chooseleaf_descend_once);
+	out(&o, "tunable chooseleaf_vary_r %u\n", m->chooseleaf_vary_r);
+	out(&o, "tunable chooseleaf_stable %u\n", m->chooseleaf_stable);
+	out(&o, "tunable straw_calc_version %u\n", m->straw_calc_version);
+	out(&o, "tunable allowed_bucket_algs %u\n", m->allowed_bucket_algs);
+
+	out(&o, "\n# devices\n");
+	for (d = 0; d < m->max_devices; d++)
+		if (devices[d] || (tm->device_names && tm->device_names[d]))
+			out(&o, "device %d %s\n", d, item_name(tm, d, tmp));
+
+	out(&o, "\n# types\n");
+	for (t = 0; t < CRUSH_TEXT_MAX_TYPES; t++)
+		if ((types[t / 8] & 1 << t % 8) ||
+		    (tm->type_names && t < tm->max_types && tm->type_names[t]))
+			out(&o, "type %d %s\n", t, type_name(tm, t, tmp));
+
+	out(&o, "\n# buckets\n");
+	for (b = 0; b < m->max_buckets; b++)
+		out_bucket(&o, tm, b, state);
+
+	out(&o, "\n# rules\n");
+	for (i = 0; i < m->max_rules; i++) {
+		if (!m->rules[i])
+			continue;
+		r = out_rule(&o, tm, i);
+		if (r)
+			goto out;
+	}
+	out(&o, "\n# end crush map\n");
+
+	r = o.error;
+	if (!r) {
+		*text = o.buf;
+		if (size)
+			*size = o.len;
+		o.buf = NULL;
+	}
+out:
+	free(o.buf);
+	free(devices);
+	free(state);
+	return r;
+}
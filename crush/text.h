@@ -0,0 +1,102 @@
+#ifndef CEPH_CRUSH_TEXT_H
+#define CEPH_CRUSH_TEXT_H
+
+/*
+ * The text format of a crush_map, as documented in sample.txt and
+ * written by crushtool -d.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * A crush_map and the names of its devices, buckets, rules and types.
+ * A name is NULL if the text did not give one.
+ */
+struct crush_text_map {
+	struct crush_map *map;     /*!< the map */
+	char **device_names;       /*!< __map->max_devices__ names or NULL */
+	char **bucket_names;       /*!< __map->max_buckets__ names or NULL */
+	char **rule_names;         /*!< __map->max_rules__ names or NULL */
+	char **type_names;         /*!< __max_types__ names or NULL */
+	int max_types;             /*!< the size of __type_names__ */
+	char *strings;             /*!< where the names are stored */
+};
+
+/** @ingroup API
+ *
+ * Compile the __size__ bytes of __text__ into a crush_map. The text is
+ * a sequence of declarations, in this order:
+ *
+ * - __tunable__ name value
+ * - __device__ id name, optionally followed by __class__ name,
+ *   __down__ or __offload__ value, which are ignored
+ * - __type__ id name
+ * - type-name bucket-name { ... } with the optional __id__,
+ *   __alg__ (__straw2__ by default), __hash__ and the __item__ name
+ *   [__weight__ w] [__pos__ p] lines. An item is a device or a bucket
+ *   declared before. The weight of a device defaults to 1, the weight
+ *   of a bucket to the sum of its items and the items without a
+ *   __pos__ fill the positions left in order.
+ * - __rule__ [name] { ... } with the optional __id__, __ruleset__ (or
+ *   __pool__), __type__, __min_size__ and __max_size__ lines and
+ *   __step__ lines: __take__ item, __choose__ or __chooseleaf__
+ *   followed by __firstn__, __indep__ or __topk__ n __type__ type-name,
+ *   __emit__, __noop__ and the __set_choose_tries__, etc. n steps
+ *
+ * Words are separated by spaces or new lines, __#__ starts a comment
+ * and weights are decimal numbers. The text is read in a single pass,
+ * the names are looked up in hash tables and each bucket is built
+ * once all its items are known. A bucket without an __id__ gets the
+ * first free one: the __id__ of the buckets that follow must not be
+ * the same.
+ *
+ * The returned map is finalized and must be deallocated with
+ * crush_destroy_text_map().
+ *
+ * - return -EINVAL and set __*line__ if the text is not valid
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param text the text of the map
+ * @param size the size of __text__
+ * @param tm set to the compiled map on success
+ * @param line NULL or set to the line of the error
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_text_compile(const char *text, size_t size,
+			      struct crush_text_map **tm, int *line);
+
+/** @ingroup API
+ *
+ * Set __*text__ to the text of __tm__, null terminated, and __*size__
+ * to its length. The text compiles back into the same map with
+ * crush_text_compile(). The devices, buckets, rules and types that
+ * have no name are given one, such as __device3__ or __type1__.
+ * Buckets are written after their items.
+ *
+ * The text must be deallocated with __free(3)__.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param tm the map and its names, which can all be NULL
+ * @param text set to the text on success
+ * @param size NULL or set to the length of the text
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_text_decompile(const struct crush_text_map *tm,
+				char **text, size_t *size);
+
+/** @ingroup API
+ *
+ * Deallocate a crush_text_map set by crush_text_compile(), including its
+ * crush_map.
+ *
+ * @param tm the crush_text_map or NULL
+ */
+extern void crush_destroy_text_map(struct crush_text_map *tm);
+
+#endif
@@ -0,0 +1,547 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "image.h"
+#include "encoding.h"
+#include "text.h"
+}
+
+//
+// Synthetic clusters: a hierarchy of __depth__ levels of buckets
+// (root of type __depth__ down to hosts of type 1), each bucket
+// containing __fanout__ items, for a total of fanout^depth devices.
+// The weight of a device is a random multiple of 0x10000 in
+// [1, skew] and out_percent % of the devices are marked out.
+//
+struct cluster_params {
+  int depth;
+  int fanout;
+  int alg;
+  int skew;
+  int out_percent;
+};
+
+struct cluster {
+  crush_map *map;
+  int rootno;
+  std::vector<__u32> weights;
+  int firstn;
+  int indep;
+};
+
+static const int bucket_algs[] = {
+  CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+  CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2,
+};
+
+static int add_rule(crush_map *m, int rootno, int op, int numrep, int type)
+{
+  struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, op, numrep, type);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  return crush_add_rule(m, rule, -1);
+}
+
+static crush_map *make_map(const cluster_params &p, int *rootno)
+{
+  std::mt19937 gen(p.depth * 1000 + p.fanout);
+  crush_map *m = crush_create();
+  std::vector<int> items, weights;
+  int devices = 1;
+
+  for (int level = 0; level < p.depth; level++)
+    devices *= p.fanout;
+  for (int i = 0; i < devices; i++) {
+    items.push_back(i);
+    // a uniform bucket only has one weight for all its items
+    if (p.alg == CRUSH_BUCKET_UNIFORM)
+      weights.push_back(0x10000 * (1 + (i / p.fanout) % p.skew));
+    else
+      weights.push_back(0x10000 * (1 + gen() % p.skew));
+  }
+  for (int type = 1; type <= p.depth; type++) {
+    std::vector<int> parent_items, parent_weights;
+    for (size_t i = 0; i < items.size(); i += p.fanout) {
+      crush_bucket *b = crush_make_bucket(m, p.alg, CRUSH_HASH_DEFAULT, type,
+                                          p.fanout, &items[i], &weights[i]);
+      int id;
+      crush_add_bucket(m, 0, b, &id);
+      parent_items.push_back(id);
+      parent_weights.push_back(b->weight);
+    }
+    items = parent_items;
+    weights = parent_weights;
+  }
+  *rootno = items[0];
+  crush_finalize(m);
+  return m;
+}
+
+static cluster make_cluster(const cluster_params &p)
+{
+  cluster c;
+  c.map = make_map(p, &c.rootno);
+  c.weights.assign(c.map->max_devices, 0x10000);
+  std::vector<int> devices(c.map->max_devices);
+  for (int i = 0; i < c.map->max_devices; i++)
+    devices[i] = i;
+  std::shuffle(devices.begin(), devices.end(), std::mt19937(p.out_percent));
+  for (int i = 0; i < c.map->max_devices * p.out_percent / 100; i++)
+    c.weights[devices[i]] = 0;
+  // one replica per host, or per device if there are no hosts
+  int type = p.depth > 1 ? 1 : 0;
+  int hosts = c.map->max_devices / (p.depth > 1 ? p.fanout : 1);
+  c.firstn = add_rule(c.map, c.rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN,
+                      std::min(3, hosts), type);
+  c.indep = add_rule(c.map, c.rootno, CRUSH_RULE_CHOOSELEAF_INDEP,
+                     std::min(6, hosts), type);
+  return c;
+}
+
+static cluster_params cluster_args(const benchmark::State &state)
+{
+  cluster_params p;
+  p.depth = state.range(0);
+  p.fanout = state.range(1);
+  p.alg = state.range(2);
+  p.skew = state.range(3);
+  p.out_percent = state.range(4);
+  return p;
+}
+
+//
+// The bucket algorithms on a mid size cluster, then the shape, the
+// weight skew and the devices out with straw2, the default.
+//
+static void cluster_shapes(benchmark::internal::Benchmark *b)
+{
+  b->ArgNames({ "depth", "fanout", "alg", "skew", "out" });
+  for (int alg : bucket_algs)
+    b->Args({ 3, 8, alg, 1, 0 });
+  for (int depth : { 2, 3, 4 })
+    for (int fanout : { 4, 16 })
+      b->Args({ depth, fanout, CRUSH_BUCKET_STRAW2, 1, 0 });
+  for (int skew : { 4, 16 })
+    b->Args({ 3, 8, CRUSH_BUCKET_STRAW2, skew, 0 });
+  for (int out : { 10, 30 })
+    b->Args({ 3, 8, CRUSH_BUCKET_STRAW2, 1, out });
+}
+
+static void do_rule(benchmark::State &state, bool indep)
+{
+  cluster c = make_cluster(cluster_args(state));
+  int ruleno = indep ? c.indep : c.firstn;
+  const int result_max = 6;
+  int result[result_max];
+  std::vector<char> cwin(crush_work_size(c.map, result_max));
+  crush_init_workspace(c.map, cwin.data());
+  int x = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crush_do_rule(c.map, ruleno, x++, result, result_max,
+                                           c.weights.data(), c.weights.size(),
+                                           cwin.data(), NULL));
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+  crush_destroy(c.map);
+}
+
+static void BM_do_rule_firstn(benchmark::State &state)
+{
+  do_rule(state, false);
+}
+BENCHMARK(BM_do_rule_firstn)->Apply(cluster_shapes);
+
+static void BM_do_rule_indep(benchmark::State &state)
+{
+  do_rule(state, true);
+}
+BENCHMARK(BM_do_rule_indep)->Apply(cluster_shapes);
+
+//
+// Erasure coded rules mapping up to 28 chunks (e.g. 20+8) to
+// distinct hosts of a 64 hosts cluster.
+//
+static void BM_do_rule_wide(benchmark::State &state)
+{
+  cluster_params p = { 3, 8, CRUSH_BUCKET_STRAW2, 1, 0 };
+  cluster c = make_cluster(p);
+  bool indep = state.range(0);
+  int numrep = state.range(1);
+  int ruleno = add_rule(c.map, c.rootno, indep ? CRUSH_RULE_CHOOSELEAF_INDEP :
+                        CRUSH_RULE_CHOOSELEAF_FIRSTN, numrep, 1);
+  std::vector<int> result(numrep);
+  std::vector<char> cwin(crush_work_size(c.map, numrep));
+  crush_init_workspace(c.map, cwin.data());
+  int x = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crush_do_rule(c.map, ruleno, x++, result.data(), numrep,
+                                           c.weights.data(), c.weights.size(),
+                                           cwin.data(), NULL));
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+  crush_destroy(c.map);
+}
+BENCHMARK(BM_do_rule_wide)
+  ->ArgNames({ "indep", "numrep" })
+  ->ArgsProduct({ { 0, 1 }, { 6, 12, 20, 28 } });
+
+//
+// Devices out on a large cluster, with and without the weights
+// prepared by crush_device_state_prepare().
+//
+static void BM_do_rule_device_state(benchmark::State &state)
+{
+  cluster_params p = { 4, 16, CRUSH_BUCKET_STRAW2, 1, (int)state.range(1) };
+  cluster c = make_cluster(p);
+  const int result_max = 6;
+  int result[result_max];
+  std::vector<char> cwin(crush_work_size(c.map, result_max));
+  crush_init_workspace(c.map, cwin.data());
+  crush_device_state devices;
+  memset(&devices, 0, sizeof(devices));
+  if (state.range(0)) {
+    crush_device_state_prepare(&devices, c.weights.data(), c.weights.size());
+    crush_work_set_device_state(cwin.data(), &devices);
+  }
+  int x = 0;
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crush_do_rule(c.map, c.indep, x++, result, result_max,
+                                           c.weights.data(), c.weights.size(),
+                                           cwin.data(), NULL));
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations());
+  crush_device_state_destroy(&devices);
+  crush_destroy(c.map);
+}
+BENCHMARK(BM_do_rule_device_state)
+  ->ArgNames({ "prepared", "out" })
+  ->ArgsProduct({ { 0, 1 }, { 0, 30 } });
+
+//
+// Remapping the values of a cluster after a host failure, with
+// crush_do_rule() or by repairing the previous results.
+//
+static void BM_do_rule_repair(benchmark::State &state)
+{
+  cluster_params p = { 3, 8, CRUSH_BUCKET_STRAW2, 1, 0 };
+  cluster c = make_cluster(p);
+  bool repair = state.range(0);
+  const int result_max = 6;
+  const int count = 1024;
+  std::vector<int> previous(count * result_max), result(count * result_max);
+  std::vector<__u64> failed(count);
+  std::vector<__u32> weights(c.weights);
+  std::vector<char> cwin(crush_work_size(c.map, result_max));
+  crush_init_workspace(c.map, cwin.data());
+  for (int x = 0; x < count; x++)
+    crush_do_rule(c.map, c.indep, x, &previous[x * result_max], result_max,
+                  c.weights.data(), c.weights.size(), cwin.data(), NULL);
+  // the devices of the first host are out
+  for (int d = 0; d < p.fanout; d++)
+    weights[d] = 0;
+  for (int i = 0; i < count * result_max; i++)
+    if (previous[i] >= 0 && previous[i] < p.fanout)
+      failed[i / result_max] |= (__u64)1 << (i % result_max);
+
+  crush_plan *plan = crush_compile_rule(c.map, c.indep);
+
+  for (auto _ : state) {
+    result = previous;
+    for (int x = 0; x < count; x++) {
+      int *o = &result[x * result_max];
+      if (repair)
+        crush_do_plan_repair(c.map, plan, x, o, result_max, failed[x],
+                             weights.data(), weights.size(), cwin.data(), NULL);
+      else
+        crush_do_rule(c.map, c.indep, x, o, result_max,
+                      weights.data(), weights.size(), cwin.data(), NULL);
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  crush_destroy_plan(plan);
+  crush_destroy(c.map);
+}
+BENCHMARK(BM_do_rule_repair)->ArgNames({ "repair" })->DenseRange(0, 1);
+
+// CHOOSELEAF_TOPK ranks the hosts once instead of drawing once per replica
+static void BM_do_rule_topk(benchmark::State &state)
+{
+  cluster_params p = { 2, 32, CRUSH_BUCKET_STRAW2, 1, 0 };
+  cluster c = make_cluster(p);
+  int numrep = state.range(1);
+  int ruleno = add_rule(c.map, c.rootno,
+                        state.range(0) ? CRUSH_RULE_CHOOSELEAF_TOPK :
+                        CRUSH_RULE_CHOOSELEAF_FIRSTN, numrep, 1);
+  std::vector<int> result(numrep);
+  std::vector<char> cwin(crush_work_size(c.map, numrep));
+  crush_init_workspace(c.map, cwin.data());
+  int x = 0;
+
+  for (auto _ : state) {
+    crush_do_rule(c.map, ruleno, x++, result.data(), numrep,
+                  c.weights.data(), c.weights.size(), cwin.data(), NULL);
+    benchmark::ClobberMemory();
+  }
+  crush_destroy(c.map);
+}
+BENCHMARK(BM_do_rule_topk)
+  ->ArgNames({ "topk", "numrep" })
+  ->ArgsProduct({ { 0, 1 }, { 3, 8 } });
+
+static void do_rule_batch(benchmark::State &state, bool indep)
+{
+  cluster c = make_cluster(cluster_args(state));
+  int ruleno = indep ? c.indep : c.firstn;
+  const int result_max = 6;
+  const int count = 1024;
+  std::vector<int> x(count), result(count * result_max);
+  std::vector<char> cwin(crush_work_size(c.map, result_max));
+  crush_init_workspace(c.map, cwin.data());
+  crush_plan *plan = crush_compile_rule(c.map, ruleno);
+  int next = 0;
+
+  for (auto _ : state) {
+    for (int i = 0; i < count; i++)
+      x[i] = next++;
+    crush_do_plan_batch(c.map, plan, x.data(), count,
+                        result.data(), result_max, result_max, NULL,
+                        c.weights.data(), c.weights.size(),
+                        cwin.data(), NULL);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  crush_destroy_plan(plan);
+  crush_destroy(c.map);
+}
+
+static void BM_do_rule_batch_firstn(benchmark::State &state)
+{
+  do_rule_batch(state, false);
+}
+BENCHMARK(BM_do_rule_batch_firstn)->Apply(cluster_shapes);
+
+static void BM_do_rule_batch_indep(benchmark::State &state)
+{
+  do_rule_batch(state, true);
+}
+BENCHMARK(BM_do_rule_batch_indep)->Apply(cluster_shapes);
+
+// a small topology edit followed by a crush_finalize()
+static void finalize(benchmark::State &state, void (*finalize)(crush_map *))
+{
+  cluster c = make_cluster(cluster_args(state));
+  crush_bucket *b = c.map->buckets[0];
+  int weight = crush_get_bucket_item_weight(b, 0);
+
+  for (auto _ : state) {
+    crush_bucket_adjust_item_weight(c.map, b, b->items[0], weight ^ 0x10000);
+    finalize(c.map);
+  }
+  crush_destroy(c.map);
+}
+
+static void BM_finalize(benchmark::State &state)
+{
+  finalize(state, crush_finalize);
+}
+BENCHMARK(BM_finalize)->Apply(cluster_shapes);
+
+static void BM_finalize_incremental(benchmark::State &state)
+{
+  finalize(state, crush_finalize_incremental);
+}
+BENCHMARK(BM_finalize_incremental)->Apply(cluster_shapes);
+
+// the startup of a process: build the map or load its image
+static void BM_image_load(benchmark::State &state)
+{
+  cluster_params p = { (int)state.range(1), (int)state.range(2),
+                       CRUSH_BUCKET_STRAW2, 1, 0 };
+  bool image = state.range(0);
+  int rootno;
+  crush_map *m = make_map(p, &rootno);
+  size_t size = crush_image_encode(m, NULL, 0);
+  std::vector<__u64> buffer((size + 7) / 8);
+  crush_image_encode(m, buffer.data(), size);
+  crush_destroy(m);
+
+  for (auto _ : state) {
+    if (image) {
+      crush_image_load(buffer.data(), size, &m);
+      crush_image_close(m);
+    } else {
+      m = make_map(p, &rootno);
+      crush_destroy(m);
+    }
+  }
+}
+BENCHMARK(BM_image_load)
+  ->ArgNames({ "image", "depth", "fanout" })
+  ->ArgsProduct({ { 0, 1 }, { 3 }, { 8, 16 } });
+
+static void BM_decode(benchmark::State &state)
+{
+  cluster_params p = { (int)state.range(1), (int)state.range(2),
+                       CRUSH_BUCKET_STRAW2, 1, 0 };
+  int flags = state.range(0);
+  int rootno;
+  crush_ceph_map cm = {};
+  cm.map = make_map(p, &rootno);
+  size_t size = crush_encode(&cm, NULL, 0);
+  std::vector<__u64> buffer((size + 7) / 8);
+  crush_encode(&cm, buffer.data(), size);
+  crush_destroy(cm.map);
+
+  for (auto _ : state) {
+    crush_ceph_map *decoded;
+    crush_decode(buffer.data(), size, flags, &decoded);
+    crush_destroy_ceph_map(decoded);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_decode)
+  ->ArgNames({ "zero_copy", "depth", "fanout" })
+  ->ArgsProduct({ { 0, CRUSH_DECODE_ZERO_COPY }, { 3 }, { 8, 16 } });
+
+//
+// Compile the text of a map with __hosts__ hosts of 20 devices in
+// racks of 100 hosts: 100000 devices and 5051 buckets for 5000 hosts.
+//
+static void BM_text_compile(benchmark::State &state)
+{
+  int hosts = state.range(0);
+  std::string text = "type 0 osd\ntype 1 host\ntype 2 rack\ntype 3 root\n";
+  for (int d = 0; d < hosts * 20; d++)
+    text += "device " + std::to_string(d) + " osd." + std::to_string(d) + "\n";
+  for (int h = 0; h < hosts; h++) {
+    text += "host host" + std::to_string(h) + " {\n\talg straw2\n";
+    for (int d = h * 20; d < (h + 1) * 20; d++)
+      text += "\titem osd." + std::to_string(d) + " weight 1.00000\n";
+    text += "}\n";
+  }
+  for (int r = 0; r < (hosts + 99) / 100; r++) {
+    text += "rack rack" + std::to_string(r) + " {\n";
+    for (int h = r * 100; h < hosts && h < (r + 1) * 100; h++)
+      text += "\titem host" + std::to_string(h) + "\n";
+    text += "}\n";
+  }
+  text += "root default {\n";
+  for (int r = 0; r < (hosts + 99) / 100; r++)
+    text += "\titem rack" + std::to_string(r) + "\n";
+  text += "}\nrule replicated {\n\tstep take default\n"
+    "\tstep chooseleaf firstn 0 type host\n\tstep emit\n}\n";
+
+  for (auto _ : state) {
+    crush_text_map *tm;
+    crush_text_compile(text.data(), text.size(), &tm, NULL);
+    crush_destroy_text_map(tm);
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_text_compile)
+  ->ArgName("hosts")
+  ->Arg(500)
+  ->Arg(5000)
+  ->Unit(benchmark::kMillisecond);
+
+static void BM_make_choose_args(benchmark::State &state)
+{
+  cluster_params p = cluster_args(state);
+  int positions = state.range(5);
+  cluster c = make_cluster(p);
+
+  for (auto _ : state) {
+    crush_choose_arg *choose_args = crush_make_choose_args(c.map, positions);
+    benchmark::DoNotOptimize(choose_args);
+    crush_destroy_choose_args(choose_args);
+  }
+  crush_destroy(c.map);
+}
+BENCHMARK(BM_make_choose_args)
+  ->ArgNames({ "depth", "fanout", "alg", "skew", "out", "positions" })
+  ->Args({ 3, 8, CRUSH_BUCKET_STRAW2, 1, 0, 1 })
+  ->Args({ 3, 8, CRUSH_BUCKET_STRAW2, 1, 0, 3 })
+  ->Args({ 4, 16, CRUSH_BUCKET_STRAW2, 1, 0, 1 })
+  ->Args({ 4, 16, CRUSH_BUCKET_STRAW2, 1, 0, 3 });
+
+//
+// Add an item to a bucket of __size__ items and remove it. The
+// num_nodes of a tree bucket is a __u8, the size is kept below 64 so
+// that adding an item does not need more than 128 nodes.
+//
+static void BM_bucket_add_remove_item(benchmark::State &state)
+{
+  int alg = state.range(0);
+  int size = state.range(1);
+  crush_map *m = crush_create();
+  std::vector<int> items(size), weights(size, 0x10000);
+  for (int i = 0; i < size; i++)
+    items[i] = i;
+  crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1,
+                                      size, items.data(), weights.data());
+  int id;
+  crush_add_bucket(m, 0, b, &id);
+
+  for (auto _ : state) {
+    crush_bucket_add_item(m, b, size, 0x10000);
+    crush_bucket_remove_item(m, b, size);
+  }
+  crush_destroy(m);
+}
+BENCHMARK(BM_bucket_add_remove_item)
+  ->ArgNames({ "alg", "size" })
+  ->ArgsProduct({ { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                    CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 },
+                  { 8, 32, 63 } });
+
+// a flat bucket of __size__ items built item by item or all at once
+static void BM_bucket_build(benchmark::State &state)
+{
+  int alg = state.range(0);
+  int size = state.range(1);
+  bool bulk = state.range(2);
+  std::vector<int> items(size), weights(size, 0x10000);
+  for (int i = 0; i < size; i++)
+    items[i] = i;
+
+  for (auto _ : state) {
+    crush_map *m = crush_create();
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1,
+                                        0, NULL, weights.data());
+    int id;
+    crush_add_bucket(m, 0, b, &id);
+    if (bulk)
+      crush_bucket_add_items(m, b, size, items.data(), weights.data());
+    else
+      for (int i = 0; i < size; i++)
+        crush_bucket_add_item(m, b, items[i], weights[i]);
+    crush_finalize(m);
+    crush_destroy(m);
+  }
+}
+BENCHMARK(BM_bucket_build)
+  ->ArgNames({ "alg", "size", "bulk" })
+  ->ArgsProduct({ { CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 },
+                  { 1000, 10000 }, { 0, 1 } });
+
+BENCHMARK_MAIN();
+
+// Local Variables:
+// compile-command: "cd ../build ; make bench_crush && test/bench_crush --benchmark_format=json"
+// End:
@@ -1,7 +1,12 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <random>
+#include <vector>
+
 extern "C" {
 #include "crush/builder.h"
+#include "crush/hash.h"
 }
 
 TEST(builder, crush_create) {
@@ -177,6 +182,433 @@ TEST(builder, crush_make_rule) {
   crush_destroy_rule(rule);
 }
 
+static void check_reciprocal(__u32 weight, __u64 n)
+{
+  struct crush_reciprocal reciprocal;
+  crush_set_reciprocal(&reciprocal, weight);
+  ASSERT_EQ(weight, reciprocal.weight);
+  // computed with 64 bit divisions, as a 128 bit division would
+  ASSERT_EQ((__u64)(((unsigned __int128)1 << reciprocal.shift) / weight) + 1,
+            reciprocal.magic);
+  __u64 q = (__u64)(((unsigned __int128)n * reciprocal.magic) >> reciprocal.shift);
+  ASSERT_EQ(n / weight, q) << "n " << n << " weight " << weight;
+}
+
+TEST(builder, crush_set_reciprocal) {
+  const __u64 max = (1ull << CRUSH_RECIPROCAL_BITS) - 1;
+  std::mt19937_64 rng(42);
+  std::vector<__u32> weights = { 1, 2, 3, 5, 7, 0x10000, 0x10001, 0xffff,
+                                 0x7fffffff, 0x80000000, 0x80000001,
+                                 0xfffffffe, 0xffffffff };
+  for (int i = 0; i < 32; i++)
+    weights.push_back(1u << i);
+  for (int i = 0; i < 500; i++)
+    weights.push_back((__u32)rng() | 1);
+  for (int i = 0; i < 500; i++)
+    weights.push_back((__u32)rng() >> (i % 32));
+
+  for (__u32 weight : weights) {
+    if (weight == 0)
+      continue;
+    std::vector<__u64> ns = { 0, 1, weight - 1ull, weight, weight + 1ull,
+                              max, max - 1, 1ull << 48, (1ull << 48) - 1 };
+    // the quotients are most likely to be wrong right before a multiple
+    __u64 k = max / weight;
+    ns.push_back(k * weight - 1);
+    ns.push_back(k * weight);
+    for (int i = 0; i < 200; i++) {
+      __u64 n = rng() & max;
+      ns.push_back(n);
+      ns.push_back(n - n % weight);
+      if (n >= weight)
+        ns.push_back(n - n % weight - 1);
+    }
+    for (__u64 n : ns)
+      if (n <= max)
+        check_reciprocal(weight, n);
+  }
+
+  struct crush_reciprocal reciprocal;
+  crush_set_reciprocal(&reciprocal, 0);
+  EXPECT_EQ(0u, reciprocal.weight);
+}
+
+TEST(builder, crush_finalize_reciprocals) {
+  crush_map *m = crush_create();
+  int items[] = { 0, 1, 2 };
+  int weights[] = { 0x10000, 0x30000, 0 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      3, items, weights);
+  int bno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &bno));
+  crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)b;
+  EXPECT_EQ(NULL, straw2->item_reciprocals);
+  crush_finalize(m);
+  ASSERT_NE((void *)NULL, straw2->item_reciprocals);
+  for (int i = 0; i < 3; i++)
+    EXPECT_EQ((__u32)weights[i], straw2->item_reciprocals[i].weight);
+
+  // the size of the bucket changes, the reciprocals are gone
+  ASSERT_EQ(0, crush_bucket_add_item(m, b, 3, 0x10000));
+  EXPECT_EQ(NULL, straw2->item_reciprocals);
+  crush_finalize(m);
+  ASSERT_NE((void *)NULL, straw2->item_reciprocals);
+  EXPECT_EQ(0x10000u, straw2->item_reciprocals[3].weight);
+  ASSERT_EQ(0, crush_bucket_remove_item(m, b, 0));
+  EXPECT_EQ(NULL, straw2->item_reciprocals);
+
+  crush_destroy(m);
+}
+
+static void expect_same_bucket(crush_bucket *a, crush_bucket *b)
+{
+  ASSERT_EQ(a->size, b->size);
+  EXPECT_EQ(a->weight, b->weight);
+  for (__u32 i = 0; i < a->size; i++)
+    EXPECT_EQ(a->items[i], b->items[i]) << i;
+  switch (a->alg) {
+  case CRUSH_BUCKET_LIST:
+    for (__u32 i = 0; i < a->size; i++) {
+      EXPECT_EQ(((crush_bucket_list *)a)->item_weights[i],
+                ((crush_bucket_list *)b)->item_weights[i]);
+      EXPECT_EQ(((crush_bucket_list *)a)->sum_weights[i],
+                ((crush_bucket_list *)b)->sum_weights[i]);
+    }
+    break;
+  case CRUSH_BUCKET_TREE:
+    ASSERT_EQ(((crush_bucket_tree *)a)->num_nodes, ((crush_bucket_tree *)b)->num_nodes);
+    for (__u32 i = 0; i < ((crush_bucket_tree *)a)->num_nodes; i++)
+      EXPECT_EQ(((crush_bucket_tree *)a)->node_weights[i],
+                ((crush_bucket_tree *)b)->node_weights[i]) << i;
+    break;
+  case CRUSH_BUCKET_STRAW:
+    EXPECT_EQ(0u, ((crush_bucket_straw *)b)->straws_stale);
+    for (__u32 i = 0; i < a->size; i++) {
+      EXPECT_EQ(((crush_bucket_straw *)a)->item_weights[i],
+                ((crush_bucket_straw *)b)->item_weights[i]);
+      EXPECT_EQ(((crush_bucket_straw *)a)->straws[i],
+                ((crush_bucket_straw *)b)->straws[i]) << i;
+    }
+    break;
+  case CRUSH_BUCKET_STRAW2:
+    for (__u32 i = 0; i < a->size; i++) {
+      EXPECT_EQ(((crush_bucket_straw2 *)a)->item_weights[i],
+                ((crush_bucket_straw2 *)b)->item_weights[i]);
+      EXPECT_EQ(((crush_bucket_straw2 *)a)->item_reciprocals[i].weight,
+                ((crush_bucket_straw2 *)b)->item_reciprocals[i].weight);
+    }
+    break;
+  }
+}
+
+TEST(builder, crush_bucket_add_remove_items) {
+  for (int alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                   CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 }) {
+    SCOPED_TRACE(alg);
+    // the num_nodes of a tree bucket cannot exceed 255
+    const int size = alg == CRUSH_BUCKET_TREE ? 60 : 300;
+    std::vector<int> items(size), weights(size);
+    for (int i = 0; i < size; i++) {
+      items[i] = i;
+      weights[i] = alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x10000 * (1 + i % 5);
+    }
+
+    // item by item
+    crush_map *one = crush_create();
+    crush_bucket *a = crush_make_bucket(one, alg, CRUSH_HASH_DEFAULT, 1,
+                                        2, items.data(), weights.data());
+    int id;
+    ASSERT_EQ(0, crush_add_bucket(one, 0, a, &id));
+    for (int i = 2; i < size; i++)
+      ASSERT_EQ(0, crush_bucket_add_item(one, a, items[i], weights[i]));
+
+    // all at once
+    crush_map *bulk = crush_create();
+    crush_bucket *b = crush_make_bucket(bulk, alg, CRUSH_HASH_DEFAULT, 1,
+                                        2, items.data(), weights.data());
+    ASSERT_EQ(0, crush_add_bucket(bulk, 0, b, &id));
+    __s32 epoch = bulk->epoch;
+    ASSERT_EQ(0, crush_bucket_add_items(bulk, b, size - 2, items.data() + 2,
+                                        weights.data() + 2));
+    EXPECT_NE(epoch, bulk->epoch);
+    if (alg == CRUSH_BUCKET_STRAW)
+      EXPECT_EQ(1u, ((crush_bucket_straw *)b)->straws_stale);
+    crush_finalize(one);
+    crush_finalize(bulk);
+    expect_same_bucket(a, b);
+
+    // the straws are the same as if the bucket was made with all the items
+    if (alg == CRUSH_BUCKET_STRAW) {
+      crush_bucket *c = crush_make_bucket(bulk, alg, CRUSH_HASH_DEFAULT, 1,
+                                          size, items.data(), weights.data());
+      expect_same_bucket(c, b);
+      crush_destroy_bucket(c);
+    }
+
+    // nothing is removed if an item is missing
+    int missing[] = { 3, size };
+    EXPECT_EQ(-ENOENT, crush_bucket_remove_items(bulk, b, 2, missing));
+    EXPECT_EQ((__u32)size, b->size);
+
+    // the trailing items and some in the middle, in any order
+    std::vector<int> removed;
+    for (int i = size - 1; i >= 0; i -= (i > size - 10 ? 1 : 7))
+      removed.push_back(items[i]);
+    removed.push_back(removed[0]);
+    for (size_t i = 0; i < removed.size() - 1; i++)
+      ASSERT_EQ(0, crush_bucket_remove_item(one, a, removed[i]));
+    ASSERT_EQ(0, crush_bucket_remove_items(bulk, b, removed.size(), removed.data()));
+    crush_finalize(one);
+    crush_finalize(bulk);
+    expect_same_bucket(a, b);
+
+    // emptied
+    std::vector<int> rest;
+    for (int i = 0; i < size; i++)
+      if (std::find(removed.begin(), removed.end(), items[i]) == removed.end())
+        rest.push_back(items[i]);
+    ASSERT_EQ(0, crush_bucket_remove_items(bulk, b, rest.size(), rest.data()));
+    EXPECT_EQ(0u, b->size);
+    EXPECT_EQ(0u, b->weight);
+    crush_finalize(bulk);
+    ASSERT_EQ(0, crush_bucket_add_items(bulk, b, 1, items.data(), weights.data()));
+    EXPECT_EQ(1u, b->size);
+
+    crush_destroy(one);
+    crush_destroy(bulk);
+  }
+}
+
+TEST(builder, crush_bucket_add_items_errors) {
+  crush_map *m = crush_create();
+  int items[] = { 0, 1 };
+  int weights[] = { 0x10000, 0x10000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_UNIFORM, CRUSH_HASH_DEFAULT, 1,
+                                      1, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  int bad[] = { 0x10000, 0x20000 };
+  EXPECT_EQ(-EINVAL, crush_bucket_add_items(m, b, 2, items, bad));
+  EXPECT_EQ(-EINVAL, crush_bucket_add_items(m, b, -1, items, weights));
+  EXPECT_EQ(1u, b->size);
+
+  crush_bucket *l = crush_make_bucket(m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT, 1,
+                                      1, items, weights);
+  ASSERT_EQ(0, crush_add_bucket(m, 0, l, &id));
+  int heavy[] = { 0x7fffffff, 0x7fffffff };
+  EXPECT_EQ(-ERANGE, crush_bucket_add_items(m, l, 2, items, heavy));
+  EXPECT_EQ(1u, l->size);
+  EXPECT_EQ(0x10000u, l->weight);
+
+  // an item in the bucket twice does not stand for a missing one
+  int twice[] = { 0, 0, 1 };
+  int twice_weights[] = { 0x10000, 0x10000, 0x10000 };
+  crush_bucket *d = crush_make_bucket(m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT, 1,
+                                      3, twice, twice_weights);
+  ASSERT_EQ(0, crush_add_bucket(m, 0, d, &id));
+  int missing[] = { 0, 5 };
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_items(m, d, 2, missing));
+  EXPECT_EQ(3u, d->size);
+  crush_destroy(m);
+}
+
+// the straws stay with their items when items are removed
+TEST(builder, crush_bucket_remove_straw_items) {
+  crush_map *m = crush_create();
+  const int size = 10;
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    weights[i] = 0x10000 * (1 + i % 3);
+  }
+  crush_bucket_straw *b = (crush_bucket_straw *)crush_make_bucket(
+    m, CRUSH_BUCKET_STRAW, CRUSH_HASH_DEFAULT, 1, size, items.data(), weights.data());
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, &b->h, &id));
+  std::vector<__u32> straws(b->straws, b->straws + size);
+
+  ASSERT_EQ(0, crush_bucket_remove_item(m, &b->h, 2));
+  int removed[] = { 7, 0 };
+  ASSERT_EQ(0, crush_bucket_remove_items(m, &b->h, 2, removed));
+  ASSERT_EQ((__u32)size - 3, b->h.size);
+  for (__u32 j = 0; j < b->h.size; j++)
+    EXPECT_EQ(straws[b->h.items[j]], b->straws[j]) << "item " << b->h.items[j];
+  crush_destroy(m);
+}
+
+// the 0 left in place of a removed tree item is not device 0
+TEST(builder, crush_bucket_remove_tree_items) {
+  crush_map *m = crush_create();
+  int device[] = { 1 };
+  int weight[] = { 0x10000 };
+  crush_bucket *sub = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                        1, device, weight);
+  int subid;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, sub, &subid));
+  int items[] = { subid, 7, 0 };
+  int weights[] = { 0x10000, 0x10000, 0x10000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_TREE, CRUSH_HASH_DEFAULT, 2,
+                                      3, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  crush_bucket_tree *t = (crush_bucket_tree *)b;
+
+  // the bucket goes first and leaves a 0 before device 0
+  int removed[] = { 0, subid };
+  ASSERT_EQ(0, crush_bucket_remove_items(m, b, 2, removed));
+  EXPECT_EQ(0x10000u, b->weight);
+  for (__u32 i = 0; i < b->size; i++)
+    if (b->items[i] == 0)
+      EXPECT_EQ(0u, t->node_weights[crush_calc_tree_node(i)]) << i;
+    else
+      EXPECT_EQ(7, b->items[i]);
+
+  // only the 0s left by removed items are there
+  int zero[] = { 0 };
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_items(m, b, 1, zero));
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, b, 0));
+  EXPECT_EQ(0x10000u, b->weight);
+  crush_destroy(m);
+}
+
+// arrays allocated by the caller with exactly the number of items
+TEST(builder, crush_bucket_add_item_exact_arrays) {
+  crush_map *m = crush_create();
+  const int size = 17;
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    weights[i] = 0x10000;
+  }
+  crush_bucket_list *b = (crush_bucket_list *)crush_make_bucket(
+    m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT, 1, size, items.data(), weights.data());
+  __s32 *exact_items = (__s32 *)malloc(sizeof(__s32) * size);
+  __u32 *exact_weights = (__u32 *)malloc(sizeof(__u32) * size);
+  __u32 *exact_sums = (__u32 *)malloc(sizeof(__u32) * size);
+  memcpy(exact_items, b->h.items, sizeof(__s32) * size);
+  memcpy(exact_weights, b->item_weights, sizeof(__u32) * size);
+  memcpy(exact_sums, b->sum_weights, sizeof(__u32) * size);
+  free(b->h.items);
+  free(b->item_weights);
+  free(b->sum_weights);
+  b->h.items = exact_items;
+  b->item_weights = exact_weights;
+  b->sum_weights = exact_sums;
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, &b->h, &id));
+  ASSERT_EQ(0, crush_bucket_add_item(m, &b->h, size, 0x10000));
+  EXPECT_EQ((__u32)size + 1, b->h.size);
+  EXPECT_EQ(size, b->h.items[size]);
+  EXPECT_EQ((__u32)(size + 1) * 0x10000, b->sum_weights[size]);
+  crush_destroy(m);
+}
+
+// the straws and reciprocals are up to date
+static void expect_finalized(crush_map *m)
+{
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (bucket == NULL)
+      continue;
+    if (bucket->alg == CRUSH_BUCKET_STRAW) {
+      EXPECT_EQ(0u, ((crush_bucket_straw *)bucket)->straws_stale);
+    } else if (bucket->alg == CRUSH_BUCKET_STRAW2) {
+      crush_bucket_straw2 *straw2 = (crush_bucket_straw2 *)bucket;
+      ASSERT_NE((void *)NULL, straw2->item_reciprocals);
+      for (__u32 i = 0; i < bucket->size; i++)
+        EXPECT_EQ(straw2->item_weights[i], straw2->item_reciprocals[i].weight);
+    }
+  }
+}
+
+TEST(builder, crush_finalize_incremental) {
+  std::mt19937 random(42);
+  crush_map *m = crush_create();
+  EXPECT_EQ((void *)NULL, m->changes);
+  const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                       CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 };
+  std::vector<crush_bucket *> buckets;
+  for (int alg : algs) {
+    int items[] = { 0, 1, 2 };
+    int weights[] = { 0x10000, 0x10000, 0x10000 };
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 3, items, weights);
+    int id;
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+    buckets.push_back(b);
+  }
+  crush_finalize(m);
+  ASSERT_NE((void *)NULL, m->changes);
+
+  int next_device = 3;
+  for (int step = 0; step < 2000; step++) {
+    size_t index = random() % buckets.size();
+    crush_bucket *b = buckets[index];
+    int weight = b->alg == CRUSH_BUCKET_UNIFORM ?
+      ((crush_bucket_uniform *)b)->item_weight : 0x10000 * (1 + random() % 4);
+    int existing = b->size ? b->items[random() % b->size] : 0;
+    switch (random() % 7) {
+    case 0:
+    case 1:
+      // trees cannot have more than 64 items
+      if (b->alg != CRUSH_BUCKET_TREE || b->size < 60)
+        crush_bucket_add_item(m, b, random() % 2 ? next_device++ : existing, weight);
+      break;
+    case 2:
+      if (b->size)
+        crush_bucket_remove_item(m, b, existing);
+      break;
+    case 3:
+      crush_bucket_adjust_item_weight(m, b, existing, weight);
+      break;
+    case 4: {
+      int items[] = { next_device, next_device + 1 };
+      int weights[] = { weight, weight };
+      if (b->alg != CRUSH_BUCKET_TREE || b->size < 60)
+        crush_bucket_add_items(m, b, 2, items, weights);
+      next_device += 2;
+      break;
+    }
+    case 5:
+      if (b->size > 1) {
+        int items[] = { b->items[0], b->items[b->size - 1] };
+        crush_bucket_remove_items(m, b, 2, items);
+      }
+      break;
+    case 6: {
+      // replace the bucket by an empty one
+      int id = b->id;
+      crush_remove_bucket(m, b);
+      b = crush_make_bucket(m, algs[random() % 5], CRUSH_HASH_DEFAULT, 1, 0, NULL, &weight);
+      ASSERT_EQ(0, crush_add_bucket(m, id, b, &id));
+      buckets[index] = b;
+      break;
+    }
+    }
+    if (step % 3)
+      continue;
+
+    crush_finalize_incremental(m);
+    ASSERT_NE((void *)NULL, m->changes);
+    expect_finalized(m);
+    __s32 max_devices = m->max_devices;
+    size_t working_size = m->working_size;
+    crush_finalize(m);
+    ASSERT_EQ(m->max_devices, max_devices) << step;
+    ASSERT_EQ(m->working_size, working_size) << step;
+  }
+
+  // crush_finalize() sees the changes made directly
+  crush_bucket *b = buckets[0];
+  if (b->size == 0)
+    ASSERT_EQ(0, crush_bucket_add_item(m, b, next_device++,
+                                       b->alg == CRUSH_BUCKET_UNIFORM ?
+                                       ((crush_bucket_uniform *)b)->item_weight : 0x10000));
+  b->items[0] = next_device + 10;
+  crush_finalize(m);
+  EXPECT_EQ(next_device + 11, m->max_devices);
+  crush_destroy(m);
+}
+
 // Local Variables:
 // compile-command: "cd ../build ; make unittest_builder && valgrind --tool=memcheck test/unittest_builder"
 // End:
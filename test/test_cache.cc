@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "parallel.h"
+#include "cache.h"
+}
+
+#include "test_maps.h"
+
+static void check_cache(crush_cache *cache, crush_map *m, int ruleno,
+                        int x_start, int count, int result_max,
+                        const std::vector<__u32> &weights,
+                        const crush_choose_arg *choose_args)
+{
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  for (int x = x_start; x < x_start + count; x++) {
+    std::vector<int> expected(result_max), result(result_max);
+    int expected_len = crush_do_rule(m, ruleno, x, expected.data(), result_max,
+                                     weights.data(), weights.size(),
+                                     cwin.data(), choose_args);
+    int len = crush_cache_do_rule(cache, ruleno, x, result.data(), result_max,
+                                  cwin.data());
+    ASSERT_EQ(expected_len, len) << "x " << x;
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(expected[i], result[i]) << "x " << x;
+  }
+}
+
+TEST(cache, crush_cache_do_rule) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 2);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  const int count = 500;
+  __u64 hits, misses;
+
+  EXPECT_EQ((void *)NULL, crush_cache_create(1, 0, 3));
+  EXPECT_EQ((void *)NULL, crush_cache_create(1, 100, 0));
+  crush_cache_destroy(NULL);
+
+  crush_cache *cache = crush_cache_create(2, 4 * count, 4);
+  ASSERT_NE((void *)NULL, cache);
+  crush_cache_bind(cache, m, weights.data(), weights.size(), NULL);
+
+  // the first pass misses, the second hits
+  check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits, &misses);
+  EXPECT_EQ(0u, hits);
+  EXPECT_EQ((__u64)count, misses);
+  check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits, &misses);
+  EXPECT_GT(hits, count * 9u / 10);
+  EXPECT_EQ(2u * count, hits + misses);
+
+  // the rule and result_max are part of the key
+  check_cache(cache, m, indep, 0, count, 4, weights, NULL);
+  check_cache(cache, m, firstn, 0, count, 2, weights, NULL);
+  // larger than the result_max of the cache, not cached
+  crush_cache_stats(cache, &hits, &misses);
+  check_cache(cache, m, firstn, 0, count, 6, weights, NULL);
+  __u64 hits2, misses2;
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_EQ(hits, hits2);
+  EXPECT_EQ(misses, misses2);
+
+  // a modification of the map changes its epoch
+  __u32 epoch = m->epoch;
+  crush_bucket *root = m->buckets[-1-rootno];
+  crush_bucket *rack = m->buckets[-1-root->items[1]];
+  crush_bucket *host = m->buckets[-1-rack->items[2]];
+  crush_bucket_adjust_item_weight(m, host, host->items[0], 0x80000);
+  crush_bucket_adjust_item_weight(m, rack, host->id, host->weight);
+  crush_bucket_adjust_item_weight(m, root, rack->id, rack->weight);
+  EXPECT_NE(epoch, m->epoch);
+  crush_cache_stats(cache, &hits, &misses);
+  check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_EQ(hits, hits2);
+  EXPECT_EQ(misses + count, misses2);
+
+  // new weights
+  weights[3] = 0;
+  weights[11] = 0x8000;
+  crush_cache_bind(cache, m, weights.data(), weights.size(), NULL);
+  crush_cache_stats(cache, &hits, &misses);
+  check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_EQ(misses + count, misses2);
+
+  // choose_args
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 1);
+  crush_cache_bind(cache, m, weights.data(), weights.size(), choose_args);
+  check_cache(cache, m, firstn, 0, count, 3, weights, choose_args);
+  choose_args[-1-host->id].weight_set[0].weights[1] = 0x1000;
+  crush_cache_bind(cache, m, weights.data(), weights.size(), choose_args);
+  crush_cache_stats(cache, &hits, &misses);
+  check_cache(cache, m, firstn, 0, count, 3, weights, choose_args);
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_EQ(misses + count, misses2);
+  // binding again forgets the results, even with the same arguments
+  crush_cache_bind(cache, m, weights.data(), weights.size(), choose_args);
+  crush_cache_stats(cache, &hits, &misses);
+  check_cache(cache, m, firstn, 0, count, 3, weights, choose_args);
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_EQ(hits, hits2);
+  EXPECT_EQ(misses + count, misses2);
+  crush_destroy_choose_args(choose_args);
+  crush_cache_destroy(cache);
+
+  // much smaller than the number of values, entries are replaced
+  cache = crush_cache_create(3, 40, 3);
+  ASSERT_NE((void *)NULL, cache);
+  crush_cache_bind(cache, m, weights.data(), weights.size(), NULL);
+  for (int pass = 0; pass < 3; pass++)
+    check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits, &misses);
+  EXPECT_GT(misses, 2u * count);
+  // a few values used over and over stay in the cache
+  for (int pass = 0; pass < 10; pass++)
+    check_cache(cache, m, firstn, 1000, 5, 3, weights, NULL);
+  crush_cache_stats(cache, &hits2, &misses2);
+  EXPECT_GE(hits2 - hits, 40u);
+  crush_cache_destroy(cache);
+
+  // too small for one set per shard, fewer shards
+  cache = crush_cache_create(16, 10, 3);
+  ASSERT_NE((void *)NULL, cache);
+  crush_cache_bind(cache, m, weights.data(), weights.size(), NULL);
+  check_cache(cache, m, firstn, 0, count, 3, weights, NULL);
+  crush_cache_stats(cache, &hits, &misses);
+  EXPECT_EQ((__u64)count, misses);
+  crush_cache_destroy(cache);
+
+  crush_destroy(m);
+}
+
+struct cache_ctx {
+  crush_map *m;
+  crush_cache *cache;
+  int ruleno;
+  std::vector<std::vector<char>> cwin;
+  std::vector<int> result;
+  std::vector<int> result_len;
+};
+
+static void cache_chunk(void *arg, int worker, int begin, int end)
+{
+  cache_ctx *ctx = (cache_ctx *)arg;
+  for (int i = begin; i < end; i++)
+    ctx->result_len[i] = crush_cache_do_rule(ctx->cache, ctx->ruleno, i % 300,
+                                             &ctx->result[i * 3], 3,
+                                             ctx->cwin[worker].data());
+}
+
+TEST(cache, concurrent) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  const int count = 6000;
+  const int threads = 4;
+  cache_ctx ctx;
+
+  ctx.m = m;
+  ctx.cache = crush_cache_create(threads, 256, 3);
+  ASSERT_NE((void *)NULL, ctx.cache);
+  crush_cache_bind(ctx.cache, m, weights.data(), weights.size(), NULL);
+  ctx.ruleno = ruleno;
+  for (int t = 0; t < threads; t++) {
+    ctx.cwin.push_back(std::vector<char>(crush_work_size(m, 3)));
+    crush_init_workspace(m, ctx.cwin[t].data());
+  }
+  ctx.result.resize(count * 3);
+  ctx.result_len.resize(count);
+  ASSERT_EQ(0, crush_parallel_for(count, threads, 7, cache_chunk, &ctx));
+
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, cwin.data());
+  for (int i = 0; i < count; i++) {
+    int expected[3];
+    int len = crush_do_rule(m, ruleno, i % 300, expected, 3,
+                            weights.data(), weights.size(), cwin.data(), NULL);
+    ASSERT_EQ(len, ctx.result_len[i]);
+    for (int j = 0; j < len; j++)
+      ASSERT_EQ(expected[j], ctx.result[i * 3 + j]) << "i " << i;
+  }
+  __u64 hits, misses;
+  crush_cache_stats(ctx.cache, &hits, &misses);
+  EXPECT_EQ((__u64)count, hits + misses);
+  EXPECT_GT(hits, 0u);
+  crush_cache_destroy(ctx.cache);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_cache && valgrind --tool=memcheck test/unittest_cache"
+// End:
@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "compiled.h"
+}
+
+#include "test_maps.h"
+
+//
+// root (type 4) -> rows (type 3) -> racks (type 2) -> hosts (type 1) -> devices
+// with a different bucket algorithm at each level
+//
+static crush_map *make_deep(int fanout, int *rootno)
+{
+  const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_TREE,
+                       CRUSH_BUCKET_STRAW, CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW2 };
+  crush_map *m = crush_create();
+  m->straw_calc_version = 1;
+  int device = 0;
+  std::vector<int> items, weights;
+  for (int i = 0; i < fanout * fanout * fanout; i++) {
+    std::vector<int> host_items, host_weights;
+    for (int d = 0; d < fanout; d++) {
+      host_items.push_back(device++);
+      host_weights.push_back(0x10000);
+    }
+    crush_bucket *b = crush_make_bucket(m, algs[0], CRUSH_HASH_DEFAULT, 1,
+                                        fanout, host_items.data(), host_weights.data());
+    int id;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+    items.push_back(id);
+    weights.push_back(b->weight);
+  }
+  for (int type = 2; type <= 4; type++) {
+    std::vector<int> parent_items, parent_weights;
+    for (size_t i = 0; i < items.size(); i += fanout) {
+      crush_bucket *b = crush_make_bucket(m, algs[type - 1], CRUSH_HASH_DEFAULT, type,
+                                          fanout, &items[i], &weights[i]);
+      int id;
+      EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+      parent_items.push_back(id);
+      parent_weights.push_back(b->weight);
+    }
+    items = parent_items;
+    weights = parent_weights;
+  }
+  crush_bucket *root = crush_make_bucket(m, algs[4], CRUSH_HASH_DEFAULT, 5,
+                                         items.size(), items.data(), weights.data());
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, rootno));
+  crush_finalize(m);
+  return m;
+}
+
+static std::vector<int> map_all(crush_map *m, int ruleno, int count, int result_max)
+{
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 7)
+    weights[i] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> result(count * result_max, -1);
+  std::vector<int> result_len(count);
+  EXPECT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                       result.data(), result_max, result_max,
+                                       result_len.data(), weights.data(),
+                                       weights.size(), cwin.data(), NULL));
+  result.insert(result.end(), result_len.begin(), result_len.end());
+  return result;
+}
+
+TEST(compiled, crush_compile) {
+  int rootno;
+  crush_map *m = make_deep(3, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 2);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 1);
+
+  crush_map *c = crush_compile(m);
+  ASSERT_NE((void *)NULL, c);
+  ASSERT_EQ(m->max_buckets, c->max_buckets);
+  ASSERT_EQ(m->max_rules, c->max_rules);
+  ASSERT_EQ(m->max_devices, c->max_devices);
+  ASSERT_EQ(m->working_size, c->working_size);
+
+  // buckets are cache line aligned and in descent order
+  for (int b = 0; b < c->max_buckets; b++) {
+    ASSERT_EQ(m->buckets[b] == NULL, c->buckets[b] == NULL);
+    if (c->buckets[b] == NULL)
+      continue;
+    ASSERT_NE(m->buckets[b], c->buckets[b]);
+    ASSERT_EQ(0u, (uintptr_t)c->buckets[b] % 64);
+  }
+  for (int b = 0; b < c->max_buckets; b++)
+    for (int d = 0; d < c->max_buckets; d++)
+      if (c->buckets[b] && c->buckets[d] &&
+          c->buckets[b]->type > c->buckets[d]->type)
+        ASSERT_LT((char *)c->buckets[b], (char *)c->buckets[d]);
+
+  std::vector<int> expected_firstn = map_all(m, firstn, 1000, 3);
+  std::vector<int> expected_indep = map_all(m, indep, 1000, 4);
+  // the compiled map does not depend on the original
+  crush_destroy(m);
+  EXPECT_EQ(expected_firstn, map_all(c, firstn, 1000, 3));
+  EXPECT_EQ(expected_indep, map_all(c, indep, 1000, 4));
+
+  crush_destroy_compiled(c);
+  crush_destroy_compiled(NULL);
+}
+
+TEST(compiled, crush_compile_straw2) {
+  int rootno;
+  crush_map *m = make_hierarchy(4, 5, 6, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  crush_map *c = crush_compile(m);
+  ASSERT_NE((void *)NULL, c);
+  for (int b = 0; b < c->max_buckets; b++) {
+    crush_bucket_straw2 *bucket = (crush_bucket_straw2 *)c->buckets[b];
+    if (bucket == NULL)
+      continue;
+    ASSERT_NE((void *)NULL, bucket->item_reciprocals);
+    // the arrays of a bucket follow its header
+    ASSERT_LT((char *)bucket, (char *)bucket->h.items);
+    ASSERT_LT((char *)bucket->h.items, (char *)bucket->item_weights);
+    ASSERT_LT((char *)bucket->item_weights, (char *)bucket->item_reciprocals);
+    ASSERT_GE((char *)bucket + 64 * 3, (char *)bucket->item_reciprocals);
+  }
+  EXPECT_EQ(map_all(m, ruleno, 1000, 3), map_all(c, ruleno, 1000, 3));
+  crush_destroy_compiled(c);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_compiled && valgrind --tool=memcheck test/unittest_compiled"
+// End:
@@ -0,0 +1,156 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "diff.h"
+}
+
+#include "test_maps.h"
+
+static void check_diff(const crush_diff_map *before, const crush_diff_map *after,
+                       int ruleno, int x_start, int count, int result_max,
+                       const struct crush_diff *diff)
+{
+  std::vector<char> cwin_before(crush_work_size(before->map, result_max));
+  std::vector<char> cwin_after(crush_work_size(after->map, result_max));
+  crush_init_workspace(before->map, cwin_before.data());
+  crush_init_workspace(after->map, cwin_after.data());
+  std::vector<__u32> device_in(diff->max_devices), device_out(diff->max_devices);
+  __u32 changed = 0;
+  __u64 mapped = 0, moved = 0;
+
+  ASSERT_EQ(x_start, diff->x_start);
+  ASSERT_EQ(count, diff->count);
+  for (int i = 0; i < count; i++) {
+    std::vector<int> b(result_max), a(result_max);
+    int len_b = crush_do_rule(before->map, ruleno, x_start + i, b.data(), result_max,
+                              before->weights, before->weight_max,
+                              cwin_before.data(), before->choose_args);
+    int len_a = crush_do_rule(after->map, ruleno, x_start + i, a.data(), result_max,
+                              after->weights, after->weight_max,
+                              cwin_after.data(), after->choose_args);
+    b.resize(len_b);
+    a.resize(len_a);
+    __u32 positions = 0;
+    for (int j = 0; j < std::max(len_b, len_a); j++)
+      if (j >= len_b || j >= len_a || b[j] != a[j])
+        positions++;
+    ASSERT_EQ(positions, diff->changed_positions[i]) << "x " << x_start + i;
+    if (positions)
+      changed++;
+    for (int item : b)
+      if (std::find(a.begin(), a.end(), item) == a.end())
+        device_out[item]++;
+    for (int item : a) {
+      mapped++;
+      if (std::find(b.begin(), b.end(), item) == b.end()) {
+        device_in[item]++;
+        moved++;
+      }
+    }
+  }
+  for (int d = 0; d < diff->max_devices; d++) {
+    ASSERT_EQ(device_in[d], diff->device_in[d]) << "device " << d;
+    ASSERT_EQ(device_out[d], diff->device_out[d]) << "device " << d;
+  }
+  EXPECT_EQ(changed, diff->changed);
+  EXPECT_EQ(mapped, diff->mapped);
+  EXPECT_EQ(moved, diff->moved);
+  EXPECT_DOUBLE_EQ((double)moved / mapped, diff->moved_fraction);
+}
+
+TEST(diff, crush_diff) {
+  int rootno;
+  crush_map *before = make_hierarchy(4, 5, 6, &rootno);
+  crush_map *after = make_hierarchy(4, 5, 6, &rootno);
+  int firstn = add_simple_rule(before, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  ASSERT_EQ(firstn, add_simple_rule(after, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1));
+  int indep = add_simple_rule(before, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 2);
+  ASSERT_EQ(indep, add_simple_rule(after, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 2));
+  std::vector<__u32> weights(before->max_devices, 0x10000);
+  std::vector<__u32> after_weights(weights);
+  crush_diff_map b = { before, weights.data(), (int)weights.size(), NULL };
+  crush_diff_map a = { after, after_weights.data(), (int)after_weights.size(), NULL };
+  const int count = 3000;
+  const int x_start = 100;
+
+  // nothing changes and nothing is mapped with after
+  struct crush_diff *diff = crush_diff(&b, &a, firstn, x_start, count, 3, 4);
+  ASSERT_NE((void *)NULL, diff);
+  EXPECT_EQ(0u, diff->changed);
+  EXPECT_EQ((__u32)count, diff->skipped);
+  EXPECT_EQ(0u, diff->moved);
+  EXPECT_EQ(0.0, diff->moved_fraction);
+  check_diff(&b, &a, firstn, x_start, count, 3, diff);
+  crush_diff_destroy(diff);
+
+  // a device is out
+  after_weights[7] = 0;
+  for (int ruleno : { firstn, indep }) {
+    diff = crush_diff(&b, &a, ruleno, x_start, count, 4, 4);
+    ASSERT_NE((void *)NULL, diff);
+    EXPECT_GT(diff->changed, 0u);
+    EXPECT_GT(diff->skipped, 0u);
+    EXPECT_EQ(0u, diff->device_in[7]);
+    EXPECT_GT(diff->device_out[7], 0u);
+    check_diff(&b, &a, ruleno, x_start, count, 4, diff);
+    crush_diff_destroy(diff);
+  }
+  after_weights[7] = 0x10000;
+
+  // the weight of a host changes in its rack and in the root
+  crush_bucket *root = after->buckets[-1-rootno];
+  crush_bucket *rack = after->buckets[-1-root->items[1]];
+  crush_bucket *host = after->buckets[-1-rack->items[2]];
+  crush_bucket_adjust_item_weight(after, host, host->items[0], 0x80000);
+  crush_bucket_adjust_item_weight(after, rack, host->id, host->weight);
+  crush_bucket_adjust_item_weight(after, root, rack->id, rack->weight);
+  crush_finalize(after);
+  for (int ruleno : { firstn, indep }) {
+    struct crush_diff *diffs[3];
+    int threads[3] = { 1, 3, 0 };
+    for (int t = 0; t < 3; t++) {
+      diffs[t] = crush_diff(&b, &a, ruleno, x_start, count, 4, threads[t]);
+      ASSERT_NE((void *)NULL, diffs[t]);
+    }
+    EXPECT_GT(diffs[0]->moved, 0u);
+    // the root changed, every value is mapped with after
+    EXPECT_EQ(0u, diffs[0]->skipped);
+    check_diff(&b, &a, ruleno, x_start, count, 4, diffs[0]);
+    for (int t = 1; t < 3; t++) {
+      EXPECT_EQ(diffs[0]->moved, diffs[t]->moved);
+      EXPECT_EQ(diffs[0]->changed, diffs[t]->changed);
+      for (int i = 0; i < count; i++)
+        ASSERT_EQ(diffs[0]->changed_positions[i], diffs[t]->changed_positions[i]);
+    }
+    for (int t = 0; t < 3; t++)
+      crush_diff_destroy(diffs[t]);
+  }
+
+  // choose_args that are only given to after
+  crush_choose_arg *choose_args = crush_make_choose_args(after, 1);
+  crush_bucket *other = after->buckets[-1-root->items[3]];
+  choose_args[-1-other->id].weight_set[0].weights[0] = 0x1000;
+  a.choose_args = choose_args;
+  diff = crush_diff(&b, &a, firstn, x_start, count, 3, 2);
+  ASSERT_NE((void *)NULL, diff);
+  check_diff(&b, &a, firstn, x_start, count, 3, diff);
+  crush_diff_destroy(diff);
+  crush_destroy_choose_args(choose_args);
+
+  EXPECT_EQ((void *)NULL, crush_diff(&b, &a, before->max_rules, 0, count, 3, 1));
+  EXPECT_EQ((void *)NULL, crush_diff(&b, &a, firstn, 0, -1, 3, 1));
+  EXPECT_EQ((void *)NULL, crush_diff(&b, &a, firstn, 0, count, 0, 1));
+  crush_diff_destroy(NULL);
+  crush_destroy(before);
+  crush_destroy(after);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_diff && valgrind --tool=memcheck test/unittest_diff"
+// End:
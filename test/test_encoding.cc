@@ -0,0 +1,281 @@
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "encoding.h"
+}
+
+#include "test_maps.h"
+
+static std::vector<int> map_all(crush_map *m, int ruleno, int count, int result_max,
+                                crush_choose_arg *choose_args)
+{
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 7)
+    weights[i] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> result;
+  for (int x = 0; x < count; x++) {
+    std::vector<int> r(result_max);
+    int len = crush_do_rule(m, ruleno, x, r.data(), result_max,
+                            weights.data(), weights.size(), cwin.data(), choose_args);
+    result.insert(result.end(), r.begin(), r.begin() + len);
+    result.push_back(len);
+  }
+  return result;
+}
+
+// an 8 bytes aligned encoding of cm
+static std::vector<__u64> encode(const crush_ceph_map *cm, size_t *size)
+{
+  *size = crush_encode(cm, NULL, 0);
+  std::vector<__u64> buf((*size + 7) / 8);
+  EXPECT_EQ(*size, crush_encode(cm, buf.data(), *size));
+  return buf;
+}
+
+static bool in(const void *p, const std::vector<__u64> &buf, size_t size)
+{
+  const char *base = (const char *)buf.data();
+  return (const char *)p >= base && (const char *)p < base + size;
+}
+
+TEST(encoding, mixed) {
+  int rootno;
+  crush_map *m = make_mixed(3, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 2);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 1);
+  // a missing bucket
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      0, NULL, NULL);
+  int removed;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &removed));
+  crush_remove_bucket(m, b);
+  crush_finalize(m);
+  m->chooseleaf_vary_r = 0;
+  m->straw_calc_version = 1;
+
+  // the type names, an item name and no rule names
+  const char names[] = {
+    1, 0, 0, 0, 1, 0, 0, 0, 4, 0, 0, 0, 'h', 'o', 's', 't',
+    1, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, 'o', 's', 'd',
+    0, 0, 0, 0 };
+  crush_ceph_map cm = {};
+  cm.map = m;
+  cm.names = names;
+  cm.names_size = sizeof(names);
+
+  size_t size;
+  std::vector<__u64> buf = encode(&cm, &size);
+  // too small, nothing is written
+  std::vector<__u64> small(1, 0);
+  EXPECT_EQ(size, crush_encode(&cm, small.data(), 8));
+  EXPECT_EQ(0u, small[0]);
+
+  for (int flags : { 0, CRUSH_DECODE_ZERO_COPY }) {
+    crush_ceph_map *decoded;
+    ASSERT_EQ(0, crush_decode(buf.data(), size, flags, &decoded));
+    crush_map *d = decoded->map;
+    EXPECT_EQ(m->max_buckets, d->max_buckets);
+    EXPECT_EQ(m->max_rules, d->max_rules);
+    EXPECT_EQ(m->max_devices, d->max_devices);
+    EXPECT_EQ(m->working_size, d->working_size);
+    EXPECT_EQ(0, d->chooseleaf_vary_r);
+    EXPECT_EQ(1, d->straw_calc_version);
+    EXPECT_EQ(m->choose_total_tries, d->choose_total_tries);
+    EXPECT_EQ(m->allowed_bucket_algs, d->allowed_bucket_algs);
+    EXPECT_EQ((void *)NULL, d->buckets[-1-removed]);
+    ASSERT_EQ(sizeof(names), decoded->names_size);
+    EXPECT_EQ(0, memcmp(names, decoded->names, sizeof(names)));
+    EXPECT_EQ(12u, decoded->classes_size);
+    EXPECT_EQ(0u, decoded->choose_args_size);
+    EXPECT_EQ(flags != 0, in(d->buckets[0]->items, buf, size));
+
+    EXPECT_EQ(map_all(m, firstn, 1000, 3, NULL), map_all(d, firstn, 1000, 3, NULL));
+    EXPECT_EQ(map_all(m, indep, 1000, 4, NULL), map_all(d, indep, 1000, 4, NULL));
+
+    // the names and classes are encoded as they were decoded
+    size_t resize;
+    std::vector<__u64> rebuf = encode(decoded, &resize);
+    ASSERT_EQ(size, resize);
+    EXPECT_EQ(0, memcmp(buf.data(), rebuf.data(), size));
+    crush_destroy_ceph_map(decoded);
+  }
+  crush_destroy_ceph_map(NULL);
+  crush_destroy(m);
+}
+
+TEST(encoding, choose_args) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  crush_choose_arg *args = crush_make_choose_args(m, 2);
+  for (int b = 0; b < m->max_buckets; b++)
+    for (__u32 j = 0; j < args[b].weight_set[1].size; j += 2)
+      args[b].weight_set[1].weights[j] /= 2;
+  crush_choose_arg_set sets[2];
+  sets[0].id = -1;
+  sets[0].map.args = args;
+  sets[0].map.size = m->max_buckets;
+  // choose_args without weight sets are not encoded
+  std::vector<crush_choose_arg> empty(m->max_buckets);
+  sets[1].id = 1LL << 40;
+  sets[1].map.args = empty.data();
+  sets[1].map.size = m->max_buckets;
+  crush_ceph_map cm = {};
+  cm.map = m;
+  cm.choose_args = sets;
+  cm.choose_args_size = 2;
+
+  size_t size;
+  std::vector<__u64> buf = encode(&cm, &size);
+  std::vector<int> expected = map_all(m, ruleno, 1000, 3, args);
+  EXPECT_NE(map_all(m, ruleno, 1000, 3, NULL), expected);
+
+  for (int flags : { 0, CRUSH_DECODE_ZERO_COPY }) {
+    crush_ceph_map *decoded;
+    ASSERT_EQ(0, crush_decode(buf.data(), size, flags, &decoded));
+    ASSERT_EQ(2u, decoded->choose_args_size);
+    EXPECT_EQ(-1, decoded->choose_args[0].id);
+    EXPECT_EQ(1LL << 40, decoded->choose_args[1].id);
+    crush_choose_arg *d = decoded->choose_args[0].map.args;
+    EXPECT_EQ(2u, d[0].weight_set_size);
+    EXPECT_EQ(0u, decoded->choose_args[1].map.args[0].weight_set_size);
+    // the choose_args follow the tunables and are not aligned
+    EXPECT_EQ(flags != 0, in(decoded->map->buckets[1]->items, buf, size));
+    EXPECT_EQ(flags != 0, in(decoded->map->rules[ruleno], buf, size));
+    EXPECT_FALSE(in(d[0].weight_set[1].weights, buf, size));
+    EXPECT_EQ(expected, map_all(decoded->map, ruleno, 1000, 3, d));
+
+    size_t resize;
+    std::vector<__u64> rebuf = encode(decoded, &resize);
+    ASSERT_EQ(size, resize);
+    EXPECT_EQ(0, memcmp(buf.data(), rebuf.data(), size));
+    crush_destroy_ceph_map(decoded);
+  }
+
+  // a weight set that does not match the size of its bucket
+  args[0].weight_set[0].size--;
+  std::vector<__u64> corrupted = encode(&cm, &size);
+  crush_ceph_map *decoded;
+  EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), size, 0, &decoded));
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+TEST(encoding, legacy) {
+  int rootno;
+  crush_map *m = make_hierarchy(2, 2, 2, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 1);
+  crush_ceph_map cm = {};
+  cm.map = m;
+  size_t size;
+  std::vector<__u64> buf = encode(&cm, &size);
+
+  // encoded before the tunables: 23 bytes of tunables, 12 bytes of
+  // device classes and 4 bytes of choose_args
+  crush_ceph_map *decoded;
+  ASSERT_EQ(0, crush_decode(buf.data(), size - 39, 0, &decoded));
+  crush_map *d = decoded->map;
+  EXPECT_EQ(2u, d->choose_local_tries);
+  EXPECT_EQ(5u, d->choose_local_fallback_tries);
+  EXPECT_EQ(19u, d->choose_total_tries);
+  EXPECT_EQ(0u, d->chooseleaf_descend_once);
+  EXPECT_EQ(0, d->chooseleaf_vary_r);
+  EXPECT_EQ(0, d->chooseleaf_stable);
+  EXPECT_EQ(0, d->straw_calc_version);
+  EXPECT_EQ((__u32)CRUSH_LEGACY_ALLOWED_BUCKET_ALGS, d->allowed_bucket_algs);
+  EXPECT_EQ((void *)NULL, decoded->classes);
+  crush_destroy_ceph_map(decoded);
+
+  // encoded before the choose_args
+  ASSERT_EQ(0, crush_decode(buf.data(), size - 4, 0, &decoded));
+  EXPECT_EQ(m->chooseleaf_stable, decoded->map->chooseleaf_stable);
+  EXPECT_EQ(map_all(m, ruleno, 100, 2, NULL), map_all(decoded->map, ruleno, 100, 2, NULL));
+  crush_destroy_ceph_map(decoded);
+  crush_destroy(m);
+}
+
+TEST(encoding, corrupted) {
+  int rootno;
+  crush_map *m = make_hierarchy(2, 2, 2, &rootno);
+  add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 1);
+  crush_ceph_map cm = {};
+  cm.map = m;
+  size_t size;
+  std::vector<__u64> buf = encode(&cm, &size);
+  crush_ceph_map *decoded;
+
+  // truncated anywhere before the tunables
+  for (size_t s = 0; s < size - 39; s++)
+    EXPECT_EQ(-EINVAL, crush_decode(buf.data(), s, 0, &decoded)) << s;
+
+  // not the magic
+  std::vector<__u64> corrupted(buf);
+  ((__u32 *)corrupted.data())[0] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), size, 0, &decoded));
+
+  // not the id of the first bucket
+  corrupted = buf;
+  ((__s32 *)corrupted.data())[5] = -2;
+  EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), size, 0, &decoded));
+
+  // an item of the first bucket that is not a bucket
+  corrupted = buf;
+  ((__s32 *)((char *)corrupted.data() + 36))[0] = -1000;
+  EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), size, CRUSH_DECODE_ZERO_COPY,
+                                  &decoded));
+
+  // too many buckets for the size of the encoding
+  corrupted = buf;
+  ((__s32 *)corrupted.data())[1] = 1 << 30;
+  EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), size, 0, &decoded));
+  crush_destroy(m);
+}
+
+TEST(encoding, tree_num_nodes) {
+  crush_map *m = crush_create();
+  int items[] = { 0 };
+  int weights[] = { 0x10000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_TREE, CRUSH_HASH_DEFAULT,
+                                      1, 1, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  crush_finalize(m);
+  ASSERT_EQ(2, ((crush_bucket_tree *)b)->num_nodes);
+  crush_ceph_map cm = {};
+  cm.map = m;
+  size_t size;
+  std::vector<__u64> buf = encode(&cm, &size);
+  crush_ceph_map *decoded;
+  ASSERT_EQ(0, crush_decode(buf.data(), size, 0, &decoded));
+  crush_destroy_ceph_map(decoded);
+
+  // the num_nodes of the bucket follows its only item, replace it and
+  // its node weights
+  const char *p = (const char *)buf.data();
+  const size_t num_nodes = 40, rest = num_nodes + 1 + 2 * 4;
+  ASSERT_EQ(2, p[num_nodes]);
+  for (int n : { 0, 1, 4, 255 }) {
+    std::vector<char> bytes(p, p + num_nodes);
+    bytes.push_back((char)n);
+    bytes.insert(bytes.end(), n * 4, 0);
+    bytes.insert(bytes.end(), p + rest, p + size);
+    std::vector<__u64> corrupted((bytes.size() + 7) / 8);
+    memcpy(corrupted.data(), bytes.data(), bytes.size());
+    EXPECT_EQ(-EINVAL, crush_decode(corrupted.data(), bytes.size(), 0, &decoded)) << n;
+  }
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_encoding && valgrind --tool=memcheck test/unittest_encoding"
+// End:
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/hash_simd.h"
+}
+
+static __u32 hash_n(int n, const __u32 *v)
+{
+  switch (n) {
+  case 2:
+    return crush_hash32_2(CRUSH_HASH_RJENKINS1, v[0], v[1]);
+  case 3:
+    return crush_hash32_3(CRUSH_HASH_RJENKINS1, v[0], v[1], v[2]);
+  case 4:
+    return crush_hash32_4(CRUSH_HASH_RJENKINS1, v[0], v[1], v[2], v[3]);
+  default:
+    return crush_hash32_5(CRUSH_HASH_RJENKINS1, v[0], v[1], v[2], v[3], v[4]);
+  }
+}
+
+static void check_lanes(crush_hash_lanes_fn lanes)
+{
+  std::mt19937 gen(42);
+  const int strides[] = { 0, 1, 3 };
+
+  for (int n = 2; n <= 5; n++) {
+    for (int count = 0; count <= 67; count++) {
+      std::vector<__u32> values[5];
+      const __u32 *in[5];
+      int stride[5];
+      for (int k = 0; k < n; k++) {
+        stride[k] = strides[(count + k) % 3];
+        values[k].resize(count * 3 + 1);
+        for (auto &v : values[k])
+          v = gen();
+        in[k] = values[k].data();
+      }
+      std::vector<__u32> hash(count + 1, 0xdeadbeef);
+      lanes(n, in, stride, hash.data(), count);
+      for (int i = 0; i < count; i++) {
+        __u32 v[5];
+        for (int k = 0; k < n; k++)
+          v[k] = in[k][i * stride[k]];
+        ASSERT_EQ(hash_n(n, v), hash[i]) << "n " << n << " count " << count << " i " << i;
+      }
+      EXPECT_EQ(0xdeadbeef, hash[count]);
+    }
+  }
+}
+
+TEST(hash, lanes) {
+  check_lanes(crush_hash_lanes_scalar);
+  check_lanes(crush_hash_lanes);
+#ifdef CRUSH_HAVE_HASH_SIMD
+  if (crush_hash_lanes_sse41_supported())
+    check_lanes(crush_hash_lanes_sse41);
+  if (crush_hash_lanes_avx2_supported())
+    check_lanes(crush_hash_lanes_avx2);
+  if (crush_hash_lanes_avx512_supported())
+    check_lanes(crush_hash_lanes_avx512);
+#endif
+}
+
+TEST(hash, crush_hash32_lanes) {
+  const int count = 37;
+  __u32 a = 1234, c = 5;
+  __u32 b[count], d[count], e[2 * count], hash[count];
+
+  for (int i = 0; i < count; i++) {
+    b[i] = i * 7919;
+    d[i] = -i;
+    e[2 * i] = i;
+    e[2 * i + 1] = 0;
+  }
+
+  crush_hash32_2_lanes(CRUSH_HASH_RJENKINS1, &a, 0, b, 1, hash, count);
+  for (int i = 0; i < count; i++)
+    EXPECT_EQ(crush_hash32_2(CRUSH_HASH_RJENKINS1, a, b[i]), hash[i]);
+
+  crush_hash32_3_lanes(CRUSH_HASH_RJENKINS1, &a, 0, b, 1, &c, 0, hash, count);
+  for (int i = 0; i < count; i++)
+    EXPECT_EQ(crush_hash32_3(CRUSH_HASH_RJENKINS1, a, b[i], c), hash[i]);
+
+  crush_hash32_4_lanes(CRUSH_HASH_RJENKINS1, &a, 0, b, 1, &c, 0, d, 1,
+                       hash, count);
+  for (int i = 0; i < count; i++)
+    EXPECT_EQ(crush_hash32_4(CRUSH_HASH_RJENKINS1, a, b[i], c, d[i]), hash[i]);
+
+  crush_hash32_5_lanes(CRUSH_HASH_RJENKINS1, &a, 0, b, 1, &c, 0, d, 1, e, 2,
+                       hash, count);
+  for (int i = 0; i < count; i++)
+    EXPECT_EQ(crush_hash32_5(CRUSH_HASH_RJENKINS1, a, b[i], c, d[i], e[2 * i]),
+              hash[i]);
+
+  crush_hash32_3_lanes(CRUSH_HASH_RJENKINS1 + 1, &a, 0, b, 1, &c, 0,
+                       hash, count);
+  for (int i = 0; i < count; i++)
+    EXPECT_EQ(0u, hash[i]);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_hash && test/unittest_hash"
+// End:
@@ -0,0 +1,177 @@
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "image.h"
+}
+
+#include "test_maps.h"
+
+static std::vector<int> map_all(crush_map *m, int ruleno, int count, int result_max)
+{
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 7)
+    weights[i] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> result;
+  for (int x = 0; x < count; x++) {
+    std::vector<int> r(result_max);
+    int len = crush_do_rule(m, ruleno, x, r.data(), result_max,
+                            weights.data(), weights.size(), cwin.data(), NULL);
+    result.insert(result.end(), r.begin(), r.begin() + len);
+    result.push_back(len);
+  }
+  return result;
+}
+
+// an 8 bytes aligned copy of the image of m
+static std::vector<__u64> encode(const crush_map *m, size_t *size)
+{
+  *size = crush_image_encode(m, NULL, 0);
+  std::vector<__u64> image((*size + 7) / 8);
+  EXPECT_EQ(*size, crush_image_encode(m, image.data(), *size));
+  return image;
+}
+
+TEST(image, crush_image_load) {
+  int rootno;
+  crush_map *m = make_mixed(3, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 2);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 1);
+  // a missing bucket
+  int removed;
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      0, NULL, NULL);
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &removed));
+  crush_remove_bucket(m, b);
+  crush_finalize(m);
+  m->chooseleaf_vary_r = 0;
+
+  size_t size;
+  std::vector<__u64> image = encode(m, &size);
+  // too small, nothing is written
+  std::vector<__u64> small(1, 0);
+  EXPECT_EQ(size, crush_image_encode(m, small.data(), 8));
+  EXPECT_EQ(0u, small[0]);
+
+  crush_map *loaded;
+  ASSERT_EQ(0, crush_image_load(image.data(), size, &loaded));
+  EXPECT_EQ(m->max_buckets, loaded->max_buckets);
+  EXPECT_EQ(m->max_rules, loaded->max_rules);
+  EXPECT_EQ(m->max_devices, loaded->max_devices);
+  EXPECT_EQ(m->working_size, loaded->working_size);
+  EXPECT_EQ(0, loaded->chooseleaf_vary_r);
+  EXPECT_EQ(1, loaded->straw_calc_version);
+  EXPECT_EQ((void *)NULL, loaded->buckets[-1-removed]);
+  // the items are not copied
+  const char *base = (const char *)image.data();
+  EXPECT_TRUE((const char *)loaded->buckets[1]->items >= base &&
+              (const char *)loaded->buckets[1]->items < base + size);
+
+  std::vector<int> expected_firstn = map_all(m, firstn, 1000, 3);
+  std::vector<int> expected_indep = map_all(m, indep, 1000, 4);
+  crush_destroy(m);
+  EXPECT_EQ(expected_firstn, map_all(loaded, firstn, 1000, 3));
+  EXPECT_EQ(expected_indep, map_all(loaded, indep, 1000, 4));
+
+  // an item that is not a bucket
+  size_t items = (const char *)loaded->buckets[1]->items - base;
+  crush_image_close(loaded);
+  crush_image_close(NULL);
+  std::vector<__u64> corrupted(image);
+  ((__s32 *)((char *)corrupted.data() + items))[0] = -1000;
+  EXPECT_EQ(-EINVAL, crush_image_load(corrupted.data(), size, &loaded));
+
+  // not an image
+  EXPECT_EQ(-EINVAL, crush_image_load(image.data(), size - 1, &loaded));
+  EXPECT_EQ(-EINVAL, crush_image_load(image.data(), 4, &loaded));
+  EXPECT_EQ(-EINVAL, crush_image_load((char *)image.data() + 4, size - 4, &loaded));
+  corrupted = image;
+  corrupted[0] ^= 1;
+  EXPECT_EQ(-EINVAL, crush_image_load(corrupted.data(), size, &loaded));
+}
+
+TEST(image, crush_image_open) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  char path[] = "/tmp/unittest_image_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_LE(0, fd);
+  close(fd);
+
+  ASSERT_EQ(0, crush_image_save(m, path));
+  crush_map *loaded;
+  ASSERT_EQ(0, crush_image_open(path, &loaded));
+  EXPECT_EQ(map_all(m, ruleno, 1000, 3), map_all(loaded, ruleno, 1000, 3));
+  for (int b = 0; b < loaded->max_buckets; b++)
+    EXPECT_NE((void *)NULL,
+              ((crush_bucket_straw2 *)loaded->buckets[b])->item_reciprocals);
+  crush_image_close(loaded);
+
+  EXPECT_EQ(0, truncate(path, 0));
+  EXPECT_EQ(-EINVAL, crush_image_open(path, &loaded));
+  unlink(path);
+  EXPECT_EQ(-ENOENT, crush_image_open(path, &loaded));
+  EXPECT_EQ(-ENOENT, crush_image_save(m, "/nonexistent/unittest_image"));
+  crush_destroy(m);
+}
+
+TEST(image, tree_num_nodes) {
+  crush_map *m = crush_create();
+  int items[] = { 0, 1, 2 };
+  int weights[] = { 0x10000, 0x10000, 0x10000 };
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_TREE, CRUSH_HASH_DEFAULT,
+                                      1, 3, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  crush_finalize(m);
+  EXPECT_EQ(8u, crush_calc_tree_num_nodes(3));
+  EXPECT_EQ(8, ((crush_bucket_tree *)b)->num_nodes);
+
+  size_t size;
+  std::vector<__u64> image = encode(m, &size);
+  crush_map *loaded;
+  ASSERT_EQ(0, crush_image_load(image.data(), size, &loaded));
+  crush_image_close(loaded);
+
+  // the num_nodes of the bucket record, after its id, type, alg, hash,
+  // weight and size
+  size_t param = 0;
+  for (size_t o = 0; o + 20 <= size; o += 8) {
+    const char *r = (const char *)image.data() + o;
+    if (*(const __s32 *)r == id && (__u8)r[6] == CRUSH_BUCKET_TREE &&
+        *(const __u32 *)(r + 12) == 3 && *(const __u32 *)(r + 16) == 8)
+      param = o + 16;
+  }
+  ASSERT_NE(0u, param);
+  // the mapper would read past the items or never reach a leaf
+  for (__u32 num_nodes : { 0u, 4u, 16u, 255u }) {
+    std::vector<__u64> corrupted(image);
+    *(__u32 *)((char *)corrupted.data() + param) = num_nodes;
+    EXPECT_EQ(-EINVAL, crush_image_load(corrupted.data(), size, &loaded)) << num_nodes;
+  }
+
+  // an emptied bucket keeps a node
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(0, crush_bucket_remove_item(m, b, i));
+  EXPECT_EQ(0u, b->size);
+  EXPECT_EQ(1, ((crush_bucket_tree *)b)->num_nodes);
+  crush_finalize(m);
+  image = encode(m, &size);
+  ASSERT_EQ(0, crush_image_load(image.data(), size, &loaded));
+  crush_image_close(loaded);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_image && valgrind --tool=memcheck test/unittest_image"
+// End:
@@ -1,13 +1,23 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <list>
+#include <iterator>
+#include <random>
+#include <set>
+#include <vector>
 
 extern "C" {
 #include "hash.h"
 #include "builder.h"
 #include "mapper.h"
+#include "mapper_simd.h"
+#include "crush_ln_table.h"
+#include "crush_ln_full.h"
 }
 
+#include "test_maps.h"
+
 TEST(mapper, crush_do_rule_choose_arg) {
   crush_map *m = crush_create();
   const int root_type = 1;
@@ -291,6 +301,872 @@ TEST(mapper, crush_do_rule_choose_arg) {
   crush_destroy(m);
 }
 
+TEST(mapper, crush_do_rule_batch) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 2);
+
+  const int device_count = 3 * 4 * 5;
+  __u32 weights[device_count];
+  for (int i = 0; i < device_count; i++)
+    weights[i] = i % 7 ? 0x10000 : 0x8000;
+
+  const int result_max = 3;
+  const int result_stride = 4;
+  const int count = 1000;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i * 7919;
+
+  for (auto ruleno : { firstn, indep }) {
+    std::vector<int> result(count * result_stride, -1);
+    std::vector<int> result_len(count);
+    ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                         result.data(), result_max, result_stride,
+                                         result_len.data(),
+                                         weights, device_count,
+                                         cwin.data(), NULL));
+    for (int i = 0; i < count; i++) {
+      int expected[result_max];
+      int expected_len = crush_do_rule(m, ruleno, x[i], expected, result_max,
+                                       weights, device_count, cwin.data(), NULL);
+      ASSERT_EQ(expected_len, result_len[i]);
+      for (int j = 0; j < expected_len; j++)
+        ASSERT_EQ(expected[j], result[i * result_stride + j]);
+      // the padding between two result vectors is not modified
+      ASSERT_EQ(-1, result[i * result_stride + result_max]);
+    }
+  }
+
+  ASSERT_EQ(0, crush_do_rule_batch(m, CRUSH_MAX_RULES, x.data(), count,
+                                   NULL, result_max, result_stride, NULL,
+                                   weights, device_count, cwin.data(), NULL));
+  crush_destroy(m);
+}
+
+static void check_plan(crush_map *m, int ruleno, int result_max,
+                       const __u32 *weights, int weight_max,
+                       const crush_choose_arg *choose_args)
+{
+  crush_plan *plan = crush_compile_rule(m, ruleno);
+  ASSERT_NE((void *)NULL, plan);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  for (int x = 0; x < 1000; x++) {
+    std::vector<int> expected(result_max, -1), result(result_max, -1);
+    int expected_len = crush_do_rule(m, ruleno, x, expected.data(), result_max,
+                                     weights, weight_max, cwin.data(), choose_args);
+    int len = crush_do_plan(m, plan, x, result.data(), result_max,
+                            weights, weight_max, cwin.data(), choose_args);
+    ASSERT_EQ(expected_len, len) << "rule " << ruleno << " x " << x;
+    ASSERT_EQ(expected, result) << "rule " << ruleno << " x " << x;
+  }
+  crush_destroy_plan(plan);
+}
+
+TEST(mapper, crush_compile_rule) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  const int device_count = 3 * 4 * 5;
+  __u32 weights[device_count];
+  for (int i = 0; i < device_count; i++)
+    weights[i] = i % 7 ? 0x10000 : 0;
+
+  std::vector<int> rules;
+  for (int op : { CRUSH_RULE_CHOOSE_FIRSTN, CRUSH_RULE_CHOOSELEAF_FIRSTN,
+                  CRUSH_RULE_CHOOSE_INDEP, CRUSH_RULE_CHOOSELEAF_INDEP })
+    for (int numrep : { 3, 0, -1, -5 })
+      for (int type : { 0, 1, 2 })
+        rules.push_back(add_simple_rule(m, rootno, op, numrep, type));
+
+  // the SET_* steps apply to the CHOOSE* steps that follow them
+  struct crush_rule *rule = crush_make_rule(9, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_SET_CHOOSE_TRIES, 3, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_SET_CHOOSELEAF_TRIES, 2, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, 0, 0);
+  crush_rule_set_step(rule, 3, CRUSH_RULE_SET_CHOOSELEAF_STABLE, 0, 0);
+  crush_rule_set_step(rule, 4, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 5, CRUSH_RULE_CHOOSE_FIRSTN, 2, 2);
+  crush_rule_set_step(rule, 6, CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES, 2, 0);
+  crush_rule_set_step(rule, 7, CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 1);
+  crush_rule_set_step(rule, 8, CRUSH_RULE_EMIT, 0, 0);
+  rules.push_back(crush_add_rule(m, rule, -1));
+
+  // an invalid TAKE is ignored and a device can be taken
+  rule = crush_make_rule(7, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_TAKE, -1000, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_INDEP, 2, 1);
+  crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+  crush_rule_set_step(rule, 4, CRUSH_RULE_TAKE, 3, 0);
+  crush_rule_set_step(rule, 5, CRUSH_RULE_NOOP, 0, 0);
+  crush_rule_set_step(rule, 6, CRUSH_RULE_EMIT, 0, 0);
+  rules.push_back(crush_add_rule(m, rule, -1));
+
+  // several TAKE and EMIT, as erasure coded pools spread over racks
+  rule = crush_make_rule(7, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_CHOOSE_INDEP, 2, 2);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_INDEP, 2, 1);
+  crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+  crush_rule_set_step(rule, 4, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 5, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 2);
+  crush_rule_set_step(rule, 6, CRUSH_RULE_EMIT, 0, 0);
+  rules.push_back(crush_add_rule(m, rule, -1));
+
+  for (int ruleno : rules) {
+    check_plan(m, ruleno, 4, weights, device_count, NULL);
+    check_plan(m, ruleno, 8, weights, device_count, NULL);
+  }
+
+  set_legacy_crush_map(m);
+  for (int ruleno : rules)
+    check_plan(m, ruleno, 6, weights, device_count, NULL);
+  set_optimal_crush_map(m);
+
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 2);
+  ASSERT_NE((void *)NULL, choose_args);
+  for (int ruleno : rules)
+    check_plan(m, ruleno, 6, weights, device_count, choose_args);
+  crush_destroy_choose_args(choose_args);
+
+  EXPECT_EQ((void *)NULL, crush_compile_rule(m, m->max_rules));
+  EXPECT_EQ((void *)NULL, crush_compile_rule(m, -1));
+  crush_destroy_plan(NULL);
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_stats) {
+  int rootno;
+  crush_map *m = make_hierarchy(2, 3, 4, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1);
+  const int result_max = 4;
+  const int count = 1000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int i = 0; i < m->max_devices; i += 3)
+    weights[i] = 0;
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i;
+  std::vector<int> result(count * result_max);
+  std::vector<int> result_len(count);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+
+  crush_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  crush_work_set_stats(cwin.data(), &stats);
+  ASSERT_EQ(count, crush_do_rule_batch(m, firstn, x.data(), count,
+                                       result.data(), result_max, result_max,
+                                       result_len.data(), weights.data(),
+                                       weights.size(), cwin.data(), NULL));
+  // each item mapped was counted once in the histogram
+  __u64 mapped = 0, tries = 0;
+  for (int i = 0; i < count; i++)
+    mapped += result_len[i];
+  for (int i = 0; i < CRUSH_STATS_MAX_TRIES; i++)
+    tries += stats.choose_tries[i];
+  // the hosts chosen by chooseleaf and the devices found under them
+  EXPECT_EQ(2 * mapped, tries);
+  EXPECT_LT(0u, stats.descents);
+  EXPECT_LT(0u, stats.collisions);
+  EXPECT_LT(0u, stats.is_out);
+  EXPECT_LT(0u, stats.rejects);
+  EXPECT_LT(0u, stats.choose_tries[1]);
+
+  crush_stats firstn_stats = stats;
+  memset(&stats, 0, sizeof(stats));
+  ASSERT_EQ(count, crush_do_rule_batch(m, indep, x.data(), count,
+                                       result.data(), result_max, result_max,
+                                       result_len.data(), weights.data(),
+                                       weights.size(), cwin.data(), NULL));
+  EXPECT_LT(0u, stats.descents);
+  EXPECT_LT(0u, stats.is_out);
+  crush_stats indep_stats = stats;
+
+  crush_stats_merge(&stats, &firstn_stats);
+  EXPECT_EQ(firstn_stats.descents + indep_stats.descents, stats.descents);
+  EXPECT_EQ(firstn_stats.is_out + indep_stats.is_out, stats.is_out);
+  EXPECT_EQ(firstn_stats.choose_tries[0] + indep_stats.choose_tries[0],
+            stats.choose_tries[0]);
+
+  // crush_init_workspace() detaches the statistics
+  crush_init_workspace(m, cwin.data());
+  memset(&stats, 0, sizeof(stats));
+  ASSERT_EQ(count, crush_do_rule_batch(m, firstn, x.data(), count,
+                                       result.data(), result_max, result_max,
+                                       result_len.data(), weights.data(),
+                                       weights.size(), cwin.data(), NULL));
+  EXPECT_EQ(0u, stats.descents);
+
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_ln_full) {
+  for (unsigned int u = 0; u < CRUSH_LN_FULL_SIZE; u++)
+    ASSERT_EQ((__s64)(crush_ln(u) - 0x1000000000000ll), crush_ln_full[u]) << u;
+}
+
+// the reciprocals computed by crush_finalize() and
+// crush_choose_reciprocals_prepare() are exact for all the draws
+TEST(mapper, straw2_reciprocals) {
+  for (unsigned int u = 0; u < CRUSH_LN_FULL_SIZE; u++) {
+    ASSERT_LE(crush_ln_full[u], 0);
+    ASSERT_LT(-crush_ln_full[u], 1ll << CRUSH_RECIPROCAL_BITS);
+  }
+
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  // zero weights and weights that are not multiples of 0x10000
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket_straw2 *bucket = (crush_bucket_straw2 *)m->buckets[b];
+    if (bucket->h.type != 1)
+      continue;
+    for (__u32 i = 0; i < bucket->h.size; i++)
+      crush_bucket_adjust_item_weight(m, &bucket->h, bucket->h.items[i],
+                                      i == 1 ? 0 : 0x1234 * (b + 1) + i * 0x777);
+  }
+  crush_reweight_bucket(m, m->buckets[-1-rootno]);
+  crush_finalize(m);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 2);
+  for (int b = 0; b < m->max_buckets; b++)
+    for (int position = 0; position < 2; position++) {
+      crush_weight_set *weight_set = &choose_args[b].weight_set[position];
+      for (__u32 i = 0; i < weight_set->size; i++)
+        weight_set->weights[i] = weight_set->weights[i] / (position + 2) + 7 * i;
+    }
+  crush_choose_reciprocals reciprocals;
+  memset(&reciprocals, 0, sizeof(reciprocals));
+  ASSERT_EQ(1, crush_choose_reciprocals_prepare(&reciprocals, choose_args,
+                                                m->max_buckets));
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_weight_set_reciprocals *r = &reciprocals.buckets[b];
+    ASSERT_EQ(2u, r->positions);
+    ASSERT_EQ(m->buckets[b]->size, r->size);
+    for (int position = 0; position < 2; position++)
+      for (__u32 i = 0; i < r->size; i++)
+        EXPECT_EQ(choose_args[b].weight_set[position].weights[i],
+                  r->reciprocals[position * r->size + i].weight);
+  }
+
+  const int count = 2000;
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_work_set_choose_reciprocals(cwin.data(), &reciprocals);
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i;
+
+  crush_straw2_fn saved = crush_straw2_simd;
+  crush_straw2_lanes_fn saved_lanes = crush_straw2_lanes_simd;
+  crush_straw2_simd = NULL;
+  crush_straw2_lanes_simd = NULL;
+  for (crush_choose_arg *args : { (crush_choose_arg *)NULL, choose_args }) {
+    std::vector<int> expected(count * result_max), result(count * result_max);
+    ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                         result.data(), result_max, result_max, NULL,
+                                         weights.data(), weights.size(),
+                                         cwin.data(), args));
+    // without the reciprocals the draws are divided
+    std::vector<crush_reciprocal *> saved_reciprocals;
+    for (int b = 0; b < m->max_buckets; b++) {
+      crush_bucket_straw2 *bucket = (crush_bucket_straw2 *)m->buckets[b];
+      saved_reciprocals.push_back(bucket->item_reciprocals);
+      bucket->item_reciprocals = NULL;
+    }
+    crush_work_set_choose_reciprocals(cwin.data(), NULL);
+    ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                         expected.data(), result_max, result_max, NULL,
+                                         weights.data(), weights.size(),
+                                         cwin.data(), args));
+    EXPECT_EQ(expected, result);
+    crush_work_set_choose_reciprocals(cwin.data(), &reciprocals);
+    for (int b = 0; b < m->max_buckets; b++) {
+      crush_bucket_straw2 *bucket = (crush_bucket_straw2 *)m->buckets[b];
+      bucket->item_reciprocals = saved_reciprocals[b];
+    }
+  }
+
+  // the table is only used with the choose_args it was prepared from
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_weight_set_reciprocals *r = &reciprocals.buckets[b];
+    for (__u32 i = 0; i < r->positions * r->size; i++)
+      r->reciprocals[i].magic = 0;
+  }
+  std::vector<crush_choose_arg> copy(choose_args, choose_args + m->max_buckets);
+  std::vector<int> expected(count * result_max), result(count * result_max);
+  ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                       expected.data(), result_max, result_max, NULL,
+                                       weights.data(), weights.size(),
+                                       cwin.data(), copy.data()));
+  ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                       result.data(), result_max, result_max, NULL,
+                                       weights.data(), weights.size(),
+                                       cwin.data(), choose_args));
+  EXPECT_NE(expected, result);
+  crush_work_set_choose_reciprocals(cwin.data(), NULL);
+  ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                       result.data(), result_max, result_max, NULL,
+                                       weights.data(), weights.size(),
+                                       cwin.data(), choose_args));
+  EXPECT_EQ(expected, result);
+  crush_straw2_simd = saved;
+  crush_straw2_lanes_simd = saved_lanes;
+
+  crush_choose_reciprocals_destroy(&reciprocals);
+  EXPECT_EQ(NULL, reciprocals.buckets);
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+static void check_straw2_kernel(crush_straw2_fn kernel)
+{
+  std::mt19937 rng(1234);
+  for (__u32 size = 1; size <= 100; size++) {
+    std::vector<__s32> ids(size);
+    std::vector<__u32> weights(size);
+    for (int round = 0; round < 20; round++) {
+      for (__u32 i = 0; i < size; i++) {
+        // duplicate ids draw the same straw and must be tie broken
+        ids[i] = round % 4 == 0 ? rng() % 4 : (int)rng();
+        switch (rng() % 6) {
+        case 0: weights[i] = 0; break;
+        case 1: weights[i] = 1; break;
+        case 2: weights[i] = 0xffffffff; break;
+        case 3: weights[i] = 0x10000; break;
+        default: weights[i] = rng(); break;
+        }
+        if (round % 5 == 0)
+          weights[i] = 0;
+      }
+      for (int r = 0; r < 3; r++) {
+        int x = rng();
+        ASSERT_EQ(crush_straw2_scalar(x, r, ids.data(), weights.data(), size),
+                  kernel(x, r, ids.data(), weights.data(), size))
+          << "size " << size << " round " << round << " x " << x << " r " << r;
+      }
+    }
+  }
+}
+
+TEST(mapper, straw2_simd) {
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+  if (crush_straw2_avx2_supported())
+    check_straw2_kernel(crush_straw2_avx2);
+  if (crush_straw2_avx512_supported())
+    check_straw2_kernel(crush_straw2_avx512);
+
+  //
+  // the mappings are the same with and without the kernel
+  //
+  int rootno;
+  crush_map *m = make_hierarchy(2, 3, 40, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  const int device_count = 2 * 3 * 40;
+  std::vector<__u32> weights(device_count, 0x10000);
+  const int result_max = 3;
+  const int count = 2000;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i;
+
+  crush_straw2_fn saved = crush_straw2_simd;
+  std::vector<std::vector<int>> results;
+  for (crush_straw2_fn kernel : { (crush_straw2_fn)NULL,
+                                  crush_straw2_avx2, crush_straw2_avx512 }) {
+    if (kernel == crush_straw2_avx2 && !crush_straw2_avx2_supported())
+      continue;
+    if (kernel == crush_straw2_avx512 && !crush_straw2_avx512_supported())
+      continue;
+    crush_straw2_simd = kernel;
+    std::vector<int> result(count * result_max);
+    ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                         result.data(), result_max, result_max,
+                                         NULL, weights.data(), device_count,
+                                         cwin.data(), NULL));
+    results.push_back(result);
+  }
+  crush_straw2_simd = saved;
+  for (size_t i = 1; i < results.size(); i++)
+    ASSERT_EQ(results[0], results[i]);
+  crush_destroy(m);
+#endif
+}
+
+static void check_straw2_lanes_kernel(crush_straw2_lanes_fn kernel)
+{
+  std::mt19937 rng(4321);
+  for (int round = 0; round < 2000; round++) {
+    std::vector<__s32> ids[CRUSH_STRAW2_LANES];
+    std::vector<__u32> weights[CRUSH_STRAW2_LANES];
+    const __s32 *lane_ids[CRUSH_STRAW2_LANES];
+    const __u32 *lane_weights[CRUSH_STRAW2_LANES];
+    __u32 size[CRUSH_STRAW2_LANES];
+    __s32 x[CRUSH_STRAW2_LANES];
+    int expected[CRUSH_STRAW2_LANES], high[CRUSH_STRAW2_LANES];
+    int r = rng() % 5;
+    for (int l = 0; l < CRUSH_STRAW2_LANES; l++) {
+      // empty lanes, small and large buckets of different sizes
+      size[l] = rng() % 8 == 0 ? 0 : 1 + rng() % (round % 2 ? 6 : 40);
+      ids[l].resize(size[l] + 1);
+      weights[l].resize(size[l] + 1);
+      for (__u32 i = 0; i < size[l]; i++) {
+        ids[l][i] = round % 4 == 0 ? rng() % 4 : (int)rng();
+        switch (rng() % 6) {
+        case 0: weights[l][i] = 0; break;
+        case 1: weights[l][i] = 1; break;
+        case 2: weights[l][i] = 0xffffffff; break;
+        default: weights[l][i] = rng(); break;
+        }
+      }
+      lane_ids[l] = ids[l].data();
+      lane_weights[l] = weights[l].data();
+      x[l] = rng();
+    }
+    crush_straw2_lanes_scalar(x, r, lane_ids, lane_weights, size, expected);
+    kernel(x, r, lane_ids, lane_weights, size, high);
+    for (int l = 0; l < CRUSH_STRAW2_LANES; l++)
+      ASSERT_EQ(expected[l], high[l]) << "round " << round << " lane " << l;
+  }
+}
+
+TEST(mapper, straw2_lanes) {
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+  if (crush_straw2_avx2_supported())
+    check_straw2_lanes_kernel(crush_straw2_lanes_avx2);
+  if (crush_straw2_avx512_supported())
+    check_straw2_lanes_kernel(crush_straw2_lanes_avx512);
+#endif
+
+  //
+  // crush_do_plan_batch() maps groups of inputs in lockstep, with the
+  // same results as crush_do_rule()
+  //
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  // an unbalanced tree: a host directly under the root
+  int items[3] = { 1000, 1001, 1002 };
+  int item_weights[3] = { 0x10000, 0x20000, 0x8000 };
+  crush_bucket *host = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                         3, items, item_weights);
+  int hostno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, host, &hostno));
+  ASSERT_EQ(0, crush_bucket_add_item(m, m->buckets[-1-rootno], hostno, host->weight));
+  crush_finalize(m);
+  int rules[] = {
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 2),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 0),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, 4, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, -1, 0),
+  };
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int d = 0; d < m->max_devices; d += 7)
+    weights[d] = d % 2 ? 0 : 0x8000;
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 2);
+  for (int b = 0; b < m->max_buckets; b++)
+    if (choose_args[b].weight_set)
+      choose_args[b].weight_set[1].weights[0] /= 3;
+  const int result_max = 4;
+  const int count = 1001;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i * 7919;
+
+  crush_straw2_lanes_fn saved = crush_straw2_lanes_simd;
+  std::vector<crush_straw2_lanes_fn> kernels = { crush_straw2_lanes_scalar };
+#ifdef CRUSH_HAVE_STRAW2_SIMD
+  if (crush_straw2_avx2_supported())
+    kernels.push_back(crush_straw2_lanes_avx2);
+  if (crush_straw2_avx512_supported())
+    kernels.push_back(crush_straw2_lanes_avx512);
+#endif
+  for (int tunables = 0; tunables < 4; tunables++) {
+    set_optimal_crush_map(m);
+    if (tunables == 1)
+      set_legacy_crush_map(m);
+    if (tunables == 2)
+      m->chooseleaf_stable = 0;
+    if (tunables == 3)
+      m->chooseleaf_vary_r = 2;
+    for (int ruleno : rules) {
+      crush_plan *plan = crush_compile_rule(m, ruleno);
+      ASSERT_NE((crush_plan *)NULL, plan);
+      for (crush_choose_arg *args : { (crush_choose_arg *)NULL, choose_args })
+        for (crush_straw2_lanes_fn kernel : kernels) {
+          crush_straw2_lanes_simd = kernel;
+          std::vector<int> result(count * (result_max + 1), -5);
+          std::vector<int> result_len(count);
+          ASSERT_EQ(count, crush_do_plan_batch(m, plan, x.data(), count,
+                                               result.data(), result_max, result_max + 1,
+                                               result_len.data(), weights.data(),
+                                               weights.size(), cwin.data(), args));
+          for (int i = 0; i < count; i++) {
+            int expected[result_max];
+            int len = crush_do_rule(m, ruleno, x[i], expected, result_max,
+                                    weights.data(), weights.size(), cwin.data(), args);
+            ASSERT_EQ(len, result_len[i]) << "tunables " << tunables << " rule " << ruleno;
+            for (int j = 0; j < len; j++)
+              ASSERT_EQ(expected[j], result[i * (result_max + 1) + j])
+                << "tunables " << tunables << " rule " << ruleno << " x " << x[i];
+          }
+        }
+      crush_destroy_plan(plan);
+    }
+  }
+  crush_straw2_lanes_simd = saved;
+
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+// collisions are detected with a crush_item_set when many items are chosen
+TEST(mapper, wide_rules) {
+  int rootno;
+  crush_map *m = make_hierarchy(4, 8, 3, &rootno);
+  const int result_max = 30;
+  std::vector<int> rules;
+  for (int numrep : { 6, 12, 28 }) {
+    rules.push_back(add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, numrep, 1));
+    rules.push_back(add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, numrep, 1));
+    rules.push_back(add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, numrep, 0));
+    rules.push_back(add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_INDEP, numrep, 0));
+  }
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int d = 0; d < m->max_devices; d += 5)
+    weights[d] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_work *cw = (crush_work *)cwin.data();
+
+  for (int ruleno : rules) {
+    std::vector<std::vector<int>> results;
+    for (int x = 0; x < 300; x++) {
+      int result[result_max];
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              weights.data(), weights.size(), cwin.data(), NULL);
+      std::vector<int> items;
+      for (int i = 0; i < len; i++)
+        if (result[i] != CRUSH_ITEM_NONE)
+          items.push_back(result[i]);
+      std::vector<int> sorted(items);
+      std::sort(sorted.begin(), sorted.end());
+      ASSERT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end())
+        << "rule " << ruleno << " x " << x;
+      for (int item : items)
+        ASSERT_NE(0u, weights[item]);
+      results.push_back(std::vector<int>(result, result + len));
+    }
+    // the set is emptied when its generation wraps around
+    cw->chosen.gen = 0xfffffffe;
+    cw->leaves.gen = 0xffffffff;
+    for (int x = 0; x < 300; x++) {
+      int result[result_max];
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              weights.data(), weights.size(), cwin.data(), NULL);
+      ASSERT_EQ(results[x], std::vector<int>(result, result + len))
+        << "rule " << ruleno << " x " << x;
+    }
+  }
+  crush_destroy(m);
+}
+
+TEST(mapper, device_state) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 1);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int d = 0; d < m->max_devices; d += 4)
+    weights[d] = 0;
+  for (int d = 1; d < m->max_devices; d += 6)
+    weights[d] = 0x8000;
+  weights[2] = 0x20000;
+  const int result_max = 4;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<char> prepared(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  crush_init_workspace(m, prepared.data());
+
+  crush_device_state devices;
+  memset(&devices, 0, sizeof(devices));
+  EXPECT_EQ(1, crush_device_state_prepare(&devices, weights.data(), weights.size()));
+  EXPECT_EQ(CRUSH_DEVICE_OUT, devices.state[0]);
+  EXPECT_EQ(CRUSH_DEVICE_PARTIAL, devices.state[1]);
+  EXPECT_EQ(CRUSH_DEVICE_IN, devices.state[2]);
+  EXPECT_EQ(CRUSH_DEVICE_IN, devices.state[3]);
+  // the same content is prepared again, even in another vector
+  std::vector<__u32> copy(weights);
+  EXPECT_EQ(1, crush_device_state_prepare(&devices, copy.data(), copy.size()));
+  EXPECT_EQ(copy.data(), devices.weights);
+  EXPECT_EQ(1, crush_device_state_prepare(&devices, weights.data(), weights.size()));
+  crush_work_set_device_state(prepared.data(), &devices);
+
+  for (int ruleno : { firstn, indep }) {
+    for (int x = 0; x < 1000; x++) {
+      int expected[result_max], result[result_max];
+      int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                       weights.data(), weights.size(),
+                                       cwin.data(), NULL);
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              weights.data(), weights.size(),
+                              prepared.data(), NULL);
+      ASSERT_EQ(expected_len, len);
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]) << "rule " << ruleno << " x " << x;
+      // the table is ignored for other weights
+      len = crush_do_rule(m, ruleno, x, result, result_max,
+                          weights.data(), weights.size() - 1,
+                          prepared.data(), NULL);
+      expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                   weights.data(), weights.size() - 1,
+                                   cwin.data(), NULL);
+      ASSERT_EQ(expected_len, len);
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]) << "rule " << ruleno << " x " << x;
+    }
+  }
+
+  // a modified vector is prepared again
+  weights[3] = 0;
+  EXPECT_EQ(1, crush_device_state_prepare(&devices, weights.data(), weights.size()));
+  EXPECT_EQ(CRUSH_DEVICE_OUT, devices.state[3]);
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, firstn, x, result, result_max,
+                            weights.data(), weights.size(),
+                            prepared.data(), NULL);
+    for (int i = 0; i < len; i++)
+      ASSERT_NE(3, result[i]);
+  }
+  crush_init_workspace(m, prepared.data());
+  EXPECT_EQ(NULL, ((crush_work *)prepared.data())->devices);
+  crush_device_state_destroy(&devices);
+  EXPECT_EQ(NULL, devices.state);
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_do_rule_repair) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  const int result_max = 6;
+  std::vector<int> rules = {
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 6, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 3, 2),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_INDEP, 6, 0),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_INDEP, 0, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1),
+  };
+  std::vector<__u32> before(m->max_devices, 0x10000);
+  before[40] = 0;
+  std::vector<std::vector<__u32>> failures;
+  // host 2 fails
+  failures.push_back(before);
+  for (int d = 10; d < 15; d++)
+    failures.back()[d] = 0;
+  // a single device fails
+  failures.push_back(before);
+  failures.back()[7] = 0;
+  // devices are partially out
+  failures.push_back(before);
+  for (int d = 3; d < m->max_devices; d += 7)
+    failures.back()[d] = 0x4000;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+
+  for (size_t f = 0; f < failures.size(); f++) {
+    const std::vector<__u32> &after = failures[f];
+    for (int ruleno : rules) {
+      crush_plan *plan = crush_compile_rule(m, ruleno);
+      ASSERT_NE((crush_plan *)NULL, plan);
+      crush_stats full_stats, repair_stats;
+      memset(&full_stats, 0, sizeof(full_stats));
+      memset(&repair_stats, 0, sizeof(repair_stats));
+      for (int x = 0; x < 2000; x++) {
+        int previous[result_max], expected[result_max], result[result_max];
+        int len = crush_do_rule(m, ruleno, x, previous, result_max,
+                                before.data(), before.size(), cwin.data(), NULL);
+        __u64 failed = 0;
+        for (int i = 0; i < len; i++)
+          if (previous[i] >= 0 && after[previous[i]] < before[previous[i]])
+            failed |= (__u64)1 << i;
+        crush_work_set_stats(cwin.data(), &full_stats);
+        int expected_len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                         after.data(), after.size(),
+                                         cwin.data(), NULL);
+        std::copy(previous, previous + len, result);
+        crush_work_set_stats(cwin.data(), &repair_stats);
+        int repaired_len = crush_do_rule_repair(m, ruleno, x, result, result_max,
+                                                failed, after.data(), after.size(),
+                                                cwin.data(), NULL);
+        crush_work_set_stats(cwin.data(), NULL);
+        ASSERT_EQ(expected_len, repaired_len) << "rule " << ruleno << " x " << x;
+        for (int i = 0; i < expected_len; i++)
+          ASSERT_EQ(expected[i], result[i])
+            << "failure " << f << " rule " << ruleno << " x " << x << " i " << i;
+        // the same with a compiled rule
+        std::copy(previous, previous + len, result);
+        repaired_len = crush_do_plan_repair(m, plan, x, result, result_max,
+                                            failed, after.data(), after.size(),
+                                            cwin.data(), NULL);
+        ASSERT_EQ(expected_len, repaired_len) << "rule " << ruleno << " x " << x;
+        for (int i = 0; i < expected_len; i++)
+          ASSERT_EQ(expected[i], result[i])
+            << "failure " << f << " rule " << ruleno << " x " << x << " i " << i;
+      }
+      // only the positions on the failed host are mapped again
+      if (f == 0 && ruleno == rules[0])
+        EXPECT_LT(repair_stats.descents * 3, full_stats.descents);
+      crush_destroy_plan(plan);
+    }
+  }
+
+  // a bad rule
+  int result[result_max];
+  EXPECT_EQ(0, crush_do_rule_repair(m, 1000, 0, result, result_max, 0,
+                                    before.data(), before.size(), cwin.data(), NULL));
+  crush_destroy(m);
+}
+
+TEST(mapper, topk) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  const int result_max = 20;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  int result[result_max], expected[result_max];
+
+  // a single item is the r = 0 choice of FIRSTN
+  int choose_topk = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 1, 1);
+  int choose_firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, 1, 1);
+  int leaf_topk = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_TOPK, 1, 1);
+  int leaf_firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 1, 1);
+  for (int x = 0; x < 1000; x++) {
+    ASSERT_EQ(1, crush_do_rule(m, choose_topk, x, result, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    ASSERT_EQ(1, crush_do_rule(m, choose_firstn, x, expected, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    ASSERT_EQ(expected[0], result[0]) << "x " << x;
+    ASSERT_EQ(1, crush_do_rule(m, leaf_topk, x, result, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    ASSERT_EQ(1, crush_do_rule(m, leaf_firstn, x, expected, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    ASSERT_EQ(expected[0], result[0]) << "x " << x;
+  }
+
+  // distinct hosts and in devices, the top k are a prefix of the top k + n
+  for (int d = 0; d < m->max_devices; d += 3)
+    weights[d] = 0;
+  weights[1] = 0x8000;
+  std::vector<int> hosts = {
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 3, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 12, 1),
+  };
+  std::vector<int> leaves = {
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_TOPK, 3, 1),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_TOPK, 0, 1),
+  };
+  std::vector<int> devices = {
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 5, 0),
+    add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 20, 0),
+  };
+  for (const std::vector<int> &rules : { hosts, leaves, devices }) {
+    for (int x = 0; x < 1000; x++) {
+      int len = crush_do_rule(m, rules[0], x, expected, result_max,
+                              weights.data(), weights.size(), cwin.data(), NULL);
+      int wide_len = crush_do_rule(m, rules[1], x, result, result_max,
+                                   weights.data(), weights.size(), cwin.data(), NULL);
+      ASSERT_LE(len, wide_len);
+      for (int i = 0; i < len; i++)
+        ASSERT_EQ(expected[i], result[i]) << "x " << x;
+      std::vector<int> sorted(result, result + wide_len);
+      std::sort(sorted.begin(), sorted.end());
+      ASSERT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end())
+        << "x " << x;
+      for (int i = 0; i < wide_len; i++) {
+        if (rules == hosts)
+          ASSERT_EQ(1, m->buckets[-1-result[i]]->type);
+        else
+          ASSERT_NE(0u, weights[result[i]]);
+      }
+    }
+  }
+  EXPECT_EQ(12, crush_do_rule(m, hosts[1], 0, result, result_max,
+                              weights.data(), weights.size(), cwin.data(), NULL));
+  EXPECT_EQ(12, crush_do_rule(m, leaves[1], 0, result, result_max,
+                              weights.data(), weights.size(), cwin.data(), NULL));
+  crush_destroy(m);
+
+  // changing the weight of a device only moves the inputs it enters or leaves
+  m = crush_create();
+  std::vector<int> items(20), item_weights(20, 0x10000);
+  for (int i = 0; i < 20; i++)
+    items[i] = i;
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      items.size(), items.data(), item_weights.data());
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &rootno));
+  int topk = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 4, 0);
+  crush_finalize(m);
+  crush_init_workspace(m, cwin.data());
+  weights.assign(m->max_devices, 0x10000);
+  std::vector<std::set<int>> before;
+  for (int x = 0; x < 2000; x++) {
+    ASSERT_EQ(4, crush_do_rule(m, topk, x, result, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    before.push_back(std::set<int>(result, result + 4));
+  }
+  crush_bucket_adjust_item_weight(m, b, 5, 0x30000);
+  int moved = 0;
+  for (int x = 0; x < 2000; x++) {
+    ASSERT_EQ(4, crush_do_rule(m, topk, x, result, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    std::set<int> after(result, result + 4);
+    if (after == before[x])
+      continue;
+    moved++;
+    ASSERT_EQ(0u, before[x].count(5));
+    ASSERT_EQ(1u, after.count(5));
+    std::vector<int> kept;
+    std::set_intersection(before[x].begin(), before[x].end(),
+                          after.begin(), after.end(), std::back_inserter(kept));
+    ASSERT_EQ(3u, kept.size());
+  }
+  EXPECT_GT(moved, 0);
+  crush_destroy(m);
+
+  // a bucket that is not straw2 is explored as with FIRSTN
+  m = crush_create();
+  b = crush_make_bucket(m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT, 1,
+                        items.size(), items.data(), item_weights.data());
+  ASSERT_EQ(0, crush_add_bucket(m, 0, b, &rootno));
+  topk = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 4, 0);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_FIRSTN, 4, 0);
+  crush_finalize(m);
+  crush_init_workspace(m, cwin.data());
+  for (int x = 0; x < 1000; x++) {
+    ASSERT_EQ(4, crush_do_rule(m, topk, x, result, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    ASSERT_EQ(4, crush_do_rule(m, firstn, x, expected, result_max,
+                               weights.data(), weights.size(), cwin.data(), NULL));
+    for (int i = 0; i < 4; i++)
+      ASSERT_EQ(expected[i], result[i]) << "x " << x;
+  }
+  crush_destroy(m);
+}
+
 // Local Variables:
 // compile-command: "cd ../build ; make unittest_mapper && valgrind --tool=memcheck test/unittest_mapper"
 // End:
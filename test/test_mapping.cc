@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "mapping.h"
+}
+
+#include "test_maps.h"
+
+static void check_mapping(crush_map *m, int ruleno, crush_mapping *mapping,
+                          int count, int result_max,
+                          const std::vector<__u32> &weights)
+{
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  for (int x = 0; x < count; x++) {
+    std::vector<int> expected(result_max);
+    int expected_len = crush_do_rule(m, ruleno, x, expected.data(), result_max,
+                                     weights.data(), weights.size(),
+                                     cwin.data(), NULL);
+    const int *result;
+    ASSERT_EQ(expected_len, crush_mapping_get(mapping, x, &result)) << "x " << x;
+    for (int i = 0; i < expected_len; i++)
+      ASSERT_EQ(expected[i], result[i]) << "x " << x << " i " << i;
+  }
+}
+
+TEST(mapping, crush_mapping_update) {
+  int rootno;
+  crush_map *m = make_hierarchy(4, 5, 6, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 2);
+  const int count = 5000;
+  const int result_max = 4;
+
+  for (int ruleno : { firstn, indep }) {
+    std::vector<__u32> weights(m->max_devices, 0x10000);
+    crush_mapping *mapping = crush_mapping_create(m, ruleno, count, result_max,
+                                                  weights.data(), weights.size(),
+                                                  NULL);
+    ASSERT_NE((void *)NULL, mapping);
+    check_mapping(m, ruleno, mapping, count, result_max, weights);
+    EXPECT_EQ(0, crush_mapping_update(mapping));
+
+    // devices out, in and partially in
+    std::mt19937 gen(ruleno);
+    for (int round = 0; round < 10; round++) {
+      int device = gen() % m->max_devices;
+      weights[device] = (round % 3) * 0x8000;
+      ASSERT_EQ(0, crush_mapping_device_changed(mapping, device));
+      int mapped = crush_mapping_update(mapping);
+      EXPECT_GE(mapped, 0);
+      EXPECT_LT(mapped, count / 5);
+      check_mapping(m, ruleno, mapping, count, result_max, weights);
+    }
+
+    // the weight of a device in its host and of a host in the root
+    crush_bucket *root = m->buckets[-1-rootno];
+    for (int round = 0; round < 4; round++) {
+      crush_bucket *rack = m->buckets[-1-root->items[round]];
+      crush_bucket *host = m->buckets[-1-rack->items[round]];
+      int device = host->items[round];
+      int diff = crush_bucket_adjust_item_weight(m, host, device, 0x50000);
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, host->id));
+      crush_bucket_adjust_item_weight(m, rack, host->id, host->weight);
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, rack->id));
+      crush_bucket_adjust_item_weight(m, root, rack->id, rack->weight);
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, root->id));
+      EXPECT_NE(0, diff);
+      EXPECT_EQ(count, crush_mapping_update(mapping));
+      check_mapping(m, ruleno, mapping, count, result_max, weights);
+
+      // only the values that went through the host are mapped again
+      crush_bucket_adjust_item_weight(m, host, device, 0x10000);
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, host->id));
+      int mapped = crush_mapping_update(mapping);
+      EXPECT_GT(mapped, 0);
+      EXPECT_LT(mapped, count / 2);
+      check_mapping(m, ruleno, mapping, count, result_max, weights);
+      crush_bucket_adjust_item_weight(m, rack, host->id, host->weight);
+      crush_bucket_adjust_item_weight(m, root, rack->id, rack->weight);
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, rack->id));
+      ASSERT_EQ(0, crush_mapping_bucket_changed(mapping, root->id));
+      ASSERT_LE(0, crush_mapping_update(mapping));
+    }
+    check_mapping(m, ruleno, mapping, count, result_max, weights);
+
+    const int *result;
+    EXPECT_EQ(-EINVAL, crush_mapping_get(mapping, count, &result));
+    EXPECT_EQ(-EINVAL, crush_mapping_get(mapping, -1, &result));
+    EXPECT_EQ(-EINVAL, crush_mapping_device_changed(mapping, m->max_devices));
+    EXPECT_EQ(-EINVAL, crush_mapping_device_changed(mapping, -1));
+    EXPECT_EQ(-EINVAL, crush_mapping_bucket_changed(mapping, 0));
+    EXPECT_EQ(-EINVAL, crush_mapping_bucket_changed(mapping, -1-m->max_buckets));
+    crush_mapping_destroy(mapping);
+  }
+
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  EXPECT_EQ((void *)NULL, crush_mapping_create(m, m->max_rules, count, result_max,
+                                               weights.data(), weights.size(), NULL));
+  crush_mapping_destroy(NULL);
+  crush_destroy(m);
+}
+
+TEST(mapping, crush_work_set_trace) {
+  int rootno;
+  crush_map *m = make_hierarchy(2, 2, 3, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 2, 1);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, 2));
+  crush_init_workspace(m, cwin.data());
+
+  __s32 items[64];
+  crush_trace trace = { items, 0, 64, 0 };
+  crush_work_set_trace(cwin.data(), &trace);
+  int result[2];
+  ASSERT_EQ(2, crush_do_rule(m, ruleno, 1234, result, 2,
+                             weights.data(), weights.size(), cwin.data(), NULL));
+  // the root, the racks, the hosts and the devices chosen are traced once
+  std::vector<int> traced(items, items + trace.size);
+  EXPECT_EQ(0, trace.overflow);
+  EXPECT_EQ(1, std::count(traced.begin(), traced.end(), rootno));
+  EXPECT_EQ(1, std::count(traced.begin(), traced.end(), result[0]));
+  EXPECT_EQ(1, std::count(traced.begin(), traced.end(), result[1]));
+  for (int item : traced)
+    EXPECT_EQ(1, std::count(traced.begin(), traced.end(), item));
+
+  trace.size = 0;
+  trace.max = 2;
+  crush_do_rule(m, ruleno, 1234, result, 2,
+                weights.data(), weights.size(), cwin.data(), NULL);
+  EXPECT_EQ(1, trace.overflow);
+  EXPECT_EQ(2u, trace.size);
+
+  crush_init_workspace(m, cwin.data());
+  trace.size = 0;
+  crush_do_rule(m, ruleno, 1234, result, 2,
+                weights.data(), weights.size(), cwin.data(), NULL);
+  EXPECT_EQ(0u, trace.size);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_mapping && valgrind --tool=memcheck test/unittest_mapping"
+// End:
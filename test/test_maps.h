@@ -0,0 +1,89 @@
+#ifndef CRUSH_TEST_MAPS_H
+#define CRUSH_TEST_MAPS_H
+
+/*
+ * Maps shared by the unit tests.
+ */
+
+#include <vector>
+
+//
+// root (type 3) -> racks (type 2) -> hosts (type 1) -> devices
+//
+static inline crush_map *make_hierarchy(int racks, int hosts_per_rack,
+                                 int devices_per_host, int *rootno)
+{
+  crush_map *m = crush_create();
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 3,
+                                         0, NULL, NULL);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, rootno));
+  int device = 0;
+  for (int rack = 0; rack < racks; rack++) {
+    crush_bucket *r = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 2,
+                                        0, NULL, NULL);
+    int rackno;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, r, &rackno));
+    for (int host = 0; host < hosts_per_rack; host++) {
+      int items[devices_per_host];
+      int weights[devices_per_host];
+      for (int i = 0; i < devices_per_host; i++) {
+        items[i] = device++;
+        weights[i] = 0x10000 * (1 + i % 3);
+      }
+      crush_bucket *h = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                          devices_per_host, items, weights);
+      int hostno;
+      EXPECT_EQ(0, crush_add_bucket(m, 0, h, &hostno));
+      EXPECT_EQ(0, crush_bucket_add_item(m, r, hostno, h->weight));
+    }
+    EXPECT_EQ(0, crush_bucket_add_item(m, root, rackno, r->weight));
+  }
+  crush_finalize(m);
+  return m;
+}
+
+static inline int add_simple_rule(crush_map *m, int rootno, int op, int numrep, int type)
+{
+  struct crush_rule *rule = crush_make_rule(3, 0, 0, 0, 0);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 1, op, numrep, type);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  return crush_add_rule(m, rule, -1);
+}
+
+//
+// root (type 4) -> racks (type 3) -> hosts (type 2) -> shelves (type 1) -> devices
+// with a different bucket algorithm at each level
+//
+static inline crush_map *make_mixed(int fanout, int *rootno)
+{
+  const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_TREE,
+                       CRUSH_BUCKET_STRAW, CRUSH_BUCKET_LIST };
+  crush_map *m = crush_create();
+  m->straw_calc_version = 1;
+  std::vector<int> items, weights;
+  for (int d = 0; d < fanout * fanout * fanout * fanout; d++) {
+    items.push_back(d);
+    weights.push_back(0x10000);
+  }
+  for (int type = 1; type <= 3; type++) {
+    std::vector<int> parent_items, parent_weights;
+    for (size_t i = 0; i < items.size(); i += fanout) {
+      crush_bucket *b = crush_make_bucket(m, algs[type - 1], CRUSH_HASH_DEFAULT, type,
+                                          fanout, &items[i], &weights[i]);
+      int id;
+      EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+      parent_items.push_back(id);
+      parent_weights.push_back(b->weight);
+    }
+    items = parent_items;
+    weights = parent_weights;
+  }
+  crush_bucket *root = crush_make_bucket(m, algs[3], CRUSH_HASH_DEFAULT, 4,
+                                         items.size(), items.data(), weights.data());
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, rootno));
+  crush_finalize(m);
+  return m;
+}
+
+#endif
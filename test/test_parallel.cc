@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "parallel.h"
+}
+
+#include "test_maps.h"
+
+static void count_indices(void *arg, int worker, int begin, int end)
+{
+  std::vector<std::atomic<int>> *seen = (std::vector<std::atomic<int>> *)arg;
+  for (int i = begin; i < end; i++)
+    (*seen)[i]++;
+}
+
+TEST(parallel, crush_parallel_for) {
+  ASSERT_EQ(-EINVAL, crush_parallel_for(-1, 2, 1, count_indices, NULL));
+  ASSERT_EQ(-EINVAL, crush_parallel_for(1, 2, 0, count_indices, NULL));
+  ASSERT_EQ(0, crush_parallel_for(0, 2, 1, count_indices, NULL));
+  ASSERT_EQ(4, crush_parallel_threads(4));
+  ASSERT_LT(0, crush_parallel_threads(0));
+
+  for (int num_threads : { 1, 2, 3, 8, 33 }) {
+    for (int count : { 1, 7, 1000, 10007 }) {
+      std::vector<std::atomic<int>> seen(count);
+      ASSERT_EQ(0, crush_parallel_for(count, num_threads, 5, count_indices, &seen));
+      for (int i = 0; i < count; i++)
+        ASSERT_EQ(1, seen[i]) << "index " << i << " threads " << num_threads;
+    }
+  }
+}
+
+struct slow_ctx {
+  std::vector<int> worker;
+};
+
+static void slow_front(void *arg, int worker, int begin, int end)
+{
+  slow_ctx *ctx = (slow_ctx *)arg;
+  for (int i = begin; i < end; i++) {
+    // the first indices are much slower than the others
+    if (i < 16)
+      usleep(10000);
+    ctx->worker[i] = worker;
+  }
+}
+
+TEST(parallel, crush_parallel_for_steal) {
+  const int count = 4096;
+  const int num_threads = 4;
+  slow_ctx ctx;
+  ctx.worker.resize(count, -1);
+  ASSERT_EQ(0, crush_parallel_for(count, num_threads, 1, slow_front, &ctx));
+  // worker 0 owned [0,1024[ but was busy with the slow indices and
+  // the other workers must have stolen part of its range
+  int stolen = 0;
+  for (int i = 0; i < count / num_threads; i++) {
+    ASSERT_NE(-1, ctx.worker[i]);
+    if (ctx.worker[i] != 0)
+      stolen++;
+  }
+  ASSERT_LT(0, stolen);
+}
+
+TEST(parallel, crush_do_rule_parallel) {
+  int rootno;
+  crush_map *m = make_hierarchy(4, 5, 6, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+  int indep = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1);
+
+  const int device_count = 4 * 5 * 6;
+  std::vector<__u32> weights(device_count);
+  for (int i = 0; i < device_count; i++)
+    weights[i] = i % 5 ? 0x10000 : 0;
+
+  const int result_max = 3;
+  const int count = 5000;
+  const int x_start = 100;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = x_start + i;
+
+  for (auto ruleno : { firstn, indep }) {
+    std::vector<int> expected(count * result_max);
+    std::vector<int> expected_len(count);
+    crush_stats expected_stats;
+    memset(&expected_stats, 0, sizeof(expected_stats));
+    crush_work_set_stats(cwin.data(), &expected_stats);
+    ASSERT_EQ(count, crush_do_rule_batch(m, ruleno, x.data(), count,
+                                         expected.data(), result_max, result_max,
+                                         expected_len.data(),
+                                         weights.data(), device_count,
+                                         cwin.data(), NULL));
+    crush_work_set_stats(cwin.data(), NULL);
+    ASSERT_LT(0u, expected_stats.descents);
+    for (int num_threads : { 1, 2, 7 }) {
+      std::vector<int> result(count * result_max);
+      std::vector<int> result_len(count);
+      crush_stats stats;
+      memset(&stats, 0, sizeof(stats));
+      ASSERT_EQ(0, crush_do_rule_parallel(m, ruleno, NULL, x_start, count,
+                                          result.data(), result_max, result_max,
+                                          result_len.data(),
+                                          weights.data(), device_count,
+                                          NULL, num_threads, &stats));
+      ASSERT_EQ(expected_len, result_len);
+      ASSERT_EQ(expected, result);
+      // the statistics do not depend on the number of threads
+      ASSERT_EQ(0, memcmp(&expected_stats, &stats, sizeof(stats)));
+
+      std::fill(result.begin(), result.end(), 0);
+      ASSERT_EQ(0, crush_do_rule_parallel(m, ruleno, x.data(), 0, count,
+                                          result.data(), result_max, result_max,
+                                          NULL,
+                                          weights.data(), device_count,
+                                          NULL, num_threads, NULL));
+      ASSERT_EQ(expected, result);
+    }
+  }
+
+  ASSERT_EQ(-EINVAL, crush_do_rule_parallel(m, CRUSH_MAX_RULES, NULL, 0, count,
+                                            NULL, result_max, result_max, NULL,
+                                            weights.data(), device_count,
+                                            NULL, 2, NULL));
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_parallel && valgrind --tool=memcheck test/unittest_parallel"
+// End:
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "parallel.h"
+#include "reverse.h"
+}
+
+#include "test_maps.h"
+
+TEST(reverse, crush_reverse_index_build) {
+  int rootno;
+  crush_map *m = make_hierarchy(3, 4, 5, &rootno);
+  int ruleno = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_INDEP, 4, 1);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  // some positions are CRUSH_ITEM_NONE
+  for (int d = 0; d < m->max_devices; d += 2)
+    weights[d] = 0;
+  const int count = 10000;
+  const int x_start = 17;
+  const int result_max = 4;
+  const int result_stride = 5;
+  std::vector<int> result(count * result_stride);
+  std::vector<int> result_len(count);
+  ASSERT_EQ(0, crush_do_rule_parallel(m, ruleno, NULL, x_start, count,
+                                      result.data(), result_max, result_stride,
+                                      result_len.data(), weights.data(),
+                                      weights.size(), NULL, 0, NULL));
+
+  // expected entries, in the order of the results
+  std::vector<std::vector<crush_reverse_entry>> expected(m->max_devices);
+  for (int i = 0; i < count; i++)
+    for (int j = 0; j < result_len[i]; j++) {
+      int device = result[i * result_stride + j];
+      if (device != CRUSH_ITEM_NONE)
+        expected[device].push_back({ x_start + i, j });
+    }
+
+  for (int num_threads : { 1, 3, 8, 0 }) {
+    crush_reverse_index *index =
+      crush_reverse_index_build(NULL, x_start, count, result.data(), result_stride,
+                                result_len.data(), m->max_devices, num_threads);
+    ASSERT_NE((void *)NULL, index);
+    ASSERT_EQ(m->max_devices, index->max_devices);
+    EXPECT_EQ(0u, index->offsets[0]);
+    for (int d = 0; d < m->max_devices; d++) {
+      const crush_reverse_entry *entries;
+      int n = crush_reverse_index_lookup(index, d, &entries);
+      ASSERT_EQ((int)expected[d].size(), n) << "device " << d;
+      for (int i = 0; i < n; i++) {
+        ASSERT_EQ(expected[d][i].x, entries[i].x);
+        ASSERT_EQ(expected[d][i].position, entries[i].position);
+      }
+      if (d % 2 == 0)
+        EXPECT_EQ(0, n);
+    }
+    const crush_reverse_entry *entries;
+    EXPECT_EQ(-EINVAL, crush_reverse_index_lookup(index, m->max_devices, &entries));
+    EXPECT_EQ(-EINVAL, crush_reverse_index_lookup(index, -1, &entries));
+    crush_reverse_index_destroy(index);
+  }
+
+  // explicit values
+  std::vector<int> x(count);
+  for (int i = 0; i < count; i++)
+    x[i] = i * 3;
+  crush_reverse_index *index =
+    crush_reverse_index_build(x.data(), 0, count, result.data(), result_stride,
+                              result_len.data(), m->max_devices, 2);
+  ASSERT_NE((void *)NULL, index);
+  const crush_reverse_entry *entries;
+  int n = crush_reverse_index_lookup(index, 1, &entries);
+  ASSERT_EQ((int)expected[1].size(), n);
+  for (int i = 0; i < n; i++)
+    EXPECT_EQ((expected[1][i].x - x_start) * 3, entries[i].x);
+  crush_reverse_index_destroy(index);
+
+  index = crush_reverse_index_build(NULL, 0, 0, NULL, result_stride, NULL,
+                                    m->max_devices, 4);
+  ASSERT_NE((void *)NULL, index);
+  EXPECT_EQ(0, crush_reverse_index_lookup(index, 0, &entries));
+  crush_reverse_index_destroy(index);
+  EXPECT_EQ((void *)NULL, crush_reverse_index_build(NULL, 0, -1, NULL, 1, NULL, 1, 1));
+  crush_reverse_index_destroy(NULL);
+  crush_destroy(m);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_reverse && valgrind --tool=memcheck test/unittest_reverse"
+// End:
@@ -0,0 +1,246 @@
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "hash.h"
+#include "builder.h"
+#include "mapper.h"
+#include "text.h"
+}
+
+#include "test_maps.h"
+
+static std::vector<int> map_all(crush_map *m, int ruleno, int count, int result_max)
+{
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, cwin.data());
+  std::vector<int> result;
+  for (int x = 0; x < count; x++) {
+    std::vector<int> r(result_max);
+    int len = crush_do_rule(m, ruleno, x, r.data(), result_max,
+                            weights.data(), weights.size(), cwin.data(), NULL);
+    result.insert(result.end(), r.begin(), r.begin() + len);
+    result.push_back(len);
+  }
+  return result;
+}
+
+static int compile(const std::string &text, crush_text_map **tm, int *line = NULL)
+{
+  return crush_text_compile(text.data(), text.size(), tm, line);
+}
+
+static std::string decompile(const crush_text_map *tm)
+{
+  char *text;
+  size_t size;
+  EXPECT_EQ(0, crush_text_decompile(tm, &text, &size));
+  std::string s(text, size);
+  EXPECT_EQ(strlen(text), size);
+  free(text);
+  return s;
+}
+
+// crush/sample.txt
+static const char sample[] =
+  "# devices\n"
+  "device 1 osd001\n"
+  "device 2 osd002\n"
+  "device 3 osd003 down   # same as offload 1.0\n"
+  "device 4 osd004 offload 0       # 0.0 -> normal, 1.0 -> failed\n"
+  "device 5 osd005 offload 0.1\n"
+  "device 6 osd006 offload 0.1\n"
+  "\n"
+  "# hierarchy\n"
+  "type 0 osd   # 'device' is actually the default for 0\n"
+  "type 2 cab\n"
+  "type 3 row\n"
+  "type 10 pool\n"
+  "\n"
+  "cab root {\n"
+  "       id -1         # optional\n"
+  "       alg tree     # required\n"
+  "       item osd001\n"
+  "       item osd002 weight 600 pos 1\n"
+  "       item osd003 weight 600 pos 0\n"
+  "       item osd004 weight 600 pos 3\n"
+  "       item osd005 weight 600 pos 4\n"
+  "}\n"
+  "\n"
+  "# rules\n"
+  "rule normal {\n"
+  "     # these are required.\n"
+  "     pool 0\n"
+  "     type replicated \n"
+  "     min_size 1\n"
+  "     max_size 4\n"
+  "     # need 1 or more of these.\n"
+  "     step take root\n"
+  "     step choose firstn 0 type osd\n"
+  "     step emit\n"
+  "}\n"
+  "\n"
+  "rule {\n"
+  "     pool 1\n"
+  "     type erasure\n"
+  "     min_size 3\n"
+  "     max_size 6\n"
+  "     step take root\n"
+  "     step choose indep 0 type osd\n"
+  "     step emit\n"
+  "}\n";
+
+TEST(text, sample) {
+  crush_text_map *tm;
+  ASSERT_EQ(0, compile(sample, &tm));
+  crush_map *m = tm->map;
+  EXPECT_EQ(7, m->max_devices);
+  crush_bucket *root = m->buckets[0];
+  ASSERT_NE((void *)NULL, root);
+  EXPECT_EQ(-1, root->id);
+  EXPECT_EQ(2, root->type);
+  EXPECT_EQ(CRUSH_BUCKET_TREE, root->alg);
+  // the items with a pos first, then the others in the positions left
+  ASSERT_EQ(5u, root->size);
+  const int items[] = { 3, 2, 1, 4, 5 };
+  for (int i = 0; i < 5; i++)
+    EXPECT_EQ(items[i], root->items[i]);
+  EXPECT_EQ(0x10000, crush_get_bucket_item_weight(root, 2));
+  EXPECT_EQ(600 * 0x10000, crush_get_bucket_item_weight(root, 0));
+  EXPECT_EQ(0x10000u + 4 * 600 * 0x10000, root->weight);
+  ASSERT_EQ(2u, m->max_rules);
+  EXPECT_EQ(1, m->rules[0]->mask.type);
+  EXPECT_EQ(4, m->rules[0]->mask.max_size);
+  EXPECT_EQ(1, m->rules[1]->mask.ruleset);
+  EXPECT_EQ(3, m->rules[1]->mask.type);
+  EXPECT_EQ((__u32)CRUSH_RULE_CHOOSE_INDEP, m->rules[1]->steps[1].op);
+  EXPECT_STREQ("normal", tm->rule_names[0]);
+  EXPECT_EQ((char *)NULL, tm->rule_names[1]);
+  EXPECT_STREQ("osd006", tm->device_names[6]);
+  EXPECT_EQ((char *)NULL, tm->device_names[0]);
+  EXPECT_STREQ("pool", tm->type_names[10]);
+  EXPECT_STREQ("root", tm->bucket_names[0]);
+
+  // decompile, compile and decompile again
+  std::string text = decompile(tm);
+  EXPECT_NE(std::string::npos, text.find("device 6 osd006\n"));
+  EXPECT_NE(std::string::npos, text.find("rule rule1 {\n"));
+  crush_text_map *again;
+  ASSERT_EQ(0, compile(text, &again));
+  EXPECT_EQ(text, decompile(again));
+  EXPECT_EQ(map_all(m, 0, 100, 3), map_all(again->map, 0, 100, 3));
+  EXPECT_EQ(map_all(m, 1, 100, 4), map_all(again->map, 1, 100, 4));
+  crush_destroy_text_map(again);
+  crush_destroy_text_map(tm);
+  crush_destroy_text_map(NULL);
+}
+
+TEST(text, decompile) {
+  int rootno;
+  crush_map *m = make_mixed(3, &rootno);
+  int firstn = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSELEAF_FIRSTN, 3, 2);
+  int topk = add_simple_rule(m, rootno, CRUSH_RULE_CHOOSE_TOPK, 2, 1);
+  struct crush_rule *rule = crush_make_rule(4, 5, 3, 2, 8);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_SET_CHOOSE_TRIES, 100, 0);
+  crush_rule_set_step(rule, 1, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 3);
+  crush_rule_set_step(rule, 3, CRUSH_RULE_EMIT, 0, 0);
+  int indep = crush_add_rule(m, rule, 7);
+  // a weight that is not a multiple of 1/100000
+  crush_bucket_adjust_item_weight(m, m->buckets[-1-rootno], m->buckets[-1-rootno]->items[1],
+                                  0x12345);
+  crush_finalize(m);
+  m->choose_total_tries = 77;
+
+  // without any name
+  crush_text_map tm = {};
+  tm.map = m;
+  std::string text = decompile(&tm);
+  crush_text_map *compiled;
+  ASSERT_EQ(0, compile(text, &compiled));
+  crush_map *c = compiled->map;
+  EXPECT_EQ(m->max_buckets, c->max_buckets);
+  EXPECT_EQ(m->max_rules, c->max_rules);
+  EXPECT_EQ(m->max_devices, c->max_devices);
+  EXPECT_EQ(77u, c->choose_total_tries);
+  EXPECT_EQ(m->straw_calc_version, c->straw_calc_version);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (!m->buckets[b]) {
+      EXPECT_EQ((void *)NULL, c->buckets[b]);
+      continue;
+    }
+    ASSERT_NE((void *)NULL, c->buckets[b]);
+    EXPECT_EQ(m->buckets[b]->alg, c->buckets[b]->alg);
+    EXPECT_EQ(m->buckets[b]->weight, c->buckets[b]->weight);
+    ASSERT_EQ(m->buckets[b]->size, c->buckets[b]->size);
+    for (__u32 i = 0; i < m->buckets[b]->size; i++) {
+      EXPECT_EQ(m->buckets[b]->items[i], c->buckets[b]->items[i]);
+      EXPECT_EQ(crush_get_bucket_item_weight(m->buckets[b], i),
+                crush_get_bucket_item_weight(c->buckets[b], i));
+    }
+  }
+  EXPECT_EQ(5, c->rules[indep]->mask.ruleset);
+  EXPECT_EQ(map_all(m, firstn, 1000, 3), map_all(c, firstn, 1000, 3));
+  EXPECT_EQ(map_all(m, topk, 1000, 2), map_all(c, topk, 1000, 2));
+  EXPECT_EQ(map_all(m, indep, 1000, 4), map_all(c, indep, 1000, 4));
+  EXPECT_EQ(text, decompile(compiled));
+  crush_destroy_text_map(compiled);
+  crush_destroy(m);
+}
+
+TEST(text, errors) {
+  const char *header =
+    "device 0 osd.0\n"
+    "device 1 osd.1\n"
+    "type 0 osd\n"
+    "type 1 host\n";
+  struct {
+    const char *text;
+    int line;
+  } errors[] = {
+    { "device 2 osd.0\n", 5 },                            // a name used twice
+    { "device 1 osd.2\n", 5 },                            // an id used twice
+    { "device -1 osd.2\n", 5 },
+    { "type 1 rack\n", 5 },
+    { "tunable choose_tries 1\n", 5 },
+    { "rack r {\n}\n", 5 },                               // an unknown type
+    { "host h {\n item osd.2\n}\n", 6 },                  // an unknown item
+    { "host h {\n item osd.0 weight x\n}\n", 6 },
+    { "host h {\n item osd.0 pos 1\n item osd.1 pos 1\n}\n", 8 },
+    { "host h {\n id 1\n}\n", 6 },
+    { "host h {\n id -1\n}\nhost g {\n id -1\n}\n", 10 },
+    { "host h {\n alg uniform\n item osd.0\n item osd.1 weight 2\n}\n", 9 },
+    { "host h {\n item osd.0\n", 7 },                     // not closed
+    { "rule {\n step take nowhere\n}\n", 6 },
+    { "rule {\n step choose firstn 1 type rack\n}\n", 6 },
+    { "rule {\n step choose leaves 1 type osd\n}\n", 6 },
+    { "rule {\n id 0\n}\nrule {\n id 0\n}\n", 10 },
+    { "rule {\n max_size 256\n}\n", 6 },
+  };
+  crush_text_map *tm;
+  for (auto &e : errors) {
+    int line = 0;
+    EXPECT_EQ(-EINVAL, compile(std::string(header) + e.text, &tm, &line)) << e.text;
+    EXPECT_EQ(e.line, line) << e.text;
+  }
+
+  ASSERT_EQ(0, compile(std::string(header) +
+                       "host h {\n item osd.0 weight 1.5\n item osd.1 weight 0.0000153\n}\n",
+                       &tm));
+  EXPECT_EQ(0x18000, crush_get_bucket_item_weight(tm->map->buckets[0], 0));
+  EXPECT_EQ(1, crush_get_bucket_item_weight(tm->map->buckets[0], 1));
+  crush_destroy_text_map(tm);
+  ASSERT_EQ(0, compile("", &tm));
+  EXPECT_EQ(0, tm->map->max_buckets);
+  crush_destroy_text_map(tm);
+}
+
+// Local Variables:
+// compile-command: "cd ../build ; make unittest_text && valgrind --tool=memcheck test/unittest_text"
+// End:
@@ -0,0 +1,266 @@
+/*
+ * crush_diff - report what moves between two versions of a crush map
+ *
+ * Map a range of values with the same rule in a map before and after
+ * a change and print, as crush_diff() computes them, the number of
+ * values and devices that move and the devices they move to and from.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crush.h"
+#include "diff.h"
+#include "encoding.h"
+#include "image.h"
+#include "text.h"
+
+/* a map read from a file, in one of the formats of libcrush */
+struct crush_diff_file {
+	struct crush_map *map;
+	const struct crush_choose_arg *choose_args;
+	struct crush_text_map *tm;   /* crush_text_compile() */
+	struct crush_ceph_map *cm;   /* crush_decode() */
+	int image;                   /* crush_image_open() */
+	__u32 *weights;
+};
+
+static void usage(FILE *out)
+{
+	fprintf(out,
+		"usage: crush_diff [options] before after\n"
+		"\n"
+		"Map the values [x,x+n[ with the rule r of the maps before\n"
+		"and after and report what moves. The exit status is 0 if\n"
+		"nothing moves, 1 if something moves and 2 on error.\n"
+		"\n"
+		"  -f text|ceph|image  format of the maps (text)\n"
+		"  -c id               use the choose_args id of a ceph map\n"
+		"  -r rule             the rule number (0)\n"
+		"  -x x                the first value (0)\n"
+		"  -n count            the number of values (1024)\n"
+		"  -s size             the maximum size of a result (3)\n"
+		"  -t threads          the number of threads (all processors)\n"
+		"  -v                  print the changed positions of each value\n");
+}
+
+/* read the whole file @path in a buffer that must be freed */
+static int read_file(const char *path, char **buf, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	size_t n = 0, max = 1 << 16;
+	char *p = NULL, *_realloc;
+	int r = 0;
+
+	if (!f)
+		return -errno;
+	do {
+		if (n == max || !p) {
+			if (p)
+				max *= 2;
+			_realloc = realloc(p, max);
+			if (!_realloc) {
+				r = -ENOMEM;
+				break;
+			}
+			p = _realloc;
+		}
+		n += fread(p + n, 1, max - n, f);
+	} while (n == max);
+	if (r == 0 && ferror(f))
+		r = -EIO;
+	fclose(f);
+	if (r < 0) {
+		free(p);
+		return r;
+	}
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+static void unload(struct crush_diff_file *file)
+{
+	if (file->image)
+		crush_image_close(file->map);
+	crush_destroy_text_map(file->tm);
+	crush_destroy_ceph_map(file->cm);
+	free(file->weights);
+}
+
+static int load(const char *path, const char *format, __s64 choose_args_id,
+		struct crush_diff_file *file)
+{
+	char *buf = NULL;
+	size_t size;
+	int line = 0;
+	__u32 i;
+	int r;
+
+	memset(file, 0, sizeof(*file));
+	if (strcmp(format, "image") == 0) {
+		r = crush_image_open(path, &file->map);
+		file->image = r == 0;
+	} else {
+		r = read_file(path, &buf, &size);
+		if (r < 0)
+			goto out;
+		if (strcmp(format, "text") == 0) {
+			r = crush_text_compile(buf, size, &file->tm, &line);
+			if (r == 0)
+				file->map = file->tm->map;
+		} else {
+			r = crush_decode(buf, size, 0, &file->cm);
+			if (r == 0)
+				file->map = file->cm->map;
+		}
+		free(buf);
+	}
+	if (r < 0)
+		goto out;
+
+	if (choose_args_id != -2) {
+		r = -ENOENT;
+		for (i = 0; file->cm && i < file->cm->choose_args_size; i++)
+			if (file->cm->choose_args[i].id == choose_args_id) {
+				file->choose_args =
+					file->cm->choose_args[i].map.args;
+				r = 0;
+			}
+		if (r < 0)
+			goto out;
+	}
+	/* all the devices are in */
+	file->weights = malloc(sizeof(__u32) *
+			       (file->map->max_devices ?
+				file->map->max_devices : 1));
+	if (!file->weights) {
+		r = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < (__u32)file->map->max_devices; i++)
+		file->weights[i] = 0x10000;
+	return 0;
+out:
+	if (line > 0)
+		fprintf(stderr, "crush_diff: %s:%d: invalid map\n", path, line);
+	else if (r == -ENOENT && file->map)
+		fprintf(stderr, "crush_diff: %s: no choose_args %lld\n",
+			path, (long long)choose_args_id);
+	else
+		fprintf(stderr, "crush_diff: %s: %s\n", path, strerror(-r));
+	unload(file);
+	return r;
+}
+
+static void report(const struct crush_diff *diff, int verbose)
+{
+	int i;
+
+	printf("values %d changed %u skipped %u\n",
+	       diff->count, diff->changed, diff->skipped);
+	printf("mapped %llu moved %llu fraction %.6f\n",
+	       (unsigned long long)diff->mapped,
+	       (unsigned long long)diff->moved, diff->moved_fraction);
+	for (i = 0; i < diff->max_devices; i++)
+		if (diff->device_in[i] || diff->device_out[i])
+			printf("device %d in %u out %u\n",
+			       i, diff->device_in[i], diff->device_out[i]);
+	if (verbose)
+		for (i = 0; i < diff->count; i++)
+			if (diff->changed_positions[i])
+				printf("x %d positions %u\n",
+				       diff->x_start + i,
+				       diff->changed_positions[i]);
+}
+
+int main(int argc, char **argv)
+{
+	const char *format = "text";
+	__s64 choose_args_id = -2;  /* none, -1 is the default choose_args */
+	int ruleno = 0, x_start = 0, count = 1024, result_max = 3;
+	int num_threads = 0, verbose = 0;
+	struct crush_diff_file before, after;
+	struct crush_diff_map b, a;
+	struct crush_diff *diff;
+	int status = 2;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:c:r:x:n:s:t:vh")) != -1) {
+		switch (c) {
+		case 'f':
+			format = optarg;
+			break;
+		case 'c':
+			choose_args_id = strtoll(optarg, NULL, 0);
+			break;
+		case 'r':
+			ruleno = atoi(optarg);
+			break;
+		case 'x':
+			x_start = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			result_max = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 2;
+		}
+	}
+	if (argc - optind != 2 ||
+	    (strcmp(format, "text") && strcmp(format, "ceph") &&
+	     strcmp(format, "image"))) {
+		usage(stderr);
+		return 2;
+	}
+	if (choose_args_id != -2 && strcmp(format, "ceph")) {
+		fprintf(stderr, "crush_diff: -c needs ceph maps\n");
+		return 2;
+	}
+
+	if (load(argv[optind], format, choose_args_id, &before) < 0)
+		return 2;
+	if (load(argv[optind + 1], format, choose_args_id, &after) < 0) {
+		unload(&before);
+		return 2;
+	}
+	b.map = before.map;
+	b.weights = before.weights;
+	b.weight_max = before.map->max_devices;
+	b.choose_args = before.choose_args;
+	a.map = after.map;
+	a.weights = after.weights;
+	a.weight_max = after.map->max_devices;
+	a.choose_args = after.choose_args;
+	diff = crush_diff(&b, &a, ruleno, x_start, count, result_max,
+			  num_threads);
+	if (diff) {
+		report(diff, verbose);
+		status = diff->moved || diff->changed ? 1 : 0;
+		crush_diff_destroy(diff);
+	} else {
+		fprintf(stderr, "crush_diff: rule %d cannot be compared\n",
+			ruleno);
+	}
+	unload(&after);
+	unload(&before);
+	return status;
+}